@@ -19,41 +19,402 @@
 #pragma once
 #ifndef EXTERN 
 #define EXTERN extern
+#else
+#define NDFIT_MODULE
 #endif
 
-// Definition of global variables. This is simply done so one can 
-// Avoid passing numbers around.
-
-EXTERN int DEPTH;
-EXTERN int MAXDEPTH;
-EXTERN double CONV;
-EXTERN double TFACTOR;
-EXTERN Py_ssize_t DIM;
-EXTERN Py_ssize_t LDIM; 
-EXTERN Py_ssize_t DATALEN;
-EXTERN PyObject* PLIST;
-EXTERN PyObject* CONSTS;
-EXTERN PyObject* LATTICE;
-EXTERN PyObject* THROTTLE = NULL;
-EXTERN char* MODE = NULL;
-
-// Now import itertools.product. We do it here so we only have to 
-// import it once rather than once
-EXTERN PyObject* ITERTOOLS; 
-EXTERN PyObject* PRODUCT;
-  
+// Everything the module keeps between fits, one copy per interpreter:
+// the defaults set through maxdepth(), convergence() and 
+// throttle_factor(), ndfit.error, itertools.product and the types. 
+// Everything that belongs to a single fit lives in ndfit_state below.
+
+// The defaults are atomic as fits on other threads read them.
+typedef struct ndfit_module_state{
+  _Atomic int maxdepth;
+  _Atomic double conv;
+  _Atomic double tfactor;
+  PyObject* error;
+  PyObject* product;
+  PyTypeObject* fit_type;
+  PyTypeObject* future_type;
+  PyTypeObject* dataset_type;
+  PyTypeObject* grid_type;
+} ndfit_module_state;
+
+// The state of the interpreter the caller runs in. The first module
+// object executed in an interpreter holds it.
+ndfit_module_state* ndfit_module(void);
+
+// Python exception object (ndfit.error)
+#define ndfitError (ndfit_module()->error)
+
+// Threads the module starts join the interpreter that started them,
+// which PyGILState would not do for a subinterpreter
+PyThreadState* ndfit_thread_enter(PyInterpreterState* interp);
+void ndfit_thread_leave(PyThreadState* ts);
+
+// Per object locking where free-threaded builds need it, nothing when
+// the GIL does the job
+#ifdef Py_GIL_DISABLED
+#define NDFIT_BEGIN_CRITICAL(op) Py_BEGIN_CRITICAL_SECTION(op)
+#define NDFIT_END_CRITICAL() Py_END_CRITICAL_SECTION()
+#else
+#define NDFIT_BEGIN_CRITICAL(op) {
+#define NDFIT_END_CRITICAL() }
+#endif
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~~~ FIT STATE ~~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+// Lattice shapes, and gradient descent which has no lattice
+#define NDFIT_SHORT 0
+#define NDFIT_FULL  1
+#define NDFIT_LBFGS 2
+
+// L-BFGS: number of (s,y) pairs kept, sufficient decrease constant
+// and the most halvings of the step in one line search
+#define NDFIT_LBFGS_M    8
+#define NDFIT_ARMIJO     1e-4
+#define NDFIT_LINE_TRIES 40
+
+// Seconds between polls of signals and the cancellation token, which
+// are a call into Python each. Flags and counters are checked always.
+#define NDFIT_BUDGET_POLL 0.002
+
+// Iterations between checkpoints unless checkpoint_every is given.
+// Each one is written, fsynced and renamed into place; a resumed fit
+// repeats the iterations since the last one.
+#define NDFIT_CHECKPOINT_EVERY 10
+
+// Multi-start sampling schemes and the factor by which a start must 
+// trail the best one before it is pruned
+#define NDFIT_LHS    0
+#define NDFIT_RANDOM 1
+#define NDFIT_PRUNE_RATIO 1.5
+
+// Residual reduction policies and the block size of the pairwise sum
+#define NDFIT_FAST     0
+#define NDFIT_ACCURATE 1
+#define NDFIT_BLOCK    128
+
+// Evaluation precision of vectorized error functions
+#define NDFIT_DOUBLE 0
+#define NDFIT_SINGLE 1
+#define NDFIT_MIXED  2
+
+// Adaptive steps: successes in a row before a step is doubled and 
+// the largest factor a step may grow by
+#define NDFIT_EXPAND_RUNS 2
+#define NDFIT_SCALE_MAX 1e6
+
+// Native error function: residuals out[i] for the nrows rows of a
+// block of column storage, where column j of row i is data[j*ld+i].
+// Called without the GIL. Returns 0, anything else is an error.
+typedef int (*ndfit_native)(const double* data, int64_t nrows, int64_t ncols, int64_t ld,
+	const double* params, int64_t nparams, const double* consts, int64_t nconsts, double* out);
+
+// Rows handed to a native error function per call, and the name a 
+// capsule holding one must have
+#define NDFIT_CBLOCK 1024
+#define NDFIT_CAPSULE "ndfit.native"
+
+// Worker pool shared by the starts of one fit (ndfitpool.c) and where
+// its workers run
+typedef struct ndfit_pool ndfit_pool;
+#define NDFIT_PROCESSES    0
+#define NDFIT_THREADS      1
+#define NDFIT_INTERPRETERS 2
+
+// Event trace of a fit (ndfittrace.c). Spans are only recorded when
+// the state has a trace, so tracing costs one branch when it is off.
+typedef struct ndfit_trace ndfit_trace;
+#define NDFIT_TRACE(st,name,ph) \
+	do{if((st)->trace!=NULL){ndfit_trace_event((st)->trace,(name),(ph),NULL,0.0);}}while(0)
+#define NDFIT_TRACE_ARG(st,name,ph,key,value) \
+	do{if((st)->trace!=NULL){ndfit_trace_event((st)->trace,(name),(ph),(key),(double)(value));}}while(0)
+
+// Separable models (ndfitblocks.c): the components of the model and
+// the most params one of them may take
+typedef struct ndfit_blocks ndfit_blocks;
+#define NDFIT_BLOCK_MAX 16
+
+// Residuals cached for the axis moves of linear params (ndfitlinear.c)
+typedef struct ndfit_linear ndfit_linear;
+
+typedef struct ndfit_state{
+  // Search parameters copied from the defaults when the fit starts
+  int depth;
+  int maxdepth;
+  double conv;
+  double tfactor;
+  int throttle;
+  int mode;
+  Py_ssize_t dim;
+  Py_ssize_t ldim;
+  Py_ssize_t datalen;
+
+  // Python side inputs (owned references)
+  PyObject* fitfunc;
+  PyObject* errfunc;
+  PyObject* data;
+  PyObject* params;
+  PyObject* consts;
+  PyObject* step;
+
+  // Search history, current lattice and the current centre 
+  // (a borrowed reference into plist)
+  PyObject* plist;
+  PyObject* lattice;
+  PyObject* center;
+  double entropy;
+
+  // Stopping rules other than conv and maxdepth. A budget of zero 
+  // means unlimited. truncated is raised when one of them ends the 
+  // fit early. cancelled may be raised from another thread. tpoll is
+  // when signals and the token are next looked at.
+  double tbudget;
+  double tstart;
+  double tpoll;
+  long maxevals;
+  long evals;
+  PyObject* cancel;
+  int truncated;
+  volatile int cancelled;
+
+  // Multi-start search (starts > 1): bounds to sample from, sampling
+  // scheme, pruning interval in rounds and the RNG state. Each start 
+  // is a child state whose parent holds the shared budgets.
+  int starts;
+  int sampling;
+  int prune;
+  int pruned;
+  PyObject* bounds;
+  unsigned long long rng;
+  struct ndfit_state* parent;
+
+  // Child fits (starts, sweep items, uncertainty refits) print nothing
+  // when they stop
+  int quiet;
+
+  // Adaptive pattern search: per dimension step factor, signed count 
+  // of successes in a row, entropy at the centre and the tolerance on
+  // the step factors at which we stop
+  int adaptive;
+  double* scale;
+  int* runs;
+  double center_entropy;
+  double steptol;
+
+  // Opportunistic polling: accept the first lattice point that beats
+  // the centre, polling in the order kept here (lattice indices)
+  int opportunistic;
+  Py_ssize_t* order;
+
+  // Residual evaluation: vectorized error functions are called once
+  // per parameter vector with the whole data object. resid is the
+  // workspace the residuals are reduced from.
+  int vectorized;
+  int reduction;
+  double* resid;
+
+  // Precision: data32 is the float32 copy of the data the error 
+  // function sees while single is raised, data64 a float64 copy for 
+  // mixed runs on float32 input
+  int precision;
+  int single;
+  PyObject* data32;
+  PyObject* data64;
+
+  // Checkpointing: file name (bytes) written every `every` iterations,
+  // iterations since the last write, the state packed after the last
+  // iteration and the current lattice scale
+  PyObject* checkpoint;
+  int every;
+  int since;
+  char* ckbuf;
+  size_t cklen;
+  double lscale;
+
+  // Gradient descent (mode="lbfgs"): gradient function, a ring of the
+  // last NDFIT_LBFGS_M (s,y) pairs, the gradient and sum of squares 
+  // at the centre
+  PyObject* gradfunc;
+  double* pairs;
+  double* grad;
+  int npairs;
+  int head;
+  double sumsq;
+
+  // Native error function: the function pointer, the data as a 
+  // Dataset, consts as packed doubles (bytes) and params scratch
+  ndfit_native native;
+  PyObject* columns;
+  PyObject* cconsts;
+  double* cparams;
+
+  // Worker pool: number of workers, where they run, the (module, 
+  // qualname) processes import the error function by and the running
+  // pool. The starts of a multi-start search share
+  // the pool of their parent.
+  int workers;
+  int backend;
+  PyObject* errname;
+  ndfit_pool* pool;
+
+  // Uncertainties (ndfituncertainty.c): the square roots of the 
+  // bootstrap draw counts each residual is scaled by (NULL: all ones).
+  // The starts of a multi-start search share the weights of their
+  // parent.
+  double* weights;
+
+  // Evaluation: the params list handed to Python error functions, 
+  // refreshed in place between calls, and the points (nsweep x dim) 
+  // and entropies of the last sweep, kept for the Hessian
+  PyObject* args;
+  double* sweepx;
+  double* sweepe;
+  Py_ssize_t nsweep;
+  Py_ssize_t sweepcap;
+
+  // Tracing: the trace events go to and whether this state writes it
+  // when the fit is done (the starts of a multi-start search and the
+  // fits of a sweep share one)
+  ndfit_trace* trace;
+  int traceown;
+
+  // Separable models: the components as given, their blocks and 
+  // windows (shared by the starts of a multi-start search) and the 
+  // cache of partial sums each search keeps
+  PyObject* components;
+  ndfit_blocks* blocks;
+  double* blockwork;
+
+  // Gridded data (ndfitgrid.c): the Grid and the built-in model 
+  // evaluated on it when there is no native error function
+  PyObject* grid;
+  int gridmodel;
+
+  // Linear parameters: the indices as given (shared by the starts of 
+  // a multi-start search), whether they are solved for rather than 
+  // searched (projection) and the residuals each search caches
+  PyObject* linear;
+  int project;
+  ndfit_linear* lin;
+} ndfit_state;
+
 // declaration of function prototypes for ndfit
+#ifdef NDFIT_MODULE
 static inline PyObject* ndfit_getminimum(PyObject* list);
-static inline PyObject* ndfit_callfunc(PyObject* func, PyObject* values, PyObject* params);
+static inline int ndfit_before(const double* a, const double* b, Py_ssize_t n);
+static inline PyObject* ndfit_callfunc(ndfit_state* st, PyObject* func, PyObject* values, PyObject* params);
 static PyObject* ndfit_maxdepth(PyObject* self, PyObject* args);
 static PyObject* ndfit_dotproduct(PyObject* a, PyObject* b);
 static PyObject* ndfit_dotadd(PyObject* a, PyObject* b);
-static double ndfit_entropy(PyObject* callfunc, PyObject* data, PyObject* params);
-static PyObject* ndfit_permutatorshort(PyObject* step, double scale);
-static PyObject* ndfit_permutatorfull(PyObject* step, double scale);
-static PyObject* ndfit_next(PyObject* callfunc, PyObject* data,PyObject* params, PyObject* lattice);
-PyObject* ndfit_recursive(PyObject* callfunc, PyObject* data, PyObject* params, PyObject* step, PyObject* lattice);
+static double* ndfit_workspace(ndfit_state* st);
+static PyObject* ndfit_args(ndfit_state* st, const double* x);
+static double ndfit_entropy_at(ndfit_state* st, const double* x);
+static double ndfit_entropy_eval(ndfit_state* st, const double* x);
+static double ndfit_entropy(ndfit_state* st, PyObject* params);
+static int ndfit_keep(ndfit_state* st, Py_ssize_t n);
+static PyObject* ndfit_evaluations(ndfit_state* st);
+static double ndfit_measure(ndfit_state* st, double sum);
+static double ndfit_objective(ndfit_state* st, PyObject* params, double* grad);
+static double ndfit_objective_eval(ndfit_state* st, PyObject* params, double* grad);
+static int ndfit_descent(ndfit_state* st);
+static PyObject* ndfit_permutatorshort(ndfit_state* st, PyObject* step, double scale);
+static PyObject* ndfit_permutatorfull(ndfit_state* st, PyObject* step, double scale);
+static int ndfit_lattice(ndfit_state* st, double scale);
+static int ndfit_lattice_build(ndfit_state* st, double scale);
+static int ndfit_order(ndfit_state* st);
+static void ndfit_reorder(ndfit_state* st, PyObject* lattice, Py_ssize_t hit);
+static PyObject* ndfit_next(ndfit_state* st, PyObject* params, PyObject* lattice);
+static PyObject* ndfit_next_serial(ndfit_state* st, PyObject* params, PyObject* lattice);
+static PyObject* ndfit_next_pool(ndfit_state* st, PyObject* params, PyObject* lattice);
+static double ndfit_record(ndfit_state* st, PyObject* next);
+static int ndfit_adapt(ndfit_state* st);
+static int ndfit_step(ndfit_state* st);
+static int ndfit_separate(ndfit_state* st);
+static int ndfit_iterate(ndfit_state* st);
+static int ndfit_iterate_once(ndfit_state* st);
+static int ndfit_begin(ndfit_state* st);
+static int ndfit_precision(ndfit_state* st);
+static int ndfit_prepare_native(ndfit_state* st);
+static int ndfit_probe(ndfit_state* st);
+static Py_ssize_t ndfit_last(ndfit_state* st);
+static PyObject* ndfit_options(ndfit_state* st);
+static PyObject* ndfit_result(ndfit_state* st);
+static void ndfit_seed(ndfit_state* st, unsigned long long seed);
+static PyObject* ndfit_samples(ndfit_state* st, Py_ssize_t n);
+static PyObject* ndfit_multistart(ndfit_state* st);
+static PyObject* ndfit_search(ndfit_state* st);
+#endif
+double ndfit_clock(void);
+double ndfit_random(ndfit_state* st);
+int ndfit_budget(ndfit_state* st);
+int ndfit_consts(ndfit_state* st);
+PyObject* ndfit_recursive(ndfit_state* st);
+int ndfit_setup(ndfit_state* st, PyObject *args, PyObject *kwds);
+void ndfit_release(ndfit_state* st);
+PyObject* ndfit_fit(ndfit_state* st);
 PyObject* ndfit_run(PyObject* self,PyObject *args, PyObject *kwds);
+PyObject* ndfit_resume(PyObject* self,PyObject *args, PyObject *kwds);
+double ndfit_evaluate(ndfit_state* st, PyObject* params);
+double ndfit_evaluate_at(ndfit_state* st, const double* x);
+int ndfit_prepare(ndfit_state* st);
+
+// Checkpoints (ndfitcheckpoint.c)
+int ndfit_checkpoint(ndfit_state* st);
+int ndfit_checkpoint_flush(ndfit_state* st);
+int ndfit_restore(ndfit_state* st, const char* path);
+
+// Tracing (ndfittrace.c)
+ndfit_trace* ndfit_trace_open(const char* path);
+void ndfit_trace_event(ndfit_trace* tr, const char* name, char phase, const char* key, double value);
+int ndfit_trace_write(ndfit_trace* tr);
+void ndfit_trace_free(ndfit_trace* tr);
+
+// Linear parameters (ndfitlinear.c)
+int ndfit_linear_check(ndfit_state* st);
+void ndfit_linear_free(ndfit_linear* lin);
+void ndfit_linear_reset(ndfit_state* st);
+int ndfit_linear_sweep(ndfit_state* st, const double* center);
+int ndfit_linear_derive(ndfit_state* st, Py_ssize_t i, const double* center, const double* x, double* sum);
+void ndfit_linear_measured(ndfit_state* st, Py_ssize_t i, const double* center, const double* x);
+void ndfit_linear_best(ndfit_state* st, const double* x, int derived);
+int ndfit_linear_projected(ndfit_state* st, Py_ssize_t k);
+Py_ssize_t ndfit_linear_searched(ndfit_state* st);
+double ndfit_linear_project(ndfit_state* st, double* x);
+
+// Separable models (ndfitblocks.c)
+int ndfit_blocks_parse(ndfit_state* st);
+void ndfit_blocks_free(ndfit_blocks* b);
+double ndfit_blocks_sumsq(ndfit_state* st, const double* x);
+PyObject* ndfit_blocks_sweep(ndfit_state* st, PyObject* center, double scale, double* sum, Py_ssize_t* moved);
+
+// Worker pool (ndfitpool.c)
+int ndfit_pool_resolve(ndfit_state* st);
+int ndfit_pool_start(ndfit_state* st);
+void ndfit_pool_stop(ndfit_pool* pool);
+int ndfit_pool_post(ndfit_pool* pool, PyObject* points);
+Py_ssize_t ndfit_pool_halt(ndfit_pool* pool);
+int ndfit_pool_take(ndfit_state* st, Py_ssize_t* index, double* entropy);
+PyObject* ndfit_pool_worker(PyObject* self, PyObject* args);
+
+// Numeric kernels (ndfitkernel.c)
+double ndfit_sumsq(const double* r, Py_ssize_t n, int policy);
+int ndfit_residuals(PyObject* obj, Py_ssize_t n, double* work, int policy, double* sum);
+Py_ssize_t ndfit_residual_count(PyObject* obj);
+double ndfit_sumsqf(const float* r, Py_ssize_t n, int policy);
+int ndfit_residual_values(PyObject* obj, Py_ssize_t n, double* out);
+int ndfit_jacobian(PyObject* jac, Py_ssize_t n, Py_ssize_t dim, const double* r, double* g);
+int ndfit_native_function(PyObject* obj, int declared, ndfit_native* fn);
+int ndfit_native_sumsq(ndfit_native fn, const double* data, Py_ssize_t nrows, Py_ssize_t ncols,
+	const double* params, Py_ssize_t nparams, const double* consts, Py_ssize_t nconsts,
+	const double* weights, double* work, int policy, double* sum);
+void ndfit_weigh(double* r, const double* w, Py_ssize_t n);
+void ndfit_axpy(double* out, const double* r, const double* col, double a, Py_ssize_t n);
+int ndfit_is_single(PyObject* data);
+PyObject* ndfit_cast(PyObject* data, int single);
 
 // Declaration of helper functions
 PyObject* ndfit_product(PyObject* self, PyObject* args);
@@ -81,13 +442,108 @@ typedef struct ndFit{
   PyObject* fitfunc;
   PyObject* errfunc;
   PyObject* lattice;
+  char truncated;
+  PyObject* options;
+  PyObject* evaluations;
+  // Fits loaded with from_bytes keep the buffer and leave pList NULL
+  // until it is asked for (ndfitserial.c)
+  PyObject* store;
+  Py_ssize_t steps;
+  Py_ssize_t dim;
+  Py_ssize_t offset;
 } ndFit;
 #endif
 
 
-PyTypeObject ndFitType;
-PyMethodDef ndFit_methods;
-PyMemberDef ndFit_members;
+extern PyType_Spec ndFit_spec;
+
+// A fit running on a background thread (ndfit.submit). The worker 
+// holds lock for the duration of the fit and releases it when done.
+// guard is held while done is raised or read before joining waiters,
+// so no coroutine is parked after the worker has woken them. interp
+// is the interpreter the worker joins.
+#ifndef NDFUTURE
+#define NDFUTURE
+typedef struct ndFuture{
+  PyObject_HEAD
+  ndfit_state st;
+  PyObject* result;
+  PyObject* exc_type;
+  PyObject* exc_value;
+  PyObject* exc_tb;
+  PyObject* waiters;
+  PyThread_type_lock lock;
+  PyThread_type_lock guard;
+  PyInterpreterState* interp;
+  volatile int done;
+} ndFuture;
+#endif
+
+extern PyType_Spec ndFuture_spec;
+PyObject* ndfit_submit(PyObject* self, PyObject* args, PyObject* kwds);
+
+// Data converted once and shared between fits (ndfit.Dataset). The 
+// values are stored column by column, rows caches the row tuples.
+#ifndef NDDATASET
+#define NDDATASET
+typedef struct ndDataset{
+  PyObject_HEAD
+  Py_ssize_t nrows;
+  Py_ssize_t ncols;
+  int ndim;
+  double* columns;
+  int borrowed;
+  PyObject* rows;
+  PyObject* min;
+  PyObject* max;
+  PyObject* mean;
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+} ndDataset;
+#endif
+
+extern PyType_Spec ndDataset_spec;
+PyObject* ndfit_dataset_rows(ndDataset* self);
+PyObject* ndfit_dataset_column(ndDataset* self, Py_ssize_t j);
+PyObject* ndfit_dataset_data(PyObject* data, int vectorized);
+PyObject* ndfit_dataset_wrap(double* columns, Py_ssize_t nrows, Py_ssize_t ncols, int ndim);
+
+// Values on a regular grid (ndfit.Grid). The values buffer is held
+// with its strides, the coordinates of every axis are copied.
+#define NDFIT_GRID_MAXDIM 3
+#ifndef NDGRID
+#define NDGRID
+typedef struct ndGrid{
+  PyObject_HEAD
+  Py_buffer view;
+  int ndim;
+  int single;
+  Py_ssize_t size;
+  Py_ssize_t shape[NDFIT_GRID_MAXDIM];
+  Py_ssize_t strides[NDFIT_GRID_MAXDIM];
+  double* axes[NDFIT_GRID_MAXDIM];
+} ndGrid;
+#endif
+
+extern PyType_Spec ndGrid_spec;
+int ndfit_grid_prepare(ndfit_state* st);
+Py_ssize_t ndfit_grid_work(PyObject* grid);
+int ndfit_grid_sumsq(ndfit_state* st, const double* x, double* work, double* sum);
+
+// Fits over a list of consts vectors (ndfitsweep.c)
+PyObject* ndfit_sweep_run(PyObject* self, PyObject* args, PyObject* kwds);
+
+// Parameter uncertainties of a finished fit (ndfituncertainty.c)
+PyObject* ndfit_uncertainty(ndFit* self, PyObject* args, PyObject* kwds);
+
+// Compact results and pickling (ndfitserial.c)
+PyObject* ndfit_fit_plist(ndFit* self);
+PyObject* ndfit_fit_getplist(ndFit* self, void* closure);
+int ndfit_fit_setplist(ndFit* self, PyObject* value, void* closure);
+PyObject* ndfit_fit_gethistory(ndFit* self, void* closure);
+PyObject* ndfit_fit_to_bytes(ndFit* self, PyObject* args, PyObject* kwds);
+PyObject* ndfit_fit_from_bytes(PyTypeObject* type, PyObject* args, PyObject* kwds);
+PyObject* ndfit_fit_reduce(ndFit* self, PyObject* ignored);
 
 void ndFit_dealloc(ndFit* self);
 PyObject* ndFit_new(PyTypeObject* type, PyObject* args, PyObject* kwds);
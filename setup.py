@@ -17,10 +17,17 @@
 ##Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #!/usr/bin/env python
+import sys
 from distutils.core import setup,Extension
 module = Extension('ndfit',
                     include_dirs=['./inc'],
-                    sources=['./src/ndfitmodule.c','./src/ndfitstruct.c'])
+                    sources=['./src/ndfitmodule.c','./src/ndfitstruct.c',
+                             './src/ndfitfuture.c','./src/ndfitkernel.c',
+                             './src/ndfitcheckpoint.c','./src/ndfitdataset.c',
+                             './src/ndfitsweep.c','./src/ndfitpool.c',
+                             './src/ndfituncertainty.c','./src/ndfittrace.c',
+                             './src/ndfitblocks.c','./src/ndfitgrid.c','./src/ndfitserial.c','./src/ndfitlinear.c'],
+                    libraries=['rt'] if sys.platform.startswith('linux') else [])
 
 
 setup(name="ndfit",
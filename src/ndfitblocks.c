@@ -0,0 +1,380 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <math.h>
+
+//////////////////////////////////////////////
+// Separable models (run(..., components=)).
+// The model is a sum of components, each with
+// its own block of params and a window in x
+// (the first column of a row) outside which
+// it is taken to be zero. The residual of a
+// row is the sum of the components minus the
+// last column. A pass of the search polls the
+// lattice of one block at a time against the
+// cached sum of the others, so a candidate
+// costs one call per row of its window.
+//
+
+#include "../inc/shared.h"
+
+struct ndfit_blocks{
+	Py_ssize_t n;
+	PyObject** funcs;
+	Py_ssize_t* first;
+	Py_ssize_t* size;
+	Py_ssize_t* start;
+	Py_ssize_t* rows;
+	double* y;
+	Py_ssize_t widest;
+	Py_ssize_t largest;
+};
+
+void ndfit_blocks_free(ndfit_blocks* b){
+
+	Py_ssize_t k;
+	if(b==NULL){return;}
+	if(b->funcs!=NULL){
+		for(k=0;k<b->n;k+=1){Py_XDECREF(b->funcs[k]);}
+	}
+	PyMem_Free(b->funcs);
+	PyMem_Free(b->first);
+	PyMem_Free(b->size);
+	PyMem_Free(b->start);
+	PyMem_Free(b->rows);
+	PyMem_Free(b->y);
+	PyMem_Free(b);
+}
+
+// Read components=[(function, size, (low, high)), ...] into the blocks
+// of a separable model. The blocks take the params in order and a
+// missing (or None) window holds every row.
+int ndfit_blocks_parse(ndfit_state* st){
+
+	Py_ssize_t i, j, k;
+	Py_ssize_t n = PyList_Size(st->components);
+	Py_ssize_t nrows = st->datalen;
+	Py_ssize_t total = 0;
+	if(n<1){
+		PyErr_SetString(ndfitError,"components must be a list of (function, size, (low, high))");
+		return -1;
+	}
+
+	ndfit_blocks* b = PyMem_Calloc(1,sizeof(ndfit_blocks));
+	double* x = PyMem_Malloc(sizeof(double)*nrows);
+	double* lo = PyMem_Malloc(sizeof(double)*n);
+	double* hi = PyMem_Malloc(sizeof(double)*n);
+	if(b==NULL || x==NULL || lo==NULL || hi==NULL){PyErr_NoMemory(); goto fail;}
+	b->funcs = PyMem_Calloc(n,sizeof(PyObject*));
+	b->first = PyMem_Malloc(sizeof(Py_ssize_t)*n);
+	b->size = PyMem_Malloc(sizeof(Py_ssize_t)*n);
+	b->start = PyMem_Calloc(n+1,sizeof(Py_ssize_t));
+	b->y = PyMem_Malloc(sizeof(double)*nrows);
+	if(b->funcs==NULL || b->first==NULL || b->size==NULL || b->start==NULL || b->y==NULL){
+		PyErr_NoMemory();
+		goto fail;
+	}
+	b->n = n;
+
+	// x and y of every row
+	for(i=0;i<nrows;i+=1){
+		PyObject* row = PySequence_Fast(PyList_GetItem(st->data,i),"Data rows must be sequences");
+		if(row==NULL){goto fail;}
+		Py_ssize_t len = PySequence_Fast_GET_SIZE(row);
+		if(len<2){
+			Py_DECREF(row);
+			PyErr_SetString(ndfitError,"Separable models need data rows of (x, ..., y)");
+			goto fail;
+		}
+		x[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(row,0));
+		b->y[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(row,len-1));
+		Py_DECREF(row);
+	}
+	if(PyErr_Occurred()){goto fail;}
+
+	for(k=0;k<n;k+=1){
+		PyObject* item = PySequence_Fast(PyList_GetItem(st->components,k),
+			"components must be (function, size, (low, high)) tuples");
+		if(item==NULL){goto fail;}
+		Py_ssize_t len = PySequence_Fast_GET_SIZE(item);
+		if(len<2 || len>3 || !PyCallable_Check(PySequence_Fast_GET_ITEM(item,0))){
+			Py_DECREF(item);
+			PyErr_SetString(ndfitError,"components must be (function, size, (low, high)) tuples");
+			goto fail;
+		}
+		b->funcs[k] = PySequence_Fast_GET_ITEM(item,0);
+		Py_INCREF(b->funcs[k]);
+		b->size[k] = PyLong_AsSsize_t(PySequence_Fast_GET_ITEM(item,1));
+		b->first[k] = total;
+		lo[k] = -INFINITY;
+		hi[k] = INFINITY;
+		if(len==3 && PySequence_Fast_GET_ITEM(item,2)!=Py_None){
+			PyObject* window = PySequence_Fast(PySequence_Fast_GET_ITEM(item,2),"Windows must be (low, high) pairs");
+			if(window!=NULL && PySequence_Fast_GET_SIZE(window)==2){
+				lo[k] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(window,0));
+				hi[k] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(window,1));
+			}
+			else if(window!=NULL){
+				PyErr_SetString(ndfitError,"Windows must be (low, high) pairs");
+			}
+			Py_XDECREF(window);
+		}
+		Py_DECREF(item);
+		if(PyErr_Occurred()){goto fail;}
+		if(b->size[k]<1 || b->size[k]>NDFIT_BLOCK_MAX){
+			PyErr_Format(ndfitError,"Components take 1 to %d params",NDFIT_BLOCK_MAX);
+			goto fail;
+		}
+		total += b->size[k];
+		if(b->size[k]>b->largest){b->largest = b->size[k];}
+
+		// Count the rows of the window
+		for(i=0;i<nrows;i+=1){
+			if(x[i]>=lo[k] && x[i]<=hi[k]){b->start[k+1] += 1;}
+		}
+		if(b->start[k+1]==0){
+			PyErr_Format(ndfitError,"Component %zd has no rows in its window",k);
+			goto fail;
+		}
+		if(b->start[k+1]>b->widest){b->widest = b->start[k+1];}
+		b->start[k+1] += b->start[k];
+	}
+	if(total!=st->dim){
+		PyErr_SetString(ndfitError,"Component sizes must add up to the number of params");
+		goto fail;
+	}
+
+	// The rows of every window, one window after the other
+	b->rows = PyMem_Malloc(sizeof(Py_ssize_t)*b->start[n]);
+	if(b->rows==NULL){PyErr_NoMemory(); goto fail;}
+	for(k=0;k<n;k+=1){
+		j = b->start[k];
+		for(i=0;i<nrows;i+=1){
+			if(x[i]>=lo[k] && x[i]<=hi[k]){b->rows[j++] = i;}
+		}
+	}
+
+	PyMem_Free(x);
+	PyMem_Free(lo);
+	PyMem_Free(hi);
+	st->blocks = b;
+	return 0;
+
+fail:
+	PyMem_Free(x);
+	PyMem_Free(lo);
+	PyMem_Free(hi);
+	ndfit_blocks_free(b);
+	return -1;
+}
+
+// The cache of a search, allocated on first use: the value of every
+// component on its window, the model and residual of every row,
+// scratch for two candidates and their residuals, the params, the
+// steps and the offsets of the best candidate
+static double* ndfit_blocks_work(ndfit_state* st){
+	if(st->blockwork==NULL){
+		ndfit_blocks* b = st->blocks;
+		st->blockwork = PyMem_Malloc(sizeof(double)*
+			(b->start[b->n]+2*st->datalen+3*b->widest+2*st->dim+b->largest));
+		if(st->blockwork==NULL){PyErr_NoMemory();}
+	}
+	return st->blockwork;
+}
+
+// Component k on the rows of its window, written to out
+static int ndfit_blocks_call(ndfit_state* st, Py_ssize_t k, PyObject* params, double* out){
+
+	Py_ssize_t j;
+	ndfit_blocks* b = st->blocks;
+	PyObject* func = b->funcs[k];
+	for(j=b->start[k];j<b->start[k+1];j+=1){
+		PyObject* argv[4] = {NULL,PyList_GET_ITEM(st->data,b->rows[j]),params,st->consts};
+		PyObject* value = PyObject_Vectorcall(func,argv+1,3|PY_VECTORCALL_ARGUMENTS_OFFSET,NULL);
+		if(value==NULL){return -1;}
+		out[j-b->start[k]] = PyFloat_AsDouble(value);
+		Py_DECREF(value);
+	}
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject* ndfit_blocks_list(const double* x, Py_ssize_t n){
+	Py_ssize_t i;
+	PyObject* list = PyList_New(n);
+	if(list==NULL){return NULL;}
+	for(i=0;i<n;i+=1){PyList_SET_ITEM(list,i,PyFloat_FromDouble(x[i]));}
+	return list;
+}
+
+// Residuals r of the model and their (weighted) sum of squares
+static double ndfit_blocks_total(ndfit_state* st, const double* model, double* r){
+	Py_ssize_t i;
+	for(i=0;i<st->datalen;i+=1){r[i] = model[i]-st->blocks->y[i];}
+	if(st->weights!=NULL){ndfit_weigh(r,st->weights,st->datalen);}
+	return ndfit_sumsq(r,st->datalen,st->reduction);
+}
+
+// Sum of squares of the model at x, refilling the cache. Returns
+// -1.0 if a component raised.
+double ndfit_blocks_sumsq(ndfit_state* st, const double* x){
+
+	Py_ssize_t i, j, k;
+	ndfit_blocks* b = st->blocks;
+	double* contrib = ndfit_blocks_work(st);
+	if(contrib==NULL){return -1.0;}
+	double* model = contrib+b->start[b->n];
+	double* r = model+st->datalen;
+
+	for(i=0;i<st->datalen;i+=1){model[i] = 0.0;}
+	for(k=0;k<b->n;k+=1){
+		PyObject* params = ndfit_blocks_list(x+b->first[k],b->size[k]);
+		if(params==NULL){return -1.0;}
+		int status = ndfit_blocks_call(st,k,params,contrib+b->start[k]);
+		Py_DECREF(params);
+		if(status<0){return -1.0;}
+		for(j=b->start[k];j<b->start[k+1];j+=1){model[b->rows[j]] += contrib[j];}
+	}
+	return ndfit_blocks_total(st,model,r);
+}
+
+// Offset c of the lattice of a block of d params: the 2^d corners at
+// scale/sqrt(d) steps in the order of itertools.product, and for
+// mode="full" the 2d points one step out along each axis
+static void ndfit_blocks_offset(const double* step, Py_ssize_t d, Py_ssize_t c, double scale, double* off){
+	Py_ssize_t i;
+	Py_ssize_t corners = (Py_ssize_t)1<<d;
+	if(c<corners){
+		for(i=0;i<d;i+=1){
+			off[i] = (((c>>(d-1-i))&1) ? -1.0 : 1.0)*scale*step[i]/sqrt((double)d);
+		}
+		return;
+	}
+	c -= corners;
+	for(i=0;i<d;i+=1){off[i] = 0.0;}
+	off[c%d] = (c<d ? 1.0 : -1.0)*scale*step[c%d];
+}
+
+// One pass over the blocks starting at center. Every block moves to the
+// best point of its lattice if that lowers the sum of squares (the
+// first such point when polling is opportunistic). The cache is
+// rebuilt at the start of the pass so rounding does not pile up over
+// many updates. Returns the new params with their sum of squares in
+// sum and the number of blocks that moved in moved.
+PyObject* ndfit_blocks_sweep(ndfit_state* st, PyObject* center, double scale, double* sum, Py_ssize_t* moved){
+
+	Py_ssize_t i, j, k, c;
+	ndfit_blocks* b = st->blocks;
+	double* contrib = ndfit_blocks_work(st);
+	if(contrib==NULL){return NULL;}
+	double* model = contrib+b->start[b->n];
+	double* r = model+st->datalen;
+	double* cand = r+st->datalen;
+	double* best = cand+b->widest;
+	double* rw = best+b->widest;
+	double* x = rw+b->widest;
+	double* step = x+st->dim;
+	double* off = step+st->dim;
+	double bestoff[NDFIT_BLOCK_MAX];
+
+	for(j=0;j<st->dim;j+=1){
+		x[j] = PyFloat_AsDouble(PyList_GetItem(center,j));
+		step[j] = PyFloat_AsDouble(PyList_GetItem(st->step,j));
+	}
+	if(PyErr_Occurred()){return NULL;}
+
+	st->evals+=1;
+	if(st->parent!=NULL){st->parent->evals+=1;}
+	if(ndfit_blocks_sumsq(st,x)<0.0){return NULL;}
+
+	*moved = 0;
+	for(k=0;k<b->n && !st->truncated;k+=1){
+		Py_ssize_t d = b->size[k];
+		Py_ssize_t nw = b->start[k+1]-b->start[k];
+		Py_ssize_t points = ((Py_ssize_t)1<<d)+(st->mode==NDFIT_FULL ? 2*d : 0);
+		const Py_ssize_t* rows = b->rows+b->start[k];
+		double* ck = contrib+b->start[k];
+		double* xk = x+b->first[k];
+		Py_ssize_t hit = -1;
+
+		NDFIT_TRACE_ARG(st,"block",'B',"component",k);
+
+		// The window's share of the sum of squares as things stand
+		for(j=0;j<nw;j+=1){rw[j] = r[rows[j]];}
+		double top = ndfit_sumsq(rw,nw,st->reduction);
+
+		for(c=0;c<points;c+=1){
+			int stop = ndfit_budget(st);
+			if(stop<0){
+				NDFIT_TRACE(st,"block",'E');
+				return NULL;
+			}
+			if(stop>0){
+				st->truncated = 1;
+				break;
+			}
+
+			ndfit_blocks_offset(step+b->first[k],d,c,scale,off);
+			for(i=0;i<d;i+=1){off[i] += xk[i];}
+			PyObject* params = ndfit_blocks_list(off,d);
+			int status = -1;
+			if(params!=NULL){
+				st->evals+=1;
+				if(st->parent!=NULL){st->parent->evals+=1;}
+				status = ndfit_blocks_call(st,k,params,cand);
+				Py_DECREF(params);
+			}
+			if(status<0){
+				NDFIT_TRACE(st,"block",'E');
+				return NULL;
+			}
+
+			// Swap the block's part of the model for the candidate's
+			for(j=0;j<nw;j+=1){rw[j] = model[rows[j]]-ck[j]+cand[j]-b->y[rows[j]];}
+			if(st->weights!=NULL){
+				for(j=0;j<nw;j+=1){rw[j] *= st->weights[rows[j]];}
+			}
+			double e = ndfit_sumsq(rw,nw,st->reduction);
+			if(e<top){
+				double* tmp = best;
+				best = cand;
+				cand = tmp;
+				top = e;
+				hit = c;
+				for(i=0;i<d;i+=1){bestoff[i] = off[i];}
+				if(st->opportunistic){break;}
+			}
+		}
+
+		if(hit>=0){
+			for(i=0;i<d;i+=1){xk[i] = bestoff[i];}
+			for(j=0;j<nw;j+=1){
+				model[rows[j]] += best[j]-ck[j];
+				ck[j] = best[j];
+				r[rows[j]] = model[rows[j]]-b->y[rows[j]];
+				if(st->weights!=NULL){r[rows[j]] *= st->weights[rows[j]];}
+			}
+			*moved += 1;
+		}
+		NDFIT_TRACE_ARG(st,"block",'E',"rows",nw);
+	}
+
+	*sum = ndfit_blocks_total(st,model,r);
+	return ndfit_blocks_list(x,st->dim);
+}
@@ -0,0 +1,389 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Include Libraries
+#include <Python.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../inc/shared.h"
+
+//////////////////////////////////////////////
+// Checkpoints: the search state of a running
+// fit in a compact binary file so a pre-empted
+// job can carry on with ndfit.resume().
+//
+// All numbers are stored in native byte order:
+//
+//   magic "NDFITCK\0", int32 version
+//   int32  mode throttle adaptive opportunistic vectorized
+//          reduction precision single depth maxdepth every
+//   int64  dim ldim datalen maxevals evals nconsts
+//   double conv tfactor steptol tbudget elapsed lscale centre entropy
+//   uint64 rng
+//   double params[dim] step[dim] consts[nconsts]
+//   int64  nlinear linear[nlinear]            (version 2)
+//   double scale[dim], int32 runs[dim]        (adaptive)
+//   int64  order[ldim]                        (opportunistic)
+//   depth x (double entropy, double params[dim])
+//   uint64 FNV-1a checksum of everything above
+//
+// The centre is always the last point in the history.
+//
+
+#define NDFIT_CK_MAGIC   "NDFITCK"
+#define NDFIT_CK_VERSION 2
+
+typedef struct ndfit_buffer{
+	char* buf;
+	size_t len;
+	size_t cap;
+	size_t pos;
+} ndfit_buffer;
+
+static uint64_t ndfit_fnv(const char* p, size_t n){
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for(i=0;i<n;i+=1){
+		h ^= (unsigned char)p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static int ndfit_put(ndfit_buffer* b, const void* p, size_t n){
+	if(b->len+n>b->cap){
+		size_t cap = b->cap ? b->cap : 4096;
+		while(cap<b->len+n){cap *= 2;}
+		char* buf = PyMem_Realloc(b->buf,cap);
+		if(buf==NULL){PyErr_NoMemory(); return -1;}
+		b->buf = buf;
+		b->cap = cap;
+	}
+	memcpy(b->buf+b->len,p,n);
+	b->len += n;
+	return 0;
+}
+
+static int ndfit_get(ndfit_buffer* b, void* p, size_t n){
+	if(b->pos+n>b->len){
+		PyErr_SetString(ndfitError,"Checkpoint file is truncated");
+		return -1;
+	}
+	memcpy(p,b->buf+b->pos,n);
+	b->pos += n;
+	return 0;
+}
+
+static int ndfit_put_int(ndfit_buffer* b, int32_t v){return ndfit_put(b,&v,sizeof(v));}
+static int ndfit_put_long(ndfit_buffer* b, int64_t v){return ndfit_put(b,&v,sizeof(v));}
+static int ndfit_put_double(ndfit_buffer* b, double v){return ndfit_put(b,&v,sizeof(v));}
+
+static int ndfit_get_int(ndfit_buffer* b, int* v){
+	int32_t t;
+	if(ndfit_get(b,&t,sizeof(t))<0){return -1;}
+	*v = (int)t;
+	return 0;
+}
+
+static int ndfit_get_long(ndfit_buffer* b, Py_ssize_t* v){
+	int64_t t;
+	if(ndfit_get(b,&t,sizeof(t))<0){return -1;}
+	*v = (Py_ssize_t)t;
+	return 0;
+}
+
+// Write a list of numbers as doubles
+static int ndfit_put_list(ndfit_buffer* b, PyObject* list){
+	Py_ssize_t i;
+	for(i=0;i<PyList_Size(list);i+=1){
+		double v = PyFloat_AsDouble(PyList_GetItem(list,i));
+		if(v==-1.0 && PyErr_Occurred()){return -1;}
+		if(ndfit_put_double(b,v)<0){return -1;}
+	}
+	return 0;
+}
+
+// Read n doubles into a new list of floats
+static PyObject* ndfit_get_list(ndfit_buffer* b, Py_ssize_t n){
+	Py_ssize_t i;
+	double v;
+	PyObject* list = PyList_New(n);
+	if(list==NULL){return NULL;}
+	for(i=0;i<n;i+=1){
+		if(ndfit_get(b,&v,sizeof(v))<0){Py_DECREF(list); return NULL;}
+		PyList_SET_ITEM(list,i,PyFloat_FromDouble(v));
+	}
+	return list;
+}
+
+/////////////////////////
+// Writing checkpoints //
+/////////////////////////
+// Pack the state of st into b
+static int ndfit_pack(ndfit_state* st, ndfit_buffer* b){
+
+	Py_ssize_t i;
+	int32_t config[] = {st->mode,st->throttle,st->adaptive,st->opportunistic,st->vectorized,
+		st->reduction,st->precision,st->single,st->depth,st->maxdepth,st->every};
+	int64_t sizes[] = {st->dim,st->ldim,st->datalen,st->maxevals,st->evals,PyList_Size(st->consts)};
+	double values[] = {st->conv,st->tfactor,st->steptol,st->tbudget,ndfit_clock()-st->tstart,
+		st->lscale,st->center_entropy};
+
+	if(ndfit_put(b,NDFIT_CK_MAGIC,8)<0){return -1;}
+	if(ndfit_put_int(b,NDFIT_CK_VERSION)<0){return -1;}
+	if(ndfit_put(b,config,sizeof(config))<0){return -1;}
+	if(ndfit_put(b,sizes,sizeof(sizes))<0){return -1;}
+	if(ndfit_put(b,values,sizeof(values))<0){return -1;}
+	if(ndfit_put(b,&st->rng,sizeof(st->rng))<0){return -1;}
+	if(ndfit_put_list(b,st->params)<0){return -1;}
+	if(ndfit_put_list(b,st->step)<0){return -1;}
+	if(ndfit_put_list(b,st->consts)<0){return -1;}
+	Py_ssize_t nlinear = (st->linear!=NULL) ? PyList_Size(st->linear) : 0;
+	if(ndfit_put_long(b,nlinear)<0){return -1;}
+	for(i=0;i<nlinear;i+=1){
+		if(ndfit_put_long(b,PyLong_AsSsize_t(PyList_GET_ITEM(st->linear,i)))<0){return -1;}
+	}
+
+	if(st->adaptive){
+		for(i=0;i<st->dim;i+=1){if(ndfit_put_double(b,st->scale[i])<0){return -1;}}
+		for(i=0;i<st->dim;i+=1){if(ndfit_put_int(b,st->runs[i])<0){return -1;}}
+	}
+	if(st->opportunistic){
+		for(i=0;i<st->ldim;i+=1){if(ndfit_put_long(b,st->order[i])<0){return -1;}}
+	}
+	for(i=0;i<st->depth;i+=1){
+		PyObject* item = PyList_GetItem(st->plist,i);
+		if(ndfit_put_double(b,PyFloat_AsDouble(PyTuple_GetItem(item,0)))<0){return -1;}
+		if(ndfit_put_list(b,PyTuple_GetItem(item,1))<0){return -1;}
+	}
+	uint64_t check = ndfit_fnv(b->buf,b->len);
+	return ndfit_put(b,&check,sizeof(check));
+}
+
+// Write the packed state to st->checkpoint. The file is written next
+// to the target and renamed over it, so a job killed half way through
+// leaves the previous checkpoint intact.
+static int ndfit_write(ndfit_state* st){
+
+	int status = -1;
+	FILE* fp = NULL;
+	const char* path = PyBytes_AS_STRING(st->checkpoint);
+	char* tmp = PyMem_Malloc(strlen(path)+5);
+	if(tmp==NULL){PyErr_NoMemory(); return -1;}
+	strcpy(tmp,path);
+	strcat(tmp,".tmp");
+
+	fp = fopen(tmp,"wb");
+	if(fp==NULL || fwrite(st->ckbuf,1,st->cklen,fp)!=st->cklen || fflush(fp)!=0 || fsync(fileno(fp))!=0){
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError,tmp);
+		goto done;
+	}
+	fclose(fp);
+	fp = NULL;
+	if(rename(tmp,path)!=0){
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError,path);
+		goto done;
+	}
+	status = 0;
+
+done:
+	if(fp!=NULL){fclose(fp); remove(tmp);}
+	PyMem_Free(tmp);
+	return status;
+}
+
+// Checkpoint st after an iteration. The state is packed in memory
+// every time but only written out every st->every iterations.
+int ndfit_checkpoint(ndfit_state* st){
+
+	ndfit_buffer b = {NULL,0,0,0};
+	if(ndfit_pack(st,&b)<0){
+		PyMem_Free(b.buf);
+		return -1;
+	}
+	PyMem_Free(st->ckbuf);
+	st->ckbuf = b.buf;
+	st->cklen = b.len;
+	if(++st->since<st->every){return 0;}
+	st->since = 0;
+	return ndfit_write(st);
+}
+
+// Write the last state packed if the file is behind it, once the fit
+// stops. A budget stop so resumes from the last full iteration.
+int ndfit_checkpoint_flush(ndfit_state* st){
+
+	if(st->ckbuf==NULL || st->since==0){return 0;}
+	st->since = 0;
+	return ndfit_write(st);
+}
+
+/////////////////////////
+// Reading checkpoints //
+/////////////////////////
+// Fill a zeroed state from the checkpoint at path: configuration,
+// params, step, consts, linear params, history and the adaptive,
+// polling and random number state. The callables and data are left
+// to the caller. Version 1 files predate linear params.
+int ndfit_restore(ndfit_state* st, const char* path){
+
+	Py_ssize_t i, nconsts;
+	int status = -1;
+	int version;
+	char magic[8];
+	ndfit_buffer b = {NULL,0,0,0};
+	long size;
+
+	FILE* fp = fopen(path,"rb");
+	if(fp==NULL){PyErr_SetFromErrnoWithFilename(PyExc_OSError,path); return -1;}
+	if(fseek(fp,0,SEEK_END)!=0 || (size = ftell(fp))<0 || fseek(fp,0,SEEK_SET)!=0){
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError,path);
+		fclose(fp);
+		return -1;
+	}
+	b.len = (size_t)size;
+	b.buf = PyMem_Malloc(b.len ? b.len : 1);
+	if(b.buf==NULL){fclose(fp); PyErr_NoMemory(); return -1;}
+	if(fread(b.buf,1,b.len,fp)!=b.len){
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError,path);
+		fclose(fp);
+		goto done;
+	}
+	fclose(fp);
+
+	// Check the file before believing any of it
+	uint64_t check;
+	if(b.len<8+sizeof(check) || memcmp(b.buf,NDFIT_CK_MAGIC,8)){
+		PyErr_SetString(ndfitError,"Not an ndfit checkpoint");
+		goto done;
+	}
+	b.len -= sizeof(check);
+	memcpy(&check,b.buf+b.len,sizeof(check));
+	if(check!=ndfit_fnv(b.buf,b.len)){
+		PyErr_SetString(ndfitError,"Checkpoint file is corrupt");
+		goto done;
+	}
+	if(ndfit_get(&b,magic,8)<0 || ndfit_get_int(&b,&version)<0){goto done;}
+	if(version<1 || version>NDFIT_CK_VERSION){
+		PyErr_Format(ndfitError,"Unsupported checkpoint version %d",version);
+		goto done;
+	}
+
+	int32_t config[11];
+	int64_t sizes[6];
+	double values[7];
+	if(ndfit_get(&b,config,sizeof(config))<0){goto done;}
+	if(ndfit_get(&b,sizes,sizeof(sizes))<0){goto done;}
+	if(ndfit_get(&b,values,sizeof(values))<0){goto done;}
+	if(ndfit_get(&b,&st->rng,sizeof(st->rng))<0){goto done;}
+
+	st->mode = config[0];
+	st->throttle = config[1];
+	st->adaptive = config[2];
+	st->opportunistic = config[3];
+	st->vectorized = config[4];
+	st->reduction = config[5];
+	st->precision = config[6];
+	st->single = config[7];
+	st->depth = config[8];
+	st->maxdepth = config[9];
+	st->every = config[10];
+	st->dim = (Py_ssize_t)sizes[0];
+	st->ldim = (Py_ssize_t)sizes[1];
+	st->datalen = (Py_ssize_t)sizes[2];
+	st->maxevals = (long)sizes[3];
+	st->evals = (long)sizes[4];
+	nconsts = (Py_ssize_t)sizes[5];
+	st->conv = values[0];
+	st->tfactor = values[1];
+	st->steptol = values[2];
+	st->tbudget = values[3];
+	st->tstart = ndfit_clock()-values[4];
+	st->lscale = values[5];
+	st->center_entropy = values[6];
+
+	if(st->dim<1 || st->depth<1 || st->depth>st->maxdepth || nconsts<0 || st->ldim<1){
+		PyErr_SetString(ndfitError,"Checkpoint holds no usable search state");
+		goto done;
+	}
+
+	st->params = ndfit_get_list(&b,st->dim);
+	if(st->params==NULL){goto done;}
+	st->step = ndfit_get_list(&b,st->dim);
+	if(st->step==NULL){goto done;}
+	st->consts = ndfit_get_list(&b,nconsts);
+	if(st->consts==NULL){goto done;}
+	if(version>=2){
+		Py_ssize_t nlinear;
+		if(ndfit_get_long(&b,&nlinear)<0){goto done;}
+		if(nlinear<0 || nlinear>st->dim){
+			PyErr_SetString(ndfitError,"Checkpoint file is corrupt");
+			goto done;
+		}
+		if(nlinear>0){
+			st->linear = PyList_New(nlinear);
+			if(st->linear==NULL){goto done;}
+			for(i=0;i<nlinear;i+=1){
+				Py_ssize_t k;
+				if(ndfit_get_long(&b,&k)<0){goto done;}
+				PyObject* index = PyLong_FromSsize_t(k);
+				if(index==NULL){goto done;}
+				PyList_SET_ITEM(st->linear,i,index);
+			}
+			if(ndfit_linear_check(st)<0){goto done;}
+		}
+	}
+
+	if(st->adaptive){
+		st->scale = PyMem_Malloc(sizeof(double)*st->dim);
+		st->runs = PyMem_Calloc(st->dim,sizeof(int));
+		if(st->scale==NULL || st->runs==NULL){PyErr_NoMemory(); goto done;}
+		if(ndfit_get(&b,st->scale,sizeof(double)*st->dim)<0){goto done;}
+		for(i=0;i<st->dim;i+=1){if(ndfit_get_int(&b,&st->runs[i])<0){goto done;}}
+	}
+	if(st->opportunistic){
+		st->order = PyMem_Malloc(sizeof(Py_ssize_t)*st->ldim);
+		if(st->order==NULL){PyErr_NoMemory(); goto done;}
+		for(i=0;i<st->ldim;i+=1){
+			if(ndfit_get_long(&b,&st->order[i])<0){goto done;}
+			if(st->order[i]<0 || st->order[i]>=st->ldim){
+				PyErr_SetString(ndfitError,"Checkpoint file is corrupt");
+				goto done;
+			}
+		}
+	}
+
+	st->plist = PyList_New(st->maxdepth);
+	if(st->plist==NULL){goto done;}
+	for(i=0;i<st->depth;i+=1){
+		double e;
+		if(ndfit_get(&b,&e,sizeof(e))<0){goto done;}
+		PyObject* params = ndfit_get_list(&b,st->dim);
+		if(params==NULL){goto done;}
+		PyList_SetItem(st->plist,i,Py_BuildValue("(dN)",e,params));
+	}
+	st->center = PyTuple_GetItem(PyList_GetItem(st->plist,st->depth-1),1);
+	status = 0;
+
+done:
+	PyMem_Free(b.buf);
+	return status;
+}
@@ -0,0 +1,395 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <structmember.h>
+#include <string.h>
+
+//////////////////////////////////////////////
+// ndfit.Dataset: data converted and checked
+// once, kept as contiguous float64 columns.
+// Fits on the same data reuse it for free.
+//
+// 1) typedef
+// 2) destructor
+// 3) constructor __new__ / __init__
+// 4) conversion helpers
+// 5) class methods and buffer export
+// 6) member & method definitions for new type (class)
+// 7) build class by calling PyTypeObject
+// 8) helpers for run() and buildcurve()
+//
+
+// 1) typedef: data structure definition lives in shared.h
+#include "../inc/shared.h"
+
+// 2) typedef destructor
+static void ndDataset_dealloc(ndDataset* self){
+	if(!self->borrowed){PyMem_Free(self->columns);}
+	Py_XDECREF(self->rows);
+	Py_XDECREF(self->min);
+	Py_XDECREF(self->max);
+	Py_XDECREF(self->mean);
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+// 3) constructor: everything empty until __init__ has run
+static PyObject* ndDataset_new(PyTypeObject* type, PyObject* args, PyObject* kwds){
+	ndDataset* self = (ndDataset*)type->tp_alloc(type,0);
+	return (PyObject*)self;
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~~~ CONVERSION ~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+// Allocate column storage for nrows x ncols
+static int ndDataset_alloc(ndDataset* self, Py_ssize_t nrows, Py_ssize_t ncols, int ndim){
+	if(nrows<1 || ncols<1){
+		PyErr_SetString(ndfitError,"Data is empty");
+		return -1;
+	}
+	self->columns = PyMem_Malloc(sizeof(double)*nrows*ncols);
+	if(self->columns==NULL){PyErr_NoMemory(); return -1;}
+	self->nrows = nrows;
+	self->ncols = ncols;
+	self->ndim = ndim;
+	return 0;
+}
+
+// Float buffers of one or two dimensions (numpy arrays, array.array)
+static int ndDataset_frombuffer(ndDataset* self, PyObject* data){
+
+	Py_ssize_t i, j;
+	Py_buffer view;
+	if(PyObject_GetBuffer(data,&view,PyBUF_FORMAT|PyBUF_STRIDES)<0){return -1;}
+
+	const char* fmt = view.format ? view.format : "B";
+	if(fmt[0]=='<' || fmt[0]=='=' || fmt[0]=='@'){fmt+=1;}
+	int isfloat = !strcmp(fmt,"f");
+	if((!isfloat && strcmp(fmt,"d")) || view.ndim<1 || view.ndim>2){
+		PyBuffer_Release(&view);
+		PyErr_SetString(ndfitError,"Data buffers must be 1-D or 2-D float32/float64");
+		return -1;
+	}
+	Py_ssize_t ncols = (view.ndim==2) ? view.shape[1] : 1;
+	if(ndDataset_alloc(self,view.shape[0],ncols,view.ndim)<0){PyBuffer_Release(&view); return -1;}
+
+	for(i=0;i<self->nrows;i+=1){
+		for(j=0;j<ncols;j+=1){
+			const char* p = (const char*)view.buf + i*view.strides[0] + (view.ndim==2 ? j*view.strides[1] : 0);
+			self->columns[j*self->nrows+i] = isfloat ? (double)*(const float*)p : *(const double*)p;
+		}
+	}
+	PyBuffer_Release(&view);
+	return 0;
+}
+
+// A list of rows (the zip()ed lists the rest of ndfit takes) or a
+// list of plain numbers. Every row must have the same length.
+static int ndDataset_fromrows(ndDataset* self, PyObject* data){
+
+	Py_ssize_t i, j;
+	PyObject* seq = PySequence_Fast(data,"Data must be a buffer or a sequence of rows");
+	if(seq==NULL){return -1;}
+
+	Py_ssize_t nrows = PySequence_Fast_GET_SIZE(seq);
+	PyObject* first = nrows ? PySequence_Fast_GET_ITEM(seq,0) : NULL;
+	int ndim = (first!=NULL && PySequence_Check(first)) ? 2 : 1;
+	Py_ssize_t ncols = (ndim==2) ? PySequence_Size(first) : 1;
+	if(ncols<0 || ndDataset_alloc(self,nrows,ncols,ndim)<0){Py_DECREF(seq); return -1;}
+
+	for(i=0;i<nrows;i+=1){
+		PyObject* row = PySequence_Fast_GET_ITEM(seq,i);
+		if(ndim==1){
+			double v = PyFloat_AsDouble(row);
+			if(v==-1.0 && PyErr_Occurred()){goto fail;}
+			self->columns[i] = v;
+			continue;
+		}
+		PyObject* items = PySequence_Fast(row,"Data rows must be sequences");
+		if(items==NULL){goto fail;}
+		if(PySequence_Fast_GET_SIZE(items)!=ncols){
+			PyErr_Format(ndfitError,"Row %zd has %zd columns, expected %zd",
+				i,PySequence_Fast_GET_SIZE(items),ncols);
+			Py_DECREF(items);
+			goto fail;
+		}
+		for(j=0;j<ncols;j+=1){
+			double v = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(items,j));
+			if(v==-1.0 && PyErr_Occurred()){Py_DECREF(items); goto fail;}
+			self->columns[j*nrows+i] = v;
+		}
+		Py_DECREF(items);
+	}
+	Py_DECREF(seq);
+	return 0;
+
+fail:
+	Py_DECREF(seq);
+	return -1;
+}
+
+// Per column minimum, maximum and mean
+static int ndDataset_stats(ndDataset* self){
+
+	Py_ssize_t i, j;
+	self->min = PyTuple_New(self->ncols);
+	self->max = PyTuple_New(self->ncols);
+	self->mean = PyTuple_New(self->ncols);
+	if(self->min==NULL || self->max==NULL || self->mean==NULL){return -1;}
+
+	for(j=0;j<self->ncols;j+=1){
+		const double* c = self->columns+j*self->nrows;
+		double lo = c[0], hi = c[0], sum = 0.0;
+		for(i=0;i<self->nrows;i+=1){
+			if(c[i]<lo){lo = c[i];}
+			if(c[i]>hi){hi = c[i];}
+			sum += c[i];
+		}
+		PyTuple_SET_ITEM(self->min,j,PyFloat_FromDouble(lo));
+		PyTuple_SET_ITEM(self->max,j,PyFloat_FromDouble(hi));
+		PyTuple_SET_ITEM(self->mean,j,PyFloat_FromDouble(sum/(double)self->nrows));
+	}
+	return 0;
+}
+
+static int ndDataset_init(ndDataset* self, PyObject* args, PyObject* kwds){
+
+	PyObject* data = NULL;
+	static char *kwlist[] = {"data",NULL};
+	if(!PyArg_ParseTupleAndKeywords(args,kwds,"O",kwlist,&data)){return -1;}
+
+	int status = -1;
+	NDFIT_BEGIN_CRITICAL(self)
+	if(self->columns!=NULL){
+		PyErr_SetString(ndfitError,"Dataset is already initialized");
+	}
+	else{
+		status = PyObject_CheckBuffer(data) ? ndDataset_frombuffer(self,data) : ndDataset_fromrows(self,data);
+		if(status==0){status = ndDataset_stats(self);}
+	}
+	NDFIT_END_CRITICAL()
+	return status;
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~ METHOD DEFINITION ~~~~~~~~~~~~~~~~~~//
+/////////////////////////////////////////////////////////
+static int ndDataset_ready(ndDataset* self){
+	if(self->columns==NULL){
+		PyErr_SetString(ndfitError,"Dataset is not initialized");
+		return -1;
+	}
+	return 0;
+}
+
+// The rows as a list of tuples (floats for 1-D data)
+static PyObject* ndDataset_buildrows(ndDataset* self){
+
+	Py_ssize_t i, j;
+	PyObject* rows = PyList_New(self->nrows);
+	if(rows==NULL){return NULL;}
+	for(i=0;i<self->nrows;i+=1){
+		PyObject* row;
+		if(self->ndim==1){
+			row = PyFloat_FromDouble(self->columns[i]);
+		}
+		else{
+			row = PyTuple_New(self->ncols);
+			for(j=0;row!=NULL && j<self->ncols;j+=1){
+				PyTuple_SET_ITEM(row,j,PyFloat_FromDouble(self->columns[j*self->nrows+i]));
+			}
+		}
+		if(row==NULL){Py_DECREF(rows); return NULL;}
+		PyList_SET_ITEM(rows,i,row);
+	}
+	return rows;
+}
+
+// The rows, built on first use and cached. This is what row by row 
+// error functions are fed.
+PyObject* ndfit_dataset_rows(ndDataset* self){
+
+	PyObject* rows;
+	if(ndDataset_ready(self)<0){return NULL;}
+	NDFIT_BEGIN_CRITICAL(self)
+	if(self->rows==NULL){self->rows = ndDataset_buildrows(self);}
+	rows = self->rows;
+	Py_XINCREF(rows);
+	NDFIT_END_CRITICAL()
+	return rows;
+}
+
+// One column as a list of floats
+PyObject* ndfit_dataset_column(ndDataset* self, Py_ssize_t j){
+
+	Py_ssize_t i;
+	if(ndDataset_ready(self)<0){return NULL;}
+	if(j<0 || j>=self->ncols){
+		PyErr_SetString(PyExc_IndexError,"Column index out of range");
+		return NULL;
+	}
+	PyObject* list = PyList_New(self->nrows);
+	if(list==NULL){return NULL;}
+	for(i=0;i<self->nrows;i+=1){
+		PyList_SET_ITEM(list,i,PyFloat_FromDouble(self->columns[j*self->nrows+i]));
+	}
+	return list;
+}
+
+static PyObject* ndDataset_column(ndDataset* self, PyObject* arg){
+	Py_ssize_t j = PyLong_AsSsize_t(arg);
+	if(j==-1 && PyErr_Occurred()){return NULL;}
+	return ndfit_dataset_column(self,j);
+}
+
+// Callers get a copy so the cached rows can not be changed under a fit
+static PyObject* ndDataset_getrows(ndDataset* self, void* closure){
+	PyObject* rows = ndfit_dataset_rows(self);
+	if(rows==NULL){return NULL;}
+	PyObject* copy = PyList_GetSlice(rows,0,self->nrows);
+	Py_DECREF(rows);
+	return copy;
+}
+
+static PyObject* ndDataset_getshape(ndDataset* self, void* closure){
+	if(ndDataset_ready(self)<0){return NULL;}
+	if(self->ndim==1){return Py_BuildValue("(n)",self->nrows);}
+	return Py_BuildValue("(nn)",self->nrows,self->ncols);
+}
+
+static Py_ssize_t ndDataset_length(ndDataset* self){
+	return self->nrows;
+}
+
+// Read-only export of the columns: a Fortran ordered (rows, cols)
+// float64 array, so numpy.asarray(ds)[:,j] is a contiguous column
+static int ndDataset_getbuffer(ndDataset* self, Py_buffer* view, int flags){
+
+	if(ndDataset_ready(self)<0){view->obj = NULL; return -1;}
+	if((flags & PyBUF_WRITABLE)==PyBUF_WRITABLE){
+		PyErr_SetString(PyExc_BufferError,"Dataset is read-only");
+		view->obj = NULL;
+		return -1;
+	}
+	if(self->ndim==2 && self->ncols>1 && (flags & PyBUF_C_CONTIGUOUS)==PyBUF_C_CONTIGUOUS){
+		PyErr_SetString(PyExc_BufferError,"Dataset is stored by column (Fortran order)");
+		view->obj = NULL;
+		return -1;
+	}
+	if((flags & PyBUF_STRIDES)!=PyBUF_STRIDES && self->ndim==2 && self->ncols>1){
+		PyErr_SetString(PyExc_BufferError,"Dataset export needs strides");
+		view->obj = NULL;
+		return -1;
+	}
+
+	self->shape[0] = self->nrows;
+	self->shape[1] = self->ncols;
+	self->strides[0] = sizeof(double);
+	self->strides[1] = sizeof(double)*self->nrows;
+
+	view->buf = self->columns;
+	view->obj = (PyObject*)self;
+	view->len = sizeof(double)*self->nrows*self->ncols;
+	view->readonly = 1;
+	view->itemsize = sizeof(double);
+	view->format = (flags & PyBUF_FORMAT) ? "d" : NULL;
+	view->ndim = self->ndim;
+	view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES) ? self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	Py_INCREF(self);
+	return 0;
+}
+
+///////////////////////////////////////////////
+// CONSTRUCTOR: MEMBER DEFINITION FOR PYTHON //
+///////////////////////////////////////////////
+static PyMemberDef ndDataset_members[] = {
+	{"min",T_OBJECT,offsetof(ndDataset,min),READONLY,"per column minimum"},
+	{"max",T_OBJECT,offsetof(ndDataset,max),READONLY,"per column maximum"},
+	{"mean",T_OBJECT,offsetof(ndDataset,mean),READONLY,"per column mean"},
+	{NULL}	 /* Sentinel */
+};
+
+static PyGetSetDef ndDataset_getset[] = {
+	{"rows",(getter)ndDataset_getrows,NULL,"the rows as a list of tuples",NULL},
+	{"shape",(getter)ndDataset_getshape,NULL,"(rows, columns)",NULL},
+	{NULL}	 /* Sentinel */
+};
+
+static PyMethodDef ndDataset_methods[] = {
+	{"column", (PyCFunction)(void(*)(void))ndDataset_column, METH_O, "return a column as a list"},
+	{NULL}	/* Sentinel */
+};
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~ BUILD OBJECT ~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+static PyType_Slot ndDataset_slots[] = {
+	{Py_tp_dealloc, (void*)ndDataset_dealloc},
+	{Py_mp_length, (void*)ndDataset_length},
+	{Py_bf_getbuffer, (void*)ndDataset_getbuffer},
+	{Py_tp_methods, ndDataset_methods},
+	{Py_tp_members, ndDataset_members},
+	{Py_tp_getset, ndDataset_getset},
+	{Py_tp_init, (void*)ndDataset_init},
+	{Py_tp_new, (void*)ndDataset_new},
+	{Py_tp_doc, "data converted and validated once for many fits"},
+	{0, NULL}
+};
+
+PyType_Spec ndDataset_spec = {
+		"ndfit.Dataset",								 /* name */
+		sizeof(ndDataset),								 /* basicsize */
+		0,												 /* itemsize */
+		Py_TPFLAGS_DEFAULT|Py_TPFLAGS_IMMUTABLETYPE,	 /* flags */
+		ndDataset_slots,								 /* slots */
+};
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~~~~ HELPERS ~~~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+// A Dataset over columns owned by someone else (a worker process's
+// view of the shared memory). The columns must outlive the Dataset.
+PyObject* ndfit_dataset_wrap(double* columns, Py_ssize_t nrows, Py_ssize_t ncols, int ndim){
+	PyTypeObject* type = ndfit_module()->dataset_type;
+	ndDataset* self = (ndDataset*)type->tp_alloc(type,0);
+	if(self==NULL){return NULL;}
+	self->columns = columns;
+	self->borrowed = 1;
+	self->nrows = nrows;
+	self->ncols = ncols;
+	self->ndim = ndim;
+	if(ndDataset_stats(self)<0){Py_DECREF(self); return NULL;}
+	return (PyObject*)self;
+}
+
+// The object a fit should hand its error function: the cached rows of
+// a Dataset for row by row fits, anything else as it is. New reference.
+PyObject* ndfit_dataset_data(PyObject* data, int vectorized){
+	if(PyObject_TypeCheck(data,ndfit_module()->dataset_type) && !vectorized){
+		return ndfit_dataset_rows((ndDataset*)data);
+	}
+	Py_INCREF(data);
+	return data;
+}
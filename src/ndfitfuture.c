@@ -0,0 +1,317 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <pythread.h>
+#include <structmember.h>
+
+//////////////////////////////////////////////
+// ndfit.Future: a fit running on a native
+// background thread. The handle can be polled
+// (done, progress), blocked on (result),
+// cancelled and awaited from asyncio.
+//
+// 1) typedef
+// 2) destructor
+// 3) worker thread
+// 4) class methods
+// 5) method definitions for new type (class)
+// 6) build class by calling PyTypeObject
+// 7) module method submit()
+//
+
+// 1) typedef: data structure definition lives in shared.h
+#include "../inc/shared.h"
+
+// 2) typedef destructor
+static void ndFuture_dealloc(ndFuture* self){
+
+	// The worker holds a reference while it runs, so by the time we
+	// get here the fit is either finished or was never started
+	ndfit_release(&self->st);
+	Py_XDECREF(self->result);
+	Py_XDECREF(self->exc_type);
+	Py_XDECREF(self->exc_value);
+	Py_XDECREF(self->exc_tb);
+	Py_XDECREF(self->waiters);
+	if(self->lock){PyThread_free_lock(self->lock);}
+	if(self->guard){PyThread_free_lock(self->guard);}
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~ WORKER THREAD ~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+
+// Hand the outcome of the fit to an asyncio future. This runs on the
+// event loop thread through loop.call_soon_threadsafe.
+static PyObject* ndFuture_settle(ndFuture* self, PyObject* fut){
+
+	PyObject* done = PyObject_CallMethod(fut,"done",NULL);
+	if(done==NULL){return NULL;}
+	int isdone = PyObject_IsTrue(done);
+	Py_DECREF(done);
+	if(isdone){Py_RETURN_NONE;}
+
+	if(self->result!=NULL){
+		return PyObject_CallMethod(fut,"set_result","O",self->result);
+	}
+	return PyObject_CallMethod(fut,"set_exception","O",self->exc_value);
+}
+
+// Take guard without the GIL: whoever holds it may need the GIL back 
+// (allocations can run the garbage collector) before letting go.
+static void ndFuture_guard(ndFuture* self){
+	if(PyThread_acquire_lock(self->guard,NOWAIT_LOCK)){return;}
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->guard,WAIT_LOCK);
+	Py_END_ALLOW_THREADS
+}
+
+// Mark the fit done and wake every coroutine awaiting it. Waiters are
+// taken from the list under guard, so every coroutine either joined 
+// before and is woken here or sees done and settles by itself. Called
+// with the GIL held.
+static void ndFuture_wake(ndFuture* self){
+
+	Py_ssize_t i;
+	ndFuture_guard(self);
+	PyObject* waiters = self->waiters;
+	self->waiters = NULL;
+	self->done = 1;
+	PyThread_release_lock(self->guard);
+
+	PyObject* settle = PyObject_GetAttrString((PyObject*)self,"_settle");
+	if(settle==NULL){PyErr_Clear(); Py_DECREF(waiters); return;}
+
+	for(i=0;i<PyList_GET_SIZE(waiters);i+=1){
+		PyObject* waiter = PyList_GET_ITEM(waiters,i);
+		PyObject* r = PyObject_CallMethod(PyTuple_GET_ITEM(waiter,0),"call_soon_threadsafe","OO",
+			settle,PyTuple_GET_ITEM(waiter,1));
+
+		// A closed loop has nobody left to tell
+		if(r==NULL){PyErr_Clear();}
+		Py_XDECREF(r);
+	}
+	Py_DECREF(settle);
+	Py_DECREF(waiters);
+}
+
+static void ndfit_worker(void* arg){
+
+	ndFuture* self = (ndFuture*)arg;
+	PyThreadState* ts = ndfit_thread_enter(self->interp);
+
+	self->result = ndfit_fit(&self->st);
+	if(self->result==NULL){
+		PyErr_Fetch(&self->exc_type,&self->exc_value,&self->exc_tb);
+		PyErr_NormalizeException(&self->exc_type,&self->exc_value,&self->exc_tb);
+		if(self->exc_tb!=NULL){PyException_SetTraceback(self->exc_value,self->exc_tb);}
+	}
+
+	// Drop the inputs now rather than when the handle goes away
+	ndfit_release(&self->st);
+	ndFuture_wake(self);
+	PyThread_release_lock(self->lock);
+
+	Py_DECREF(self);
+	ndfit_thread_leave(ts);
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~ METHOD DEFINITION ~~~~~~~~~~~~~~~~~~//
+/////////////////////////////////////////////////////////
+
+static PyObject* ndFuture_done(ndFuture* self){
+	return PyBool_FromLong(self->done);
+}
+
+static PyObject* ndFuture_cancelled(ndFuture* self){
+	return PyBool_FromLong(self->st.cancelled);
+}
+
+// Ask the fit to stop at the next evaluation. The fit then finishes
+// as a truncated ndFit holding the best point found so far.
+static PyObject* ndFuture_cancel(ndFuture* self){
+	if(self->done){Py_RETURN_FALSE;}
+	self->st.cancelled = 1;
+	Py_RETURN_TRUE;
+}
+
+// Snapshot of how far the fit has got
+static PyObject* ndFuture_progress(ndFuture* self){
+	double elapsed = self->st.tstart>0.0 ? ndfit_clock()-self->st.tstart : 0.0;
+	return Py_BuildValue("{s:i,s:l,s:d,s:d,s:O}",
+		"depth",self->st.depth,
+		"evaluations",self->st.evals,
+		"entropy",self->st.entropy,
+		"elapsed",elapsed,
+		"done",self->done ? Py_True : Py_False);
+}
+
+// Block until the fit is done (or timeout seconds pass) and return
+// the ndFit. Exceptions raised by the fit are raised again here.
+static PyObject* ndFuture_result(ndFuture* self, PyObject* args, PyObject* kwds){
+
+	double timeout = -1.0;
+	PyObject* otimeout = Py_None;
+	static char *kwlist[] = {"timeout",NULL};
+	if(!PyArg_ParseTupleAndKeywords(args,kwds,"|O",kwlist,&otimeout)){return NULL;}
+	if(otimeout!=Py_None){
+		timeout = PyFloat_AsDouble(otimeout);
+		if(PyErr_Occurred()){return NULL;}
+	}
+
+	// Wait in short slices so Ctrl-C still reaches us
+	double start = ndfit_clock();
+	while(!self->done){
+		PyLockStatus r;
+		Py_BEGIN_ALLOW_THREADS
+		r = PyThread_acquire_lock_timed(self->lock,50000,0);
+		Py_END_ALLOW_THREADS
+		if(r==PY_LOCK_ACQUIRED){PyThread_release_lock(self->lock); break;}
+		if(PyErr_CheckSignals()<0){return NULL;}
+		if(timeout>=0.0 && ndfit_clock()-start>=timeout){
+			PyErr_SetString(PyExc_TimeoutError,"Fit is still running");
+			return NULL;
+		}
+	}
+
+	if(self->result!=NULL){
+		Py_INCREF(self->result);
+		return self->result;
+	}
+	PyErr_SetObject(self->exc_type,self->exc_value);
+	return NULL;
+}
+
+// await support: park an asyncio future on the running loop and let
+// the worker resolve it through call_soon_threadsafe
+static PyObject* ndFuture_await(ndFuture* self){
+
+	PyObject* asyncio = PyImport_ImportModule("asyncio");
+	if(asyncio==NULL){return NULL;}
+	PyObject* loop = PyObject_CallMethod(asyncio,"get_running_loop",NULL);
+	Py_DECREF(asyncio);
+	if(loop==NULL){return NULL;}
+
+	PyObject* fut = PyObject_CallMethod(loop,"create_future",NULL);
+	if(fut==NULL){Py_DECREF(loop); return NULL;}
+
+	// Join the waiters unless the worker has been through them already
+	PyObject* waiter = PyTuple_Pack(2,loop,fut);
+	Py_DECREF(loop);
+	if(waiter==NULL){Py_DECREF(fut); return NULL;}
+	int joined = 0;
+	int status = 0;
+	ndFuture_guard(self);
+	if(!self->done){
+		status = PyList_Append(self->waiters,waiter);
+		joined = 1;
+	}
+	PyThread_release_lock(self->guard);
+	Py_DECREF(waiter);
+
+	PyObject* r = joined ? (status<0 ? NULL : Py_NewRef(Py_None)) : ndFuture_settle(self,fut);
+	if(r==NULL){Py_DECREF(fut); return NULL;}
+	Py_DECREF(r);
+
+	PyObject* it = PyObject_CallMethod(fut,"__await__",NULL);
+	Py_DECREF(fut);
+	return it;
+}
+
+///////////////////////
+// METHOD DEFINITION //
+///////////////////////
+static PyMethodDef ndFuture_methods[] = {
+	{"done", (PyCFunction)(void(*)(void))ndFuture_done, METH_NOARGS, "True once the fit has finished"},
+	{"cancel", (PyCFunction)(void(*)(void))ndFuture_cancel, METH_NOARGS, "stop the fit at the next evaluation"},
+	{"cancelled", (PyCFunction)(void(*)(void))ndFuture_cancelled, METH_NOARGS, "True if cancel() was called"},
+	{"progress", (PyCFunction)(void(*)(void))ndFuture_progress, METH_NOARGS, "return depth, evaluations, entropy and elapsed time"},
+	{"result", (PyCFunction)(void(*)(void))ndFuture_result, METH_VARARGS|METH_KEYWORDS, "wait for and return the ndFit"},
+	{"_settle", (PyCFunction)(void(*)(void))ndFuture_settle, METH_O, "resolve an asyncio future (internal)"},
+	{NULL}	/* Sentinel */
+};
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~ BUILD OBJECT ~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+
+///////////////////////////
+// NEW PYOBJECT: TYPEDEF //
+///////////////////////////
+static PyType_Slot ndFuture_slots[] = {
+	{Py_tp_dealloc, (void*)ndFuture_dealloc},
+	{Py_am_await, (void*)ndFuture_await},
+	{Py_tp_methods, ndFuture_methods},
+	{Py_tp_doc, "handle on a fit running in the background"},
+	{0, NULL}
+};
+
+// Not constructible from Python: use ndfit.submit()
+PyType_Spec ndFuture_spec = {
+		"ndfit.Future",									 /* name */
+		sizeof(ndFuture),								 /* basicsize */
+		0,												 /* itemsize */
+		Py_TPFLAGS_DEFAULT|Py_TPFLAGS_IMMUTABLETYPE|
+		Py_TPFLAGS_DISALLOW_INSTANTIATION,				 /* flags */
+		ndFuture_slots,									 /* slots */
+};
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~ MODULE METHOD ~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+
+// Same arguments as run(). The inputs are validated here, in the
+// calling thread, so bad arguments raise immediately.
+PyObject* ndfit_submit(PyObject* self, PyObject* args, PyObject* kwds){
+
+	PyTypeObject* type = ndfit_module()->future_type;
+	ndFuture* fut = (ndFuture*)type->tp_alloc(type,0);
+	if(fut==NULL){return NULL;}
+	fut->interp = PyInterpreterState_Get();
+
+	if(ndfit_setup(&fut->st,args,kwds)<0){
+		Py_DECREF(fut);
+		return NULL;
+	}
+
+	fut->waiters = PyList_New(0);
+	fut->lock = PyThread_allocate_lock();
+	fut->guard = PyThread_allocate_lock();
+	if(fut->waiters==NULL || fut->lock==NULL || fut->guard==NULL){
+		if(!PyErr_Occurred()){PyErr_NoMemory();}
+		Py_DECREF(fut);
+		return NULL;
+	}
+	PyThread_acquire_lock(fut->lock,WAIT_LOCK);
+
+	// The worker owns a reference until it is done
+	Py_INCREF(fut);
+	if(PyThread_start_new_thread(ndfit_worker,(void*)fut)==PYTHREAD_INVALID_THREAD_ID){
+		Py_DECREF(fut);
+		Py_DECREF(fut);
+		PyErr_SetString(ndfitError,"Unable to start fit thread");
+		return NULL;
+	}
+	return (PyObject*)fut;
+}
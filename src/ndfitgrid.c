@@ -0,0 +1,398 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <structmember.h>
+#include <string.h>
+#include <math.h>
+
+//////////////////////////////////////////////
+// ndfit.Grid: values on a regular 1-D, 2-D or
+// 3-D grid with a coordinate vector per axis.
+// The values buffer is held as it is, strides
+// and all, so a slice of an image is fitted
+// without a copy. Fits walk the grid in tiles
+// of NDFIT_CBLOCK points in C.
+//
+// 1) typedef
+// 2) destructor
+// 3) constructor __new__ / __init__
+// 4) class methods
+// 5) member & method definitions for new type (class)
+// 6) build class by calling PyTypeObject
+// 7) evaluation for run()
+//
+
+// 1) typedef: data structure definition lives in shared.h
+#include "../inc/shared.h"
+
+// Built-in models, all products of one factor per axis:
+// params = [amplitude, centre_0, width_0, ..., centre_n, width_n, offset]
+static const char* ndfit_grid_models[] = {"gaussian","lorentzian",NULL};
+
+// 2) typedef destructor
+static void ndGrid_dealloc(ndGrid* self){
+	int d;
+	if(self->view.obj!=NULL){PyBuffer_Release(&self->view);}
+	for(d=0;d<NDFIT_GRID_MAXDIM;d+=1){PyMem_Free(self->axes[d]);}
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+// 3) constructor: everything empty until __init__ has run
+static PyObject* ndGrid_new(PyTypeObject* type, PyObject* args, PyObject* kwds){
+	ndGrid* self = (ndGrid*)type->tp_alloc(type,0);
+	return (PyObject*)self;
+}
+
+// Coordinates of axis d: the given vector or 0, 1, 2, ...
+static int ndGrid_axis(ndGrid* self, int d, PyObject* axis){
+
+	Py_ssize_t i;
+	Py_ssize_t n = self->shape[d];
+	self->axes[d] = PyMem_Malloc(sizeof(double)*n);
+	if(self->axes[d]==NULL){PyErr_NoMemory(); return -1;}
+	if(axis==NULL || axis==Py_None){
+		for(i=0;i<n;i+=1){self->axes[d][i] = (double)i;}
+		return 0;
+	}
+	PyObject* seq = PySequence_Fast(axis,"Grid axes must be sequences of coordinates");
+	if(seq==NULL){return -1;}
+	if(PySequence_Fast_GET_SIZE(seq)!=n){
+		PyErr_Format(ndfitError,"Axis %d has %zd coordinates, the values have %zd",
+			d,PySequence_Fast_GET_SIZE(seq),n);
+		Py_DECREF(seq);
+		return -1;
+	}
+	for(i=0;i<n;i+=1){self->axes[d][i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq,i));}
+	Py_DECREF(seq);
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+static int ndGrid_init(ndGrid* self, PyObject* args, PyObject* kwds){
+
+	int d;
+	PyObject* values = NULL;
+	PyObject* axes = Py_None;
+	static char *kwlist[] = {"values","axes",NULL};
+	if(!PyArg_ParseTupleAndKeywords(args,kwds,"O|O",kwlist,&values,&axes)){return -1;}
+	if(self->view.obj!=NULL){
+		PyErr_SetString(ndfitError,"Grid is already initialized");
+		return -1;
+	}
+
+	Py_buffer view;
+	if(PyObject_GetBuffer(values,&view,PyBUF_FORMAT|PyBUF_STRIDES)<0){return -1;}
+	const char* fmt = view.format ? view.format : "B";
+	if(fmt[0]=='<' || fmt[0]=='=' || fmt[0]=='@'){fmt+=1;}
+	int single = !strcmp(fmt,"f");
+	if((!single && strcmp(fmt,"d")) || view.ndim<1 || view.ndim>NDFIT_GRID_MAXDIM){
+		PyBuffer_Release(&view);
+		PyErr_SetString(ndfitError,"Grid values must be a 1-D, 2-D or 3-D float32/float64 buffer");
+		return -1;
+	}
+
+	PyObject* seq = NULL;
+	if(axes!=Py_None){
+		seq = PySequence_Fast(axes,"Grid axes must be a sequence with a vector per axis");
+		if(seq==NULL || PySequence_Fast_GET_SIZE(seq)!=view.ndim){
+			if(seq!=NULL){PyErr_SetString(ndfitError,"Grid axes must be a sequence with a vector per axis");}
+			Py_XDECREF(seq);
+			PyBuffer_Release(&view);
+			return -1;
+		}
+	}
+
+	self->ndim = view.ndim;
+	self->single = single;
+	self->size = 1;
+	for(d=0;d<view.ndim;d+=1){
+		self->shape[d] = view.shape[d];
+		self->strides[d] = view.strides[d];
+		self->size *= view.shape[d];
+	}
+	int status = (self->size<1) ? -1 : 0;
+	if(status<0){PyErr_SetString(ndfitError,"Data is empty");}
+	for(d=0;d<view.ndim && status==0;d+=1){
+		status = ndGrid_axis(self,d,seq ? PySequence_Fast_GET_ITEM(seq,d) : NULL);
+	}
+	Py_XDECREF(seq);
+	if(status<0){
+		for(d=0;d<NDFIT_GRID_MAXDIM;d+=1){
+			PyMem_Free(self->axes[d]);
+			self->axes[d] = NULL;
+		}
+		PyBuffer_Release(&view);
+		return -1;
+	}
+	self->view = view;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~ METHOD DEFINITION ~~~~~~~~~~~~~~~~~~//
+/////////////////////////////////////////////////////////
+static int ndGrid_ready(ndGrid* self){
+	if(self->view.obj==NULL){
+		PyErr_SetString(ndfitError,"Grid is not initialized");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject* ndGrid_getshape(ndGrid* self, void* closure){
+	int d;
+	if(ndGrid_ready(self)<0){return NULL;}
+	PyObject* shape = PyTuple_New(self->ndim);
+	for(d=0;shape!=NULL && d<self->ndim;d+=1){
+		PyTuple_SET_ITEM(shape,d,PyLong_FromSsize_t(self->shape[d]));
+	}
+	return shape;
+}
+
+// The coordinates as a tuple of lists, one per axis
+static PyObject* ndGrid_getaxes(ndGrid* self, void* closure){
+	int d;
+	Py_ssize_t i;
+	if(ndGrid_ready(self)<0){return NULL;}
+	PyObject* axes = PyTuple_New(self->ndim);
+	for(d=0;axes!=NULL && d<self->ndim;d+=1){
+		PyObject* axis = PyList_New(self->shape[d]);
+		if(axis==NULL){Py_CLEAR(axes); break;}
+		for(i=0;i<self->shape[d];i+=1){PyList_SET_ITEM(axis,i,PyFloat_FromDouble(self->axes[d][i]));}
+		PyTuple_SET_ITEM(axes,d,axis);
+	}
+	return axes;
+}
+
+static PyObject* ndGrid_getvalues(ndGrid* self, void* closure){
+	if(ndGrid_ready(self)<0){return NULL;}
+	Py_INCREF(self->view.obj);
+	return self->view.obj;
+}
+
+static Py_ssize_t ndGrid_length(ndGrid* self){
+	return self->size;
+}
+
+///////////////////////////////////////////////
+// CONSTRUCTOR: MEMBER DEFINITION FOR PYTHON //
+///////////////////////////////////////////////
+static PyMemberDef ndGrid_members[] = {
+	{"ndim",T_INT,offsetof(ndGrid,ndim),READONLY,"number of axes"},
+	{NULL}	 /* Sentinel */
+};
+
+static PyGetSetDef ndGrid_getset[] = {
+	{"shape",(getter)ndGrid_getshape,NULL,"points along every axis",NULL},
+	{"axes",(getter)ndGrid_getaxes,NULL,"the coordinates, a list per axis",NULL},
+	{"values",(getter)ndGrid_getvalues,NULL,"the values object the grid reads",NULL},
+	{NULL}	 /* Sentinel */
+};
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~ BUILD OBJECT ~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+static PyType_Slot ndGrid_slots[] = {
+	{Py_tp_dealloc, (void*)ndGrid_dealloc},
+	{Py_mp_length, (void*)ndGrid_length},
+	{Py_tp_members, ndGrid_members},
+	{Py_tp_getset, ndGrid_getset},
+	{Py_tp_init, (void*)ndGrid_init},
+	{Py_tp_new, (void*)ndGrid_new},
+	{Py_tp_doc, "Grid(values, axes=None): values on a regular grid"},
+	{0, NULL}
+};
+
+PyType_Spec ndGrid_spec = {
+		"ndfit.Grid",									 /* name */
+		sizeof(ndGrid),									 /* basicsize */
+		0,												 /* itemsize */
+		Py_TPFLAGS_DEFAULT|Py_TPFLAGS_IMMUTABLETYPE,	 /* flags */
+		ndGrid_slots,									 /* slots */
+};
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~~~~ EVALUATION ~~~~~~~~~~~~~~~~~~~~//
+/////////////////////////////////////////////////////////
+// Set up a fit on a Grid. The error function names a built-in model
+// or is a native error function, which is handed tiles of rows of
+// (coordinates..., value) as if the grid were a Dataset.
+int ndfit_grid_prepare(ndfit_state* st){
+
+	int m;
+	ndGrid* g = (ndGrid*)st->data;
+	if(ndGrid_ready(g)<0){return -1;}
+	st->grid = st->data;
+	Py_INCREF(st->grid);
+	st->datalen = g->size;
+
+	if(PyUnicode_Check(st->errfunc)){
+		const char* name = PyUnicode_AsUTF8(st->errfunc);
+		if(name==NULL){return -1;}
+		for(m=0;ndfit_grid_models[m]!=NULL;m+=1){
+			if(!strcmp(name,ndfit_grid_models[m])){break;}
+		}
+		if(ndfit_grid_models[m]==NULL){
+			PyErr_SetString(ndfitError,"Grid models are \"gaussian\" and \"lorentzian\"");
+			return -1;
+		}
+		if(PyList_Size(st->params)!=2*g->ndim+2){
+			PyErr_Format(ndfitError,"Model \"%s\" on a %d-D grid takes %d params",name,g->ndim,2*g->ndim+2);
+			return -1;
+		}
+		st->gridmodel = m;
+	}
+	else{
+		if(st->native==NULL){
+			PyErr_SetString(ndfitError,"Grid data needs a built-in model name or a native error function");
+			return -1;
+		}
+	}
+	return ndfit_consts(st);
+}
+
+// Doubles of workspace a fit on the grid needs: a tile of residuals
+// and either a tile of rows for a native function or the factors of
+// a built-in model along every axis
+Py_ssize_t ndfit_grid_work(PyObject* grid){
+	int d;
+	ndGrid* g = (ndGrid*)grid;
+	Py_ssize_t factors = 0;
+	for(d=0;d<g->ndim;d+=1){factors += g->shape[d];}
+	Py_ssize_t tile = NDFIT_CBLOCK*(g->ndim+1);
+	return NDFIT_CBLOCK+(tile>factors ? tile : factors);
+}
+
+// Factor of a built-in model along one axis
+static void ndfit_grid_factor(int model, const double* x, Py_ssize_t n, double c, double w, double* f){
+	Py_ssize_t i;
+	if(model==0){
+		for(i=0;i<n;i+=1){
+			double u = (x[i]-c)/w;
+			f[i] = exp(-0.5*u*u);
+		}
+	}
+	else{
+		for(i=0;i<n;i+=1){
+			double u = (x[i]-c)/w;
+			f[i] = 1.0/(1.0+u*u);
+		}
+	}
+}
+
+// Reduce the n residuals of a tile starting at point p, running the
+// native function on the tile first if there is one
+static int ndfit_grid_flush(ndfit_state* st, const double* x, double* r, const double* tile,
+	Py_ssize_t n, Py_ssize_t p, double* sum){
+	if(st->native!=NULL){
+		int status = st->native(tile,n,((ndGrid*)st->grid)->ndim+1,NDFIT_CBLOCK,x,st->dim,
+			(const double*)PyBytes_AS_STRING(st->cconsts),PyBytes_GET_SIZE(st->cconsts)/sizeof(double),r);
+		if(status!=0){return status;}
+	}
+	if(st->weights!=NULL){ndfit_weigh(r,st->weights+p,n);}
+	*sum += ndfit_sumsq(r,n,st->reduction);
+	return 0;
+}
+
+// Sum of squared residuals over the grid at params x, in C order of
+// the points whatever the strides of the values. Built-in models are
+// a product of per axis factors, computed once per call so a point
+// costs a multiply. Safe to call without the GIL. Returns what the
+// native function returned (0 for built-in models).
+int ndfit_grid_sumsq(ndfit_state* st, const double* x, double* work, double* sum){
+
+	int d;
+	Py_ssize_t i, j, k;
+	ndGrid* g = (ndGrid*)st->grid;
+	int nd = g->ndim;
+	Py_ssize_t last = g->shape[nd-1];
+	Py_ssize_t step = g->strides[nd-1];
+	Py_ssize_t outer = g->size/last;
+	double* r = work;
+	double* tile = work+NDFIT_CBLOCK;
+	double* f[NDFIT_GRID_MAXDIM];
+	Py_ssize_t idx[NDFIT_GRID_MAXDIM];
+	Py_ssize_t t = 0;
+	Py_ssize_t p = 0;
+	int status;
+
+	double amplitude = 0.0;
+	double offset = 0.0;
+	*sum = 0.0;
+	if(st->native==NULL){
+		double* factor = tile;
+		for(d=0;d<nd;d+=1){
+			f[d] = factor;
+			ndfit_grid_factor(st->gridmodel,g->axes[d],g->shape[d],x[1+2*d],x[2+2*d],factor);
+			factor += g->shape[d];
+		}
+		amplitude = x[0];
+		offset = x[2*nd+1];
+	}
+
+	for(i=0;i<outer;i+=1){
+
+		// Position of the line of points along the last axis
+		const char* line = (const char*)g->view.buf;
+		double scale = amplitude;
+		Py_ssize_t rest = i;
+		for(d=nd-2;d>=0;d-=1){
+			idx[d] = rest%g->shape[d];
+			rest /= g->shape[d];
+			line += idx[d]*g->strides[d];
+			if(st->native==NULL){scale *= f[d][idx[d]];}
+		}
+
+		for(j=0;j<last;){
+			Py_ssize_t n = NDFIT_CBLOCK-t;
+			if(last-j<n){n = last-j;}
+			if(st->native!=NULL){
+				for(d=0;d<nd-1;d+=1){
+					double c = g->axes[d][idx[d]];
+					for(k=0;k<n;k+=1){tile[d*NDFIT_CBLOCK+t+k] = c;}
+				}
+				for(k=0;k<n;k+=1){tile[(nd-1)*NDFIT_CBLOCK+t+k] = g->axes[nd-1][j+k];}
+				double* v = tile+nd*NDFIT_CBLOCK+t;
+				if(g->single){for(k=0;k<n;k+=1){v[k] = *(const float*)(line+(j+k)*step);}}
+				else{for(k=0;k<n;k+=1){v[k] = *(const double*)(line+(j+k)*step);}}
+			}
+			else{
+				const double* fl = f[nd-1]+j;
+				if(g->single){
+					for(k=0;k<n;k+=1){r[t+k] = scale*fl[k]+offset-*(const float*)(line+(j+k)*step);}
+				}
+				else{
+					for(k=0;k<n;k+=1){r[t+k] = scale*fl[k]+offset-*(const double*)(line+(j+k)*step);}
+				}
+			}
+			t += n;
+			j += n;
+			if(t==NDFIT_CBLOCK){
+				status = ndfit_grid_flush(st,x,r,tile,t,p,sum);
+				if(status!=0){return status;}
+				p += t;
+				t = 0;
+			}
+		}
+	}
+	if(t>0){return ndfit_grid_flush(st,x,r,tile,t,p,sum);}
+	return 0;
+}
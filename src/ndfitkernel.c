@@ -0,0 +1,595 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Include Libraries
+#include <Python.h>
+#include <string.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "../inc/shared.h"
+
+//////////////////////////////////////////////
+// Numeric kernels shared by every way of
+// producing residuals (row callbacks,
+// vectorized callbacks). Residuals end up in
+// a contiguous buffer and are reduced here.
+//
+
+////////////////////////////
+// Sum of squares kernels //
+////////////////////////////
+// Eight independent accumulators. With SSE2 (x86-64 baseline) these
+// are four 2-wide registers, with AVX two 4-wide registers. The tail
+// is summed in plain C.
+static double ndfit_block_sumsq(const double* r, Py_ssize_t n){
+
+	Py_ssize_t i = 0;
+	double sum = 0.0;
+
+#if defined(__AVX__)
+	__m256d a0 = _mm256_setzero_pd();
+	__m256d a1 = _mm256_setzero_pd();
+	for(;i+8<=n;i+=8){
+		__m256d x0 = _mm256_loadu_pd(r+i);
+		__m256d x1 = _mm256_loadu_pd(r+i+4);
+		a0 = _mm256_add_pd(a0,_mm256_mul_pd(x0,x0));
+		a1 = _mm256_add_pd(a1,_mm256_mul_pd(x1,x1));
+	}
+	double lane[4];
+	_mm256_storeu_pd(lane,_mm256_add_pd(a0,a1));
+	sum = (lane[0]+lane[1])+(lane[2]+lane[3]);
+#elif defined(__SSE2__)
+	__m128d a0 = _mm_setzero_pd();
+	__m128d a1 = _mm_setzero_pd();
+	__m128d a2 = _mm_setzero_pd();
+	__m128d a3 = _mm_setzero_pd();
+	for(;i+8<=n;i+=8){
+		__m128d x0 = _mm_loadu_pd(r+i);
+		__m128d x1 = _mm_loadu_pd(r+i+2);
+		__m128d x2 = _mm_loadu_pd(r+i+4);
+		__m128d x3 = _mm_loadu_pd(r+i+6);
+		a0 = _mm_add_pd(a0,_mm_mul_pd(x0,x0));
+		a1 = _mm_add_pd(a1,_mm_mul_pd(x1,x1));
+		a2 = _mm_add_pd(a2,_mm_mul_pd(x2,x2));
+		a3 = _mm_add_pd(a3,_mm_mul_pd(x3,x3));
+	}
+	double lane[2];
+	_mm_storeu_pd(lane,_mm_add_pd(_mm_add_pd(a0,a1),_mm_add_pd(a2,a3)));
+	sum = lane[0]+lane[1];
+#else
+	double a[8] = {0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0};
+	for(;i+8<=n;i+=8){
+		a[0] += r[i]*r[i];     a[1] += r[i+1]*r[i+1];
+		a[2] += r[i+2]*r[i+2]; a[3] += r[i+3]*r[i+3];
+		a[4] += r[i+4]*r[i+4]; a[5] += r[i+5]*r[i+5];
+		a[6] += r[i+6]*r[i+6]; a[7] += r[i+7]*r[i+7];
+	}
+	sum = ((a[0]+a[1])+(a[2]+a[3]))+((a[4]+a[5])+(a[6]+a[7]));
+#endif
+
+	for(;i<n;i+=1){sum += r[i]*r[i];}
+	return sum;
+}
+
+// Blocked pairwise summation: the error grows with log(n) rather
+// than n, which keeps lattice candidates apart near convergence
+static double ndfit_pairwise_sumsq(const double* r, Py_ssize_t n){
+
+	if(n<=NDFIT_BLOCK){return ndfit_block_sumsq(r,n);}
+
+	// Split on a multiple of eight so the lanes stay aligned
+	Py_ssize_t half = (n/2) & ~(Py_ssize_t)7;
+	return ndfit_pairwise_sumsq(r,half)+ndfit_pairwise_sumsq(r+half,n-half);
+}
+
+double ndfit_sumsq(const double* r, Py_ssize_t n, int policy){
+	if(policy==NDFIT_FAST){return ndfit_block_sumsq(r,n);}
+	return ndfit_pairwise_sumsq(r,n);
+}
+
+// Single precision residuals are widened as they are loaded, so only
+// the memory traffic is float32 and the accumulation stays float64
+static double ndfit_block_sumsqf(const float* r, Py_ssize_t n){
+
+	Py_ssize_t i = 0;
+	double sum = 0.0;
+
+#if defined(__AVX__)
+	__m256d a0 = _mm256_setzero_pd();
+	__m256d a1 = _mm256_setzero_pd();
+	for(;i+8<=n;i+=8){
+		__m256d x0 = _mm256_cvtps_pd(_mm_loadu_ps(r+i));
+		__m256d x1 = _mm256_cvtps_pd(_mm_loadu_ps(r+i+4));
+		a0 = _mm256_add_pd(a0,_mm256_mul_pd(x0,x0));
+		a1 = _mm256_add_pd(a1,_mm256_mul_pd(x1,x1));
+	}
+	double lane[4];
+	_mm256_storeu_pd(lane,_mm256_add_pd(a0,a1));
+	sum = (lane[0]+lane[1])+(lane[2]+lane[3]);
+#elif defined(__SSE2__)
+	__m128d a0 = _mm_setzero_pd();
+	__m128d a1 = _mm_setzero_pd();
+	__m128d a2 = _mm_setzero_pd();
+	__m128d a3 = _mm_setzero_pd();
+	for(;i+8<=n;i+=8){
+		__m128 lo = _mm_loadu_ps(r+i);
+		__m128 hi = _mm_loadu_ps(r+i+4);
+		__m128d x0 = _mm_cvtps_pd(lo);
+		__m128d x1 = _mm_cvtps_pd(_mm_movehl_ps(lo,lo));
+		__m128d x2 = _mm_cvtps_pd(hi);
+		__m128d x3 = _mm_cvtps_pd(_mm_movehl_ps(hi,hi));
+		a0 = _mm_add_pd(a0,_mm_mul_pd(x0,x0));
+		a1 = _mm_add_pd(a1,_mm_mul_pd(x1,x1));
+		a2 = _mm_add_pd(a2,_mm_mul_pd(x2,x2));
+		a3 = _mm_add_pd(a3,_mm_mul_pd(x3,x3));
+	}
+	double lane[2];
+	_mm_storeu_pd(lane,_mm_add_pd(_mm_add_pd(a0,a1),_mm_add_pd(a2,a3)));
+	sum = lane[0]+lane[1];
+#else
+	double a[8] = {0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0};
+	Py_ssize_t k;
+	for(;i+8<=n;i+=8){
+		for(k=0;k<8;k+=1){a[k] += (double)r[i+k]*(double)r[i+k];}
+	}
+	sum = ((a[0]+a[1])+(a[2]+a[3]))+((a[4]+a[5])+(a[6]+a[7]));
+#endif
+
+	for(;i<n;i+=1){sum += (double)r[i]*(double)r[i];}
+	return sum;
+}
+
+static double ndfit_pairwise_sumsqf(const float* r, Py_ssize_t n){
+
+	if(n<=NDFIT_BLOCK){return ndfit_block_sumsqf(r,n);}
+	Py_ssize_t half = (n/2) & ~(Py_ssize_t)7;
+	return ndfit_pairwise_sumsqf(r,half)+ndfit_pairwise_sumsqf(r+half,n-half);
+}
+
+double ndfit_sumsqf(const float* r, Py_ssize_t n, int policy){
+	if(policy==NDFIT_FAST){return ndfit_block_sumsqf(r,n);}
+	return ndfit_pairwise_sumsqf(r,n);
+}
+
+///////////////////////////////////
+// Residuals from Python objects //
+///////////////////////////////////
+// Buffer format code without the byte order prefix
+static const char* ndfit_format(Py_buffer* view){
+	const char* fmt = view->format ? view->format : "B";
+	if(fmt[0]=='<' || fmt[0]=='=' || fmt[0]=='@'){fmt+=1;}
+	return fmt;
+}
+
+// Reduce a residual vector returned by a vectorized error function.
+// Contiguous float64 or float32 buffers (numpy arrays, array.array) 
+// are reduced in place, strided ones (a column of a 2-D array) are 
+// gathered into work first and anything else is read as a sequence 
+// into work. Returns 0 and the sum of squares in sum, or -1 with an 
+// exception set.
+int ndfit_residuals(PyObject* obj, Py_ssize_t n, double* work, int policy, double* sum){
+
+	Py_ssize_t i;
+
+	if(PyObject_CheckBuffer(obj)){
+		Py_buffer view;
+		if(PyObject_GetBuffer(obj,&view,PyBUF_STRIDES|PyBUF_FORMAT)<0){return -1;}
+
+		const char* fmt = ndfit_format(&view);
+		int isdouble = !strcmp(fmt,"d") && view.itemsize==sizeof(double);
+		int isfloat = !strcmp(fmt,"f") && view.itemsize==sizeof(float);
+		int contiguous = PyBuffer_IsContiguous(&view,'C');
+
+		if((isdouble || isfloat) && (contiguous || view.ndim==1)){
+			if(view.len/view.itemsize!=n){
+				PyBuffer_Release(&view);
+				PyErr_Format(ndfitError,"Error function returned %zd residuals, expected %zd",
+					(Py_ssize_t)(view.len/view.itemsize),n);
+				return -1;
+			}
+			if(contiguous){
+				*sum = isdouble ? ndfit_sumsq((const double*)view.buf,n,policy) : 
+					ndfit_sumsqf((const float*)view.buf,n,policy);
+			}
+			else{
+				for(i=0;i<n;i+=1){
+					const char* p = (const char*)view.buf + i*view.strides[0];
+					work[i] = isdouble ? *(const double*)p : (double)*(const float*)p;
+				}
+				*sum = ndfit_sumsq(work,n,policy);
+			}
+			PyBuffer_Release(&view);
+			return 0;
+		}
+		PyBuffer_Release(&view);
+	}
+
+	PyObject* seq = PySequence_Fast(obj,"Vectorized error function must return a sequence or buffer of residuals");
+	if(seq==NULL){return -1;}
+	if(PySequence_Fast_GET_SIZE(seq)!=n){
+		PyErr_Format(ndfitError,"Error function returned %zd residuals, expected %zd",
+			PySequence_Fast_GET_SIZE(seq),n);
+		Py_DECREF(seq);
+		return -1;
+	}
+	PyObject** items = PySequence_Fast_ITEMS(seq);
+	for(i=0;i<n;i+=1){work[i] = PyFloat_AsDouble(items[i]);}
+	Py_DECREF(seq);
+	if(PyErr_Occurred()){return -1;}
+
+	*sum = ndfit_sumsq(work,n,policy);
+	return 0;
+}
+
+// Number of residuals in what a vectorized error function returned
+Py_ssize_t ndfit_residual_count(PyObject* obj){
+
+	if(PyObject_CheckBuffer(obj)){
+		Py_buffer view;
+		if(PyObject_GetBuffer(obj,&view,PyBUF_STRIDES)<0){return -1;}
+		Py_ssize_t n = view.itemsize ? view.len/view.itemsize : 0;
+		PyBuffer_Release(&view);
+		return n;
+	}
+	return PyObject_Length(obj);
+}
+
+// Copy the n residuals in obj (float buffer of any stride or sequence)
+// into out
+int ndfit_residual_values(PyObject* obj, Py_ssize_t n, double* out){
+
+	Py_ssize_t i;
+	if(PyObject_CheckBuffer(obj)){
+		Py_buffer view;
+		if(PyObject_GetBuffer(obj,&view,PyBUF_STRIDES|PyBUF_FORMAT)<0){return -1;}
+		const char* fmt = ndfit_format(&view);
+		int isdouble = !strcmp(fmt,"d") && view.itemsize==sizeof(double);
+		int isfloat = !strcmp(fmt,"f") && view.itemsize==sizeof(float);
+		int contiguous = PyBuffer_IsContiguous(&view,'C');
+		if((isdouble || isfloat) && (contiguous || view.ndim==1)){
+			if(view.len/view.itemsize!=n){
+				PyBuffer_Release(&view);
+				PyErr_Format(ndfitError,"Error function returned %zd residuals, expected %zd",
+					(Py_ssize_t)(view.len/view.itemsize),n);
+				return -1;
+			}
+			Py_ssize_t stride = contiguous ? view.itemsize : view.strides[0];
+			if(isdouble && contiguous){memcpy(out,view.buf,sizeof(double)*n);}
+			else{
+				for(i=0;i<n;i+=1){
+					const char* p = (const char*)view.buf + i*stride;
+					out[i] = isdouble ? *(const double*)p : (double)*(const float*)p;
+				}
+			}
+			PyBuffer_Release(&view);
+			return 0;
+		}
+		PyBuffer_Release(&view);
+	}
+	double sum;
+	return ndfit_residuals(obj,n,out,NDFIT_FAST,&sum);
+}
+
+// Gradient of half the sum of squares, g = J^T r, from the n x dim
+// Jacobian returned by a vectorized gradient function: a 2-D float 
+// buffer of any layout or a sequence of n rows of dim derivatives
+int ndfit_jacobian(PyObject* jac, Py_ssize_t n, Py_ssize_t dim, const double* r, double* g){
+
+	Py_ssize_t i, j;
+	for(j=0;j<dim;j+=1){g[j] = 0.0;}
+
+	if(PyObject_CheckBuffer(jac)){
+		Py_buffer view;
+		if(PyObject_GetBuffer(jac,&view,PyBUF_FORMAT|PyBUF_STRIDES)<0){return -1;}
+		const char* fmt = ndfit_format(&view);
+		int isfloat = !strcmp(fmt,"f");
+		if((!isfloat && strcmp(fmt,"d")) || view.ndim!=2 || view.shape[0]!=n || view.shape[1]!=dim){
+			PyBuffer_Release(&view);
+			PyErr_Format(ndfitError,"Gradient function must return a %zd x %zd float array",n,dim);
+			return -1;
+		}
+		for(i=0;i<n;i+=1){
+			const char* row = (const char*)view.buf + i*view.strides[0];
+			for(j=0;j<dim;j+=1){
+				const char* p = row + j*view.strides[1];
+				g[j] += r[i]*(isfloat ? (double)*(const float*)p : *(const double*)p);
+			}
+		}
+		PyBuffer_Release(&view);
+		return 0;
+	}
+
+	PyObject* rows = PySequence_Fast(jac,"Gradient function must return a Jacobian");
+	if(rows==NULL){return -1;}
+	if(PySequence_Fast_GET_SIZE(rows)!=n){
+		PyErr_Format(ndfitError,"Gradient function returned %zd rows, expected %zd",
+			PySequence_Fast_GET_SIZE(rows),n);
+		Py_DECREF(rows);
+		return -1;
+	}
+	for(i=0;i<n;i+=1){
+		PyObject* row = PySequence_Fast(PySequence_Fast_GET_ITEM(rows,i),"Jacobian rows must be sequences");
+		if(row==NULL){Py_DECREF(rows); return -1;}
+		if(PySequence_Fast_GET_SIZE(row)!=dim){
+			Py_DECREF(row);
+			Py_DECREF(rows);
+			PyErr_Format(ndfitError,"Jacobian rows must hold %zd derivatives",dim);
+			return -1;
+		}
+		for(j=0;j<dim;j+=1){g[j] += r[i]*PyFloat_AsDouble(PySequence_Fast_GET_ITEM(row,j));}
+		Py_DECREF(row);
+	}
+	Py_DECREF(rows);
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+// Scale the residuals r by w. With w the square roots of how often 
+// every row was drawn the sum of squares is that of the resampled 
+// data, without the data being copied.
+void ndfit_weigh(double* r, const double* w, Py_ssize_t n){
+	Py_ssize_t i;
+	for(i=0;i<n;i+=1){r[i] *= w[i];}
+}
+
+// out = r + a*col: the residuals after a move of a along a column
+void ndfit_axpy(double* out, const double* r, const double* col, double a, Py_ssize_t n){
+	Py_ssize_t i;
+	for(i=0;i<n;i+=1){out[i] = r[i]+a*col[i];}
+}
+
+//////////////////////////////
+// Native error functions   //
+//////////////////////////////
+// CFUNCTYPE(c_int, POINTER(c_double), c_int64, c_int64, c_int64, 
+// POINTER(c_double), c_int64, POINTER(c_double), c_int64, 
+// POINTER(c_double)): the ctypes prototype of ndfit_native
+static PyObject* ndfit_native_prototype(PyObject* ctypes){
+
+	PyObject* proto = NULL;
+	PyObject* cint = PyObject_GetAttrString(ctypes,"c_int");
+	PyObject* cint64 = PyObject_GetAttrString(ctypes,"c_int64");
+	PyObject* cdouble = PyObject_GetAttrString(ctypes,"c_double");
+	PyObject* ptr = cdouble ? PyObject_CallMethod(ctypes,"POINTER","O",cdouble) : NULL;
+	if(cint!=NULL && cint64!=NULL && ptr!=NULL){
+		proto = PyObject_CallMethod(ctypes,"CFUNCTYPE","OOOOOOOOOO",
+			cint,ptr,cint64,cint64,cint64,ptr,cint64,ptr,cint64,ptr);
+	}
+	Py_XDECREF(ptr);
+	Py_XDECREF(cdouble);
+	Py_XDECREF(cint64);
+	Py_XDECREF(cint);
+	return proto;
+}
+
+// The function pointer behind a C error function, in *fn, which is 
+// left NULL if obj is not one. Accepted are capsules named 
+// NDFIT_CAPSULE and ctypes functions of the prototype above, checked 
+// by type. Integer addresses and objects 
+// with an integer .address (numba cfunc) are only taken as declared 
+// native. Returns -1 with a TypeError for other capsules, ctypes 
+// functions of another prototype and declared functions without one.
+int ndfit_native_function(PyObject* obj, int declared, ndfit_native* fn){
+
+	*fn = NULL;
+
+	if(PyCapsule_CheckExact(obj)){
+		if(!PyCapsule_IsValid(obj,NDFIT_CAPSULE)){
+			PyErr_SetString(PyExc_TypeError,"Native error function capsules must be named \"" NDFIT_CAPSULE "\"");
+			return -1;
+		}
+		*fn = (ndfit_native)PyCapsule_GetPointer(obj,NDFIT_CAPSULE);
+		return (*fn==NULL) ? -1 : 0;
+	}
+
+	// ctypes is only looked at if it has been imported already. Its
+	// prototypes are cached, so equal prototypes are the same type.
+	PyObject* name = PyUnicode_FromString("ctypes");
+	if(name==NULL){return -1;}
+	PyObject* ctypes = PyImport_GetModule(name);
+	Py_DECREF(name);
+	if(ctypes==NULL && PyErr_Occurred()){return -1;}
+	if(ctypes!=NULL){
+		PyObject* base = PyObject_GetAttrString(ctypes,"_CFuncPtr");
+		int isptr = base ? PyObject_IsInstance(obj,base) : -1;
+		Py_XDECREF(base);
+		if(isptr==0){Py_DECREF(ctypes);}
+		else{
+			PyObject* proto = (isptr<0) ? NULL : ndfit_native_prototype(ctypes);
+			int same = (proto!=NULL && (PyObject*)Py_TYPE(obj)==proto);
+			Py_XDECREF(proto);
+			PyObject* voidp = same ? PyObject_GetAttrString(ctypes,"c_void_p") : NULL;
+			PyObject* cast = voidp ? PyObject_CallMethod(ctypes,"cast","OO",obj,voidp) : NULL;
+			PyObject* value = cast ? PyObject_GetAttrString(cast,"value") : NULL;
+			if(value!=NULL && value!=Py_None){*fn = (ndfit_native)PyLong_AsVoidPtr(value);}
+			Py_XDECREF(value);
+			Py_XDECREF(cast);
+			Py_XDECREF(voidp);
+			Py_DECREF(ctypes);
+			if(PyErr_Occurred()){return -1;}
+			if(!same){
+				PyErr_SetString(PyExc_TypeError,"ctypes error functions must be of the prototype "
+					"CFUNCTYPE(c_int, POINTER(c_double), c_int64, c_int64, c_int64, "
+					"POINTER(c_double), c_int64, POINTER(c_double), c_int64, POINTER(c_double))");
+				return -1;
+			}
+			if(*fn==NULL){
+				PyErr_SetString(PyExc_TypeError,"ctypes error function is a NULL pointer");
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	if(!declared && PyLong_Check(obj)){
+		PyErr_SetString(PyExc_TypeError,"Addresses are only called as native error functions with native=True");
+		return -1;
+	}
+	if(!declared){return 0;}
+	PyObject* address = PyLong_Check(obj) ? Py_NewRef(obj) : PyObject_GetAttrString(obj,"address");
+	if(address==NULL && PyErr_ExceptionMatches(PyExc_AttributeError)){PyErr_Clear();}
+	if(address!=NULL && PyLong_Check(address)){*fn = (ndfit_native)PyLong_AsVoidPtr(address);}
+	Py_XDECREF(address);
+	if(PyErr_Occurred()){return -1;}
+	if(*fn==NULL){
+		PyErr_SetString(PyExc_TypeError,"native=True needs a capsule, a ctypes function, "
+			"an address or an object with an integer .address");
+		return -1;
+	}
+	return 0;
+}
+
+// Sum of squared residuals of a native error function over column 
+// storage, NDFIT_CBLOCK rows at a time so each block of residuals is
+// still in cache when it is reduced. weights (may be NULL) scale the
+// residuals as in ndfit_weigh. Safe to call without the GIL. Returns
+// what the error function returned.
+int ndfit_native_sumsq(ndfit_native fn, const double* data, Py_ssize_t nrows, Py_ssize_t ncols,
+	const double* params, Py_ssize_t nparams, const double* consts, Py_ssize_t nconsts,
+	const double* weights, double* work, int policy, double* sum){
+
+	Py_ssize_t i;
+	*sum = 0.0;
+	for(i=0;i<nrows;i+=NDFIT_CBLOCK){
+		Py_ssize_t n = (nrows-i<NDFIT_CBLOCK) ? nrows-i : NDFIT_CBLOCK;
+		int status = fn(data+i,n,ncols,nrows,params,nparams,consts,nconsts,work);
+		if(status!=0){return status;}
+		if(weights!=NULL){ndfit_weigh(work,weights+i,n);}
+		*sum += ndfit_sumsq(work,n,policy);
+	}
+	return 0;
+}
+
+//////////////////////////////
+// Single / double precision //
+//////////////////////////////
+// True if data exports a float32 buffer
+int ndfit_is_single(PyObject* data){
+
+	if(!PyObject_CheckBuffer(data)){return 0;}
+	Py_buffer view;
+	if(PyObject_GetBuffer(data,&view,PyBUF_FORMAT|PyBUF_STRIDES)<0){PyErr_Clear(); return 0;}
+	int single = !strcmp(ndfit_format(&view),"f");
+	PyBuffer_Release(&view);
+	return single;
+}
+
+static double ndfit_item(PyObject* obj, int* err){
+	double v = PyFloat_AsDouble(obj);
+	if(v==-1.0 && PyErr_Occurred()){*err = 1;}
+	return v;
+}
+
+// Copy data into a new C contiguous float32 (single) or float64 array
+// of the same shape. Arrays with astype() (numpy) convert themselves, 
+// other float buffers and lists of rows become a memoryview.
+PyObject* ndfit_cast(PyObject* data, int single){
+
+	Py_ssize_t i, j, rows = 0, cols = 0;
+	Py_ssize_t itemsize = single ? sizeof(float) : sizeof(double);
+	int err = 0;
+	int ndim = 1;
+
+	if(PyObject_HasAttrString(data,"astype")){
+		return PyObject_CallMethod(data,"astype","s",single ? "float32" : "float64");
+	}
+
+	PyObject* bytes = NULL;
+	if(PyObject_CheckBuffer(data)){
+
+		// Strided float buffers of one or two dimensions
+		Py_buffer view;
+		if(PyObject_GetBuffer(data,&view,PyBUF_FORMAT|PyBUF_STRIDES)<0){return NULL;}
+		const char* fmt = ndfit_format(&view);
+		int isfloat = !strcmp(fmt,"f");
+		if((!isfloat && strcmp(fmt,"d")) || view.ndim<1 || view.ndim>2){
+			PyBuffer_Release(&view);
+			PyErr_SetString(ndfitError,"Data buffers must be 1-D or 2-D float32/float64");
+			return NULL;
+		}
+		ndim = view.ndim;
+		rows = view.shape[0];
+		cols = (ndim==2) ? view.shape[1] : 1;
+		bytes = PyBytes_FromStringAndSize(NULL,rows*cols*itemsize);
+		if(bytes==NULL){PyBuffer_Release(&view); return NULL;}
+		char* out = PyBytes_AS_STRING(bytes);
+		for(i=0;i<rows;i+=1){
+			for(j=0;j<cols;j+=1){
+				const char* p = (const char*)view.buf + i*view.strides[0] + (ndim==2 ? j*view.strides[1] : 0);
+				double v = isfloat ? (double)*(const float*)p : *(const double*)p;
+				if(single){((float*)out)[i*cols+j] = (float)v;}
+				else{((double*)out)[i*cols+j] = v;}
+			}
+		}
+		PyBuffer_Release(&view);
+	}
+	else{
+
+		// A list of rows (tuples) or of plain numbers
+		PyObject* seq = PySequence_Fast(data,"Data must be a buffer or a sequence of rows");
+		if(seq==NULL){return NULL;}
+		rows = PySequence_Fast_GET_SIZE(seq);
+		PyObject* first = rows ? PySequence_Fast_GET_ITEM(seq,0) : NULL;
+		if(first!=NULL && PySequence_Check(first)){
+			ndim = 2;
+			cols = PySequence_Size(first);
+		}
+		else{
+			cols = 1;
+		}
+		bytes = PyBytes_FromStringAndSize(NULL,rows*cols*itemsize);
+		if(bytes==NULL){Py_DECREF(seq); return NULL;}
+		char* out = PyBytes_AS_STRING(bytes);
+		for(i=0;i<rows && !err;i+=1){
+			PyObject* row = PySequence_Fast_GET_ITEM(seq,i);
+			for(j=0;j<cols && !err;j+=1){
+				double v;
+				if(ndim==2){
+					PyObject* item = PySequence_GetItem(row,j);
+					if(item==NULL){err = 1; break;}
+					v = ndfit_item(item,&err);
+					Py_DECREF(item);
+				}
+				else{
+					v = ndfit_item(row,&err);
+				}
+				if(single){((float*)out)[i*cols+j] = (float)v;}
+				else{((double*)out)[i*cols+j] = v;}
+			}
+		}
+		Py_DECREF(seq);
+		if(err){Py_DECREF(bytes); return NULL;}
+	}
+
+	PyObject* view = PyMemoryView_FromObject(bytes);
+	Py_DECREF(bytes);
+	if(view==NULL){return NULL;}
+	PyObject* cast;
+	if(ndim==2){
+		cast = PyObject_CallMethod(view,"cast","s(nn)",single ? "f" : "d",rows,cols);
+	}
+	else{
+		cast = PyObject_CallMethod(view,"cast","s",single ? "f" : "d");
+	}
+	Py_DECREF(view);
+	return cast;
+}
@@ -0,0 +1,424 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <math.h>
+#include <string.h>
+
+//////////////////////////////////////////////
+// Linear parameters (run(..., linear=[...])).
+// The residuals are affine in these params,
+// with no products between them: amplitudes,
+// offsets. The full lattice moves one param
+// at a time on its last 2*DIM points. For a
+// linear param such a move is the residuals
+// at the centre plus the move times a column,
+// the change of the residuals per unit of the
+// param. Columns are measured from the first
+// axis move made with the other params where
+// they are now, after which the axis moves of
+// that param cost no call to the model.
+//
+// With projection=True the lattice leaves the
+// linear params out. At every point of it they
+// are solved for instead: the residuals and a
+// column per linear param are measured there
+// (one evaluation each) and the least squares
+// problem in the linear params is solved by
+// Householder QR in a workspace the search
+// keeps. The lattice shrinks by 2^(linear).
+//
+
+#include "../inc/shared.h"
+
+// Columns whose norm drops below this fraction of what it was are
+// taken to depend on the others and their param is left where it is
+#define NDFIT_LINEAR_TOL 1e-10
+
+struct ndfit_linear{
+	Py_ssize_t n;
+	Py_ssize_t* slot;
+	double* base;
+	double* basex;
+	int hasbase;
+	double* best;
+	double* bestx;
+	int hasbest;
+	double* work;
+	double* cols;
+	double* colx;
+	char* hascol;
+
+	// Projection: residuals at the point, its columns, their QR
+	// factorisation, the right hand side and the solution
+	double* r;
+	double* g;
+	double* qr;
+	double* b;
+	double* norms;
+	double* delta;
+	Py_ssize_t* pivot;
+};
+
+void ndfit_linear_free(ndfit_linear* lin){
+
+	if(lin==NULL){return;}
+	PyMem_Free(lin->slot);
+	PyMem_Free(lin->base);
+	PyMem_Free(lin->basex);
+	PyMem_Free(lin->best);
+	PyMem_Free(lin->bestx);
+	PyMem_Free(lin->work);
+	PyMem_Free(lin->cols);
+	PyMem_Free(lin->colx);
+	PyMem_Free(lin->hascol);
+	PyMem_Free(lin->r);
+	PyMem_Free(lin->g);
+	PyMem_Free(lin->qr);
+	PyMem_Free(lin->b);
+	PyMem_Free(lin->norms);
+	PyMem_Free(lin->delta);
+	PyMem_Free(lin->pivot);
+	PyMem_Free(lin);
+}
+
+// Check linear=[index, ...] against the params of the fit
+int ndfit_linear_check(ndfit_state* st){
+
+	Py_ssize_t i, j;
+	if(!PyList_Check(st->linear)){
+		PyErr_SetString(ndfitError,"linear must be a list of parameter indices");
+		return -1;
+	}
+	for(i=0;i<PyList_Size(st->linear);i+=1){
+		Py_ssize_t k = PyLong_Check(PyList_GET_ITEM(st->linear,i)) ?
+			PyLong_AsSsize_t(PyList_GET_ITEM(st->linear,i)) : -1;
+		if(k<0 || k>=st->dim){
+			PyErr_Clear();
+			PyErr_Format(ndfitError,"linear parameter indices must be between 0 and %zd",st->dim-1);
+			return -1;
+		}
+		for(j=0;j<i;j+=1){
+			if(PyLong_AsSsize_t(PyList_GET_ITEM(st->linear,j))==k){
+				PyErr_Format(ndfitError,"Parameter %zd is listed as linear twice",k);
+				return -1;
+			}
+		}
+	}
+	if(st->project && PyList_Size(st->linear)>=st->dim){
+		PyErr_SetString(ndfitError,"projection needs a parameter that is not linear to search over");
+		return -1;
+	}
+	return 0;
+}
+
+// True if param k is left out of the lattice and solved for
+int ndfit_linear_projected(ndfit_state* st, Py_ssize_t k){
+
+	Py_ssize_t i;
+	if(!st->project){return 0;}
+	for(i=0;i<PyList_Size(st->linear);i+=1){
+		if(PyLong_AsSsize_t(PyList_GET_ITEM(st->linear,i))==k){return 1;}
+	}
+	return 0;
+}
+
+// The number of params the lattice moves
+Py_ssize_t ndfit_linear_searched(ndfit_state* st){
+	return st->project ? st->dim-PyList_Size(st->linear) : st->dim;
+}
+
+// The cache of a search, made on its first sweep
+static ndfit_linear* ndfit_linear_cache(ndfit_state* st){
+
+	Py_ssize_t k;
+	Py_ssize_t n = PyList_Size(st->linear);
+	Py_ssize_t len = st->datalen;
+	ndfit_linear* lin = PyMem_Calloc(1,sizeof(ndfit_linear));
+	if(lin==NULL){PyErr_NoMemory(); return NULL;}
+	lin->n = n;
+	lin->slot = PyMem_Malloc(sizeof(Py_ssize_t)*st->dim);
+	if(lin->slot==NULL){
+		ndfit_linear_free(lin);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for(k=0;k<st->dim;k+=1){lin->slot[k] = -1;}
+	for(k=0;k<n;k+=1){lin->slot[PyLong_AsSsize_t(PyList_GET_ITEM(st->linear,k))] = k;}
+
+	if(st->project){
+		lin->r = PyMem_Malloc(sizeof(double)*len);
+		lin->g = PyMem_Malloc(sizeof(double)*len*n);
+		lin->qr = PyMem_Malloc(sizeof(double)*len*n);
+		lin->b = PyMem_Malloc(sizeof(double)*len);
+		lin->norms = PyMem_Malloc(sizeof(double)*n);
+		lin->delta = PyMem_Malloc(sizeof(double)*n);
+		lin->pivot = PyMem_Malloc(sizeof(Py_ssize_t)*n);
+		if(lin->r==NULL || lin->g==NULL || lin->qr==NULL || lin->b==NULL || lin->norms==NULL ||
+		   lin->delta==NULL || lin->pivot==NULL){
+			ndfit_linear_free(lin);
+			PyErr_NoMemory();
+			return NULL;
+		}
+		return lin;
+	}
+
+	lin->base = PyMem_Malloc(sizeof(double)*len);
+	lin->basex = PyMem_Malloc(sizeof(double)*st->dim);
+	lin->best = PyMem_Malloc(sizeof(double)*len);
+	lin->bestx = PyMem_Malloc(sizeof(double)*st->dim);
+	lin->work = PyMem_Malloc(sizeof(double)*len);
+	lin->cols = PyMem_Malloc(sizeof(double)*(n>0 ? n : 1)*len);
+	lin->colx = PyMem_Malloc(sizeof(double)*(n>0 ? n : 1)*st->dim);
+	lin->hascol = PyMem_Calloc(n>0 ? n : 1,1);
+	if(lin->base==NULL || lin->basex==NULL || lin->best==NULL || lin->bestx==NULL ||
+	   lin->work==NULL || lin->cols==NULL || lin->colx==NULL || lin->hascol==NULL){
+		ndfit_linear_free(lin);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	return lin;
+}
+
+// Forget everything cached, as when the precision changes
+void ndfit_linear_reset(ndfit_state* st){
+
+	ndfit_linear* lin = st->lin;
+	if(lin==NULL){return;}
+	lin->hasbase = 0;
+	lin->hasbest = 0;
+	if(lin->hascol!=NULL){memset(lin->hascol,0,lin->n>0 ? lin->n : 1);}
+}
+
+// Start a sweep around center. The residuals at the centre are those
+// of the best point of the last sweep when the search moved there.
+int ndfit_linear_sweep(ndfit_state* st, const double* center){
+
+	if(st->lin==NULL){
+		st->lin = ndfit_linear_cache(st);
+		if(st->lin==NULL){return -1;}
+	}
+	ndfit_linear* lin = st->lin;
+	size_t bytes = sizeof(double)*st->dim;
+	if(lin->hasbest && !memcmp(lin->bestx,center,bytes)){
+		double* t = lin->base;
+		lin->base = lin->best;
+		lin->best = t;
+		memcpy(lin->basex,center,bytes);
+		lin->hasbase = 1;
+	}
+	else if(lin->hasbase && memcmp(lin->basex,center,bytes)){
+		lin->hasbase = 0;
+	}
+	lin->hasbest = 0;
+	return 0;
+}
+
+// The param lattice point i moves alone and is linear, or -1
+static Py_ssize_t ndfit_linear_axis(ndfit_state* st, Py_ssize_t i){
+	Py_ssize_t first = st->ldim-2*st->dim;
+	if(st->mode!=NDFIT_FULL || i<first){return -1;}
+	Py_ssize_t k = (i-first)%st->dim;
+	return (st->lin->slot[k]>=0) ? k : -1;
+}
+
+// True if column c was measured with the params that are not linear
+// where they are at center
+static int ndfit_linear_fresh(ndfit_state* st, Py_ssize_t c, const double* center){
+	Py_ssize_t j;
+	ndfit_linear* lin = st->lin;
+	if(!lin->hascol[c]){return 0;}
+	for(j=0;j<st->dim;j+=1){
+		if(lin->slot[j]<0 && lin->colx[c*st->dim+j]!=center[j]){return 0;}
+	}
+	return 1;
+}
+
+// Sum of squares at lattice point i (at x) from the cache. Returns 1
+// and the sum if it could be had that way, 0 if the point has to be
+// evaluated and -1 if the error function raised. The residuals at
+// the centre cost one evaluation when they are not known yet.
+int ndfit_linear_derive(ndfit_state* st, Py_ssize_t i, const double* center, const double* x, double* sum){
+
+	Py_ssize_t k = ndfit_linear_axis(st,i);
+	if(k<0 || x[k]==center[k]){return 0;}
+	ndfit_linear* lin = st->lin;
+	if(!lin->hasbase){
+		if(ndfit_evaluate_at(st,center)<0.0){return -1;}
+		double* t = lin->base;
+		lin->base = st->resid;
+		st->resid = t;
+		memcpy(lin->basex,center,sizeof(double)*st->dim);
+		lin->hasbase = 1;
+	}
+	Py_ssize_t c = lin->slot[k];
+	if(!ndfit_linear_fresh(st,c,center)){return 0;}
+	ndfit_axpy(lin->work,lin->base,lin->cols+c*st->datalen,x[k]-center[k],st->datalen);
+	*sum = ndfit_sumsq(lin->work,st->datalen,st->reduction);
+	return 1;
+}
+
+// Lattice point i (at x) was evaluated: measure the column of its
+// param from it if that is missing
+void ndfit_linear_measured(ndfit_state* st, Py_ssize_t i, const double* center, const double* x){
+
+	Py_ssize_t j;
+	Py_ssize_t k = ndfit_linear_axis(st,i);
+	ndfit_linear* lin = st->lin;
+	if(k<0 || !lin->hasbase || x[k]==center[k]){return;}
+	Py_ssize_t c = lin->slot[k];
+	if(ndfit_linear_fresh(st,c,center)){return;}
+	double* col = lin->cols+c*st->datalen;
+	double h = 1.0/(x[k]-center[k]);
+	for(j=0;j<st->datalen;j+=1){col[j] = (st->resid[j]-lin->base[j])*h;}
+	memcpy(lin->colx+c*st->dim,center,sizeof(double)*st->dim);
+	lin->hascol[c] = 1;
+}
+
+// The point at x just became the best of the sweep: keep its
+// residuals, which were derived from the cache or evaluated
+void ndfit_linear_best(ndfit_state* st, const double* x, int derived){
+
+	ndfit_linear* lin = st->lin;
+	double* t = lin->best;
+	if(derived){
+		lin->best = lin->work;
+		lin->work = t;
+	}
+	else{
+		lin->best = st->resid;
+		st->resid = t;
+	}
+	memcpy(lin->bestx,x,sizeof(double)*st->dim);
+	lin->hasbest = 1;
+}
+
+////////////////
+// Projection //
+////////////////
+// Least squares solution delta of g delta = b for the len x m columns
+// in a (overwritten, as is b) by Householder QR. A column that is
+// (nearly) a combination of the ones before it gets a zero.
+static void ndfit_linear_solve(ndfit_linear* lin, Py_ssize_t len, Py_ssize_t m){
+
+	Py_ssize_t i, j, k;
+	Py_ssize_t row = 0;
+	double* a = lin->qr;
+	double* b = lin->b;
+
+	for(k=0;k<m;k+=1){
+		double* col = a+k*len;
+		double norm = 0.0;
+		for(i=row;i<len;i+=1){norm += col[i]*col[i];}
+		norm = sqrt(norm);
+		if(row>=len || !(norm>NDFIT_LINEAR_TOL*lin->norms[k])){
+			lin->pivot[k] = -1;
+			continue;
+		}
+
+		// Reflect col[row:] onto alpha e_row, v kept in col[row:]
+		double alpha = (col[row]>0.0) ? -norm : norm;
+		col[row] -= alpha;
+		double vv = 0.0;
+		for(i=row;i<len;i+=1){vv += col[i]*col[i];}
+		for(j=k+1;j<m;j+=1){
+			double* c = a+j*len;
+			double d = 0.0;
+			for(i=row;i<len;i+=1){d += col[i]*c[i];}
+			d *= 2.0/vv;
+			for(i=row;i<len;i+=1){c[i] -= d*col[i];}
+		}
+		double d = 0.0;
+		for(i=row;i<len;i+=1){d += col[i]*b[i];}
+		d *= 2.0/vv;
+		for(i=row;i<len;i+=1){b[i] -= d*col[i];}
+		col[row] = alpha;
+		lin->pivot[k] = row;
+		row += 1;
+	}
+
+	// Back substitution on R
+	for(k=m-1;k>=0;k-=1){
+		Py_ssize_t r = lin->pivot[k];
+		if(r<0){lin->delta[k] = 0.0; continue;}
+		double v = b[r];
+		for(j=k+1;j<m;j+=1){v -= a[j*len+r]*lin->delta[j];}
+		lin->delta[k] = v/a[k*len+r];
+	}
+}
+
+// Solve for the linear params at the lattice point x, which are set 
+// to the solution. Returns the sum of squares there, or -1.0 if the 
+// error function raised. Costs one evaluation per linear param and
+// one more.
+double ndfit_linear_project(ndfit_state* st, double* x){
+
+	Py_ssize_t i, k;
+	if(st->lin==NULL){
+		st->lin = ndfit_linear_cache(st);
+		if(st->lin==NULL){return -1.0;}
+	}
+	ndfit_linear* lin = st->lin;
+	Py_ssize_t m = lin->n;
+	Py_ssize_t len = st->datalen;
+
+	NDFIT_TRACE(st,"project",'B');
+	double sum = -1.0;
+	if(ndfit_evaluate_at(st,x)<0.0){goto done;}
+	memcpy(lin->r,st->resid,sizeof(double)*len);
+
+	// The change of the residuals per unit of every linear param,
+	// measured over a step of the size of the param (or its step)
+	for(k=0;k<m;k+=1){
+		Py_ssize_t p = PyLong_AsSsize_t(PyList_GET_ITEM(st->linear,k));
+		double q = x[p];
+		double h = fabs(q);
+		if(!(h>0.0)){h = fabs(PyFloat_AsDouble(PyList_GetItem(st->step,p)));}
+		if(!(h>0.0)){h = 1.0;}
+		x[p] = q+h;
+		double e = ndfit_evaluate_at(st,x);
+		x[p] = q;
+		if(e<0.0){goto done;}
+		double* g = lin->g+k*len;
+		double norm = 0.0;
+		for(i=0;i<len;i+=1){
+			g[i] = (st->resid[i]-lin->r[i])/h;
+			norm += g[i]*g[i];
+		}
+		lin->norms[k] = sqrt(norm);
+	}
+
+	// Minimise |r + g delta|: solve g delta = -r
+	memcpy(lin->qr,lin->g,sizeof(double)*len*m);
+	for(i=0;i<len;i+=1){lin->b[i] = -lin->r[i];}
+	ndfit_linear_solve(lin,len,m);
+
+	// The residuals at the solution, reduced as any others
+	for(k=0;k<m;k+=1){
+		Py_ssize_t p = PyLong_AsSsize_t(PyList_GET_ITEM(st->linear,k));
+		if(lin->delta[k]==0.0){continue;}
+		x[p] += lin->delta[k];
+		ndfit_axpy(lin->r,lin->r,lin->g+k*len,lin->delta[k],len);
+	}
+	sum = ndfit_sumsq(lin->r,len,st->reduction);
+
+done:
+	NDFIT_TRACE(st,"project",'E');
+	return sum;
+}
@@ -20,38 +20,125 @@
 #include <Python.h>
 #include <structmember.h>
 #include <math.h>
+#include <time.h>
 
 #define EXTERN
 #include "../inc/shared.h"
 
-// Python exception obj
-static PyObject* ndfitError;
-
 //////////////////////
 // Helper Functions //
 //////////////////////
-// Find minimum and calculate function methods
+// Find minimum and calculate function methods. The minimum is 
+// returned as a new reference so the caller may drop the list. 
 static inline PyObject* ndfit_getminimum(PyObject* list){
-	PyList_Sort(list); return PyList_GetItem(list,0);}
+	PyList_Sort(list); 
+	PyObject* min = PyList_GetItem(list,0);
+	Py_XINCREF(min);
+	return min;
+}
 
-static inline PyObject* ndfit_callfunc(PyObject* func, PyObject* values, PyObject* params){
-	return PyObject_CallFunctionObjArgs(func,values,params,CONSTS,NULL);
+// Lexicographic order of two points, as lists of floats compare
+static inline int ndfit_before(const double* a, const double* b, Py_ssize_t n){
+	Py_ssize_t i;
+	for(i=0;i<n;i+=1){
+		if(a[i]!=b[i]){return a[i]<b[i];}
+	}
+	return 0;
+}
+
+// Callbacks go through vectorcall with the arguments on the stack. 
+// The spare slot in front lets bound methods prepend self in place.
+static inline PyObject* ndfit_callfunc(ndfit_state* st, PyObject* func, PyObject* values, PyObject* params){
+	PyObject* argv[4] = {NULL,values,params,st->consts};
+	return PyObject_Vectorcall(func,argv+1,3|PY_VECTORCALL_ARGUMENTS_OFFSET,NULL);
 }
 
 // Setters for maxdepth and convergence
 static PyObject* ndfit_maxdepth(PyObject* self, PyObject* args){
-	if(!PyArg_ParseTuple(args,"i",&MAXDEPTH)){return NULL;}
+	int value;
+	if(!PyArg_ParseTuple(args,"i",&value)){return NULL;}
+	ndfit_module()->maxdepth = value;
 	Py_RETURN_NONE;
 }
 static PyObject* ndfit_convergence(PyObject* self, PyObject* args){
-	if(!PyArg_ParseTuple(args,"d",&CONV)){return NULL;}
+	double value;
+	if(!PyArg_ParseTuple(args,"d",&value)){return NULL;}
+	ndfit_module()->conv = value;
 	Py_RETURN_NONE;
 }
 static PyObject* ndfit_throttle_factor(PyObject* self, PyObject* args){
-	if(!PyArg_ParseTuple(args,"d",&TFACTOR)){return NULL;}
+	double value;
+	if(!PyArg_ParseTuple(args,"d",&value)){return NULL;}
+	ndfit_module()->tfactor = value;
 	Py_RETURN_NONE;
 }
 
+// Monotonic wall clock in seconds for the time budget
+double ndfit_clock(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+}
+
+// The module state of this interpreter. ndfit_exec files the first
+// module object in the interpreter's dict, so module functions and
+// the fit code find the same state wherever they are called from.
+ndfit_module_state* ndfit_module(void){
+	PyObject* dict = PyInterpreterState_GetDict(PyInterpreterState_Get());
+	PyObject* m = (dict==NULL) ? NULL : PyDict_GetItemString(dict,"ndfit");
+	return (m==NULL) ? NULL : PyModule_GetState(m);
+}
+
+// Attach a thread the module started to interp and take its GIL
+PyThreadState* ndfit_thread_enter(PyInterpreterState* interp){
+	PyThreadState* ts = PyThreadState_New(interp);
+	if(ts==NULL){Py_FatalError("ndfit: unable to create a thread state");}
+	PyEval_RestoreThread(ts);
+	return ts;
+}
+
+// Release the GIL and drop the thread state again
+void ndfit_thread_leave(PyThreadState* ts){
+	PyThreadState_Clear(ts);
+	PyThreadState_DeleteCurrent();
+}
+
+// Check the stopping rules which are not part of the search itself. 
+// Returns 0 to carry on, 1 if a budget or the cancellation token says 
+// stop and -1 if a signal handler raised (e.g. KeyboardInterrupt).
+// Signals and the token are only polled every NDFIT_BUDGET_POLL.
+int ndfit_budget(ndfit_state* st){
+
+	// The starts of a multi-start search share the parent's budget
+	if(st->parent!=NULL){st = st->parent;}
+
+	if(st->cancelled){return 1;}
+	if(st->maxevals>0 && st->evals>=st->maxevals){return 1;}
+	double now = ndfit_clock();
+	if(st->tbudget>0.0 && (now-st->tstart)>=st->tbudget){return 1;}
+	if(now<st->tpoll){return 0;}
+	st->tpoll = now+NDFIT_BUDGET_POLL;
+
+	if(PyErr_CheckSignals()<0){return -1;}
+
+	// The token is either an Event-like object with is_set() or any
+	// callable which returns True once the fit should be abandoned
+	if(st->cancel!=NULL && st->cancel!=Py_None){
+		PyObject* flag;
+		if(PyObject_HasAttrString(st->cancel,"is_set")){
+			flag = PyObject_CallMethod(st->cancel,"is_set",NULL);
+		}
+		else{
+			flag = PyObject_CallObject(st->cancel,NULL);
+		}
+		if(flag==NULL){return -1;}
+		int stop = PyObject_IsTrue(flag);
+		Py_DECREF(flag);
+		return stop;
+	}
+	return 0;
+}
+
 ///////////////////////////////////////////
 // List algebra methods needed for ndfit //
 ///////////////////////////////////////////
@@ -84,37 +171,260 @@ static PyObject* ndfit_dotadd(PyObject* a, PyObject* b){
 ////////////////////////////////
 // Entropy Calculation Method //
 ////////////////////////////////
-static double ndfit_entropy(PyObject* callfunc, PyObject* data, PyObject* params){
+// The residual workspace is allocated on first use so the starts of
+// a multi-start search each get their own
+static double* ndfit_workspace(ndfit_state* st){
+	if(st->resid==NULL){
+		Py_ssize_t n = (st->grid!=NULL) ? ndfit_grid_work(st->grid) : st->datalen;
+		st->resid = PyMem_Malloc(sizeof(double)*(n>0 ? n : 1));
+		if(st->resid==NULL){PyErr_NoMemory();}
+	}
+	return st->resid;
+}
+
+// The params list for the error function, made once per state. A 
+// list nobody else holds is refreshed in place and so are its floats,
+// anything the error function kept a reference to is replaced. 
+static PyObject* ndfit_args(ndfit_state* st, const double* x){
+
+	Py_ssize_t j;
+	PyObject* args = st->args;
+	if(args==NULL || Py_REFCNT(args)!=1 || PyList_GET_SIZE(args)!=st->dim){
+		args = PyList_New(st->dim);
+		if(args==NULL){return NULL;}
+		for(j=0;j<st->dim;j+=1){
+			PyObject* v = PyFloat_FromDouble(x[j]);
+			if(v==NULL){Py_DECREF(args); return NULL;}
+			PyList_SET_ITEM(args,j,v);
+		}
+		Py_XSETREF(st->args,args);
+		return args;
+	}
+	for(j=0;j<st->dim;j+=1){
+		PyObject* item = PyList_GET_ITEM(args,j);
+		if(PyFloat_CheckExact(item) && Py_REFCNT(item)==1){
+			((PyFloatObject*)item)->ob_fval = x[j];
+			continue;
+		}
+		PyObject* v = PyFloat_FromDouble(x[j]);
+		if(v==NULL){return NULL;}
+		PyList_SET_ITEM(args,j,v);
+		Py_DECREF(item);
+	}
+	return args;
+}
+
+// Entropy at the point x (dim values), one "errfunc" span
+static double ndfit_entropy_at(ndfit_state* st, const double* x){
+	if(st->trace==NULL){return ndfit_entropy_eval(st,x);}
+	ndfit_trace_event(st->trace,"errfunc",'B',NULL,0.0);
+	double e = ndfit_entropy_eval(st,x);
+	ndfit_trace_event(st->trace,"errfunc",'E',NULL,0.0);
+	return e;
+}
+
+static double ndfit_entropy_eval(ndfit_state* st, const double* x){
 	
 	// Initialize counter
 	Py_ssize_t i;
+	double sum = 0.0;
+	double* resid = ndfit_workspace(st);
+	if(resid==NULL){return -1.0;}
+
+	// A negative entropy tells the caller that the error function raised.
+	st->evals+=1;
+	if(st->parent!=NULL){st->parent->evals+=1;}
+
+	// Grids are walked tile by tile in C without the GIL
+	if(st->grid!=NULL){
+		int status;
+		Py_BEGIN_ALLOW_THREADS
+		status = ndfit_grid_sumsq(st,x,resid,&sum);
+		Py_END_ALLOW_THREADS
+		if(status!=0){
+			PyErr_Format(ndfitError,"Native error function returned %d",status);
+			return -1.0;
+		}
+		return ndfit_measure(st,sum);
+	}
 
-	// Initialize Residual List and tmp object (will not be returned)
-	PyObject* values;
-	PyObject* res_list;
-	res_list = PyList_New(DATALEN);
+	// Separable models add up their components
+	if(st->blocks!=NULL){
+		sum = ndfit_blocks_sumsq(st,x);
+		if(sum<0.0){return -1.0;}
+		return ndfit_measure(st,sum);
+	}
 
-	// Perform Loop to calculate residuals
-	for(i=0;i<DATALEN;i+=1){
-		Py_INCREF(data);
-		values = ndfit_callfunc(callfunc,PyList_GetItem(data,i), params);
-		PyList_SetItem(res_list,i,values);
-		Py_DECREF(data);
+	// Native error functions run on the columns without the GIL
+	if(st->native!=NULL){
+		ndDataset* ds = (ndDataset*)st->columns;
+		int status;
+		Py_BEGIN_ALLOW_THREADS
+		status = ndfit_native_sumsq(st->native,ds->columns,ds->nrows,ds->ncols,x,st->dim,
+			(const double*)PyBytes_AS_STRING(st->cconsts),PyBytes_GET_SIZE(st->cconsts)/sizeof(double),
+			st->weights,resid,st->reduction,&sum);
+		Py_END_ALLOW_THREADS
+		if(status!=0){
+			PyErr_Format(ndfitError,"Native error function returned %d",status);
+			return -1.0;
+		}
+		return ndfit_measure(st,sum);
 	}
-		
-	// Sum over the residual list to get a final value
-	double tmp;
-	double sum = 0.0;
-	for(i=0;i<DATALEN;i+=1){
-		Py_INCREF(res_list);
-		tmp = PyFloat_AsDouble(PyList_GetItem(res_list,i));
-		sum+= tmp*tmp;
-		Py_DECREF(res_list);
-	}
-	Py_DECREF(res_list);
-	// Decref to things we are done with
-	return (sqrt(sum)*(double)log((double)DATALEN))/((double)DATALEN);
-};
+
+	// params may be the list of the last call with its floats written
+	// over. That is only done while the list and each float are ours 
+	// alone (refcount 1, exact float): whatever the error function kept
+	// of an earlier call never changes under it.
+	PyObject* params = ndfit_args(st,x);
+	if(params==NULL){return -1.0;}
+
+	// Vectorized error functions hand back all residuals at once. 
+	// Weighted residuals are copied out to be scaled first, and so are
+	// those the linear params are cached from.
+	if(st->vectorized){
+		PyObject* data = st->single ? st->data32 : (st->data64 ? st->data64 : st->data);
+		PyObject* values = ndfit_callfunc(st,st->errfunc,data,params);
+		if(values==NULL){return -1.0;}
+		int status;
+		if(st->weights==NULL && st->linear==NULL){
+			status = ndfit_residuals(values,st->datalen,resid,st->reduction,&sum);
+		}
+		else{
+			status = ndfit_residual_values(values,st->datalen,resid);
+			if(status==0){
+				if(st->weights!=NULL){ndfit_weigh(resid,st->weights,st->datalen);}
+				sum = ndfit_sumsq(resid,st->datalen,st->reduction);
+			}
+		}
+		Py_DECREF(values);
+		if(status<0){return -1.0;}
+	}
+
+	// Otherwise perform loop to calculate residuals row by row
+	else{
+		for(i=0;i<st->datalen;i+=1){
+			PyObject* values = ndfit_callfunc(st,st->errfunc,PyList_GET_ITEM(st->data,i), params);
+			if(values==NULL){return -1.0;}
+			resid[i] = PyFloat_AsDouble(values);
+			Py_DECREF(values);
+		}
+		if(PyErr_Occurred()){return -1.0;}
+		if(st->weights!=NULL){ndfit_weigh(resid,st->weights,st->datalen);}
+		sum = ndfit_sumsq(resid,st->datalen,st->reduction);
+	}
+	return ndfit_measure(st,sum);
+}
+
+// Entropy at a params list
+static double ndfit_entropy(ndfit_state* st, PyObject* params){
+
+	Py_ssize_t i;
+	if(st->cparams==NULL){
+		st->cparams = PyMem_Malloc(sizeof(double)*st->dim);
+		if(st->cparams==NULL){PyErr_NoMemory(); return -1.0;}
+	}
+	for(i=0;i<st->dim;i+=1){st->cparams[i] = PyFloat_AsDouble(PyList_GetItem(params,i));}
+	if(PyErr_Occurred()){return -1.0;}
+	return ndfit_entropy_at(st,st->cparams);
+}
+
+// Entropy at params for the other files (the pool workers)
+double ndfit_evaluate(ndfit_state* st, PyObject* params){
+	return ndfit_entropy(st,params);
+}
+
+// Entropy at x for the other files, leaving the residuals in st->resid
+double ndfit_evaluate_at(ndfit_state* st, const double* x){
+	return ndfit_entropy_at(st,x);
+}
+
+// Check the error function against the data before the first 
+// evaluation, which also counts the residuals of vectorized ones
+int ndfit_prepare(ndfit_state* st){
+	return ndfit_probe(st);
+}
+
+// Entropy of a sum of squared residuals
+static double ndfit_measure(ndfit_state* st, double sum){
+	return (sqrt(sum)*(double)log((double)st->datalen))/((double)st->datalen);
+}
+
+// Sum of squares at params and the gradient of half of it, J^T r, in
+// grad. Counts as one evaluation. Returns -1.0 if a callback raised.
+static double ndfit_objective(ndfit_state* st, PyObject* params, double* grad){
+	if(st->trace==NULL){return ndfit_objective_eval(st,params,grad);}
+	ndfit_trace_event(st->trace,"objective",'B',NULL,0.0);
+	double sum = ndfit_objective_eval(st,params,grad);
+	ndfit_trace_event(st->trace,"objective",'E',NULL,0.0);
+	return sum;
+}
+
+static double ndfit_objective_eval(ndfit_state* st, PyObject* params, double* grad){
+
+	Py_ssize_t i, j;
+	double* resid = ndfit_workspace(st);
+	if(resid==NULL){return -1.0;}
+
+	st->evals+=1;
+	if(st->parent!=NULL){st->parent->evals+=1;}
+
+	if(st->vectorized){
+		PyObject* data = st->single ? st->data32 : (st->data64 ? st->data64 : st->data);
+		PyObject* values = ndfit_callfunc(st,st->errfunc,data,params);
+		if(values==NULL){return -1.0;}
+		int status = ndfit_residual_values(values,st->datalen,resid);
+		Py_DECREF(values);
+		if(status<0){return -1.0;}
+
+		// With weights w the gradient is J^T (w*w*r): the residuals 
+		// are scaled once for the sum and once more for the gradient
+		double sum = 0.0;
+		if(st->weights!=NULL){
+			ndfit_weigh(resid,st->weights,st->datalen);
+			sum = ndfit_sumsq(resid,st->datalen,st->reduction);
+			ndfit_weigh(resid,st->weights,st->datalen);
+		}
+
+		PyObject* jac = ndfit_callfunc(st,st->gradfunc,data,params);
+		if(jac==NULL){return -1.0;}
+		status = ndfit_jacobian(jac,st->datalen,st->dim,resid,grad);
+		Py_DECREF(jac);
+		if(status<0){return -1.0;}
+		if(st->weights!=NULL){return sum;}
+	}
+	else{
+		for(j=0;j<st->dim;j+=1){grad[j] = 0.0;}
+		for(i=0;i<st->datalen;i+=1){
+			PyObject* row = PyList_GetItem(st->data,i);
+			PyObject* values = ndfit_callfunc(st,st->errfunc,row,params);
+			if(values==NULL){return -1.0;}
+			resid[i] = PyFloat_AsDouble(values);
+			Py_DECREF(values);
+			double w = 1.0;
+			if(st->weights!=NULL){
+				resid[i] *= st->weights[i];
+				w = st->weights[i];
+			}
+
+			PyObject* deriv = ndfit_callfunc(st,st->gradfunc,row,params);
+			if(deriv==NULL){return -1.0;}
+			PyObject* seq = PySequence_Fast(deriv,"Gradient function must return a sequence");
+			Py_DECREF(deriv);
+			if(seq==NULL){return -1.0;}
+			if(PySequence_Fast_GET_SIZE(seq)!=st->dim){
+				Py_DECREF(seq);
+				PyErr_Format(ndfitError,"Gradient function must return %zd derivatives",st->dim);
+				return -1.0;
+			}
+			for(j=0;j<st->dim;j+=1){
+				grad[j] += w*resid[i]*PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq,j));
+			}
+			Py_DECREF(seq);
+		}
+		if(PyErr_Occurred()){return -1.0;}
+	}
+	return ndfit_sumsq(resid,st->datalen,st->reduction);
+}
 
 //////////////////////////
 // Build Lattice Method //
@@ -122,36 +432,38 @@ static double ndfit_entropy(PyObject* callfunc, PyObject* data, PyObject* params
 // A static method to build the permutator. This defines the fitting
 // lattice. (e.g. the cube corners: +++,-++,+-+,++-,--+,-+-,+--,---)
 // Note that the code only calls this method once.
-static PyObject* ndfit_permutatorshort(PyObject* step, double scale){
+static PyObject* ndfit_permutatorshort(ndfit_state* st, PyObject* step, double scale){
 
 	// Build [1,-1] for perumutation this is what 
 	// will be fed to itertools
-	PyObject* pm = Py_BuildValue("(d,d)",(1.0*scale)/sqrt(DIM),(-1.0*scale)/sqrt(DIM));
+	// Params solved for by projection are left out
+	Py_ssize_t free = ndfit_linear_searched(st);
+	PyObject* pm = Py_BuildValue("(d,d)",(1.0*scale)/sqrt(free),(-1.0*scale)/sqrt(free));
 
 	// Pack these into the arglist. We need m of them where
 	// m is the number of fitting parameters
-	PyObject* args = PyTuple_New(DIM);
+	PyObject* args = PyTuple_New(free);
 
 	Py_ssize_t i = 0;
-	for(i=0; i<(Py_ssize_t)DIM;i+=1){
+	for(i=0; i<free;i+=1){
 		PyTuple_SetItem(args,i,pm);
 		Py_INCREF(pm);
 	}
-	PyObject* iterator = PyObject_CallObject(PRODUCT, args);
+	PyObject* iterator = PyObject_CallObject(ndfit_module()->product, args);
 	
 	// Result is an iterator which returns a tuple. We want to turn this 
 	// into a static list of tuples which can be saved and used foever. 
 	double tmp;
-	Py_ssize_t j;
+	Py_ssize_t j, f;
 		 
 	PyObject* item;
-	PyObject* lattice = PyList_New((Py_ssize_t)pow(2,DIM));
+	PyObject* lattice = PyList_New((Py_ssize_t)pow(2,free));
 	// Get the (2^D) corners for the lattice
-	for (i=0; i<(Py_ssize_t)pow(2,DIM); i+=1){
-		PyObject* corner = PyList_New((Py_ssize_t)DIM);
+	for (i=0; i<(Py_ssize_t)pow(2,free); i+=1){
+		PyObject* corner = PyList_New((Py_ssize_t)st->dim);
 		item = PyIter_Next(iterator);
-		for (j=0; j<(Py_ssize_t)DIM; j+=1){
-			tmp = PyFloat_AsDouble(PyTuple_GetItem(item,j));
+		for (j=0, f=0; j<(Py_ssize_t)st->dim; j+=1){
+			tmp = ndfit_linear_projected(st,j) ? 0.0 : PyFloat_AsDouble(PyTuple_GetItem(item,f++));
 			PyList_SetItem(corner,j,Py_BuildValue("d",tmp));
 			Py_INCREF(corner);
 		}
@@ -161,47 +473,49 @@ static PyObject* ndfit_permutatorshort(PyObject* step, double scale){
 	}
 	Py_DECREF(iterator);
 	
-	for (i=0; i<(Py_ssize_t)pow(2,DIM); i+=1){
+	for (i=0; i<(Py_ssize_t)pow(2,free); i+=1){
 		PyList_SetItem(lattice,i,ndfit_dotproduct(step,PyList_GetItem(lattice,i)));
 	} 
 
 	// Clean up
 	Py_DECREF(pm);
 	Py_DECREF(args);
-	LDIM = (Py_ssize_t)pow(2,DIM);
+	st->ldim = (Py_ssize_t)pow(2,free);
 	return lattice;
 }
 
-static PyObject* ndfit_permutatorfull(PyObject* step, double scale){
+static PyObject* ndfit_permutatorfull(ndfit_state* st, PyObject* step, double scale){
 
 		// Build [1,-1] for perumutation this is what 
 	// will be fed to itertools
-	PyObject* pm = Py_BuildValue("(d,d)",(1.0*scale)/sqrt(DIM),(-1.0*scale)/sqrt(DIM));
+	// Params solved for by projection are left out
+	Py_ssize_t free = ndfit_linear_searched(st);
+	PyObject* pm = Py_BuildValue("(d,d)",(1.0*scale)/sqrt(free),(-1.0*scale)/sqrt(free));
 
 	// Pack these into the arglist. We need m of them where
 	// m is the number of fitting parameters
-	PyObject* args = PyTuple_New(DIM);
+	PyObject* args = PyTuple_New(free);
 
 	Py_ssize_t i = 0;
-	for(i=0; i<(Py_ssize_t)DIM;i+=1){
+	for(i=0; i<free;i+=1){
 		PyTuple_SetItem(args,i,pm);
 		Py_INCREF(pm);
 	}
-	PyObject* iterator = PyObject_CallObject(PRODUCT, args);
+	PyObject* iterator = PyObject_CallObject(ndfit_module()->product, args);
 	
 	// Result is an iterator which returns a tuple. We want to turn this 
 	// into a static list of tuples which can be saved and used foever. 
 	double tmp;
-	Py_ssize_t j;
+	Py_ssize_t j, f;
 		 
 	PyObject* item;
-	PyObject* lattice = PyList_New((Py_ssize_t)pow(2,DIM)+2*DIM);
+	PyObject* lattice = PyList_New((Py_ssize_t)pow(2,free)+2*free);
 	// Get the (2^D) corners for the lattice
-	for (i=0; i<(Py_ssize_t)pow(2,DIM); i+=1){
-		PyObject* corner = PyList_New((Py_ssize_t)DIM);
+	for (i=0; i<(Py_ssize_t)pow(2,free); i+=1){
+		PyObject* corner = PyList_New((Py_ssize_t)st->dim);
 		item = PyIter_Next(iterator);
-		for (j=0; j<(Py_ssize_t)DIM; j+=1){
-			tmp = PyFloat_AsDouble(PyTuple_GetItem(item,j));
+		for (j=0, f=0; j<(Py_ssize_t)st->dim; j+=1){
+			tmp = ndfit_linear_projected(st,j) ? 0.0 : PyFloat_AsDouble(PyTuple_GetItem(item,f++));
 			PyList_SetItem(corner,j,Py_BuildValue("d",tmp));
 			Py_INCREF(corner);
 		}
@@ -211,289 +525,1769 @@ static PyObject* ndfit_permutatorfull(PyObject* step, double scale){
 	}
 	Py_DECREF(iterator);
 	
-	for (i=0; i<(Py_ssize_t)pow(2,DIM); i+=1){
+	for (i=0; i<(Py_ssize_t)pow(2,free); i+=1){
 		PyList_SetItem(lattice,i,ndfit_dotproduct(step,PyList_GetItem(lattice,i)));
 	} 
 
 	// Get the (2*DIM) edges for the lattice not that the numer of corners. 
-	for (i=0; i<(Py_ssize_t)DIM; i+=1){
-		PyObject* args2 = PyList_New(DIM);
-		for (j=0; j<DIM; j+=1){PyList_SetItem(args2,j,Py_BuildValue("d",(double)0));} 
+	for (i=0, f=0; i<(Py_ssize_t)st->dim; i+=1){
+		if(ndfit_linear_projected(st,i)){continue;}
+		PyObject* args2 = PyList_New(st->dim);
+		for (j=0; j<st->dim; j+=1){PyList_SetItem(args2,j,Py_BuildValue("d",(double)0));} 
 		PyList_SetItem(args2,i,Py_BuildValue("d",(double)scale));
-		PyList_SetItem(lattice,i+pow(2,DIM),args2);
+		PyList_SetItem(lattice,f+pow(2,free),args2);
+		f+=1;
 	}
 	// Another round for the negative sides
-	for (i=0; i<(Py_ssize_t)DIM; i+=1){
-		PyObject* args2 = PyList_New(DIM);
-		for (j=0; j<DIM; j+=1){PyList_SetItem(args2,j,Py_BuildValue("d",(double)0));} 
+	for (i=0, f=0; i<(Py_ssize_t)st->dim; i+=1){
+		if(ndfit_linear_projected(st,i)){continue;}
+		PyObject* args2 = PyList_New(st->dim);
+		for (j=0; j<st->dim; j+=1){PyList_SetItem(args2,j,Py_BuildValue("d",(double)0));} 
 		PyList_SetItem(args2,i,Py_BuildValue("d",(double)(-1*scale)));
-		PyList_SetItem(lattice,i+pow(2,DIM)+DIM,args2);
+		PyList_SetItem(lattice,f+pow(2,free)+free,args2);
+		f+=1;
 	}
 
-	LDIM = (Py_ssize_t)(pow(2,DIM)+(2*DIM));
+	st->ldim = (Py_ssize_t)(pow(2,free)+(2*free));
 	return lattice;
 }
 
+// Rebuild the lattice for the current mode with a new scale
+static int ndfit_lattice(ndfit_state* st, double scale){
+	NDFIT_TRACE_ARG(st,"lattice",'B',"scale",scale);
+	int status = ndfit_lattice_build(st,scale);
+	NDFIT_TRACE(st,"lattice",'E');
+	return status;
+}
+
+static int ndfit_lattice_build(ndfit_state* st, double scale){
+	
+	Py_ssize_t i;
+	PyObject* lattice;
+	PyObject* step = st->step;
+
+	// Adaptive steps scale every dimension on its own
+	if(st->adaptive){
+		step = PyList_New(st->dim);
+		if(step==NULL){return -1;}
+		for(i=0;i<st->dim;i+=1){
+			double h = PyFloat_AsDouble(PyList_GetItem(st->step,i));
+			PyList_SET_ITEM(step,i,PyFloat_FromDouble(h*st->scale[i]));
+		}
+	}
+	else{
+		Py_INCREF(step);
+	}
+
+	if(st->mode==NDFIT_FULL){
+		lattice = ndfit_permutatorfull(st,step,scale);
+	}
+	else {
+		lattice = ndfit_permutatorshort(st,step,scale);
+	}
+	Py_DECREF(step);
+	if(lattice==NULL){return -1;}
+	Py_XDECREF(st->lattice);
+	st->lattice = lattice;
+	st->lscale = scale;
+	return 0;
+}
+
+/////////////////////////////////////
+// Polling order (opportunistic)   //
+/////////////////////////////////////
+// Reset the polling order to the lattice order
+static int ndfit_order(ndfit_state* st){
+	Py_ssize_t i;
+	PyMem_Free(st->order);
+	st->order = PyMem_Malloc(sizeof(Py_ssize_t)*st->ldim);
+	if(st->order==NULL){PyErr_NoMemory(); return -1;}
+	for(i=0;i<st->ldim;i+=1){st->order[i] = i;}
+	return 0;
+}
+
+// After lattice point hit improved on the centre, poll it first next 
+// time, followed by the points which point the same way (positive dot 
+// product with hit) and then everything else. Both groups keep their 
+// previous relative order so older successes are remembered.
+static void ndfit_reorder(ndfit_state* st, PyObject* lattice, Py_ssize_t hit){
+
+	Py_ssize_t i, j, n = 0;
+	Py_ssize_t* next = PyMem_Malloc(sizeof(Py_ssize_t)*st->ldim);
+	char* near = PyMem_Calloc(st->ldim,1);
+	if(next==NULL || near==NULL){PyMem_Free(next); PyMem_Free(near); return;}
+
+	PyObject* h = PyList_GetItem(lattice,hit);
+	for(i=0;i<st->ldim;i+=1){
+		PyObject* v = PyList_GetItem(lattice,i);
+		double dot = 0.0;
+		for(j=0;j<st->dim;j+=1){
+			dot += PyFloat_AsDouble(PyList_GetItem(h,j))*PyFloat_AsDouble(PyList_GetItem(v,j));
+		}
+		near[i] = (dot>0.0);
+	}
+
+	next[n++] = hit;
+	for(i=0;i<st->ldim;i+=1){
+		if(st->order[i]!=hit && near[st->order[i]]){next[n++] = st->order[i];}
+	}
+	for(i=0;i<st->ldim;i+=1){
+		if(st->order[i]!=hit && !near[st->order[i]]){next[n++] = st->order[i];}
+	}
+	memcpy(st->order,next,sizeof(Py_ssize_t)*st->ldim);
+	PyMem_Free(next);
+	PyMem_Free(near);
+}
+
 //////////////////////////////////////////////////
 // A method to calculate the recursive step one //
 //////////////////////////////////////////////////
-static PyObject* ndfit_next(PyObject* callfunc,PyObject* data,PyObject* params, PyObject* lattice){
-	
-	Py_INCREF(callfunc); 
-	Py_INCREF(data);
-	Py_INCREF(params);
-	Py_INCREF(lattice);
+// Evaluates the lattice points around params and returns the best 
+// (entropy, params) tuple as a new reference. NULL with no exception 
+// set can not happen: a budget stop still returns the best of the 
+// points evaluated so far and raises st->truncated. Opportunistic 
+// polling stops at the first point which beats the centre.
+static PyObject* ndfit_next(ndfit_state* st, PyObject* params, PyObject* lattice){
+	NDFIT_TRACE(st,"sweep",'B');
+	PyObject* next = (st->pool!=NULL) ? ndfit_next_pool(st,params,lattice) : 
+		ndfit_next_serial(st,params,lattice);
+	NDFIT_TRACE_ARG(st,"sweep",'E',"points",st->nsweep);
+	return next;
+}
+
+static PyObject* ndfit_next_serial(ndfit_state* st, PyObject* params, PyObject* lattice){
 
 	Py_ssize_t i = 0;
+	Py_ssize_t j = 0;
+	Py_ssize_t n = 0;
+	Py_ssize_t best = 0;
 	Py_ssize_t lsize = PyList_Size(lattice); 
-	PyObject* calc = PyList_New(lsize);
-
-	PyObject* point;
-	PyObject* entropy;
+	Py_ssize_t dim = st->dim;
+	double e;
+	double sum;
+	int stop;
+	int derived = 0;
+
+	// Points are evaluated from C doubles and only the best becomes a 
+	// list. The sweep is kept whole for the Hessian.
+	if(ndfit_keep(st,lsize+1)<0){return NULL;}
+	double* center = st->sweepx+lsize*dim;
+	for(j=0;j<dim;j+=1){center[j] = PyFloat_AsDouble(PyList_GetItem(params,j));}
+	if(PyErr_Occurred()){return NULL;}
+	if(st->linear!=NULL && !st->project && ndfit_linear_sweep(st,center)<0){return NULL;}
+	st->nsweep = 0;
 		
-	for (i=0;i<lsize;i+=1){
-		PyObject* tmp = PyTuple_New((Py_ssize_t)2);
- 
-		point = ndfit_dotadd(PyList_GetItem(lattice,i),params);
-		entropy = Py_BuildValue("d",ndfit_entropy(callfunc, data, point));
-		//printf("Entropy is: %f\n", PyFloat_AsDouble(entropy) );
-
-		Py_INCREF(entropy);
-		Py_INCREF(point);
-							 
-		PyTuple_SetItem(tmp,0,entropy);
-		PyTuple_SetItem(tmp,1,point);
-		Py_INCREF(tmp);
-		Py_INCREF(tmp);
-		 
-		PyList_SetItem(calc,i,tmp);
-		Py_INCREF(tmp);
+	for (n=0;n<lsize;n+=1){
+
+		// Budgets are checked between evaluations. We always evaluate 
+		// at least one point so there is a best-so-far to hand back. 
+		stop = ndfit_budget(st);
+		if(stop<0){return NULL;}
+		if(stop>0 && n>0){
+			st->truncated = 1;
+			break;
+		}
+
+		i = st->opportunistic ? st->order[n] : n;
+		PyObject* offset = PyList_GetItem(lattice,i);
+		double* x = st->sweepx+n*dim;
+		for(j=0;j<dim;j+=1){x[j] = PyFloat_AsDouble(PyList_GetItem(offset,j))+center[j];}
+		if(PyErr_Occurred()){return NULL;}
+
+		// Linear params are solved for at every point (projection) or 
+		// their axis moves had from the cached residuals
+		if(st->project){
+			sum = ndfit_linear_project(st,x);
+			if(sum<0.0){return NULL;}
+			derived = 1;
+		}
+		else if(st->linear!=NULL){
+			derived = ndfit_linear_derive(st,i,center,x,&sum);
+			if(derived<0){return NULL;}
+		}
+		if(derived){e = ndfit_measure(st,sum);}
+		else{
+			e = ndfit_entropy_at(st,x);
+			if(e<0.0){return NULL;}
+			if(st->linear!=NULL){ndfit_linear_measured(st,i,center,x);}
+		}
+		//printf("Entropy is: %f\n", e);
+
+		// Lowest entropy, ties going to the lowest point as when the 
+		// (entropy, params) pairs were sorted
+		st->sweepe[n] = e;
+		st->nsweep = n+1;
+		if(n>0 && (e<st->sweepe[best] || 
+		   (e==st->sweepe[best] && ndfit_before(x,st->sweepx+best*dim,dim)))){best = n;}
+		if(best==n && st->linear!=NULL && !st->project){ndfit_linear_best(st,x,derived);}
+
+		if(st->opportunistic && e<st->center_entropy){
+			ndfit_reorder(st,lattice,i);
+			break;
+		}
 	}
 
-	Py_DECREF(callfunc); 
-	Py_DECREF(data);
-	Py_DECREF(params);
-	Py_DECREF(lattice);
+	PyObject* point = PyList_New(dim);
+	if(point==NULL){return NULL;}
+	for(j=0;j<dim;j+=1){PyList_SET_ITEM(point,j,PyFloat_FromDouble(st->sweepx[best*dim+j]));}
+	return Py_BuildValue("(dN)",st->sweepe[best],point);
+}
+
+// The same sweep on the process pool. All points are posted at once 
+// and the results come back in any order, this process evaluating 
+// points too while it waits. A budget stop or an opportunistic hit 
+// halts the batch; the points already claimed are still taken.
+static PyObject* ndfit_next_pool(ndfit_state* st, PyObject* params, PyObject* lattice){
+
+	Py_ssize_t i, n;
+	Py_ssize_t lsize = PyList_Size(lattice);
+	Py_ssize_t total = lsize;
+	Py_ssize_t taken = 0;
+	PyObject* points = PyList_New(lsize);
+	PyObject* calc = PyList_New(0);
+	PyObject* result = NULL;
+	int halted = 0;
+	double e;
+
+	if(points==NULL || calc==NULL){goto done;}
+	for(n=0;n<lsize;n+=1){
+		i = st->opportunistic ? st->order[n] : n;
+		PyList_SET_ITEM(points,n,ndfit_dotadd(PyList_GetItem(lattice,i),params));
+	}
+	if(ndfit_pool_post(st->pool,points)<0){goto done;}
+
+	while(taken<total){
+		int local = ndfit_pool_take(st,&n,&e);
+		if(local<0){goto fail;}
+		if(!local){
+			st->evals+=1;
+			if(st->parent!=NULL){st->parent->evals+=1;}
+		}
+		taken+=1;
+		PyObject* item = Py_BuildValue("(dO)",e,PyList_GET_ITEM(points,n));
+		if(item==NULL){goto fail;}
+		int appended = PyList_Append(calc,item);
+		Py_DECREF(item);
+		if(appended<0){goto fail;}
+		if(halted){continue;}
+
+		if(st->opportunistic && e<st->center_entropy){
+			ndfit_reorder(st,lattice,st->order[n]);
+			total = ndfit_pool_halt(st->pool);
+			halted = 1;
+			continue;
+		}
+		int stop = ndfit_budget(st);
+		if(stop<0){goto fail;}
+		if(stop>0){
+			st->truncated = 1;
+			total = ndfit_pool_halt(st->pool);
+			halted = 1;
+		}
+	}
+	result = ndfit_getminimum(calc);
+	if(result==NULL || ndfit_keep(st,PyList_GET_SIZE(calc))<0){goto fail;}
+	st->nsweep = PyList_GET_SIZE(calc);
+	for(n=0;n<st->nsweep;n+=1){
+		PyObject* item = PyList_GET_ITEM(calc,n);
+		st->sweepe[n] = PyFloat_AsDouble(PyTuple_GET_ITEM(item,0));
+		for(i=0;i<st->dim;i+=1){
+			st->sweepx[n*st->dim+i] = PyFloat_AsDouble(PyList_GET_ITEM(PyTuple_GET_ITEM(item,1),i));
+		}
+	}
+	goto done;
 
-	return ndfit_getminimum(calc);
+fail:
+	ndfit_pool_halt(st->pool);
+done:
+	Py_XDECREF(points);
+	Py_XDECREF(calc);
+	return result;
 }
 
-PyObject* 
-ndfit_recursive(
-	PyObject* callfunc, 
-	PyObject* data, 
-	PyObject* params, 
-	PyObject* step,
-	PyObject* lattice)
+// Room for n points in the sweep arrays
+static int ndfit_keep(ndfit_state* st, Py_ssize_t n){
+	if(n<=st->sweepcap){return 0;}
+	double* x = PyMem_Realloc(st->sweepx,sizeof(double)*n*(st->dim>0 ? st->dim : 1));
+	if(x==NULL){PyErr_NoMemory(); return -1;}
+	st->sweepx = x;
+	double* e = PyMem_Realloc(st->sweepe,sizeof(double)*n);
+	if(e==NULL){PyErr_NoMemory(); return -1;}
+	st->sweepe = e;
+	st->sweepcap = n;
+	return 0;
+}
 
-{
+// The last sweep as a list of (entropy, params)
+static PyObject* ndfit_evaluations(ndfit_state* st){
+	Py_ssize_t n, j;
+	PyObject* list = PyList_New(st->nsweep);
+	if(list==NULL){return NULL;}
+	for(n=0;n<st->nsweep;n+=1){
+		PyObject* point = PyList_New(st->dim);
+		if(point==NULL){Py_DECREF(list); return NULL;}
+		for(j=0;j<st->dim;j+=1){PyList_SET_ITEM(point,j,PyFloat_FromDouble(st->sweepx[n*st->dim+j]));}
+		PyList_SET_ITEM(list,n,Py_BuildValue("(dN)",st->sweepe[n],point));
+	}
+	return list;
+}
+
+// Append an (entropy, params) step to the history. Steals next.
+static double ndfit_record(ndfit_state* st, PyObject* next){
+
+	PyList_SetItem(st->plist,st->depth,next);
+	st->depth+=1;
 
-	PyObject* next = ndfit_next(callfunc,data,params,lattice);
-	PyList_SetItem(PLIST,DEPTH,next);
-	DEPTH+=1;
-	
-	PyObject* tmp = PyList_GetItem(PLIST,DEPTH-2);
-	Py_INCREF(PLIST);
 	double entropy = PyFloat_AsDouble(PyTuple_GetItem(next,0));
-	double check = PyFloat_AsDouble(PyTuple_GetItem(tmp,0));
-		
-	// Scale the lattice appropriately if throrrling is on
-	if (entropy > CONV && (int)PyObject_IsTrue(THROTTLE)){ 
-		if(!strcmp(MODE,"short")){
-			LATTICE = ndfit_permutatorshort(step,((TFACTOR*entropy)+1.0));
+	st->entropy = entropy;
+	if(st->parent!=NULL){
+		st->parent->depth += 1;
+		if(st->parent->entropy==0.0 || entropy<st->parent->entropy){st->parent->entropy = entropy;}
+	}
+	return entropy;
+}
+
+// Report how a fit stopped: it converged, or ran out of depth. Child
+// fits (starts of a multi-start search, sweep items and the refits of
+// the uncertainty estimates) stay quiet.
+static void ndfit_converged(ndfit_state* st, double entropy){
+	if(st->quiet){return;}
+	printf("Recursion Depth: %d\n",st->depth);
+	printf("Fit Entropy %f\n",entropy);
+}
+
+static void ndfit_exceeded(ndfit_state* st, double entropy){
+	if(st->quiet){return;}
+	printf("Exceeded Maximum Number of Recusive Steps %d\n",st->maxdepth);
+	printf("Fit Entropy: %f\n",entropy);
+}
+
+// One iteration of the adaptive pattern search. The centre only moves 
+// when a lattice point improves on it. A dimension which keeps moving 
+// the same way has its step doubled, a sweep without improvement halves
+// every step. We stop once all steps have shrunk below steptol times 
+// the steps given by the user.
+static int ndfit_adapt(ndfit_state* st){
+
+	Py_ssize_t i;
+	PyObject* next = ndfit_next(st,st->center,st->lattice);
+	if(next==NULL){return -1;}
+	double entropy = PyFloat_AsDouble(PyTuple_GetItem(next,0));
+
+	if(entropy<st->center_entropy){
+		for(i=0;i<st->dim;i+=1){
+			double delta = PyFloat_AsDouble(PyList_GetItem(PyTuple_GetItem(next,1),i))
+				- PyFloat_AsDouble(PyList_GetItem(st->center,i));
+			int sign = (delta>0.0) - (delta<0.0);
+			if(sign==0){st->runs[i] = 0;}
+			else if(sign*st->runs[i]>0){st->runs[i] += sign;}
+			else{st->runs[i] = sign;}
+
+			if(abs(st->runs[i])>=NDFIT_EXPAND_RUNS && st->scale[i]<NDFIT_SCALE_MAX){
+				st->scale[i] *= 2.0;
+				st->runs[i] = 0;
+			}
 		}
-		else if(!strcmp(MODE,"full")){
-			LATTICE = ndfit_permutatorfull(step,((TFACTOR*entropy)+1.0));
+		st->center_entropy = entropy;
+		ndfit_record(st,next);
+		st->center = PyTuple_GetItem(next,1);
+	}
+	else{
+		// Nothing improved: contract and stay put
+		Py_DECREF(next);
+		for(i=0;i<st->dim;i+=1){
+			st->scale[i] *= 0.5;
+			st->runs[i] = 0;
 		}
-		else{
-			LATTICE = ndfit_permutatorshort(step,(TFACTOR*entropy)+1.0);
+		next = Py_BuildValue("(dO)",st->center_entropy,st->center);
+		if(next==NULL){return -1;}
+		ndfit_record(st,next);
+		st->center = PyTuple_GetItem(next,1);
+	}
+
+	if(st->truncated){return 1;}
+
+	double largest = 0.0;
+	for(i=0;i<st->dim;i+=1){
+		if(st->scale[i]>largest){largest = st->scale[i];}
+	}
+	if(largest<st->steptol){
+		ndfit_converged(st,st->center_entropy);
+		return 1;
+	}
+	else if(st->depth==st->maxdepth){
+		ndfit_exceeded(st,st->center_entropy);
+		return 1;
+	}
+	return ndfit_lattice(st,1.0);
+}
+
+// One iteration of L-BFGS on half the sum of squares. The direction
+// comes from the two-loop recursion over the last NDFIT_LBFGS_M (s,y)
+// pairs, the step length from a backtracking (Armijo) line search. 
+// The first direction is steepest descent scaled to the length of the
+// user's step. We stop once a step moves every parameter by less than
+// steptol times its user step, or the line search finds no decrease.
+static int ndfit_descent(ndfit_state* st){
+
+	Py_ssize_t i, j;
+	Py_ssize_t dim = st->dim;
+	int status = 1;
+	double* a = PyMem_Malloc(sizeof(double)*(5*dim+NDFIT_LBFGS_M));
+	if(a==NULL){PyErr_NoMemory(); return -1;}
+	double* x = a;
+	double* d = a+dim;
+	double* xn = a+2*dim;
+	double* gn = a+3*dim;
+	double* h = a+4*dim;
+	double* alpha = a+5*dim;
+	double* g = st->grad;
+
+	for(j=0;j<dim;j+=1){x[j] = PyFloat_AsDouble(PyList_GetItem(st->center,j));}
+
+	// Two-loop recursion: d = -H g
+	double gg = 0.0;
+	for(j=0;j<dim;j+=1){d[j] = g[j]; gg += g[j]*g[j];}
+	for(i=0;i<st->npairs;i+=1){
+		Py_ssize_t k = (st->head-1-i+NDFIT_LBFGS_M)%NDFIT_LBFGS_M;
+		double* s = st->pairs+k*2*dim;
+		double* y = s+dim;
+		double sy = 0.0, sq = 0.0;
+		for(j=0;j<dim;j+=1){sy += s[j]*y[j]; sq += s[j]*d[j];}
+		alpha[i] = sq/sy;
+		for(j=0;j<dim;j+=1){d[j] -= alpha[i]*y[j];}
+	}
+	double gamma;
+	if(st->npairs>0){
+		double* s = st->pairs+((st->head-1+NDFIT_LBFGS_M)%NDFIT_LBFGS_M)*2*dim;
+		double* y = s+dim;
+		double sy = 0.0, yy = 0.0;
+		for(j=0;j<dim;j+=1){sy += s[j]*y[j]; yy += y[j]*y[j];}
+		gamma = sy/yy;
+	}
+	else{
+		double hh = 0.0;
+		for(j=0;j<dim;j+=1){h[j] = PyFloat_AsDouble(PyList_GetItem(st->step,j)); hh += h[j]*h[j];}
+		gamma = (gg>0.0) ? sqrt(hh/gg) : 0.0;
+	}
+	for(j=0;j<dim;j+=1){d[j] *= gamma;}
+	for(i=st->npairs-1;i>=0;i-=1){
+		Py_ssize_t k = (st->head-1-i+NDFIT_LBFGS_M)%NDFIT_LBFGS_M;
+		double* s = st->pairs+k*2*dim;
+		double* y = s+dim;
+		double sy = 0.0, yd = 0.0;
+		for(j=0;j<dim;j+=1){sy += s[j]*y[j]; yd += y[j]*d[j];}
+		for(j=0;j<dim;j+=1){d[j] += s[j]*(alpha[i]-yd/sy);}
+	}
+	double dg = 0.0;
+	for(j=0;j<dim;j+=1){d[j] = -d[j]; dg += d[j]*g[j];}
+
+	// Not a descent direction: forget the curvature and go downhill
+	if(dg>=0.0){
+		st->npairs = 0;
+		double hh = 0.0;
+		for(j=0;j<dim;j+=1){h[j] = PyFloat_AsDouble(PyList_GetItem(st->step,j)); hh += h[j]*h[j];}
+		gamma = (gg>0.0) ? sqrt(hh/gg) : 0.0;
+		dg = 0.0;
+		for(j=0;j<dim;j+=1){d[j] = -gamma*g[j]; dg += d[j]*g[j];}
+	}
+
+	// Backtracking line search on phi = sum/2
+	double phi = 0.5*st->sumsq;
+	double t = 1.0;
+	double sn = 0.0;
+	int accepted = 0;
+	for(i=0;i<NDFIT_LINE_TRIES && dg<0.0;i+=1){
+		int stop = ndfit_budget(st);
+		if(stop<0){status = -1; goto done;}
+		if(stop>0){st->truncated = 1; break;}
+
+		PyObject* point = PyList_New(dim);
+		if(point==NULL){status = -1; goto done;}
+		for(j=0;j<dim;j+=1){
+			xn[j] = x[j]+t*d[j];
+			PyList_SET_ITEM(point,j,PyFloat_FromDouble(xn[j]));
 		}
+		sn = ndfit_objective(st,point,gn);
+		Py_DECREF(point);
+		if(sn<0.0){status = -1; goto done;}
+		if(isfinite(sn) && 0.5*sn<=phi+NDFIT_ARMIJO*t*dg){accepted = 1; break;}
+		t *= 0.5;
+	}
+
+	PyObject* next;
+	if(!accepted){
+		// Stay put: the history shows where we stopped
+		next = Py_BuildValue("(dO)",st->center_entropy,st->center);
+		if(next==NULL){status = -1; goto done;}
+		ndfit_record(st,next);
+		st->center = PyTuple_GetItem(next,1);
+		if(!st->truncated){ndfit_converged(st,st->center_entropy);}
+		goto done;
+	}
+
+	// Keep the new pair if it has positive curvature
+	double* s = st->pairs+st->head*2*dim;
+	double* y = s+dim;
+	double sy = 0.0;
+	int moved = 0;
+	for(j=0;j<dim;j+=1){
+		s[j] = xn[j]-x[j];
+		y[j] = gn[j]-g[j];
+		sy += s[j]*y[j];
+		if(fabs(s[j])>=st->steptol*fabs(PyFloat_AsDouble(PyList_GetItem(st->step,j)))){moved = 1;}
+	}
+	if(sy>0.0){
+		st->head = (st->head+1)%NDFIT_LBFGS_M;
+		if(st->npairs<NDFIT_LBFGS_M){st->npairs += 1;}
+	}
+	memcpy(g,gn,sizeof(double)*dim);
+	st->sumsq = sn;
+	st->center_entropy = ndfit_measure(st,sn);
+
+	PyObject* params = PyList_New(dim);
+	if(params==NULL){status = -1; goto done;}
+	for(j=0;j<dim;j+=1){PyList_SET_ITEM(params,j,PyFloat_FromDouble(xn[j]));}
+	next = Py_BuildValue("(dN)",st->center_entropy,params);
+	if(next==NULL){status = -1; goto done;}
+	ndfit_record(st,next);
+	st->center = PyTuple_GetItem(next,1);
+
+	if(!moved){
+		ndfit_converged(st,st->center_entropy);
+	}
+	else if(st->depth==st->maxdepth){
+		ndfit_exceeded(st,st->center_entropy);
+	}
+	else{
+		status = 0;
+	}
+
+done:
+	PyMem_Free(a);
+	return status;
+}
+
+// Fixed lattice step around st->center, scaled by the throttle
+static int ndfit_step(ndfit_state* st){
+
+	PyObject* next = ndfit_next(st,st->center,st->lattice);
+	if(next==NULL){return -1;}
+	double entropy = ndfit_record(st,next);
+
+	// Stop Case 0: A budget ran out or the fit was cancelled 
+	if(st->truncated){return 1;}
+	
+	// Scale the lattice appropriately if throrrling is on
+	if (entropy > st->conv && st->throttle){ 
+		if(ndfit_lattice(st,(st->tfactor*entropy)+1.0)<0){return -1;}
 	}
 
 	// It we are throttling, then we would like to turn it off below 
 	// the convergence to prevent overscaling
-	else if ((int)PyObject_IsTrue(THROTTLE)){
-		if(!strcmp(MODE,"short")){
-			LATTICE = ndfit_permutatorshort(step,1.0);
-		}
-		else if(!strcmp(MODE,"full")){
-			LATTICE = ndfit_permutatorfull(step,1.0);
-		}
-		else{
-			LATTICE = ndfit_permutatorshort(step,1.0);
-		}
+	else if (st->throttle){
+		if(ndfit_lattice(st,1.0)<0){return -1;}
+	}
+
+	// The very first sweep only seeds the history
+	if(st->depth==1){
+		st->center = PyTuple_GetItem(next,1);
+		st->center_entropy = entropy;
+		return 0;
 	}
 
+	PyObject* tmp = PyList_GetItem(st->plist,st->depth-2);
+	double check = PyFloat_AsDouble(PyTuple_GetItem(tmp,0));
+
 	// Stop Case 1: We arrived at the desired value 
-	if (entropy<CONV && entropy>check){
-		printf("Recursion Depth: %d\n",DEPTH);
-		printf("Fit Entropy %f\n",check);
-		return params;	
+	if (entropy<st->conv && entropy>check){
+		ndfit_converged(st,check);
+		return 1;	
 	} 
 
 	// Stop Case 2: We have hit the maximim recursion depth
-	else if(DEPTH==MAXDEPTH){
-		printf("Exceeded Maximum Number of Recusive Steps %d\n",MAXDEPTH);
-		printf("Fit Entropy: %f\n", check);
-		return params;	
+	else if(st->depth==st->maxdepth){
+		ndfit_exceeded(st,check);
+		return 1;	
 	}
-	// Otherwise make the tail recursive call
-	else{
-		return ndfit_recursive(callfunc,data,PyTuple_GetItem(next,1),step,LATTICE);
+	
+	// Otherwise move the centre to the best lattice point
+	st->center = PyTuple_GetItem(next,1);
+	st->center_entropy = entropy;
+	return 0;
+}
+
+// One pass of the block-coordinate search over the components of a 
+// separable model. The lattice of every block is scaled by the 
+// throttle like the full lattice, and a throttled pass in which no 
+// block moved is repeated at the unit scale. The adaptive search 
+// halves the scale (st->lscale) instead, otherwise such a pass ends 
+// the fit.
+static int ndfit_separate(ndfit_state* st){
+
+	double sum;
+	Py_ssize_t moved = 0;
+	double scale = st->lscale;
+	if(st->throttle && st->depth>0 && st->center_entropy>st->conv){
+		scale = (st->tfactor*st->center_entropy)+1.0;
+	}
+
+	NDFIT_TRACE(st,"sweep",'B');
+	PyObject* point = ndfit_blocks_sweep(st,st->center,scale,&sum,&moved);
+	if(point!=NULL && moved==0 && scale!=st->lscale && !st->truncated){
+		Py_DECREF(point);
+		point = ndfit_blocks_sweep(st,st->center,st->lscale,&sum,&moved);
+	}
+	NDFIT_TRACE_ARG(st,"sweep",'E',"moved",moved);
+	if(point==NULL){return -1;}
+	double entropy = ndfit_measure(st,sum);
+	PyObject* next = Py_BuildValue("(dN)",entropy,point);
+	if(next==NULL){return -1;}
+	ndfit_record(st,next);
+	st->center = PyTuple_GetItem(next,1);
+	st->center_entropy = entropy;
+
+	if(st->truncated){return 1;}
+	if(moved==0 && st->adaptive){st->lscale *= 0.5;}
+	if((moved==0 && !st->adaptive) || st->lscale<st->steptol){
+		ndfit_converged(st,entropy);
+		return 1;
+	}
+	else if(st->depth==st->maxdepth){
+		ndfit_exceeded(st,entropy);
+		return 1;
 	}
+	return 0;
 }
 
-///////////////////////////////////////////////
-// Main Method Runs Fit and Optimizes Params //
-///////////////////////////////////////////////
-PyObject* 
-ndfit_run(PyObject* self,PyObject *args, PyObject *kwds){
+// One iteration of the search around st->center. Returns 0 to keep
+// going, 1 once a stopping rule fired and -1 on error.
+static int ndfit_iterate(ndfit_state* st){
+	NDFIT_TRACE_ARG(st,"iteration",'B',"depth",st->depth);
+	int status = ndfit_iterate_once(st);
+	NDFIT_TRACE_ARG(st,"iteration",'E',"entropy",st->center_entropy);
+	return status;
+}
+
+static int ndfit_iterate_once(ndfit_state* st){
+
+	int status;
+	if(st->mode==NDFIT_LBFGS){status = ndfit_descent(st);}
+	else if(st->blocks!=NULL){status = ndfit_separate(st);}
+	else if(st->adaptive){status = ndfit_adapt(st);}
+	else{status = ndfit_step(st);}
+
+	// Mixed precision: once the fit is refining below the convergence
+	// value the remaining iterations are done in float64
+	if(status==0 && st->single && st->precision==NDFIT_MIXED && st->center_entropy<st->conv){
+		st->single = 0;
+		ndfit_linear_reset(st);
+		if(st->mode==NDFIT_LBFGS){
+			st->sumsq = ndfit_objective(st,st->center,st->grad);
+			if(st->sumsq<0.0){return -1;}
+			st->npairs = 0;
+			st->center_entropy = ndfit_measure(st,st->sumsq);
+		}
+		else{
+			st->center_entropy = ndfit_entropy(st,st->center);
+			if(st->center_entropy<0.0){return -1;}
+		}
+	}
+	return status;
+}
 
+PyObject* 
+ndfit_recursive(ndfit_state* st)
+{
+	int status = ndfit_iterate(st);
+	if(status<0){return NULL;}
+
+	// Save the search state between iterations, and once the fit stops
+	// whatever the file has not caught up with
+	if(st->checkpoint!=NULL){
+		NDFIT_TRACE(st,"checkpoint",'B');
+		int saved = (status>0) ? ndfit_checkpoint_flush(st) : ndfit_checkpoint(st);
+		NDFIT_TRACE(st,"checkpoint",'E');
+		if(saved<0){return NULL;}
+	}
+	if(status>0){return st->center;}
 
-	// Input Data we are reading from 
-	PyObject* fitfunc;
-	PyObject* callfunc; 
-	PyObject* data;
-	PyObject* params;
-	PyObject* step;
+	// Otherwise make the tail recursive call
+	return ndfit_recursive(st);
+}
 
-	static char *kwlist[] = {"fitfunc","errfunc","data","params","consts","step","mode","throttle",NULL};
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOOOO|sO", kwlist, 
-					 &fitfunc,&callfunc,
-					 &data,&params,&CONSTS,
-					 &step,&MODE,&THROTTLE))
+///////////////////////////////////////////////
+// Main Method Runs Fit and Optimizes Params //
+///////////////////////////////////////////////
+// Parse the arguments of run() (and submit()) into a fresh state. 
+// Everything the search needs is copied or referenced here so that 
+// several fits can be in flight at once.
+int 
+ndfit_setup(ndfit_state* st, PyObject *args, PyObject *kwds){
+
+	PyObject* throttle = NULL;
+	char* mode = NULL;
+	char* sampling = NULL;
+	char* poll = NULL;
+	char* reduction = NULL;
+	char* precision = NULL;
+	char* backend = NULL;
+	PyObject* seed = NULL;
+	PyObject* checkpoint = NULL;
+	PyObject* trace = NULL;
+	PyObject* components = NULL;
+	PyObject* linear = NULL;
+	int project = 0;
+	int native = 0;
+
+	memset(st,0,sizeof(ndfit_state));
+	st->starts = 1;
+	st->prune = 10;
+	st->steptol = 1e-3;
+
+	static char *kwlist[] = {"fitfunc","errfunc","data","params","consts","step","mode","throttle",
+					 "time_budget","max_evaluations","cancel",
+					 "starts","bounds","sampling","prune","seed",
+					 "adaptive","steptol","poll","vectorized","reduction","precision",
+					 "checkpoint","checkpoint_every",
+					 "gradfunc","workers","backend","trace","components","linear","projection","native",NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOOOO|sOdlOiOsiOpdspssOiOisOOOpp", kwlist, 
+					 &st->fitfunc,&st->errfunc,
+					 &st->data,&st->params,&st->consts,
+					 &st->step,&mode,&throttle,
+					 &st->tbudget,&st->maxevals,&st->cancel,
+					 &st->starts,&st->bounds,&sampling,&st->prune,&seed,
+					 &st->adaptive,&st->steptol,&poll,&st->vectorized,&reduction,&precision,
+					 &checkpoint,&st->every,&st->gradfunc,&st->workers,&backend,&trace,&components,&linear,&project,&native))
 	{
+		memset(st,0,sizeof(ndfit_state));
 		PyErr_SetString(ndfitError,"Parse error");
-		return NULL;
+		return -1;
+	}
+
+	// Own everything we hold on to. From here on ndfit_release cleans up.
+	Py_INCREF(st->fitfunc);
+	Py_INCREF(st->errfunc);
+	Py_INCREF(st->data);
+	Py_INCREF(st->params);
+	Py_INCREF(st->consts);
+	Py_INCREF(st->step);
+	Py_XINCREF(st->cancel);
+	Py_XINCREF(st->bounds);
+	if(st->gradfunc==Py_None){st->gradfunc = NULL;}
+	Py_XINCREF(st->gradfunc);
+
+	// Worker processes and subinterpreters import the error function,
+	// which may therefore also be given as "module:qualname". Threads 
+	// call it as it is.
+	if(st->workers<0){
+		PyErr_SetString(ndfitError,"workers must be positive (zero runs in this process)");
+		return -1;
+	}
+	if(backend==NULL || !strcmp(backend,"processes")){st->backend = NDFIT_PROCESSES;}
+	else if(!strcmp(backend,"threads")){st->backend = NDFIT_THREADS;}
+	else if(!strcmp(backend,"subinterpreters")){
+#if PY_VERSION_HEX >= 0x030C0000
+		st->backend = NDFIT_INTERPRETERS;
+#else
+		PyErr_SetString(ndfitError,"backend \"subinterpreters\" needs Python 3.12 or later");
+		return -1;
+#endif
+	}
+	else{
+		PyErr_SetString(ndfitError,"backend must be \"processes\", \"threads\" or \"subinterpreters\"");
+		return -1;
+	}
+	if(PyObject_TypeCheck(st->data,ndfit_module()->grid_type)){
+		if(st->workers>0){
+			PyErr_SetString(ndfitError,"Grids are evaluated in C and do not need workers");
+			return -1;
+		}
+	}
+	else if(st->workers>0 && (st->backend!=NDFIT_THREADS || PyUnicode_Check(st->errfunc)) &&
+	   ndfit_pool_resolve(st)<0){return -1;}
+
+	// Grids are evaluated by a built-in model or a native error 
+	// function, which are otherwise handed the data as columns
+	if(ndfit_native_function(st->errfunc,native,&st->native)<0){return -1;}
+	if(PyObject_TypeCheck(st->data,ndfit_module()->grid_type)){
+		if(ndfit_grid_prepare(st)<0){return -1;}
+	}
+	else if(st->native!=NULL && ndfit_prepare_native(st)<0){return -1;}
+
+	// A Dataset has been checked already: row by row fits use its rows
+	if(st->native==NULL && st->grid==NULL){
+		PyObject* data = ndfit_dataset_data(st->data,st->vectorized);
+		if(data==NULL){return -1;}
+		Py_SETREF(st->data,data);
 	}
 
-	// Read in the data and err check the input
-	if(!PyList_Check(data)){
+	// Read in the data and err check the input. Vectorized error 
+	// functions get the data object as is, so it can be anything.
+	if(!st->vectorized && st->native==NULL && st->grid==NULL && !PyList_Check(st->data)){
 		PyErr_SetString(ndfitError,"Data is not a list");
-		return NULL;
+		return -1;
 	}
 
-	if(!PyList_Check(params)){
+	if(!PyList_Check(st->params)){
 		PyErr_SetString(ndfitError,"Params is not a list");
-		return NULL;
+		return -1;
 
 	}
 
-
-	if(!PyList_Check(CONSTS)){
-		PyErr_SetString(ndfitError,"Step is not a list");
-		return NULL;
+	if(!PyList_Check(st->consts)){
+		PyErr_SetString(ndfitError,"Consts is not a list");
+		return -1;
 
 	}
 
-	if(!PyList_Check(step)){
+	if(!PyList_Check(st->step)){
 		PyErr_SetString(ndfitError,"Step is not a list");
-		return NULL;
+		return -1;
 
 	}
 
 	// Check for lambdas
-	if(!PyCallable_Check(fitfunc)){
+	if(!PyCallable_Check(st->fitfunc)){
 		PyErr_SetString(ndfitError,"Invalid Fit Function");
-		return NULL;
+		return -1;
 
 	}
 
-	if(!PyCallable_Check(callfunc)){
+	if(st->native==NULL && st->grid==NULL && !PyCallable_Check(st->errfunc)){
 		PyErr_SetString(ndfitError,"Invalid Error Function");
-		return NULL;
+		return -1;
 	}
 
+	if(st->cancel!=NULL && st->cancel!=Py_None && 
+	   !PyCallable_Check(st->cancel) && !PyObject_HasAttrString(st->cancel,"is_set")){
+		PyErr_SetString(ndfitError,"Cancellation token must be callable or provide is_set()");
+		return -1;
+	}
 
-	// Increase ref counts if we didnt bail
-	Py_INCREF(fitfunc);
-	Py_INCREF(callfunc);
-	Py_INCREF(data);
-	Py_INCREF(params);
-	Py_INCREF(CONSTS);
-	Py_INCREF(step);
+	if(st->tbudget<0.0 || st->maxevals<0){
+		PyErr_SetString(ndfitError,"Budgets must be positive (zero means unlimited)");
+		return -1;
+	}
 
+	// Lattice shape: anything other than "full" is the short lattice.
+	// "lbfgs" drops the lattice for gradient descent.
+	if(mode!=NULL && !strcmp(mode,"full")){st->mode = NDFIT_FULL;}
+	else if(mode!=NULL && !strcmp(mode,"lbfgs")){st->mode = NDFIT_LBFGS;}
+	else{st->mode = NDFIT_SHORT;}
 
-	// Test to see if the error function is even callable with the 
-	// data provided. This prevents a segmentation fault with bad functions
-	if(!ndfit_callfunc(callfunc,PyList_GetItem(data,0),params)){
-		PyErr_SetString(ndfitError,"Unable to call error function. Check that input matches data");
-		return NULL;
+	if(st->gradfunc!=NULL && !PyCallable_Check(st->gradfunc)){
+		PyErr_SetString(ndfitError,"Invalid Gradient Function");
+		return -1;
+	}
+	if(st->mode==NDFIT_LBFGS && st->gradfunc==NULL){
+		PyErr_SetString(ndfitError,"mode=\"lbfgs\" needs a gradient function (gradfunc)");
+		return -1;
+	}
+	if(st->mode==NDFIT_LBFGS && (st->native!=NULL || st->grid!=NULL)){
+		PyErr_SetString(ndfitError,"mode=\"lbfgs\" needs a Python error function");
+		return -1;
+	}
+	if(st->mode==NDFIT_LBFGS && st->adaptive){
+		PyErr_SetString(ndfitError,"mode=\"lbfgs\" can not be combined with adaptive steps");
+		return -1;
 	}
 
 	// Check if the throttling parameter has been set. 
 	// If not, then set it to FALSE
-	if (THROTTLE==NULL){
-		THROTTLE = Py_False;
+	st->throttle = (throttle==NULL) ? 0 : PyObject_IsTrue(throttle);
+	if(st->throttle<0){return -1;}
+
+	// Set max depth and convergence to default values if not set already
+	ndfit_module_state* module = ndfit_module();
+	double conv = module->conv;
+	int maxdepth = module->maxdepth;
+	double tfactor = module->tfactor;
+	st->conv = conv ? conv : 0.1;
+	st->maxdepth = maxdepth ? maxdepth : 1000;
+	st->tfactor = tfactor ? tfactor : 1.0;
+
+	// Initialize the necessary parameters based on data sets
+	st->dim = PyList_Size(st->params);
+	if(st->native==NULL && st->grid==NULL){
+		st->datalen = st->vectorized ? PyObject_Length(st->data) : PyList_Size(st->data); 
+		if(st->datalen<0){return -1;}
+	}
+
+	if(st->datalen==0){
+		PyErr_SetString(ndfitError,"Data is empty");
+		return -1;
+	}
+	if(PyList_Size(st->step)!=st->dim){
+		PyErr_SetString(ndfitError,"Step and params must be the same size");
+		return -1;
 	}
-	Py_INCREF(THROTTLE);
 
+	if(st->steptol<=0.0){
+		PyErr_SetString(ndfitError,"steptol must be positive");
+		return -1;
+	}
 
-	// Set max depth and convergence to default values if not set already
-	if(!CONV){
-		CONV = 0.1;
+	if(reduction==NULL || !strcmp(reduction,"accurate")){st->reduction = NDFIT_ACCURATE;}
+	else if(!strcmp(reduction,"fast")){st->reduction = NDFIT_FAST;}
+	else{
+		PyErr_SetString(ndfitError,"reduction must be \"fast\" or \"accurate\"");
+		return -1;
 	}
-	
-	if(!MAXDEPTH){
-		MAXDEPTH = 1000;
+
+	// Single and mixed precision hand the vectorized error function a 
+	// float32 copy of the data (or the data itself if it is float32). 
+	// Mixed keeps a float64 copy for the refinement iterations.
+	if(precision==NULL || !strcmp(precision,"double")){st->precision = NDFIT_DOUBLE;}
+	else if(!strcmp(precision,"single")){st->precision = NDFIT_SINGLE;}
+	else if(!strcmp(precision,"mixed")){st->precision = NDFIT_MIXED;}
+	else{
+		PyErr_SetString(ndfitError,"precision must be \"double\", \"single\" or \"mixed\"");
+		return -1;
 	}
-	
-	if(!TFACTOR){
-		TFACTOR = 1.0;
+	if(st->precision!=NDFIT_DOUBLE){
+		if(!st->vectorized || st->native!=NULL){
+			PyErr_SetString(ndfitError,"Single and mixed precision need a vectorized error function");
+			return -1;
+		}
+		if(ndfit_precision(st)<0){return -1;}
+		st->single = 1;
 	}
 
-	// Initialize the necessary gobal parameters based on data sets
-	DEPTH = 0;
-	DIM = PyList_Size(params);
-	DATALEN = PyList_Size(data); 
+	if(poll==NULL || !strcmp(poll,"complete")){st->opportunistic = 0;}
+	else if(!strcmp(poll,"opportunistic")){st->opportunistic = 1;}
+	else{
+		PyErr_SetString(ndfitError,"poll must be \"complete\" or \"opportunistic\"");
+		return -1;
+	}
 
-	// Build the lattice and call the recursive code
-	PLIST = PyList_New(MAXDEPTH);
+	// The adaptive search sizes its own steps
+	if(st->adaptive){st->throttle = 0;}
 
-	// Build the lattice from step. First we need to 
-	// get itertools.product.
-	ITERTOOLS = PyImport_ImportModule((char*)"itertools"); 
-	PRODUCT = PyObject_GetAttrString(ITERTOOLS,(char*)"product");
-	
-	if(!strcmp(MODE,"short")){
-		LATTICE = ndfit_permutatorshort(step,1.0);
+	// Multi-start needs a box to sample the other starts from
+	if(st->starts<1){
+		PyErr_SetString(ndfitError,"starts must be at least 1");
+		return -1;
 	}
-	else if(!strcmp(MODE,"full")){
-		LATTICE = ndfit_permutatorfull(step,1.0);
+	if(st->starts>1 && (st->bounds==NULL || !PyList_Check(st->bounds) || PyList_Size(st->bounds)!=st->dim)){
+		PyErr_SetString(ndfitError,"Multi-start needs bounds: a list of (low,high) for every parameter");
+		return -1;
 	}
-	else {
-		LATTICE = ndfit_permutatorshort(step,1.0);
+	Py_ssize_t j;
+	for(j=0;st->starts>1 && j<st->dim;j+=1){
+		PyObject* bound = PySequence_Fast(PyList_GET_ITEM(st->bounds,j),"bounds must be (low,high) pairs");
+		int pair = (bound!=NULL && PySequence_Fast_GET_SIZE(bound)==2);
+		if(pair){
+			PyFloat_AsDouble(PySequence_Fast_GET_ITEM(bound,0));
+			PyFloat_AsDouble(PySequence_Fast_GET_ITEM(bound,1));
+			pair = !PyErr_Occurred();
+		}
+		Py_XDECREF(bound);
+		if(!pair){
+			PyErr_Clear();
+			PyErr_Format(ndfitError,"bounds must be (low,high) pairs of numbers (bound %zd)",j);
+			return -1;
+		}
+	}
+	if(sampling==NULL || !strcmp(sampling,"lhs")){st->sampling = NDFIT_LHS;}
+	else if(!strcmp(sampling,"random")){st->sampling = NDFIT_RANDOM;}
+	else{
+		PyErr_SetString(ndfitError,"sampling must be \"lhs\" or \"random\"");
+		return -1;
+	}
+
+	// The pool evaluates lattice points of Python error functions
+	if(st->workers>0){
+		if(st->native!=NULL){
+			PyErr_SetString(ndfitError,"Native error functions do not need workers");
+			return -1;
+		}
+		if(st->mode==NDFIT_LBFGS){
+			PyErr_SetString(ndfitError,"workers evaluate lattice points and can not run mode=\"lbfgs\"");
+			return -1;
+		}
+		if(st->precision!=NDFIT_DOUBLE){
+			PyErr_SetString(ndfitError,"workers evaluate in double precision only");
+			return -1;
+		}
+	}
+
+	// Checkpoints store consts as numbers and cover a single search
+	if(checkpoint!=NULL && checkpoint!=Py_None){
+		Py_ssize_t i;
+		if(st->starts>1){
+			PyErr_SetString(ndfitError,"Checkpoints are not supported for multi-start searches");
+			return -1;
+		}
+		if(st->grid!=NULL){
+			PyErr_SetString(ndfitError,"Checkpoints are not supported for grids");
+			return -1;
+		}
+		if(st->mode==NDFIT_LBFGS){
+			PyErr_SetString(ndfitError,"Checkpoints are not supported with mode=\"lbfgs\"");
+			return -1;
+		}
+		for(i=0;i<PyList_Size(st->consts);i+=1){
+			if(!PyNumber_Check(PyList_GetItem(st->consts,i))){
+				PyErr_SetString(ndfitError,"Checkpoints need consts to be numbers");
+				return -1;
+			}
+		}
+		if(!PyUnicode_FSConverter(checkpoint,&st->checkpoint)){return -1;}
+		if(st->every<1){st->every = NDFIT_CHECKPOINT_EVERY;}
+	}
+
+	// Separable models are fitted block by block on rows of (x, ..., y)
+	// and the sum of their components stands in for the error function
+	if(components!=NULL && components!=Py_None){
+		if(!PyList_Check(components)){
+			PyErr_SetString(ndfitError,"components must be a list of (function, size, (low, high))");
+			return -1;
+		}
+		if(st->vectorized || st->native!=NULL || st->grid!=NULL){
+			PyErr_SetString(ndfitError,"Separable models need row by row data");
+			return -1;
+		}
+		if(st->mode==NDFIT_LBFGS){
+			PyErr_SetString(ndfitError,"Separable models can not run mode=\"lbfgs\"");
+			return -1;
+		}
+		if(st->workers>0){
+			PyErr_SetString(ndfitError,"Separable models are evaluated block by block and do not use workers");
+			return -1;
+		}
+		if(st->checkpoint!=NULL){
+			PyErr_SetString(ndfitError,"Checkpoints are not supported for separable models");
+			return -1;
+		}
+		Py_INCREF(components);
+		st->components = components;
+		if(ndfit_blocks_parse(st)<0){return -1;}
+	}
+
+	// Axis moves of linear params are derived from residuals the search
+	// keeps, so it has to see them. Projection solves for them instead
+	// and searches the others on any lattice.
+	if(linear!=NULL && linear!=Py_None){
+		if(st->mode==NDFIT_LBFGS){
+			PyErr_SetString(ndfitError,"linear params are for lattice searches and can not run mode=\"lbfgs\"");
+			return -1;
+		}
+		if(st->mode!=NDFIT_FULL && !project){
+			PyErr_SetString(ndfitError,"linear needs mode=\"full\" or projection=True");
+			return -1;
+		}
+		if(project && st->checkpoint!=NULL){
+			PyErr_SetString(ndfitError,"Checkpoints are not supported with projection");
+			return -1;
+		}
+		if(st->native!=NULL || st->grid!=NULL || st->blocks!=NULL){
+			PyErr_SetString(ndfitError,"linear needs a Python error function");
+			return -1;
+		}
+		if(st->workers>0){
+			PyErr_SetString(ndfitError,"linear params are updated in this process and do not use workers");
+			return -1;
+		}
+		Py_INCREF(linear);
+		st->linear = linear;
+		st->project = project;
+		if(ndfit_linear_check(st)<0){return -1;}
+	}
+	else if(project){
+		PyErr_SetString(ndfitError,"projection needs the linear params (linear=[...])");
+		return -1;
+	}
+
+	// Trace events are written to the file named when the fit is done
+	if(trace!=NULL && trace!=Py_None){
+		PyObject* path = NULL;
+		if(!PyUnicode_FSConverter(trace,&path)){return -1;}
+		st->trace = ndfit_trace_open(PyBytes_AS_STRING(path));
+		Py_DECREF(path);
+		if(st->trace==NULL){return -1;}
+		st->traceown = 1;
+	}
+
+	// Seed from the clock unless the caller wants a reproducible run
+	if(seed!=NULL && seed!=Py_None){
+		unsigned long long s = PyLong_AsUnsignedLongLongMask(seed);
+		if(PyErr_Occurred()){return -1;}
+		ndfit_seed(st,s);
+	}
+	else{
+		ndfit_seed(st,(unsigned long long)(ndfit_clock()*1e9));
+	}
+	return 0;
+}
+
+// Float32 (and for float32 input, float64) copies of the data for 
+// single and mixed precision
+static int ndfit_precision(ndfit_state* st){
+
+	int single = ndfit_is_single(st->data);
+	if(single){Py_INCREF(st->data); st->data32 = st->data;}
+	else{st->data32 = ndfit_cast(st->data,1);}
+	if(st->data32==NULL){return -1;}
+	if(st->precision==NDFIT_MIXED && single){
+		st->data64 = ndfit_cast(st->data,0);
+		if(st->data64==NULL){return -1;}
+	}
+	return 0;
+}
+
+// Native error functions read the data as the columns of a Dataset 
+// and the consts as packed doubles
+static int ndfit_prepare_native(ndfit_state* st){
+
+	if(PyObject_TypeCheck(st->data,ndfit_module()->dataset_type)){
+		Py_INCREF(st->data);
+		st->columns = st->data;
+	}
+	else{
+		st->columns = PyObject_CallFunctionObjArgs((PyObject*)ndfit_module()->dataset_type,st->data,NULL);
+		if(st->columns==NULL){return -1;}
+	}
+	st->datalen = ((ndDataset*)st->columns)->nrows;
+	return ndfit_consts(st);
+}
+
+// The consts as packed doubles for C evaluation
+int ndfit_consts(ndfit_state* st){
+
+	Py_ssize_t i;
+	Py_ssize_t n = PyList_Size(st->consts);
+	st->cconsts = PyBytes_FromStringAndSize(NULL,sizeof(double)*(n>0 ? n : 0));
+	if(st->cconsts==NULL){return -1;}
+	double* c = (double*)PyBytes_AS_STRING(st->cconsts);
+	for(i=0;i<n;i+=1){
+		c[i] = PyFloat_AsDouble(PyList_GetItem(st->consts,i));
+		if(c[i]==-1.0 && PyErr_Occurred()){
+			PyErr_SetString(ndfitError,"Native error functions need consts to be numbers");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Drop every reference held by the state
+void 
+ndfit_release(ndfit_state* st){
+	// Worker threads use the inputs until they are stopped
+	if(st->parent==NULL){ndfit_pool_stop(st->pool);}
+	st->pool = NULL;
+	Py_CLEAR(st->fitfunc);
+	Py_CLEAR(st->errfunc);
+	Py_CLEAR(st->data);
+	Py_CLEAR(st->params);
+	Py_CLEAR(st->consts);
+	Py_CLEAR(st->step);
+	Py_CLEAR(st->cancel);
+	Py_CLEAR(st->bounds);
+	Py_CLEAR(st->data32);
+	Py_CLEAR(st->data64);
+	Py_CLEAR(st->checkpoint);
+	PyMem_Free(st->ckbuf);
+	st->ckbuf = NULL;
+	Py_CLEAR(st->gradfunc);
+	Py_CLEAR(st->columns);
+	Py_CLEAR(st->cconsts);
+	Py_CLEAR(st->errname);
+	Py_CLEAR(st->plist);
+	Py_CLEAR(st->lattice);
+	st->center = NULL;
+	PyMem_Free(st->scale);
+	PyMem_Free(st->runs);
+	st->scale = NULL;
+	st->runs = NULL;
+	PyMem_Free(st->order);
+	st->order = NULL;
+	PyMem_Free(st->resid);
+	st->resid = NULL;
+	PyMem_Free(st->pairs);
+	PyMem_Free(st->grad);
+	st->pairs = NULL;
+	st->grad = NULL;
+	PyMem_Free(st->cparams);
+	st->cparams = NULL;
+	Py_CLEAR(st->args);
+	PyMem_Free(st->sweepx);
+	PyMem_Free(st->sweepe);
+	st->sweepx = NULL;
+	st->sweepe = NULL;
+	st->nsweep = 0;
+	st->sweepcap = 0;
+	if(st->parent==NULL){PyMem_Free(st->weights);}
+	if(st->traceown){ndfit_trace_free(st->trace);}
+	if(st->parent==NULL){ndfit_blocks_free(st->blocks);}
+	Py_CLEAR(st->components);
+	Py_CLEAR(st->grid);
+	PyMem_Free(st->blockwork);
+	ndfit_linear_free(st->lin);
+	Py_CLEAR(st->linear);
+	st->lin = NULL;
+	st->blocks = NULL;
+	st->blockwork = NULL;
+	st->trace = NULL;
+	st->traceown = 0;
+	st->weights = NULL;
+}
+
+// Start a search at st->params: fresh history, unit lattice and the 
+// first sweep. Returns like ndfit_iterate.
+static int ndfit_begin(ndfit_state* st){
+
+	st->depth = 0;
+	st->truncated = 0;
+	st->pruned = 0;
+
+	// Adaptive steps start at the user's step and need the entropy 
+	// of the starting point to compare the first sweep against
+	if(st->adaptive){
+		Py_ssize_t i;
+		PyMem_Free(st->scale);
+		PyMem_Free(st->runs);
+		st->scale = PyMem_Malloc(sizeof(double)*st->dim);
+		st->runs = PyMem_Calloc(st->dim,sizeof(int));
+		if(st->scale==NULL || st->runs==NULL){PyErr_NoMemory(); return -1;}
+		for(i=0;i<st->dim;i+=1){st->scale[i] = ndfit_linear_projected(st,i) ? 0.0 : 1.0;}
+	}
+
+	// Gradient descent needs no lattice, just the function and the
+	// gradient at the start
+	if(st->mode==NDFIT_LBFGS){
+		PyMem_Free(st->pairs);
+		PyMem_Free(st->grad);
+		st->pairs = PyMem_Malloc(sizeof(double)*2*st->dim*NDFIT_LBFGS_M);
+		st->grad = PyMem_Malloc(sizeof(double)*st->dim);
+		if(st->pairs==NULL || st->grad==NULL){PyErr_NoMemory(); return -1;}
+		st->npairs = 0;
+		st->head = 0;
+		st->sumsq = ndfit_objective(st,st->params,st->grad);
+		if(st->sumsq<0.0){return -1;}
+		st->center_entropy = ndfit_measure(st,st->sumsq);
+
+		Py_XDECREF(st->plist);
+		st->plist = PyList_New(st->maxdepth);
+		if(st->plist==NULL){return -1;}
+		st->center = st->params;
+		return ndfit_iterate(st);
+	}
+
+	// Separable models poll a lattice per block which is built as 
+	// the pass goes
+	if(st->blocks!=NULL){
+		Py_XDECREF(st->plist);
+		st->plist = PyList_New(st->maxdepth);
+		if(st->plist==NULL){return -1;}
+		st->lscale = 1.0;
+		st->center = st->params;
+		return ndfit_iterate(st);
+	}
+
+	// Both the adaptive search and opportunistic polling compare 
+	// the lattice against the entropy at the centre
+	if(st->adaptive || st->opportunistic){
+		st->center_entropy = ndfit_entropy(st,st->params);
+		if(st->center_entropy<0.0){return -1;}
 	}
 
+	// Build the lattice and call the recursive code
+	Py_XDECREF(st->plist);
+	st->plist = PyList_New(st->maxdepth);
+	if(st->plist==NULL){return -1;}
+	if(ndfit_lattice(st,1.0)<0){return -1;}
+	if(st->opportunistic && ndfit_order(st)<0){return -1;}
+
 	// Need to give the plist an initial value
-	PyObject* first = ndfit_next(callfunc,data,params,LATTICE);
-	PyList_SetItem(PLIST,DEPTH,first);
-	Py_INCREF(first);
-	DEPTH+=1;
-
-	PyObject* result = ndfit_recursive(callfunc,data,params,step,LATTICE);
-
-	// Build the final values
-	PLIST = PyList_GetSlice(PLIST,0,DEPTH-1);
-	PyObject* argList = Py_BuildValue("OOOOOO", data, PLIST, CONSTS, fitfunc, callfunc, LATTICE);
-	PyObject* ndfobj = PyObject_CallObject((PyObject*)&ndFitType,argList);
-
-	// Clean up	
-	Py_DECREF(argList);
-	Py_DECREF(fitfunc);
-	Py_DECREF(callfunc);
-	Py_DECREF(data);
+	st->center = st->params;
+	return ndfit_iterate(st);
+}
+
+// End of the history handed back to the user. A converged fit drops 
+// the last (worse) step. A truncated or pruned search keeps its 
+// history up to the best point found so far.
+static Py_ssize_t ndfit_last(ndfit_state* st){
+
+	Py_ssize_t i;
+	Py_ssize_t last = st->depth-1;
+
+	// The adaptive search, gradient descent and the block search of 
+	// separable models never step uphill so their last step is their best
+	if(st->adaptive || st->mode==NDFIT_LBFGS || st->blocks!=NULL){return st->depth;}
+
+	if(st->truncated || st->pruned || last<1){
+		double best = PyFloat_AsDouble(PyTuple_GetItem(PyList_GetItem(st->plist,0),0));
+		last = 1;
+		for(i=1;i<st->depth;i+=1){
+			double e = PyFloat_AsDouble(PyTuple_GetItem(PyList_GetItem(st->plist,i),0));
+			if(e<best){best = e; last = i+1;}
+		}
+	}
+	return last;
+}
+
+static double ndfit_final(ndfit_state* st){
+	PyObject* item = PyList_GetItem(st->plist,ndfit_last(st)-1);
+	return PyFloat_AsDouble(PyTuple_GetItem(item,0));
+}
+
+// The options of run() a refit of the same problem needs, handed 
+// to the ndFit for uncertainty()
+static PyObject* ndfit_options(ndfit_state* st){
+
+	static const char* modes[] = {"short","full","lbfgs"};
+	static const char* reductions[] = {"fast","accurate"};
+	static const char* precisions[] = {"double","single","mixed"};
+
+	PyObject* options = Py_BuildValue("{s:O,s:s,s:O,s:O,s:d,s:s,s:O,s:s,s:s}",
+		"step",st->step,
+		"mode",modes[st->mode],
+		"throttle",st->throttle ? Py_True : Py_False,
+		"adaptive",st->adaptive ? Py_True : Py_False,
+		"steptol",st->steptol,
+		"poll",st->opportunistic ? "opportunistic" : "complete",
+		"vectorized",st->vectorized ? Py_True : Py_False,
+		"reduction",reductions[st->reduction],
+		"precision",precisions[st->precision]);
+	if(options!=NULL && st->gradfunc!=NULL && PyDict_SetItemString(options,"gradfunc",st->gradfunc)<0){
+		Py_CLEAR(options);
+	}
+	if(options!=NULL && st->components!=NULL && PyDict_SetItemString(options,"components",st->components)<0){
+		Py_CLEAR(options);
+	}
+	if(options!=NULL && st->linear!=NULL && PyDict_SetItemString(options,"linear",st->linear)<0){
+		Py_CLEAR(options);
+	}
+	if(options!=NULL && st->project && PyDict_SetItemString(options,"projection",Py_True)<0){
+		Py_CLEAR(options);
+	}
+	if(options!=NULL && st->native!=NULL && PyDict_SetItemString(options,"native",Py_True)<0){
+		Py_CLEAR(options);
+	}
+	return options;
+}
+
+// Build the ndFit from the history of a finished search
+static PyObject* ndfit_result(ndfit_state* st){
+
+	PyObject* plist = PyList_GetSlice(st->plist,0,ndfit_last(st));
+	if(plist==NULL){return NULL;}
+
+	// Mixed precision always reports a float64 entropy
+	if(st->precision==NDFIT_MIXED && st->single){
+		Py_ssize_t last = PyList_Size(plist)-1;
+		PyObject* params = PyTuple_GetItem(PyList_GetItem(plist,last),1);
+		st->single = 0;
+		double e = ndfit_entropy(st,params);
+		if(e<0.0){Py_DECREF(plist); return NULL;}
+		PyList_SetItem(plist,last,Py_BuildValue("(dO)",e,params));
+	}
+	PyObject* options = ndfit_options(st);
+	PyObject* evaluations = options ? ndfit_evaluations(st) : NULL;
+	if(evaluations==NULL){Py_XDECREF(options); Py_DECREF(plist); return NULL;}
+	PyObject* ndfobj = PyObject_CallFunction((PyObject*)ndfit_module()->fit_type,"OOOOOOiOO", 
+		st->data, plist, st->consts, st->fitfunc, st->errfunc, 
+		st->lattice ? st->lattice : Py_None, st->truncated,
+		options, evaluations);
+	Py_DECREF(options);
+	Py_DECREF(evaluations);
+	Py_DECREF(plist);
+	return ndfobj;
+}
+
+/////////////////////////////////
+// Multi-start (global) search //
+/////////////////////////////////
+// xorshift64* seeded through splitmix64. Uniform on [0,1).
+double ndfit_random(ndfit_state* st){
+	st->rng ^= st->rng >> 12;
+	st->rng ^= st->rng << 25;
+	st->rng ^= st->rng >> 27;
+	return (double)((st->rng * 2685821657736338717ULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+static void ndfit_seed(ndfit_state* st, unsigned long long seed){
+	unsigned long long z = seed + 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	st->rng = (z ^ (z >> 31)) | 1ULL;
+}
+
+// Draw n starting points inside the bounds. Latin hypercube puts one 
+// point in each of n strata along every axis, random is plain uniform. 
+static PyObject* ndfit_samples(ndfit_state* st, Py_ssize_t n){
+
+	Py_ssize_t i, j, k;
+	PyObject* points = PyList_New(n);
+	Py_ssize_t* perm = PyMem_Malloc(sizeof(Py_ssize_t)*(n>0 ? n : 1));
+	if(points==NULL || perm==NULL){Py_XDECREF(points); PyMem_Free(perm); return PyErr_NoMemory();}
+
+	for(i=0;i<n;i+=1){
+		PyObject* point = PyList_New(st->dim);
+		if(point==NULL){Py_DECREF(points); PyMem_Free(perm); return NULL;}
+		PyList_SET_ITEM(points,i,point);
+	}
+	for(j=0;j<st->dim;j+=1){
+		PyObject* bound = PySequence_Fast(PyList_GetItem(st->bounds,j),"bounds must be (low,high) pairs");
+		if(bound!=NULL && PySequence_Fast_GET_SIZE(bound)!=2){
+			Py_SETREF(bound,NULL);
+			PyErr_SetString(ndfitError,"bounds must be (low,high) pairs");
+		}
+		if(bound==NULL){Py_DECREF(points); PyMem_Free(perm); return NULL;}
+		double lo = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(bound,0));
+		double hi = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(bound,1));
+		Py_DECREF(bound);
+
+		// Shuffle the strata for this axis (Fisher-Yates)
+		for(i=0;i<n;i+=1){perm[i] = i;}
+		for(i=n-1;i>0;i-=1){
+			k = (Py_ssize_t)(ndfit_random(st)*(double)(i+1));
+			Py_ssize_t t = perm[i]; perm[i] = perm[k]; perm[k] = t;
+		}
+		for(i=0;i<n;i+=1){
+			double u = (st->sampling==NDFIT_LHS) ? 
+				((double)perm[i]+ndfit_random(st))/(double)n : ndfit_random(st);
+			PyList_SET_ITEM(PyList_GET_ITEM(points,i),j,PyFloat_FromDouble(lo+u*(hi-lo)));
+		}
+	}
+	PyMem_Free(perm);
+	if(PyErr_Occurred()){Py_DECREF(points); return NULL;}
+	return points;
+}
+
+// Run st->starts searches in lock-step, one sweep each per round. The 
+// user's guess is always the first start, the rest are sampled from 
+// the bounds. Every st->prune rounds a start whose best entropy is 
+// NDFIT_PRUNE_RATIO times worse than the best overall is stopped and 
+// its unused depth is shared out between the survivors. 
+static PyObject* ndfit_multistart(ndfit_state* st){
+
+	Py_ssize_t i, k;
+	Py_ssize_t n = st->starts;
+	Py_ssize_t alive = n;
+	PyObject* ndfobj = NULL;
+	int* running = PyMem_Calloc(n,sizeof(int));
+	ndfit_state* subs = PyMem_Calloc(n,sizeof(ndfit_state));
+	if(subs==NULL || running==NULL){PyMem_Free(subs); PyMem_Free(running); return PyErr_NoMemory();}
+
+	PyObject* guesses = ndfit_samples(st,n-1);
+	if(guesses==NULL){goto done;}
+
+	// Each start shares the inputs of the parent but owns its params, 
+	// history and lattice. Budgets are counted on the parent.
+	for(k=0;k<n;k+=1){
+		memcpy(&subs[k],st,sizeof(ndfit_state));
+		subs[k].parent = st;
+		subs[k].quiet = 1;
+		subs[k].starts = 1;
+		subs[k].plist = NULL;
+		subs[k].lattice = NULL;
+		subs[k].scale = NULL;
+		subs[k].runs = NULL;
+		subs[k].order = NULL;
+		subs[k].resid = NULL;
+		subs[k].checkpoint = NULL;
+		subs[k].ckbuf = NULL;
+		subs[k].pairs = NULL;
+		subs[k].grad = NULL;
+		subs[k].args = NULL;
+		subs[k].sweepx = NULL;
+		subs[k].sweepe = NULL;
+		subs[k].nsweep = 0;
+		subs[k].sweepcap = 0;
+		subs[k].traceown = 0;
+		subs[k].blockwork = NULL;
+		subs[k].lin = NULL;
+		Py_XINCREF(subs[k].linear);
+		Py_XINCREF(subs[k].components);
+		Py_XINCREF(subs[k].grid);
+		Py_XINCREF(subs[k].gradfunc);
+		Py_XINCREF(subs[k].columns);
+		Py_XINCREF(subs[k].cconsts);
+		Py_XINCREF(subs[k].errname);
+		subs[k].cparams = NULL;
+		Py_XINCREF(subs[k].data32);
+		Py_XINCREF(subs[k].data64);
+		subs[k].params = (k==0) ? st->params : PyList_GetItem(guesses,k-1);
+		Py_INCREF(subs[k].fitfunc);
+		Py_INCREF(subs[k].errfunc);
+		Py_INCREF(subs[k].data);
+		Py_INCREF(subs[k].params);
+		Py_INCREF(subs[k].consts);
+		Py_INCREF(subs[k].step);
+		Py_XINCREF(subs[k].cancel);
+		Py_XINCREF(subs[k].bounds);
+	}
+	Py_DECREF(guesses);
+
+	for(k=0;k<n;k+=1){
+		int status = ndfit_begin(&subs[k]);
+		if(status<0){goto done;}
+		running[k] = (status==0);
+		if(subs[k].truncated){st->truncated = 1; break;}
+	}
+
+	int round = 0;
+	while(!st->truncated){
+
+		int active = 0;
+		for(k=0;k<n && !st->truncated;k+=1){
+			if(!running[k]){continue;}
+			int status = ndfit_iterate(&subs[k]);
+			if(status<0){goto done;}
+			if(status>0){running[k] = 0;}
+			if(subs[k].truncated){st->truncated = 1;}
+			active += running[k];
+		}
+		if(active==0){break;}
+		round += 1;
+
+		// Prune the dominated starts
+		if(st->prune>0 && round%st->prune==0 && alive>1){
+			double best = -1.0;
+			double* mins = PyMem_Malloc(sizeof(double)*n);
+			if(mins==NULL){PyErr_NoMemory(); goto done;}
+			for(k=0;k<n;k+=1){
+				mins[k] = PyFloat_AsDouble(PyTuple_GetItem(PyList_GetItem(subs[k].plist,ndfit_last(&subs[k])-1),0));
+				if(best<0.0 || mins[k]<best){best = mins[k];}
+			}
+			int spare = 0;
+			for(k=0;k<n;k+=1){
+				if(running[k] && mins[k]>NDFIT_PRUNE_RATIO*best){
+					running[k] = 0;
+					subs[k].pruned = 1;
+					NDFIT_TRACE_ARG(st,"prune",'i',"start",k);
+					spare += subs[k].maxdepth-subs[k].depth;
+					alive -= 1;
+				}
+			}
+			PyMem_Free(mins);
+
+			// Hand the unused depth of the pruned starts to the survivors
+			int share = 0;
+			for(k=0;k<n;k+=1){share += running[k];}
+			for(k=0;k<n && share>0 && spare>0;k+=1){
+				if(!running[k]){continue;}
+				int extra = spare/share;
+				for(i=0;i<extra;i+=1){
+					if(PyList_Append(subs[k].plist,Py_None)<0){goto done;}
+				}
+				subs[k].maxdepth += extra;
+			}
+		}
+	}
+	// The winner is the start with the best reported entropy
+	Py_ssize_t winner = 0;
+	for(k=1;k<n;k+=1){
+		if(subs[k].depth>0 && ndfit_final(&subs[k])<ndfit_final(&subs[winner])){winner = k;}
+	}
+	subs[winner].truncated = st->truncated;
+	ndfobj = ndfit_result(&subs[winner]);
+
+done:
+	for(k=0;k<n;k+=1){
+		if(subs[k].parent!=NULL){ndfit_release(&subs[k]);}
+	}
+	PyMem_Free(subs);
+	PyMem_Free(running);
+	return ndfobj;
+}
+
+// Test to see if the error function is even callable with the 
+// data provided. This prevents a segmentation fault with bad functions
+static int ndfit_probe(ndfit_state* st){
+
+	// Nothing to test on a native function short of calling it, and 
+	// built-in models have had their params counted
+	if(st->native!=NULL || st->grid!=NULL){return 0;}
+
+	// A copy of the guess, so an error function that changes or keeps 
+	// its params never touches the caller's list
+	PyObject* params = PyList_GetSlice(st->params,0,st->dim);
+	if(params==NULL){return -1;}
+	PyObject* test = ndfit_callfunc(st,st->errfunc,
+		st->vectorized ? st->data : PyList_GetItem(st->data,0),params);
 	Py_DECREF(params);
-	Py_DECREF(result);
-	Py_DECREF(LATTICE);
-	Py_DECREF(ITERTOOLS);
-	Py_DECREF(PRODUCT);
+	if(test==NULL){
+		// Interrupts (KeyboardInterrupt from a signal) pass as they are
+		if(PyErr_ExceptionMatches(PyExc_Exception)){
+			PyErr_SetString(ndfitError,"Unable to call error function. Check that input matches data");
+		}
+		return -1;
+	}
+
+	// A vectorized error function decides how many residuals there are
+	if(st->vectorized){
+		st->datalen = ndfit_residual_count(test);
+		if(st->datalen<=0){
+			Py_DECREF(test);
+			if(!PyErr_Occurred()){PyErr_SetString(ndfitError,"Error function returned no residuals");}
+			return -1;
+		}
+	}
+	Py_DECREF(test);
+	return 0;
+}
+
+// Run the search described by a prepared state and build the ndFit.
+// A trace of the fit's own is written once its workers have stopped; 
+// if the fit failed its error wins over one from writing the trace.
+PyObject* 
+ndfit_fit(ndfit_state* st){
+
+	NDFIT_TRACE(st,"fit",'B');
+	PyObject* ndfobj = ndfit_search(st);
+	NDFIT_TRACE_ARG(st,"fit",'E',"evaluations",st->evals);
+
+	if(st->traceown){
+		PyObject *et, *ev, *etb;
+		PyErr_Fetch(&et,&ev,&etb);
+		if(st->parent==NULL){
+			ndfit_pool_stop(st->pool);
+			st->pool = NULL;
+		}
+		if(ndfit_trace_write(st->trace)<0){
+			if(ndfobj!=NULL){Py_CLEAR(ndfobj);}
+			else{PyErr_Clear();}
+		}
+		if(et!=NULL){PyErr_Restore(et,ev,etb);}
+	}
+	return ndfobj;
+}
+
+static PyObject* ndfit_search(ndfit_state* st){
+
+	if(ndfit_probe(st)<0){return NULL;}
+	if(st->workers>0 && st->pool==NULL && ndfit_pool_start(st)<0){return NULL;}
+
+	st->evals = 0;
+	st->truncated = 0;
+	st->tstart = ndfit_clock();
+
+	if(st->starts>1){
+		return ndfit_multistart(st);
+	}
+
+	int status = ndfit_begin(st);
+	if(status<0){return NULL;}
+	if(status==0 && ndfit_recursive(st)==NULL){return NULL;}
+	return ndfit_result(st);
+}
+
+PyObject* 
+ndfit_run(PyObject* self,PyObject *args, PyObject *kwds){
 
-	// return ndfobj;
-	return ndfobj;	
+	ndfit_state st;
+	PyObject* ndfobj = NULL;
 
+	if(ndfit_setup(&st,args,kwds)==0){
+		ndfobj = ndfit_fit(&st);
+	}
+	ndfit_release(&st);
+	return ndfobj;
 };
 
+// Pick up a checkpointed fit where it stopped. The callables and data
+// are not in the checkpoint and have to be handed in again. Budgets 
+// carry over unless given, and checkpoints keep going to path unless 
+// another file is named.
+PyObject* 
+ndfit_resume(PyObject* self,PyObject *args, PyObject *kwds){
+
+	ndfit_state st;
+	PyObject* path = NULL;
+	PyObject* fitfunc = NULL;
+	PyObject* errfunc = NULL;
+	PyObject* data = NULL;
+	PyObject* cancel = NULL;
+	PyObject* checkpoint = NULL;
+	PyObject* ndfobj = NULL;
+	int every = 0;
+	int native = 0;
+	double tbudget = -1.0;
+	long maxevals = -1;
+
+	memset(&st,0,sizeof(ndfit_state));
+	static char *kwlist[] = {"path","fitfunc","errfunc","data","cancel",
+					 "checkpoint","checkpoint_every","time_budget","max_evaluations","native",NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&OOO|OOidlp", kwlist, 
+					 PyUnicode_FSConverter,&path,&fitfunc,&errfunc,&data,&cancel,
+					 &checkpoint,&every,&tbudget,&maxevals,&native)){
+		return NULL;
+	}
+
+	if(ndfit_restore(&st,PyBytes_AS_STRING(path))<0){goto done;}
+
+	st.fitfunc = fitfunc;
+	st.errfunc = errfunc;
+	st.cancel = (cancel==Py_None) ? NULL : cancel;
+	Py_INCREF(st.fitfunc);
+	Py_INCREF(st.errfunc);
+	Py_XINCREF(st.cancel);
+	st.starts = 1;
+
+	// The data has to be the data the checkpoint was taken with
+	Py_ssize_t datalen = st.datalen;
+	if(ndfit_native_function(st.errfunc,native,&st.native)<0){goto done;}
+	if(st.native!=NULL){
+		Py_INCREF(data);
+		st.data = data;
+		if(ndfit_prepare_native(&st)<0){goto done;}
+	}
+	else{
+		st.data = ndfit_dataset_data(data,st.vectorized);
+		if(st.data==NULL){goto done;}
+	}
+
+	if(!PyCallable_Check(st.fitfunc) || (st.native==NULL && !PyCallable_Check(st.errfunc))){
+		PyErr_SetString(ndfitError,"Invalid Fit or Error Function");
+		goto done;
+	}
+	if(st.linear!=NULL && st.native!=NULL){
+		PyErr_SetString(ndfitError,"linear needs a Python error function");
+		goto done;
+	}
+	if(!st.vectorized && st.native==NULL && !PyList_Check(st.data)){
+		PyErr_SetString(ndfitError,"Data is not a list");
+		goto done;
+	}
+	if(tbudget>=0.0){st.tbudget = tbudget;}
+	if(maxevals>=0){st.maxevals = maxevals;}
+	if(every>0){st.every = every;}
+
+	if(checkpoint!=NULL && checkpoint!=Py_None){
+		if(!PyUnicode_FSConverter(checkpoint,&st.checkpoint)){goto done;}
+	}
+	else{
+		Py_INCREF(path);
+		st.checkpoint = path;
+	}
+
+	if(!st.vectorized && st.native==NULL){st.datalen = PyList_Size(st.data);}
+	if(ndfit_probe(&st)<0){goto done;}
+	if(st.datalen!=datalen){
+		PyErr_Format(ndfitError,"Data has %zd points, the checkpoint was taken with %zd",st.datalen,datalen);
+		goto done;
+	}
+	if(st.precision!=NDFIT_DOUBLE && ndfit_precision(&st)<0){goto done;}
+
+	// Rebuild the lattice the search was on and carry on
+	Py_ssize_t ldim = st.ldim;
+	if(ndfit_lattice(&st,st.lscale)<0){goto done;}
+	if(st.ldim!=ldim){
+		PyErr_SetString(ndfitError,"Checkpoint lattice does not match its step");
+		goto done;
+	}
+	if(ndfit_recursive(&st)==NULL){goto done;}
+	ndfobj = ndfit_result(&st);
+
+done:
+	Py_XDECREF(path);
+	ndfit_release(&st);
+	return ndfobj;
+}
+
 ///////////////////////////
 // Misc Useful Functions //
 ///////////////////////////
@@ -761,6 +2555,10 @@ static PyMethodDef ndfit_methods[]={
 	{"convergence", ndfit_convergence,METH_VARARGS,"set entropy convergence"},
 	{"throttle_factor",ndfit_throttle_factor, METH_VARARGS,"set throttle factor"},
 	{"run", (PyCFunction)(void(*)(void))ndfit_run, METH_VARARGS | METH_KEYWORDS,"main method"},
+	{"resume", (PyCFunction)(void(*)(void))ndfit_resume, METH_VARARGS | METH_KEYWORDS,"continue a fit from a checkpoint file"},
+	{"sweep", (PyCFunction)(void(*)(void))ndfit_sweep_run, METH_VARARGS | METH_KEYWORDS,"fit once for every consts vector in a list, on worker threads"},
+	{"submit", (PyCFunction)(void(*)(void))ndfit_submit, METH_VARARGS | METH_KEYWORDS,"run the fit on a background thread and return a Future"},
+	{"_worker",ndfit_pool_worker, METH_VARARGS,"body of a worker process of the process pool"},
 	{"evaluate_function",ndfit_functest, METH_VARARGS, "external method to check the function"},
 	{"product",ndfit_product, METH_VARARGS, "external method to get elementwise product"},
 	{"quotient",ndfit_quotient, METH_VARARGS, "external method to get elementwise quotient"},
@@ -775,30 +2573,122 @@ static PyMethodDef ndfit_methods[]={
 /////////////////////////////
 
 
+// Module execution (multi-phase initialisation). Every interpreter
+// gets its own types, exception and defaults, made by the first 
+// module object executed there; a module imported again (after it
+// was dropped from sys.modules) shares them.
+static int ndfit_exec(PyObject* m){
+
+	ndfit_module_state* state = PyModule_GetState(m);
+	PyObject* dict = PyInterpreterState_GetDict(PyInterpreterState_Get());
+	if (dict == NULL){
+		PyErr_SetString(PyExc_RuntimeError,"ndfit needs an interpreter dict");
+		return -1;
+	}
+	PyObject* first = PyDict_GetItemString(dict,"ndfit");
+	if (first == NULL){
+		state->fit_type = (PyTypeObject*)PyType_FromModuleAndSpec(m,&ndFit_spec,NULL);
+		if (state->fit_type == NULL)
+			return -1;
+
+		state->future_type = (PyTypeObject*)PyType_FromModuleAndSpec(m,&ndFuture_spec,NULL);
+		if (state->future_type == NULL)
+			return -1;
+
+		state->dataset_type = (PyTypeObject*)PyType_FromModuleAndSpec(m,&ndDataset_spec,NULL);
+		if (state->dataset_type == NULL)
+			return -1;
+
+		state->grid_type = (PyTypeObject*)PyType_FromModuleAndSpec(m,&ndGrid_spec,NULL);
+		if (state->grid_type == NULL)
+			return -1;
+
+		// Build the lattice from step. First we need to 
+		// get itertools.product.
+		PyObject* itertools = PyImport_ImportModule("itertools"); 
+		if (itertools == NULL)
+			return -1;
+		state->product = PyObject_GetAttrString(itertools,"product");
+		Py_DECREF(itertools);
+		if (state->product == NULL)
+			return -1;
+
+		state->error = PyErr_NewException("ndfit.error",NULL,NULL);
+		if (state->error == NULL)
+			return -1;
+
+		if (PyDict_SetItemString(dict,"ndfit",m) < 0)
+			return -1;
+	}
+	else{
+		state = PyModule_GetState(first);
+	}
+
+	if (PyModule_AddObjectRef(m, "Noddy", (PyObject*)state->fit_type) < 0 ||
+	    PyModule_AddObjectRef(m, "ndFit", (PyObject*)state->fit_type) < 0 ||
+	    PyModule_AddObjectRef(m, "error", state->error) < 0 ||
+	    PyModule_AddObjectRef(m, "Future", (PyObject*)state->future_type) < 0 ||
+	    PyModule_AddObjectRef(m, "Dataset", (PyObject*)state->dataset_type) < 0 ||
+	    PyModule_AddObjectRef(m, "Grid", (PyObject*)state->grid_type) < 0)
+		return -1;
+	return 0;
+}
+
+static int ndfit_traverse(PyObject* m, visitproc visit, void* arg){
+	ndfit_module_state* state = PyModule_GetState(m);
+	Py_VISIT(state->error);
+	Py_VISIT(state->product);
+	Py_VISIT(state->fit_type);
+	Py_VISIT(state->future_type);
+	Py_VISIT(state->dataset_type);
+	Py_VISIT(state->grid_type);
+	return 0;
+}
+
+static int ndfit_clear(PyObject* m){
+	ndfit_module_state* state = PyModule_GetState(m);
+	Py_CLEAR(state->error);
+	Py_CLEAR(state->product);
+	Py_CLEAR(state->fit_type);
+	Py_CLEAR(state->future_type);
+	Py_CLEAR(state->dataset_type);
+	Py_CLEAR(state->grid_type);
+	return 0;
+}
+
+static void ndfit_free(void* m){
+	ndfit_clear((PyObject*)m);
+}
+
+// Nothing is shared between interpreters (the worker pool hands its
+// subinterpreters plain C data only), so each may have its own GIL. 
+// Free-threaded builds turn the GIL back on for the module: not all
+// state shared between fits, pools and handles is safe without it.
+static PyModuleDef_Slot ndfit_slots[] = {
+	{Py_mod_exec, ndfit_exec},
+#ifdef Py_mod_multiple_interpreters
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+	{0, NULL}
+};
+
 static struct PyModuleDef ndfit =
 {
 	PyModuleDef_HEAD_INIT,
 	"ndfit",		 	/* name of module */
 	"",					/* module documentation, may be NULL */
-	-1,					/* size of per-interpreter state of the module, or -1 if the module keeps state in global variables. */
-	ndfit_methods
+	sizeof(ndfit_module_state),	/* size of per-interpreter state of the module */
+	ndfit_methods,
+	ndfit_slots,
+	ndfit_traverse,
+	ndfit_clear,
+	ndfit_free
 };
 
 PyMODINIT_FUNC 
 PyInit_ndfit(void)
 {
-	PyObject* m;
-
-    if (PyType_Ready(&ndFitType) < 0)
-        return NULL;
-
-    m = PyModule_Create(&ndfit);
-    if (m == NULL)
-        return NULL;
-
-    Py_INCREF(&ndFitType);
-    PyModule_AddObject(m, "Noddy", (PyObject*)&ndFitType);
-    return m;
+	return PyModuleDef_Init(&ndfit);
 }
 
 // Python2 version
@@ -0,0 +1,955 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <pythread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+//////////////////////////////////////////////
+// Worker pool (run(..., workers=N)). The
+// data, consts and a task table live in one
+// segment: POSIX shared memory for worker
+// processes, plain memory for threads. Worker
+// processes and subinterpreters import the
+// error function by module path, threads call
+// the fit's own. They evaluate the lattice
+// points of a sweep; results come back
+// through a lock-free ring in the same
+// segment.
+//
+// Subinterpreters (Python 3.12 and later) run
+// on threads of this process with a GIL of
+// their own. Like processes they only share
+// the plain C data of the segment with the
+// parent, so their error functions run in 
+// parallel; unlike processes they need every
+// module the error function imports to 
+// support isolated interpreters (numpy does
+// not yet).
+//
+// A sweep is a batch. batch holds the batch
+// number and its size, next the batch number
+// and the next unclaimed point, so a claim
+// left over from an old batch is recognised.
+// The parent claims points as well while it
+// waits for the ring.
+//
+// Waiting sides block on a counter in the
+// segment: posted moves with every batch and
+// at shutdown, pushed with every result.
+//
+
+#include "../inc/shared.h"
+
+extern char** environ;
+
+#define NDFIT_POOL_MAGIC "NDFITPL"
+#define NDFIT_POOL_NAME  256
+#define NDFIT_POOL_ERROR 1024
+#define NDFIT_POOL_ALIGN 64
+#define NDFIT_POOL_MASK  0xffffffffLL
+#define NDFIT_POOL_HALT  0x40000000LL
+
+// Longest single wait (ns), so waiters still look for signals and 
+// dead workers or parents, and the first and last nap of the backoff
+// where there is no futex
+#define NDFIT_POOL_NAP   10000000L
+#define NDFIT_POOL_NAP0  50000L
+#define NDFIT_POOL_NAP1  2000000L
+
+// How the workers hand the data to the error function
+#define NDFIT_FORM_ROWS    0
+#define NDFIT_FORM_DATASET 1
+#define NDFIT_FORM_ARRAY   2
+
+// One result in the ring. seq is pos+1 once slot pos is written.
+typedef struct ndfit_slot{
+	_Atomic uint64_t seq;
+	int64_t index;
+	double entropy;
+	int64_t status;
+} ndfit_slot;
+
+// Head of the segment. Offsets are in bytes from the start.
+typedef struct ndfit_shared{
+	char magic[8];
+	int64_t parent;
+	int64_t process;
+	int64_t nrows;
+	int64_t ncols;
+	int64_t ndim;
+	int64_t dim;
+	int64_t datalen;
+	int64_t slots;
+	int64_t vectorized;
+	int64_t reduction;
+	int64_t form;
+	int64_t nconsts;
+	int64_t consts;
+	int64_t columns;
+	int64_t tasks;
+	int64_t ring;
+	char module[NDFIT_POOL_NAME];
+	char qualname[NDFIT_POOL_NAME];
+	_Atomic int64_t batch;
+	_Atomic int64_t next;
+	_Atomic uint64_t tail;
+	_Atomic int32_t shutdown;
+	_Atomic int32_t failed;
+	_Atomic uint32_t posted;
+	_Atomic uint32_t pushed;
+	char error[NDFIT_POOL_ERROR];
+} ndfit_shared;
+
+struct ndfit_pool{
+	ndfit_shared* sh;
+	size_t size;
+	char name[64];
+	pid_t* pids;
+	int n;
+	int64_t epoch;
+	uint64_t head;
+	PyObject* points;
+	Py_ssize_t count;
+	double checked;
+	int backend;
+	_Atomic int running;
+	PyObject* objects;
+	ndfit_trace* trace;
+	PyInterpreterState* interp;
+	char* path;
+};
+
+static void ndfit_pool_thread(void* arg);
+#if PY_VERSION_HEX >= 0x030C0000
+static void ndfit_pool_interpreter(void* arg);
+#endif
+
+static inline size_t ndfit_pool_align(size_t n){
+	return (n+NDFIT_POOL_ALIGN-1) & ~(size_t)(NDFIT_POOL_ALIGN-1);
+}
+
+static inline double* ndfit_pool_tasks(ndfit_shared* sh){
+	return (double*)((char*)sh+sh->tasks);
+}
+
+static inline ndfit_slot* ndfit_pool_ring(ndfit_shared* sh){
+	return (ndfit_slot*)((char*)sh+sh->ring);
+}
+
+// Wait for *word to move on from seen, which the caller read before
+// it found nothing to do: spin a little and yield, as results often 
+// come soon, then block on the word. Linux has futexes, which work 
+// across processes on the shared segment; elsewhere the naps double 
+// up to NDFIT_POOL_NAP1. Returns spuriously, so callers loop.
+static void ndfit_pool_wait(_Atomic uint32_t* word, uint32_t seen, unsigned* spins){
+	*spins += 1;
+	if(*spins<64){return;}
+	if(*spins<256){sched_yield(); return;}
+#ifdef __linux__
+	struct timespec ts = {0,NDFIT_POOL_NAP};
+	syscall(SYS_futex,(uint32_t*)word,FUTEX_WAIT,seen,&ts,NULL,0);
+#else
+	(void)word;
+	(void)seen;
+	long nap = NDFIT_POOL_NAP0;
+	unsigned k;
+	for(k=256;k<*spins && nap<NDFIT_POOL_NAP1;k+=1){nap *= 2;}
+	struct timespec ts = {0,nap<NDFIT_POOL_NAP1 ? nap : NDFIT_POOL_NAP1};
+	nanosleep(&ts,NULL);
+#endif
+}
+
+// Move *word on and wake everyone waiting on it
+static void ndfit_pool_wake(_Atomic uint32_t* word){
+	atomic_fetch_add(word,1);
+#ifdef __linux__
+	syscall(SYS_futex,(uint32_t*)word,FUTEX_WAKE,INT_MAX,NULL,NULL,0);
+#endif
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~ ERROR FUNCTION LOOKUP ~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+// Import module and walk the dotted qualname. New reference.
+static PyObject* ndfit_pool_lookup(const char* module, const char* qualname){
+
+	PyObject* obj = PyImport_ImportModule(module);
+	char* name = PyMem_Malloc(strlen(qualname)+1);
+	if(obj==NULL || name==NULL){Py_XDECREF(obj); PyMem_Free(name); return NULL;}
+	strcpy(name,qualname);
+
+	char* save = NULL;
+	char* part;
+	for(part=strtok_r(name,".",&save); part!=NULL && obj!=NULL; part=strtok_r(NULL,".",&save)){
+		Py_SETREF(obj,PyObject_GetAttrString(obj,part));
+	}
+	PyMem_Free(name);
+	return obj;
+}
+
+// Worker processes find the error function by name: "module:qualname"
+// or the __module__ and __qualname__ of a callable. The name has to
+// lead back to the same function from a fresh interpreter. On success
+// st->errname is (module, qualname) and st->errfunc is the function.
+int ndfit_pool_resolve(ndfit_state* st){
+
+	PyObject* module = NULL;
+	PyObject* qualname = NULL;
+	PyObject* found = NULL;
+	int status = -1;
+
+	if(PyUnicode_Check(st->errfunc)){
+		PyObject* sep = PyUnicode_FromString(":");
+		PyObject* parts = sep ? PyUnicode_Split(st->errfunc,sep,1) : NULL;
+		Py_XDECREF(sep);
+		if(parts==NULL){return -1;}
+		if(PyList_Size(parts)!=2){
+			Py_DECREF(parts);
+			PyErr_SetString(ndfitError,"Error function names look like \"module:qualname\"");
+			return -1;
+		}
+		module = PyList_GetItem(parts,0);
+		qualname = PyList_GetItem(parts,1);
+		Py_INCREF(module);
+		Py_INCREF(qualname);
+		Py_DECREF(parts);
+	}
+	else{
+		module = PyObject_GetAttrString(st->errfunc,"__module__");
+		qualname = PyObject_GetAttrString(st->errfunc,"__qualname__");
+		if(module==NULL || qualname==NULL || !PyUnicode_Check(module) || !PyUnicode_Check(qualname)){
+			PyErr_Clear();
+			PyErr_SetString(ndfitError,"workers need an error function with a module path");
+			goto done;
+		}
+	}
+
+	const char* m = PyUnicode_AsUTF8(module);
+	const char* q = PyUnicode_AsUTF8(qualname);
+	if(m==NULL || q==NULL){goto done;}
+	if(strlen(m)>=NDFIT_POOL_NAME || strlen(q)>=NDFIT_POOL_NAME){
+		PyErr_SetString(ndfitError,"Error function module path is too long");
+		goto done;
+	}
+	if(!strcmp(m,"__main__") || strchr(q,'<')!=NULL){
+		PyErr_Format(ndfitError,"workers can not import %s.%s: define the error function "
+			"at the top level of an importable module",m,q);
+		goto done;
+	}
+
+	found = ndfit_pool_lookup(m,q);
+	if(found==NULL){goto done;}
+	if(PyUnicode_Check(st->errfunc)){
+		Py_SETREF(st->errfunc,found);
+		found = NULL;
+	}
+	else if(found!=st->errfunc && PyObject_RichCompareBool(found,st->errfunc,Py_EQ)!=1){
+		PyErr_Clear();
+		PyErr_Format(ndfitError,"%s.%s is not the error function handed to run()",m,q);
+		goto done;
+	}
+	st->errname = PyTuple_Pack(2,module,qualname);
+	status = (st->errname==NULL) ? -1 : 0;
+
+done:
+	Py_XDECREF(module);
+	Py_XDECREF(qualname);
+	Py_XDECREF(found);
+	return status;
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~~ PARENT SIDE ~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+// The parent's sys.path joined by ":", so workers find the same 
+// modules. New reference to bytes.
+static PyObject* ndfit_pool_path(void){
+	PyObject* path = NULL;
+	PyObject* syspath = PySys_GetObject("path");
+	PyObject* sep = PyUnicode_FromString(":");
+	if(syspath!=NULL && sep!=NULL){
+		PyObject* joined = PyUnicode_Join(sep,syspath);
+		if(joined!=NULL){PyUnicode_FSConverter(joined,&path); Py_DECREF(joined);}
+	}
+	Py_XDECREF(sep);
+	return path;
+}
+
+// Start one worker: sys.executable -c "import ndfit; ndfit._worker(name)"
+// with the parent's sys.path as PYTHONPATH
+static int ndfit_pool_spawn(ndfit_pool* pool){
+
+	int i, k, n = 0;
+	int status = -1;
+	PyObject* exe = NULL;
+	PyObject* path = NULL;
+	char** envp = NULL;
+	char* pythonpath = NULL;
+	char code[160];
+
+	PyObject* executable = PySys_GetObject("executable");
+	if(executable==NULL || !PyUnicode_Check(executable) || PyUnicode_GetLength(executable)==0){
+		PyErr_SetString(ndfitError,"workers need sys.executable");
+		return -1;
+	}
+	if(!PyUnicode_FSConverter(executable,&exe)){return -1;}
+
+	path = ndfit_pool_path();
+	if(path==NULL){goto done;}
+
+	const char* p = PyBytes_AS_STRING(path);
+	pythonpath = PyMem_Malloc(strlen(p)+12);
+	while(environ[n]!=NULL){n+=1;}
+	envp = PyMem_Malloc(sizeof(char*)*(n+2));
+	if(pythonpath==NULL || envp==NULL){PyErr_NoMemory(); goto done;}
+	sprintf(pythonpath,"PYTHONPATH=%s",p);
+	for(i=0,k=0;i<n;i+=1){
+		if(strncmp(environ[i],"PYTHONPATH=",11)){envp[k++] = environ[i];}
+	}
+	envp[k++] = pythonpath;
+	envp[k] = NULL;
+
+	snprintf(code,sizeof(code),"import ndfit; ndfit._worker('%s')",pool->name);
+	char* argv[] = {PyBytes_AS_STRING(exe),"-c",code,NULL};
+	for(i=0;i<pool->n;i+=1){
+		int err = posix_spawn(&pool->pids[i],PyBytes_AS_STRING(exe),NULL,NULL,argv,envp);
+		if(err!=0){
+			pool->pids[i] = 0;
+			PyErr_Format(ndfitError,"Unable to start worker process: %s",strerror(err));
+			goto done;
+		}
+	}
+	status = 0;
+
+done:
+	Py_XDECREF(exe);
+	Py_XDECREF(path);
+	PyMem_Free(envp);
+	PyMem_Free(pythonpath);
+	return status;
+}
+
+// Put the data, consts and names into the segment and start the
+// workers. Threads share the objects of the fit instead, so their
+// segment only holds the tasks and the ring. Subinterpreters get
+// the sys.path besides. Called once the probe has sized the data.
+int ndfit_pool_start(ndfit_state* st){
+
+	static _Atomic unsigned counter = 0;
+	Py_ssize_t i;
+	PyObject* ds = NULL;
+	PyObject* pickled = NULL;
+	ndDataset* d = NULL;
+	int status = -1;
+	int fd = -1;
+
+	ndfit_pool* pool = PyMem_Calloc(1,sizeof(ndfit_pool));
+	if(pool==NULL){PyErr_NoMemory(); return -1;}
+	pool->n = st->workers;
+	pool->backend = st->backend;
+	pool->trace = (st->backend==NDFIT_THREADS) ? st->trace : NULL;
+	pool->interp = PyInterpreterState_Get();
+	pool->pids = PyMem_Calloc(pool->n,sizeof(pid_t));
+	if(pool->pids==NULL){PyMem_Free(pool); PyErr_NoMemory(); return -1;}
+	atomic_init(&pool->running,0);
+	st->pool = pool;
+
+	if(pool->backend==NDFIT_THREADS){
+		pool->objects = PyTuple_Pack(3,st->errfunc,st->data,st->consts);
+		if(pool->objects==NULL){goto done;}
+	}
+	else{
+		// The data as float64 columns
+		if(PyObject_TypeCheck(st->data,ndfit_module()->dataset_type)){
+			Py_INCREF(st->data);
+			ds = st->data;
+		}
+		else{
+			ds = PyObject_CallFunctionObjArgs((PyObject*)ndfit_module()->dataset_type,st->data,NULL);
+			if(ds==NULL){
+				PyErr_SetString(ndfitError,"workers need numeric data (a buffer, a list of rows or a Dataset)");
+				goto done;
+			}
+		}
+		d = (ndDataset*)ds;
+
+		PyObject* pickle = PyImport_ImportModule("pickle");
+		if(pickle==NULL){goto done;}
+		pickled = PyObject_CallMethod(pickle,"dumps","O",st->consts);
+		Py_DECREF(pickle);
+		if(pickled==NULL){goto done;}
+	}
+	if(pool->backend==NDFIT_INTERPRETERS){
+		PyObject* path = ndfit_pool_path();
+		if(path==NULL){goto done;}
+		pool->path = PyMem_RawMalloc(PyBytes_GET_SIZE(path)+1);
+		if(pool->path!=NULL){strcpy(pool->path,PyBytes_AS_STRING(path));}
+		Py_DECREF(path);
+		if(pool->path==NULL){PyErr_NoMemory(); goto done;}
+	}
+
+	// Lay out the segment: head, consts, columns, tasks, ring. Every
+	// sweep fits in the task table, the full lattice being the largest.
+	int64_t slots = (int64_t)pow(2,st->dim)+2*st->dim;
+	size_t consts = ndfit_pool_align(sizeof(ndfit_shared));
+	size_t columns = consts+ndfit_pool_align(pickled ? PyBytes_GET_SIZE(pickled) : 0);
+	size_t tasks = columns+ndfit_pool_align(d ? sizeof(double)*d->nrows*d->ncols : 0);
+	size_t ring = tasks+ndfit_pool_align(sizeof(double)*slots*st->dim);
+	pool->size = ring+sizeof(ndfit_slot)*slots;
+
+	// Processes need POSIX shared memory, threads and subinterpreters
+	// plain memory
+	void* base;
+	if(pool->backend==NDFIT_PROCESSES){
+		snprintf(pool->name,sizeof(pool->name),"/ndfit-%ld-%u",(long)getpid(),atomic_fetch_add(&counter,1));
+		fd = shm_open(pool->name,O_RDWR|O_CREAT|O_EXCL,0600);
+		if(fd<0 || ftruncate(fd,pool->size)<0){
+			PyErr_Format(ndfitError,"Unable to create shared memory %s: %s",pool->name,strerror(errno));
+			goto done;
+		}
+		base = mmap(NULL,pool->size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+		if(base==MAP_FAILED){
+			PyErr_Format(ndfitError,"Unable to map shared memory: %s",strerror(errno));
+			goto done;
+		}
+	}
+	else{
+		base = PyMem_RawCalloc(1,pool->size);
+		if(base==NULL){PyErr_NoMemory(); goto done;}
+	}
+	ndfit_shared* sh = pool->sh = base;
+
+	memcpy(sh->magic,NDFIT_POOL_MAGIC,8);
+	sh->parent = (int64_t)getpid();
+	sh->process = (pool->backend==NDFIT_PROCESSES);
+	sh->dim = st->dim;
+	sh->datalen = st->datalen;
+	sh->slots = slots;
+	sh->vectorized = st->vectorized;
+	sh->reduction = st->reduction;
+	sh->consts = consts;
+	sh->columns = columns;
+	sh->tasks = tasks;
+	sh->ring = ring;
+	if(d!=NULL){
+		sh->nrows = d->nrows;
+		sh->ncols = d->ncols;
+		sh->ndim = d->ndim;
+		if(!st->vectorized){sh->form = NDFIT_FORM_ROWS;}
+		else if(PyObject_TypeCheck(st->data,ndfit_module()->dataset_type)){sh->form = NDFIT_FORM_DATASET;}
+		else if(PyObject_CheckBuffer(st->data)){sh->form = NDFIT_FORM_ARRAY;}
+		else{sh->form = NDFIT_FORM_ROWS;}
+		sh->nconsts = PyBytes_GET_SIZE(pickled);
+		strcpy(sh->module,PyUnicode_AsUTF8(PyTuple_GET_ITEM(st->errname,0)));
+		strcpy(sh->qualname,PyUnicode_AsUTF8(PyTuple_GET_ITEM(st->errname,1)));
+		memcpy((char*)sh+consts,PyBytes_AS_STRING(pickled),sh->nconsts);
+		memcpy((char*)sh+columns,d->columns,sizeof(double)*d->nrows*d->ncols);
+	}
+	for(i=0;i<slots;i+=1){atomic_init(&ndfit_pool_ring(sh)[i].seq,0);}
+	atomic_init(&sh->batch,0);
+	atomic_init(&sh->next,NDFIT_POOL_HALT);
+	atomic_init(&sh->tail,0);
+	atomic_init(&sh->shutdown,0);
+	atomic_init(&sh->failed,0);
+	atomic_init(&sh->posted,0);
+	atomic_init(&sh->pushed,0);
+
+	if(pool->backend==NDFIT_PROCESSES){
+		status = ndfit_pool_spawn(pool);
+		goto done;
+	}
+	void (*body)(void*) = ndfit_pool_thread;
+#if PY_VERSION_HEX >= 0x030C0000
+	if(pool->backend==NDFIT_INTERPRETERS){body = ndfit_pool_interpreter;}
+#endif
+	for(i=0;i<pool->n;i+=1){
+		atomic_fetch_add(&pool->running,1);
+		if(PyThread_start_new_thread(body,pool)==PYTHREAD_INVALID_THREAD_ID){
+			atomic_fetch_sub(&pool->running,1);
+			PyErr_SetString(ndfitError,"Unable to start worker thread");
+			goto done;
+		}
+	}
+	status = 0;
+
+done:
+	if(fd>=0){close(fd);}
+	Py_XDECREF(ds);
+	Py_XDECREF(pickled);
+	return status;
+}
+
+// Ask the workers to leave and wait for them. Processes which hang on
+// in an error function are killed, threads have to finish theirs.
+void ndfit_pool_stop(ndfit_pool* pool){
+
+	int i;
+	if(pool==NULL){return;}
+	if(pool->sh!=NULL){
+		atomic_store(&pool->sh->shutdown,1);
+		ndfit_pool_wake(&pool->sh->posted);
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	double start = ndfit_clock();
+	for(i=0;i<pool->n;i+=1){
+		if(pool->pids[i]<=0){continue;}
+		while(waitpid(pool->pids[i],NULL,WNOHANG)==0){
+			if(ndfit_clock()-start>2.0){
+				kill(pool->pids[i],SIGKILL);
+				waitpid(pool->pids[i],NULL,0);
+				break;
+			}
+			struct timespec ts = {0,1000000};
+			nanosleep(&ts,NULL);
+		}
+	}
+	while(atomic_load(&pool->running)>0){
+		struct timespec ts = {0,1000000};
+		nanosleep(&ts,NULL);
+	}
+	Py_END_ALLOW_THREADS
+
+	if(pool->backend==NDFIT_PROCESSES){
+		if(pool->sh!=NULL){munmap(pool->sh,pool->size);}
+		if(pool->name[0]){shm_unlink(pool->name);}
+	}
+	else{
+		PyMem_RawFree(pool->sh);
+	}
+	PyMem_RawFree(pool->path);
+	Py_XDECREF(pool->objects);
+	PyMem_Free(pool->pids);
+	PyMem_Free(pool);
+}
+
+// Fail if a worker died. Parked workers never exit on their own.
+static int ndfit_pool_alive(ndfit_pool* pool){
+	int i, code;
+	for(i=0;i<pool->n;i+=1){
+		if(pool->pids[i]>0 && waitpid(pool->pids[i],&code,WNOHANG)==pool->pids[i]){
+			PyErr_Format(ndfitError,"Worker process %d exited (status %d)",(int)pool->pids[i],code);
+			pool->pids[i] = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Publish the points of a sweep (a list of params lists, which must
+// stay alive until every result is taken) as a new batch
+int ndfit_pool_post(ndfit_pool* pool, PyObject* points){
+
+	Py_ssize_t i, j;
+	ndfit_shared* sh = pool->sh;
+	Py_ssize_t n = PyList_Size(points);
+	double* tasks = ndfit_pool_tasks(sh);
+	if(n>sh->slots){
+		PyErr_SetString(ndfitError,"Sweep is larger than the task table");
+		return -1;
+	}
+	for(i=0;i<n;i+=1){
+		PyObject* p = PyList_GetItem(points,i);
+		for(j=0;j<sh->dim;j+=1){tasks[i*sh->dim+j] = PyFloat_AsDouble(PyList_GetItem(p,j));}
+	}
+	if(PyErr_Occurred()){return -1;}
+
+	pool->epoch += 1;
+	pool->points = points;
+	pool->count = n;
+	atomic_store(&sh->batch,(pool->epoch<<32)|n);
+	atomic_store(&sh->next,pool->epoch<<32);
+	ndfit_pool_wake(&sh->posted);
+	return 0;
+}
+
+// Stop handing out points of the current batch. Returns how many were
+// claimed, i.e. how many results are still to be taken in all.
+Py_ssize_t ndfit_pool_halt(ndfit_pool* pool){
+	int64_t old = atomic_exchange(&pool->sh->next,(pool->epoch<<32)|NDFIT_POOL_HALT);
+	int64_t claimed = old & NDFIT_POOL_MASK;
+	return (claimed<pool->count) ? claimed : pool->count;
+}
+
+// Take the next result of the batch: from the ring if one is there,
+// else by evaluating an unclaimed point here. Returns 1 for a local
+// evaluation (already counted in st->evals), 0 for a worker's and -1
+// with an exception set. Time spent waiting on the workers is traced
+// as one "wait" span.
+static int ndfit_pool_result(ndfit_state* st, Py_ssize_t* index, double* entropy, int* waited);
+
+int ndfit_pool_take(ndfit_state* st, Py_ssize_t* index, double* entropy){
+	int waited = 0;
+	int status = ndfit_pool_result(st,index,entropy,&waited);
+	if(waited){NDFIT_TRACE(st,"wait",'E');}
+	return status;
+}
+
+static int ndfit_pool_result(ndfit_state* st, Py_ssize_t* index, double* entropy, int* waited){
+
+	ndfit_pool* pool = st->pool;
+	ndfit_shared* sh = pool->sh;
+	ndfit_slot* ring = ndfit_pool_ring(sh);
+	unsigned spins = 0;
+
+	for(;;){
+		uint32_t pushed = atomic_load(&sh->pushed);
+		ndfit_slot* s = &ring[pool->head % sh->slots];
+		if(atomic_load_explicit(&s->seq,memory_order_acquire)==pool->head+1){
+			pool->head += 1;
+			if(s->status!=0){
+				PyErr_Format(ndfitError,"Error function raised in a worker: %s",sh->error);
+				return -1;
+			}
+			*index = (Py_ssize_t)s->index;
+			*entropy = s->entropy;
+			return 0;
+		}
+
+		int64_t claim = atomic_fetch_add(&sh->next,1);
+		int64_t i = claim & NDFIT_POOL_MASK;
+		if((claim>>32)==pool->epoch && i<pool->count){
+			double e = ndfit_evaluate(st,PyList_GetItem(pool->points,i));
+			if(e<0.0){return -1;}
+			*index = (Py_ssize_t)i;
+			*entropy = e;
+			return 1;
+		}
+
+		// Everything is claimed: wait for the workers
+		if(PyErr_CheckSignals()<0){return -1;}
+		double now = ndfit_clock();
+		if(now-pool->checked>0.1){
+			pool->checked = now;
+			if(ndfit_pool_alive(pool)<0){return -1;}
+		}
+		if(!*waited){
+			NDFIT_TRACE(st,"wait",'B');
+			*waited = 1;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		ndfit_pool_wait(&sh->pushed,pushed,&spins);
+		Py_END_ALLOW_THREADS
+	}
+}
+
+/////////////////////////////////////////////////////////
+// ~~~~~~~~~~~~~~~~~~ WORKER SIDE ~~~~~~~~~~~~~~~~~~~~ //
+/////////////////////////////////////////////////////////
+// Hand a result to the parent. Producers reserve a position with
+// fetch_add and publish the slot with its sequence number.
+static void ndfit_pool_push(ndfit_shared* sh, int64_t index, double entropy, int64_t status){
+	uint64_t pos = atomic_fetch_add(&sh->tail,1);
+	ndfit_slot* s = &ndfit_pool_ring(sh)[pos % sh->slots];
+	s->index = index;
+	s->entropy = entropy;
+	s->status = status;
+	atomic_store_explicit(&s->seq,pos+1,memory_order_release);
+	ndfit_pool_wake(&sh->pushed);
+}
+
+// Keep the first error raised by any worker for the parent to report.
+// Returns 1 if this was the first.
+static int ndfit_pool_fail(ndfit_shared* sh){
+
+	PyObject *type, *value, *tb;
+	PyErr_Fetch(&type,&value,&tb);
+	PyErr_NormalizeException(&type,&value,&tb);
+	int32_t expected = 0;
+	int first = atomic_compare_exchange_strong(&sh->failed,&expected,1);
+	if(first){
+		PyObject* text = value ? PyObject_Str(value) : NULL;
+		const char* msg = text ? PyUnicode_AsUTF8(text) : NULL;
+		if(type==NULL){snprintf(sh->error,NDFIT_POOL_ERROR,"worker failed to start");}
+		else{snprintf(sh->error,NDFIT_POOL_ERROR,"%s: %s",((PyTypeObject*)type)->tp_name,msg ? msg : "");}
+		Py_XDECREF(text);
+	}
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(tb);
+	PyErr_Clear();
+	return first;
+}
+
+// Rows as the parent hands them to a row by row error function
+static PyObject* ndfit_pool_rows(ndfit_shared* sh){
+
+	Py_ssize_t i, j;
+	const double* columns = (const double*)((char*)sh+sh->columns);
+	PyObject* rows = PyList_New(sh->nrows);
+	if(rows==NULL){return NULL;}
+	for(i=0;i<sh->nrows;i+=1){
+		PyObject* row;
+		if(sh->ndim==1){
+			row = PyFloat_FromDouble(columns[i]);
+		}
+		else{
+			row = PyTuple_New(sh->ncols);
+			for(j=0;row!=NULL && j<sh->ncols;j+=1){
+				PyTuple_SET_ITEM(row,j,PyFloat_FromDouble(columns[j*sh->nrows+i]));
+			}
+		}
+		if(row==NULL){Py_DECREF(rows); return NULL;}
+		PyList_SET_ITEM(rows,i,row);
+	}
+	return rows;
+}
+
+// A read-only numpy view of the columns, (rows, cols) in Fortran order
+static PyObject* ndfit_pool_array(ndfit_shared* sh){
+
+	PyObject* numpy = PyImport_ImportModule("numpy");
+	PyObject* mem = PyMemoryView_FromMemory((char*)sh+sh->columns,
+		sizeof(double)*sh->nrows*sh->ncols,PyBUF_READ);
+	PyObject* flat = NULL;
+	PyObject* array = NULL;
+	if(numpy!=NULL && mem!=NULL){flat = PyObject_CallMethod(numpy,"frombuffer","O",mem);}
+	if(flat!=NULL && sh->ndim==1){Py_INCREF(flat); array = flat;}
+	else if(flat!=NULL){
+		PyObject* shaped = PyObject_CallMethod(flat,"reshape","nn",(Py_ssize_t)sh->ncols,(Py_ssize_t)sh->nrows);
+		if(shaped!=NULL){array = PyObject_GetAttrString(shaped,"T"); Py_DECREF(shaped);}
+	}
+	Py_XDECREF(numpy);
+	Py_XDECREF(mem);
+	Py_XDECREF(flat);
+	return array;
+}
+
+// Rebuild the inputs of the fit from the segment: the error function
+// by name, the consts by unpickling and the data the way the parent's
+// error function sees it.
+static int ndfit_pool_open(ndfit_state* st, ndfit_shared* sh){
+
+	memset(st,0,sizeof(ndfit_state));
+	st->dim = sh->dim;
+	st->datalen = sh->datalen;
+	st->vectorized = (int)sh->vectorized;
+	st->reduction = (int)sh->reduction;
+
+	PyObject* pickle = PyImport_ImportModule("pickle");
+	PyObject* pickled = PyBytes_FromStringAndSize((char*)sh+sh->consts,(Py_ssize_t)sh->nconsts);
+	if(pickle!=NULL && pickled!=NULL){st->consts = PyObject_CallMethod(pickle,"loads","O",pickled);}
+	Py_XDECREF(pickle);
+	Py_XDECREF(pickled);
+	if(st->consts==NULL){return -1;}
+
+	st->errfunc = ndfit_pool_lookup(sh->module,sh->qualname);
+	if(st->errfunc==NULL){return -1;}
+
+	if(sh->form==NDFIT_FORM_DATASET){
+		st->data = ndfit_dataset_wrap((double*)((char*)sh+sh->columns),sh->nrows,sh->ncols,(int)sh->ndim);
+	}
+	else if(sh->form!=NDFIT_FORM_ROWS){st->data = ndfit_pool_array(sh);}
+	else{st->data = ndfit_pool_rows(sh);}
+	return (st->data==NULL) ? -1 : 0;
+}
+
+// Evaluate points of the batches the parent posts until it shuts the
+// pool down or (for processes) goes away
+static void ndfit_pool_serve(ndfit_state* st, ndfit_shared* sh){
+
+	Py_ssize_t j;
+	int64_t seen = 0;
+	unsigned spins = 0;
+	double* tasks = ndfit_pool_tasks(sh);
+
+	while(!atomic_load(&sh->shutdown) && (!sh->process || getppid()==(pid_t)sh->parent)){
+
+		uint32_t posted = atomic_load(&sh->posted);
+		int64_t batch = atomic_load(&sh->batch);
+		if((batch>>32)==seen){
+			Py_BEGIN_ALLOW_THREADS
+			ndfit_pool_wait(&sh->posted,posted,&spins);
+			Py_END_ALLOW_THREADS
+			continue;
+		}
+		seen = batch>>32;
+		spins = 0;
+
+		for(;;){
+			int64_t claim = atomic_fetch_add(&sh->next,1);
+			int64_t now = atomic_load(&sh->batch);
+			int64_t i = claim & NDFIT_POOL_MASK;
+
+			// next still belongs to the previous batch: the parent is
+			// between publishing the batch and resetting next
+			if((claim>>32)<(now>>32)){continue;}
+			if((claim>>32)!=(now>>32) || i>=(now & NDFIT_POOL_MASK)){break;}
+
+			PyObject* params = PyList_New(sh->dim);
+			for(j=0;params!=NULL && j<sh->dim;j+=1){
+				PyList_SET_ITEM(params,j,PyFloat_FromDouble(tasks[i*sh->dim+j]));
+			}
+			double e = (params==NULL) ? -1.0 : ndfit_evaluate(st,params);
+			Py_XDECREF(params);
+			if(e<0.0){ndfit_pool_fail(sh);}
+			ndfit_pool_push(sh,i,e,(e<0.0));
+		}
+	}
+}
+
+// Body of a worker thread: call the fit's own error function
+static void ndfit_pool_thread(void* arg){
+
+	ndfit_pool* pool = arg;
+	ndfit_shared* sh = pool->sh;
+	ndfit_state st;
+	PyThreadState* ts = ndfit_thread_enter(pool->interp);
+
+	memset(&st,0,sizeof(ndfit_state));
+	st.dim = sh->dim;
+	st.datalen = sh->datalen;
+	st.vectorized = (int)sh->vectorized;
+	st.reduction = (int)sh->reduction;
+	st.errfunc = PyTuple_GET_ITEM(pool->objects,0);
+	st.data = PyTuple_GET_ITEM(pool->objects,1);
+	st.consts = PyTuple_GET_ITEM(pool->objects,2);
+	st.trace = pool->trace;
+	Py_INCREF(st.errfunc);
+	Py_INCREF(st.data);
+	Py_INCREF(st.consts);
+	ndfit_pool_serve(&st,sh);
+	ndfit_release(&st);
+
+	ndfit_thread_leave(ts);
+	atomic_fetch_sub(&pool->running,1);
+}
+
+#if PY_VERSION_HEX >= 0x030C0000
+// Give a worker's own interpreter the parent's sys.path and import
+// ndfit there, which sets up the module state the fit code uses
+static int ndfit_pool_enter(const char* path){
+	PyObject* text = PyUnicode_DecodeFSDefault(path);
+	PyObject* sep = PyUnicode_FromString(":");
+	PyObject* list = (text!=NULL && sep!=NULL) ? PyUnicode_Split(text,sep,-1) : NULL;
+	int status = (list!=NULL) ? PySys_SetObject("path",list) : -1;
+	Py_XDECREF(text);
+	Py_XDECREF(sep);
+	Py_XDECREF(list);
+	if(status<0){return -1;}
+	PyObject* module = PyImport_ImportModule("ndfit");
+	Py_XDECREF(module);
+	return (module==NULL) ? -1 : 0;
+}
+
+// Body of a worker thread with an interpreter and a GIL of its own.
+// The thread holds no thread state of the parent's interpreter, so 
+// the new interpreter's becomes the thread's (PyGILState included).
+// It takes the settings of the main interpreter and rebuilds the 
+// inputs from the segment as a worker process would.
+static void ndfit_pool_interpreter(void* arg){
+
+	ndfit_pool* pool = arg;
+	ndfit_shared* sh = pool->sh;
+	ndfit_state st;
+	PyThreadState* ts = NULL;
+	PyInterpreterConfig config = {
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+
+	PyStatus status = Py_NewInterpreterFromConfig(&ts,&config);
+	if(PyStatus_Exception(status) || ts==NULL){
+		int32_t expected = 0;
+		if(atomic_compare_exchange_strong(&sh->failed,&expected,1)){
+			snprintf(sh->error,NDFIT_POOL_ERROR,"Unable to create a subinterpreter: %s",
+				status.err_msg ? status.err_msg : "out of memory");
+			ndfit_pool_push(sh,0,-1.0,1);
+		}
+		atomic_fetch_sub(&pool->running,1);
+		return;
+	}
+
+	memset(&st,0,sizeof(ndfit_state));
+	if(ndfit_pool_enter(pool->path)<0 || ndfit_pool_open(&st,sh)<0){
+		if(ndfit_pool_fail(sh)){ndfit_pool_push(sh,0,-1.0,1);}
+	}
+	else{
+		ndfit_pool_serve(&st,sh);
+	}
+	ndfit_release(&st);
+
+	Py_EndInterpreter(ts);
+	atomic_fetch_sub(&pool->running,1);
+}
+#endif
+
+// ndfit._worker(name): the body of a worker process
+PyObject* ndfit_pool_worker(PyObject* self, PyObject* args){
+
+	const char* name;
+	struct stat info;
+	ndfit_state st;
+	if(!PyArg_ParseTuple(args,"s",&name)){return NULL;}
+
+	// Interrupts are the parent's to handle; it shuts us down
+	signal(SIGINT,SIG_IGN);
+
+	int fd = shm_open(name,O_RDWR,0);
+	if(fd<0 || fstat(fd,&info)<0){
+		if(fd>=0){close(fd);}
+		return PyErr_Format(ndfitError,"Unable to open shared memory %s: %s",name,strerror(errno));
+	}
+	void* base = mmap(NULL,info.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if(base==MAP_FAILED){
+		return PyErr_Format(ndfitError,"Unable to map shared memory: %s",strerror(errno));
+	}
+	ndfit_shared* sh = base;
+	if(memcmp(sh->magic,NDFIT_POOL_MAGIC,8)){
+		munmap(base,info.st_size);
+		return PyErr_Format(ndfitError,"%s is not an ndfit pool",name);
+	}
+
+	// A worker which can not start up fails the parent's next batch
+	if(ndfit_pool_open(&st,sh)<0){
+		if(ndfit_pool_fail(sh)){ndfit_pool_push(sh,0,-1.0,1);}
+	}
+	else{
+		ndfit_pool_serve(&st,sh);
+	}
+
+	ndfit_release(&st);
+	munmap(base,info.st_size);
+	Py_RETURN_NONE;
+}
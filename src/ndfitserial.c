@@ -0,0 +1,363 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Include Libraries
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../inc/shared.h"
+
+//////////////////////////////////////////////
+// Compact results: an ndFit as bytes for
+// pickling, worker pools and files. All
+// numbers are in native byte order:
+//
+//   magic "NDFITRS\0", int32 version
+//   int32  flags (1 truncated, 2 whole history)
+//   int64  steps dim nconsts
+//   double consts[nconsts]
+//   steps x (double entropy, double params[dim])
+//
+// Without the whole history only the final
+// step is stored. ndFit.from_bytes keeps a
+// view of the buffer it is given and only
+// builds pList when something asks for it.
+//
+
+#define NDFIT_RS_MAGIC   "NDFITRS"
+#define NDFIT_RS_VERSION 1
+#define NDFIT_RS_HEADER  40
+
+#define NDFIT_RS_TRUNCATED 1
+#define NDFIT_RS_HISTORY   2
+
+// Build pList from the stored history
+static PyObject* ndfit_serial_unpack(ndFit* self){
+
+	Py_ssize_t i,j;
+	double v;
+	const char* p = (const char*)PyMemoryView_GET_BUFFER(self->store)->buf+self->offset;
+	PyObject* plist = PyList_New(self->steps);
+	if(plist==NULL){return NULL;}
+	for(i=0;i<self->steps;i+=1){
+		PyObject* params = PyList_New(self->dim);
+		if(params==NULL){Py_DECREF(plist); return NULL;}
+		for(j=0;j<self->dim;j+=1){
+			memcpy(&v,p+sizeof(double)*(1+j),sizeof(v));
+			PyList_SET_ITEM(params,j,PyFloat_FromDouble(v));
+		}
+		memcpy(&v,p,sizeof(v));
+		PyObject* step = Py_BuildValue("(dN)",v,params);
+		if(step==NULL){Py_DECREF(plist); return NULL;}
+		PyList_SET_ITEM(plist,i,step);
+		p += sizeof(double)*(1+self->dim);
+	}
+	return plist;
+}
+
+// pList of a fit, built from the stored history by fits loaded with
+// from_bytes. Borrowed, NULL with an exception set on failure.
+PyObject* ndfit_fit_plist(ndFit* self){
+
+	PyObject* plist;
+	NDFIT_BEGIN_CRITICAL(self)
+	if(self->pList==NULL && self->store!=NULL){self->pList = ndfit_serial_unpack(self);}
+	plist = self->pList;
+	NDFIT_END_CRITICAL()
+	if(plist==NULL && !PyErr_Occurred()){PyErr_SetString(ndfitError,"Fit has no result");}
+	return plist;
+}
+
+PyObject* ndfit_fit_getplist(ndFit* self, void* closure){
+
+	PyObject* plist = ndfit_fit_plist(self);
+	Py_XINCREF(plist);
+	return plist;
+}
+
+// A new pList replaces whatever history the fit was loaded with
+int ndfit_fit_setplist(ndFit* self, PyObject* value, void* closure){
+
+	if(value==NULL){
+		PyErr_SetString(PyExc_TypeError,"pList cannot be deleted");
+		return -1;
+	}
+	NDFIT_BEGIN_CRITICAL(self)
+	Py_INCREF(value);
+	Py_XSETREF(self->pList,value);
+	Py_CLEAR(self->store);
+	NDFIT_END_CRITICAL()
+	return 0;
+}
+
+// Write steps rows of plist, starting at first, as (entropy, params)
+static int ndfit_serial_rows(PyObject* plist, Py_ssize_t first, Py_ssize_t steps, Py_ssize_t dim, double* out){
+
+	Py_ssize_t i,j;
+	for(i=0;i<steps;i+=1){
+		PyObject* step = PyList_GetItem(plist,first+i);
+		if(step==NULL){return -1;}
+		if(!PyTuple_Check(step) || PyTuple_Size(step)<2 || PySequence_Size(PyTuple_GET_ITEM(step,1))!=dim){
+			PyErr_Clear();
+			PyErr_SetString(ndfitError,"pList entries must be (entropy, params) with params of one length");
+			return -1;
+		}
+		double* row = out+i*(1+dim);
+		row[0] = PyFloat_AsDouble(PyTuple_GET_ITEM(step,0));
+		PyObject* params = PySequence_Fast(PyTuple_GET_ITEM(step,1),"params must be a sequence");
+		if(params==NULL){return -1;}
+		for(j=0;j<dim;j+=1){row[1+j] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(params,j));}
+		Py_DECREF(params);
+		if(PyErr_Occurred()){return -1;}
+	}
+	return 0;
+}
+
+// The number of params in the last step of plist
+static Py_ssize_t ndfit_serial_dim(PyObject* plist){
+
+	Py_ssize_t size = PyList_Size(plist);
+	PyObject* last = (size>0) ? PyList_GetItem(plist,size-1) : NULL;
+	Py_ssize_t dim = last!=NULL && PyTuple_Check(last) && PyTuple_Size(last)>=2 ? PySequence_Size(PyTuple_GET_ITEM(last,1)) : -1;
+	if(dim<0){
+		PyErr_Clear();
+		PyErr_SetString(ndfitError,"Fit has no result");
+	}
+	return dim;
+}
+
+///////////////
+// Exporting //
+///////////////
+// The fit as bytes, with the whole history or only its final step
+static PyObject* ndfit_serial_pack(ndFit* self, int history){
+
+	PyObject* result = NULL;
+	PyObject* plist = NULL;
+	Py_ssize_t steps = 0;
+	Py_ssize_t dim = -1;
+	Py_ssize_t nconsts = -1;
+	NDFIT_BEGIN_CRITICAL(self)
+
+	// A loaded fit whose history nobody replaced copies its rows as they are
+	int stored = (self->pList==NULL && self->store!=NULL);
+	Py_ssize_t total = stored ? self->steps : PyList_Size(self->pList);
+	dim = stored ? self->dim : ndfit_serial_dim(self->pList);
+	nconsts = PyList_Check(self->consts) ? PyList_Size(self->consts) : -1;
+	steps = history ? total : 1;
+	if(dim>=0 && nconsts>=0){
+		result = PyBytes_FromStringAndSize(NULL,NDFIT_RS_HEADER+sizeof(double)*(nconsts+steps*(1+dim)));
+	}
+	if(result!=NULL){
+		char* p = PyBytes_AS_STRING(result);
+		int32_t head[2] = {NDFIT_RS_VERSION,
+			(self->truncated ? NDFIT_RS_TRUNCATED : 0) | (steps==total ? NDFIT_RS_HISTORY : 0)};
+		int64_t sizes[3] = {steps,dim,nconsts};
+		memcpy(p,NDFIT_RS_MAGIC,8);
+		memcpy(p+8,head,sizeof(head));
+		memcpy(p+16,sizes,sizeof(sizes));
+
+		// Bytes objects keep their contents 8 byte aligned
+		double* out = (double*)(p+NDFIT_RS_HEADER);
+		Py_ssize_t i;
+		for(i=0;i<nconsts;i+=1){out[i] = PyFloat_AsDouble(PyList_GET_ITEM(self->consts,i));}
+		if(stored){
+			const char* rows = (const char*)PyMemoryView_GET_BUFFER(self->store)->buf+self->offset;
+			memcpy(out+nconsts,rows+sizeof(double)*(total-steps)*(1+dim),sizeof(double)*steps*(1+dim));
+		}
+		else{plist = Py_NewRef(self->pList);}
+	}
+	NDFIT_END_CRITICAL()
+
+	if(nconsts<0 || (result!=NULL && PyErr_Occurred())){
+		PyErr_Clear();
+		PyErr_SetString(ndfitError,"to_bytes needs consts to be a list of numbers");
+		Py_CLEAR(result);
+	}
+
+	// Entries are read with the fit unlocked: their float conversions may
+	// call back into Python
+	if(plist!=NULL){
+		if(result!=NULL && (ndfit_serial_dim(plist)!=dim || PyList_Size(plist)<steps ||
+			ndfit_serial_rows(plist,PyList_Size(plist)-steps,steps,dim,
+				(double*)(PyBytes_AS_STRING(result)+NDFIT_RS_HEADER)+nconsts)<0)){
+			if(!PyErr_Occurred()){PyErr_SetString(ndfitError,"pList changed while it was being written");}
+			Py_CLEAR(result);
+		}
+		Py_DECREF(plist);
+	}
+	return result;
+}
+
+PyObject* ndfit_fit_to_bytes(ndFit* self, PyObject* args, PyObject* kwds){
+
+	int history = 1;
+	static char *kwlist[] = {"history",NULL};
+	if(!PyArg_ParseTupleAndKeywords(args,kwds,"|p",kwlist,&history)){return NULL;}
+	return ndfit_serial_pack(self,history);
+}
+
+///////////////
+// Importing //
+///////////////
+// ndFit.from_bytes(buffer, data, fitfunc, errfunc, lattice, options,
+// evaluations): the history and consts come from the buffer, which is
+// kept rather than copied. Everything else is optional.
+PyObject* ndfit_fit_from_bytes(PyTypeObject* type, PyObject* args, PyObject* kwds){
+
+	PyObject* buffer = NULL;
+	PyObject* data = NULL;
+	PyObject* fitfunc = Py_None;
+	PyObject* errfunc = Py_None;
+	PyObject* lattice = Py_None;
+	PyObject* options = NULL;
+	PyObject* evaluations = NULL;
+	static char *kwlist[] = {"buffer","data","fitfunc","errfunc","lattice","options","evaluations",NULL};
+	if(!PyArg_ParseTupleAndKeywords(args,kwds,"O|OOOOOO",kwlist,&buffer,&data,&fitfunc,&errfunc,&lattice,
+		&options,&evaluations)){return NULL;}
+	if(data==Py_None){data = NULL;}
+	if(options==Py_None){options = NULL;}
+	if(evaluations==Py_None){evaluations = NULL;}
+
+	PyObject* view = PyMemoryView_FromObject(buffer);
+	if(view==NULL){return NULL;}
+	if(!PyBuffer_IsContiguous(PyMemoryView_GET_BUFFER(view),'C')){
+		Py_DECREF(view);
+		PyErr_SetString(ndfitError,"from_bytes needs a contiguous buffer");
+		return NULL;
+	}
+	if(PyMemoryView_GET_BUFFER(view)->ndim!=1 || PyMemoryView_GET_BUFFER(view)->itemsize!=1){
+		Py_SETREF(view,PyObject_CallMethod(view,"cast","s","B"));
+		if(view==NULL){return NULL;}
+	}
+
+	const char* p = PyMemoryView_GET_BUFFER(view)->buf;
+	Py_ssize_t len = PyMemoryView_GET_BUFFER(view)->len;
+	int32_t head[2];
+	int64_t sizes[3];
+	if(len>=NDFIT_RS_HEADER){
+		memcpy(head,p+8,sizeof(head));
+		memcpy(sizes,p+16,sizeof(sizes));
+	}
+	if(len<NDFIT_RS_HEADER || memcmp(p,NDFIT_RS_MAGIC,8)!=0){
+		Py_DECREF(view);
+		PyErr_SetString(ndfitError,"Not an ndfit result");
+		return NULL;
+	}
+	if(head[0]!=NDFIT_RS_VERSION){
+		Py_DECREF(view);
+		PyErr_Format(ndfitError,"Unsupported result version %d",(int)head[0]);
+		return NULL;
+	}
+
+	// Sizes are checked against the length before they are multiplied
+	int64_t doubles = (len-NDFIT_RS_HEADER)/(int64_t)sizeof(double);
+	if(sizes[0]<1 || sizes[1]<0 || sizes[2]<0 || sizes[1]>=doubles || sizes[2]>doubles ||
+		sizes[0]>(doubles-sizes[2])/(1+sizes[1]) ||
+		len!=NDFIT_RS_HEADER+(int64_t)sizeof(double)*(sizes[2]+sizes[0]*(1+sizes[1]))){
+		Py_DECREF(view);
+		PyErr_SetString(ndfitError,"Result is truncated or corrupt");
+		return NULL;
+	}
+
+	Py_ssize_t i;
+	double v;
+	PyObject* consts = PyList_New(sizes[2]);
+	if(consts==NULL){Py_DECREF(view); return NULL;}
+	for(i=0;i<sizes[2];i+=1){
+		memcpy(&v,p+NDFIT_RS_HEADER+sizeof(double)*i,sizeof(v));
+		PyList_SET_ITEM(consts,i,PyFloat_FromDouble(v));
+	}
+
+	ndFit* self = (ndFit*)type->tp_alloc(type,0);
+	if(self==NULL){Py_DECREF(view); Py_DECREF(consts); return NULL;}
+	self->data = data!=NULL ? Py_NewRef(data) : PyList_New(0);
+	self->pList = NULL;
+	self->consts = consts;
+	self->fitfunc = Py_NewRef(fitfunc);
+	self->errfunc = Py_NewRef(errfunc);
+	self->lattice = Py_NewRef(lattice);
+	self->truncated = (head[1] & NDFIT_RS_TRUNCATED) ? 1 : 0;
+	self->options = Py_XNewRef(options);
+	self->evaluations = Py_XNewRef(evaluations);
+	self->store = view;
+	self->steps = (Py_ssize_t)sizes[0];
+	self->dim = (Py_ssize_t)sizes[1];
+	self->offset = NDFIT_RS_HEADER+sizeof(double)*(Py_ssize_t)sizes[2];
+	if(self->data==NULL){Py_DECREF(self); return NULL;}
+	return (PyObject*)self;
+}
+
+// Pickles go through from_bytes with the history as bytes. The data,
+// functions and options are pickled as they are.
+PyObject* ndfit_fit_reduce(ndFit* self, PyObject* Py_UNUSED(ignored)){
+
+	PyObject* blob = ndfit_serial_pack(self,1);
+	if(blob==NULL){return NULL;}
+	PyObject* load = PyObject_GetAttrString((PyObject*)Py_TYPE(self),"from_bytes");
+	if(load==NULL){Py_DECREF(blob); return NULL;}
+	PyObject* result;
+	NDFIT_BEGIN_CRITICAL(self)
+	result = Py_BuildValue("(N(NOOOOOO))",load,blob,self->data,self->fitfunc,self->errfunc,self->lattice,
+		self->options ? self->options : Py_None,self->evaluations ? self->evaluations : Py_None);
+	NDFIT_END_CRITICAL()
+	return result;
+}
+
+// The history as a read only (steps, 1+dim) float64 memoryview, one
+// row of (entropy, params) per step. Loaded fits give a view of their
+// buffer, others pack pList first.
+PyObject* ndfit_fit_gethistory(ndFit* self, void* closure){
+
+	PyObject* view = NULL;
+	Py_ssize_t offset = 0;
+	Py_ssize_t steps = 0;
+	Py_ssize_t dim = 0;
+	NDFIT_BEGIN_CRITICAL(self)
+	if(self->store!=NULL){
+		view = Py_NewRef(self->store);
+		offset = self->offset;
+		steps = self->steps;
+		dim = self->dim;
+	}
+	NDFIT_END_CRITICAL()
+
+	if(view==NULL){
+		PyObject* blob = ndfit_serial_pack(self,1);
+		if(blob==NULL){return NULL;}
+		int64_t sizes[3];
+		memcpy(sizes,PyBytes_AS_STRING(blob)+16,sizeof(sizes));
+		steps = (Py_ssize_t)sizes[0];
+		dim = (Py_ssize_t)sizes[1];
+		offset = NDFIT_RS_HEADER+sizeof(double)*(Py_ssize_t)sizes[2];
+		view = PyMemoryView_FromObject(blob);
+		Py_DECREF(blob);
+		if(view==NULL){return NULL;}
+	}
+
+	PyObject* rows = PySequence_GetSlice(view,offset,offset+sizeof(double)*steps*(1+dim));
+	Py_DECREF(view);
+	if(rows==NULL){return NULL;}
+	PyObject* history = PyObject_CallMethod(rows,"cast","s(nn)","d",steps,1+dim);
+	Py_DECREF(rows);
+	if(history!=NULL && PyMemoryView_GET_BUFFER(history)->readonly==0){
+		Py_SETREF(history,PyObject_CallMethod(history,"toreadonly",NULL));
+	}
+	return history;
+}
@@ -41,23 +41,9 @@
 // 0) initialization
 //
 
-// Python exception object 
-static PyObject* ndfitError;
-
-// 1) typedef: data structure definition
-typedef struct ndfit{
-
-	PyObject_HEAD
-
-	// Data members
-	PyObject* data;
-	PyObject* pList;
-	PyObject* consts;
-	PyObject* fitfunc;
-	PyObject* errfunc;
-	PyObject* lattice;	
-
-} ndFit;
+// 1) typedef: data structure definition lives in shared.h so that
+// the module can build ndFit objects directly
+#include "../inc/shared.h"
 
 // 2) typedef destructor
 void ndFit_dealloc(ndFit* self){
@@ -69,9 +55,15 @@ void ndFit_dealloc(ndFit* self){
 	Py_XDECREF(self->fitfunc); 
 	Py_XDECREF(self->errfunc);
 	Py_XDECREF(self->lattice);
-
-	// actually free the memory by calling tp_free
-	//self->ob_type->tp_free((PyObject*)self);
+	Py_XDECREF(self->options);
+	Py_XDECREF(self->evaluations);
+	Py_XDECREF(self->store);
+
+	// actually free the memory by calling tp_free, then let go of
+	// the type, which every instance of a heap type holds
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
 }
 
 /////////////////////////////////
@@ -92,6 +84,13 @@ PyObject* ndFit_new(PyTypeObject* type, PyObject* args, PyObject* kwds){
 		self->fitfunc = Py_None;						
 		self->errfunc = Py_None;
 		self->lattice = Py_None;
+		Py_INCREF(Py_None);
+		Py_INCREF(Py_None);
+		Py_INCREF(Py_None);
+		self->truncated = 0;
+		self->options = NULL;
+		self->evaluations = NULL;
+		self->store = NULL;
 
 		if (self->data == NULL){Py_DECREF(self);return NULL;}
 		if (self->pList == NULL){Py_DECREF(self);return NULL;}
@@ -116,16 +115,28 @@ ndFit_init(ndFit* self, PyObject* args){
 	PyObject* fitfunc = NULL; 
 	PyObject* errfunc = NULL;
 	PyObject* lattice = NULL;
+	int truncated = 0;
+	PyObject* options = NULL;
+	PyObject* evaluations = NULL;
 
 	PyObject* tmp;
-	if (!PyArg_ParseTuple(args,"OOOOOO",&data, &pList,&consts, &fitfunc, &errfunc, &lattice)){return -1;}
+	if (!PyArg_ParseTuple(args,"OOOOOO|pOO",&data, &pList,&consts, &fitfunc, &errfunc, &lattice, &truncated,
+		&options, &evaluations)){return -1;}
+	if (options==Py_None) {options = NULL;}
+	if (evaluations==Py_None) {evaluations = NULL;}
 
+	// A second __init__ may race readers on free-threaded builds
+	NDFIT_BEGIN_CRITICAL(self)
 	if (data) {tmp=self->data; Py_INCREF(data); self->data = data; Py_XDECREF(tmp);}
-	if (data) {tmp=self->pList; Py_INCREF(pList); self->pList = pList; Py_XDECREF(tmp);}
+	if (data) {tmp=self->pList; Py_INCREF(pList); self->pList = pList; Py_XDECREF(tmp); Py_CLEAR(self->store);}
 	if (data) {tmp=self->consts; Py_INCREF(consts); self->consts = consts; Py_XDECREF(tmp);}
 	if (data) {tmp=self->fitfunc; Py_INCREF(fitfunc); self->fitfunc = fitfunc; Py_XDECREF(tmp);}
 	if (data) {tmp=self->errfunc; Py_INCREF(errfunc); self->errfunc = errfunc; Py_XDECREF(tmp);}
 	if (data) {tmp=self->lattice; Py_INCREF(lattice); self->lattice = lattice; Py_XDECREF(tmp);}
+	self->truncated = (char)truncated;
+	tmp=self->options; Py_XINCREF(options); self->options = options; Py_XDECREF(tmp);
+	tmp=self->evaluations; Py_XINCREF(evaluations); self->evaluations = evaluations; Py_XDECREF(tmp);
+	NDFIT_END_CRITICAL()
 	return 0;
 }
 
@@ -135,11 +146,18 @@ ndFit_init(ndFit* self, PyObject* args){
 // set this is PyTypeObject-->tp_members
 PyMemberDef ndFit_members[] = {
 	{"data",T_OBJECT_EX,offsetof(ndFit,data),0,"input data"},
-	{"pList",T_OBJECT_EX,offsetof(ndFit,pList),0,"parameter list [entropy,(params)]"},
 	{"consts",T_OBJECT_EX,offsetof(ndFit,consts),0,"constant parameter list [consts]]"},
 	{"fitfunc",T_OBJECT_EX,offsetof(ndFit,fitfunc),0,"fit function used"},
 	{"errfunc",T_OBJECT_EX,offsetof(ndFit,errfunc),0,"error function used"},
 	{"lattice",T_OBJECT_EX,offsetof(ndFit,lattice),0,"fit lattice for error checking"},
+	{"truncated",T_BOOL,offsetof(ndFit,truncated),READONLY,"fit stopped early on a budget or cancellation"},
+	{NULL}	 /* Sentinel */
+};
+
+// pList is built on demand for fits loaded with from_bytes
+PyGetSetDef ndFit_getset[] = {
+	{"pList",(getter)ndfit_fit_getplist,(setter)ndfit_fit_setplist,"parameter list [entropy,(params)]",NULL},
+	{"history",(getter)ndfit_fit_gethistory,NULL,"(steps, 1+dim) float64 view of the entropy and params of each step",NULL},
 	{NULL}	 /* Sentinel */
 };
 
@@ -151,9 +169,11 @@ PyMemberDef ndFit_members[] = {
 static PyObject* ndFit_getresult(ndFit* self){
 	
 	PyObject* result; 
-	Py_ssize_t sizep = PyList_Size(self->pList);
-	result = PyList_GetItem(self->pList,sizep-1);
-	Py_INCREF(result);
+	PyObject* plist = ndfit_fit_plist(self);
+	if(plist==NULL){return NULL;}
+	Py_ssize_t sizep = PyList_Size(plist);
+	result = PyList_GetItem(plist,sizep-1);
+	Py_XINCREF(result);
 	return result;
 }
 
@@ -162,13 +182,15 @@ static PyObject* ndFit_getentropy(ndFit* self){
 
 	PyObject* list;
 	Py_ssize_t iter; 
-	Py_ssize_t size = PyList_Size(self->pList);
+	PyObject* plist = ndfit_fit_plist(self);
+	if(plist==NULL){return NULL;}
+	Py_ssize_t size = PyList_Size(plist);
 	list = PyList_New(size);
 	Py_INCREF(list);
 
 	PyObject* tmp; 
 	for(iter = 0; iter<size; iter+=1){ 
-		tmp = PyList_GetItem(self->pList,iter);
+		tmp = PyList_GetItem(plist,iter);
 		PyList_SetItem(list,iter,PyTuple_GetItem(tmp,0));
 		Py_DECREF(tmp);
 	}
@@ -183,12 +205,22 @@ static PyObject* ndFit_buildcurve(ndFit* self, PyObject* args, PyObject* kwds){
 
 	PyObject* result; 
 	PyObject* params;
-	Py_ssize_t sizep = PyList_Size(self->pList);
-	result = PyList_GetItem(self->pList,sizep-1);
+	PyObject* plist = ndfit_fit_plist(self);
+	if(plist==NULL){return NULL;}
+	Py_ssize_t sizep = PyList_Size(plist);
+	result = PyList_GetItem(plist,sizep-1);
 	params = PyTuple_GetItem(result,1);
 	Py_INCREF(result);
 	Py_INCREF(params);
 
+	// A Dataset gives its first column as the x values
+	PyObject* xcol = NULL;
+	if(PyObject_TypeCheck(values,ndfit_module()->dataset_type)){
+		xcol = ndfit_dataset_column((ndDataset*)values,0);
+		if(xcol==NULL){return NULL;}
+		values = xcol;
+	}
+
 	if(!PyList_Check(values)){
 		PyErr_SetString(ndfitError,"Data is not a list: please remember to zip your lists");
 		return NULL;
@@ -212,6 +244,7 @@ static PyObject* ndFit_buildcurve(ndFit* self, PyObject* args, PyObject* kwds){
 		pt = PyObject_CallFunctionObjArgs(self->fitfunc,tmp,params,self->consts,NULL);
 		PyList_SetItem(curve,i,pt);
 	}
+	Py_XDECREF(xcol);
 	return curve;
 }
 
@@ -222,6 +255,10 @@ PyMethodDef ndFit_methods[] = {
 	{"getresult" , (PyCFunction)(void(*)(void))ndFit_getresult, METH_NOARGS, "return the final result"},
 	{"getentropy", (PyCFunction)(void(*)(void))ndFit_getentropy, METH_NOARGS,"return a list of the entropy values"},
 	{"buildcurve", (PyCFunction)(void(*)(void))ndFit_buildcurve, METH_VARARGS|METH_KEYWORDS, "build the optimized curve"},
+	{"uncertainty", (PyCFunction)(void(*)(void))ndfit_uncertainty, METH_VARARGS|METH_KEYWORDS, "parameter uncertainties from the Hessian or a bootstrap"},
+	{"to_bytes", (PyCFunction)(void(*)(void))ndfit_fit_to_bytes, METH_VARARGS|METH_KEYWORDS, "the fit in a compact binary form"},
+	{"from_bytes", (PyCFunction)(void(*)(void))ndfit_fit_from_bytes, METH_VARARGS|METH_KEYWORDS|METH_CLASS, "load a fit from to_bytes without copying its history"},
+	{"__reduce__", (PyCFunction)(void(*)(void))ndfit_fit_reduce, METH_NOARGS, "pickle support"},
 	{NULL}	/* Sentinel */
 }; 
 
@@ -234,43 +271,21 @@ PyMethodDef ndFit_methods[] = {
 // NEW PYOBJECT: TYPEDEF //
 ///////////////////////////
 // everything listed below needs to show up above
-PyTypeObject ndFitType = {
-		PyObject_HEAD_INIT(NULL)
-		"ndfit.ndFit",									 /* tp_name */
-		sizeof(ndFit),									 /* tp_basicsize */
-		0,												 /* tp_itemsize */
-		(destructor)ndFit_dealloc, 						 /* tp_dealloc */
-	    0,												 /* tp_print */
-	    0,												 /* tp_getattr */
-	    0,												 /* tp_setattr */
-	    0,												 /* tp_compare */
-	    0,												 /* tp_repr */
-	    0,												 /* tp_as_number */
-	    0,												 /* tp_as_sequence */
-	    0,												 /* tp_as_mapping */
-	    0,												 /* tp_hash */
-	    0,												 /* tp_call */
-	    0,												 /* tp_str */
-	    0,												 /* tp_getattro */
-	    0,												 /* tp_setattro */
-	    0,												 /* tp_as_buffer */
-	    Py_TPFLAGS_DEFAULT,								 /* tp_flags */
-	    0,												 /* tp_doc */
-		0,												 /* tp_traverse */
-		0,												 /* tp_clear */
-		0,												 /* tp_richcompare */
-		0,												 /* tp_weaklistoffset */
-		0,												 /* tp_iter */
-		0,												 /* tp_iternext */
-		ndFit_methods,									 /* tp_methods */
-		ndFit_members,									 /* tp_members */
-		0,												 /* tp_getset */
-		0,												 /* tp_base */
-		0,												 /* tp_dict */
-		0,												 /* tp_descr_get */
-		0,												 /* tp_descr_set */
-		0,												 /* tp_dictoffset */
-		(initproc)ndFit_init,							 /* tp_init */
-		0,												 /* tp_alloc */
-		ndFit_new,										 /* tp_new */
+static PyType_Slot ndFit_slots[] = {
+	{Py_tp_dealloc, (void*)ndFit_dealloc},
+	{Py_tp_methods, ndFit_methods},
+	{Py_tp_members, ndFit_members},
+	{Py_tp_getset, ndFit_getset},
+	{Py_tp_init, (void*)ndFit_init},
+	{Py_tp_new, (void*)ndFit_new},
+	{0, NULL}
+};
+
+// The type is made for every interpreter from this (see ndfit_exec)
+PyType_Spec ndFit_spec = {
+		"ndfit.ndFit",									 /* name */
+		sizeof(ndFit),									 /* basicsize */
+		0,												 /* itemsize */
+		Py_TPFLAGS_DEFAULT|Py_TPFLAGS_IMMUTABLETYPE,	 /* flags */
+		ndFit_slots,									 /* slots */
 };
@@ -0,0 +1,431 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <pythread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////
+// ndfit.sweep: the same fit under many consts
+// vectors. Every fit is prepared up front in
+// the calling thread against one shared data
+// object, then worker threads take them in
+// order. A fit may start from the result of
+// the nearest fit scheduled before it, so the
+// outcome does not depend on the threads.
+//
+
+#include "../inc/shared.h"
+
+typedef struct ndfit_sweep{
+	ndfit_state* states;
+	PyObject* results;
+	double* consts;
+	double* span;
+	char* done;
+	Py_ssize_t* order;
+	Py_ssize_t* source;
+	PyThread_type_lock* finished;
+	Py_ssize_t n;
+	Py_ssize_t m;
+	_Atomic Py_ssize_t next;
+	int warm;
+	_Atomic int running;
+	volatile int failed;
+	PyObject* exc_type;
+	PyObject* exc_value;
+	PyObject* exc_tb;
+	PyThread_type_lock lock;
+	PyInterpreterState* interp;
+	ndfit_trace* trace;
+} ndfit_sweep;
+
+// Stop every fit that is still going (they finish truncated)
+static void ndfit_sweep_cancel(ndfit_sweep* sw){
+	Py_ssize_t k;
+	sw->failed = 1;
+	for(k=0;k<sw->n;k+=1){sw->states[k].cancelled = 1;}
+}
+
+// Schedule of a warm started sweep. Fits go in rounds which bisect
+// the list (0, then n/2, then n/4 and 3n/4, ...) and every fit starts
+// from the nearest fit of an earlier round, ties going to the lower 
+// index. The distance is taken on consts scaled by their range over
+// the sweep. A round only waits on the ones before it, so fits of a 
+// round run side by side, and half of them start next to a neighbour.
+static int ndfit_sweep_schedule(ndfit_sweep* sw){
+
+	Py_ssize_t i, j, k;
+	Py_ssize_t n = sw->n;
+	int levels = 0;
+	while(((Py_ssize_t)1<<levels)<n){levels += 1;}
+
+	int* level = PyMem_Malloc(sizeof(int)*n);
+	sw->order = PyMem_Malloc(sizeof(Py_ssize_t)*n);
+	sw->source = PyMem_Malloc(sizeof(Py_ssize_t)*n);
+	sw->finished = PyMem_Calloc(n,sizeof(PyThread_type_lock));
+	if(level==NULL || sw->order==NULL || sw->source==NULL || sw->finished==NULL){
+		PyMem_Free(level);
+		PyErr_NoMemory();
+		return -1;
+	}
+	for(k=0;k<n;k+=1){
+		int zeros = 0;
+		while(k>0 && !(k & ((Py_ssize_t)1<<zeros))){zeros += 1;}
+		level[k] = (k==0) ? 0 : levels-zeros;
+	}
+	Py_ssize_t q = 0;
+	for(i=0;i<=levels;i+=1){
+		for(k=0;k<n;k+=1){if(level[k]==i){sw->order[q++] = k;}}
+	}
+
+	for(k=0;k<n;k+=1){
+		double best = 0.0;
+		sw->source[k] = -1;
+		for(i=0;i<n;i+=1){
+			if(level[i]>=level[k]){continue;}
+			double d = 0.0;
+			for(j=0;j<sw->m;j+=1){
+				double t = (sw->consts[i*sw->m+j]-sw->consts[k*sw->m+j])/sw->span[j];
+				d += t*t;
+			}
+			if(sw->source[k]<0 || d<best){sw->source[k] = i; best = d;}
+		}
+	}
+	PyMem_Free(level);
+
+	// Held until the fit is over, so later rounds can wait on it
+	for(k=0;k<n;k+=1){
+		sw->finished[k] = PyThread_allocate_lock();
+		if(sw->finished[k]==NULL){PyErr_NoMemory(); return -1;}
+		PyThread_acquire_lock(sw->finished[k],WAIT_LOCK);
+	}
+	return 0;
+}
+
+// Wait for fit i to be over, in slices so Ctrl-C still gets through
+static int ndfit_sweep_wait(ndfit_sweep* sw, Py_ssize_t i){
+	for(;;){
+		PyLockStatus r;
+		Py_BEGIN_ALLOW_THREADS
+		r = PyThread_acquire_lock_timed(sw->finished[i],50000,0);
+		Py_END_ALLOW_THREADS
+		if(r==PY_LOCK_ACQUIRED){
+			PyThread_release_lock(sw->finished[i]);
+			return 0;
+		}
+		if(PyErr_CheckSignals()<0){return -1;}
+	}
+}
+
+// Start fit k from the best params of its scheduled source. Returns 
+// 1 if the source failed, which only happens once the sweep has.
+static int ndfit_sweep_warm(ndfit_sweep* sw, Py_ssize_t k){
+
+	Py_ssize_t nearest = sw->source[k];
+	if(nearest<0){return 0;}
+	if(!sw->done[nearest]){return 1;}
+
+	ndFit* fit = (ndFit*)PyList_GetItem(sw->results,nearest);
+	PyObject* plist = ndfit_fit_plist(fit);
+	if(plist==NULL){return -1;}
+	PyObject* last = PyList_GetItem(plist,PyList_Size(plist)-1);
+	if(last==NULL){return -1;}
+	PyObject* params = PyList_GetSlice(PyTuple_GetItem(last,1),0,sw->states[k].dim);
+	if(params==NULL){return -1;}
+	Py_SETREF(sw->states[k].params,params);
+	return 0;
+}
+
+// Take fits off the queue until it is empty or one of them failed
+static void ndfit_sweep_worker(ndfit_sweep* sw){
+
+	while(!sw->failed){
+		Py_ssize_t q = atomic_fetch_add(&sw->next,1);
+		if(q>=sw->n){break;}
+		Py_ssize_t k = sw->warm ? sw->order[q] : q;
+
+		// The results list guards the finished fits and the first error
+		int warm = 0;
+		PyObject* result = NULL;
+		if(sw->warm && sw->source[k]>=0){warm = ndfit_sweep_wait(sw,sw->source[k]);}
+		if(warm==0 && sw->warm){
+			NDFIT_BEGIN_CRITICAL(sw->results)
+			warm = ndfit_sweep_warm(sw,k);
+			NDFIT_END_CRITICAL()
+		}
+		if(warm==0){
+			result = ndfit_fit(&sw->states[k]);
+		}
+		NDFIT_BEGIN_CRITICAL(sw->results)
+		if(result==NULL){
+			if(sw->exc_type==NULL){
+				PyErr_Fetch(&sw->exc_type,&sw->exc_value,&sw->exc_tb);
+				PyErr_NormalizeException(&sw->exc_type,&sw->exc_value,&sw->exc_tb);
+				if(sw->exc_tb!=NULL){PyException_SetTraceback(sw->exc_value,sw->exc_tb);}
+			}
+			PyErr_Clear();
+			ndfit_sweep_cancel(sw);
+		}
+		else{
+			PyList_SetItem(sw->results,k,result);
+			sw->done[k] = 1;
+		}
+		NDFIT_END_CRITICAL()
+		if(sw->warm){PyThread_release_lock(sw->finished[k]);}
+		if(result==NULL){break;}
+		ndfit_release(&sw->states[k]);
+	}
+
+	if(atomic_fetch_sub(&sw->running,1)==1){PyThread_release_lock(sw->lock);}
+}
+
+// The other worker threads. sw is gone once the last one is done.
+static void ndfit_sweep_thread(void* arg){
+	ndfit_sweep* sw = (ndfit_sweep*)arg;
+	PyThreadState* ts = ndfit_thread_enter(sw->interp);
+	ndfit_sweep_worker(sw);
+	ndfit_thread_leave(ts);
+}
+
+// The consts matrix as doubles, with the range of every column
+static int ndfit_sweep_matrix(ndfit_sweep* sw, PyObject* matrix){
+
+	Py_ssize_t i, j;
+	sw->n = PyList_Size(matrix);
+	sw->m = (sw->n>0 && PyList_Check(PyList_GetItem(matrix,0))) ? PyList_Size(PyList_GetItem(matrix,0)) : -1;
+	if(sw->n<1 || sw->m<0){
+		PyErr_SetString(ndfitError,"consts must be a non-empty list of consts lists");
+		return -1;
+	}
+	sw->consts = PyMem_Calloc(sw->n*(sw->m ? sw->m : 1),sizeof(double));
+	sw->span = PyMem_Calloc(sw->m ? sw->m : 1,sizeof(double));
+	if(sw->consts==NULL || sw->span==NULL){PyErr_NoMemory(); return -1;}
+
+	for(i=0;i<sw->n;i+=1){
+		PyObject* row = PyList_GetItem(matrix,i);
+		if(!PyList_Check(row) || PyList_Size(row)!=sw->m){
+			PyErr_Format(ndfitError,"consts row %zd is not a list of %zd values",i,sw->m);
+			return -1;
+		}
+		// Non-numeric consts are allowed, they just play no part in
+		// choosing the warm start
+		for(j=0;j<sw->m;j+=1){
+			double v = PyFloat_AsDouble(PyList_GetItem(row,j));
+			if(v==-1.0 && PyErr_Occurred()){PyErr_Clear(); v = 0.0;}
+			sw->consts[i*sw->m+j] = v;
+		}
+	}
+	for(j=0;j<sw->m;j+=1){
+		double lo = sw->consts[j], hi = sw->consts[j];
+		for(i=1;i<sw->n;i+=1){
+			double v = sw->consts[i*sw->m+j];
+			if(v<lo){lo = v;}
+			if(v>hi){hi = v;}
+		}
+		sw->span[j] = (hi>lo) ? hi-lo : 1.0;
+	}
+	return 0;
+}
+
+// sweep(fitfunc, errfunc, data, params, consts, step, threads=0,
+// warm_start=False, **run options). consts is a list of consts lists
+// and the result is a list of ndFit objects in the same order.
+// threads=0 uses one thread per processor. Python error functions
+// take turns on the GIL, so threads pay off when the error function
+// releases it (numpy on large vectorized data). workers= is refused.
+PyObject* ndfit_sweep_run(PyObject* self, PyObject* args, PyObject* kwds){
+
+	static const char* names[] = {"fitfunc","errfunc","data","params","consts","step"};
+	Py_ssize_t i, k;
+	int threads = 0;
+	PyObject* result = NULL;
+	PyObject* empty = NULL;
+	ndfit_sweep sw;
+	memset(&sw,0,sizeof(ndfit_sweep));
+
+	// Positional arguments are folded into the options so every fit
+	// can be set up from keywords alone
+	PyObject* kw = kwds ? PyDict_Copy(kwds) : PyDict_New();
+	if(kw==NULL){return NULL;}
+	if(PyTuple_Size(args)>6){
+		PyErr_SetString(ndfitError,"sweep takes at most six positional arguments");
+		goto done;
+	}
+	for(i=0;i<PyTuple_Size(args);i+=1){
+		if(PyDict_GetItemString(kw,names[i])!=NULL){
+			PyErr_Format(ndfitError,"sweep got %s twice",names[i]);
+			goto done;
+		}
+		if(PyDict_SetItemString(kw,names[i],PyTuple_GetItem(args,i))<0){goto done;}
+	}
+
+	PyObject* opt = PyDict_GetItemString(kw,"threads");
+	if(opt!=NULL){
+		threads = (int)PyLong_AsLong(opt);
+		if(threads==-1 && PyErr_Occurred()){goto done;}
+		PyDict_DelItemString(kw,"threads");
+	}
+	opt = PyDict_GetItemString(kw,"warm_start");
+	if(opt!=NULL){
+		sw.warm = PyObject_IsTrue(opt);
+		if(sw.warm<0){goto done;}
+		PyDict_DelItemString(kw,"warm_start");
+	}
+	// All fits record into one trace, written when the sweep is done
+	opt = PyDict_GetItemString(kw,"trace");
+	if(opt!=NULL){
+		if(opt!=Py_None){
+			PyObject* path = NULL;
+			if(!PyUnicode_FSConverter(opt,&path)){goto done;}
+			sw.trace = ndfit_trace_open(PyBytes_AS_STRING(path));
+			Py_DECREF(path);
+			if(sw.trace==NULL){goto done;}
+		}
+		PyDict_DelItemString(kw,"trace");
+	}
+	opt = PyDict_GetItemString(kw,"checkpoint");
+	if(opt!=NULL && opt!=Py_None){
+		PyErr_SetString(ndfitError,"Checkpoints are not supported for sweeps");
+		goto done;
+	}
+
+	// A pool holds the consts of one fit; the items run on the threads
+	opt = PyDict_GetItemString(kw,"workers");
+	if(opt!=NULL && opt!=Py_None && PyObject_IsTrue(opt)){
+		PyErr_SetString(ndfitError,"sweep runs its fits on threads and does not use workers");
+		goto done;
+	}
+
+	PyObject* matrix = PyDict_GetItemString(kw,"consts");
+	PyObject* data = PyDict_GetItemString(kw,"data");
+	if(matrix==NULL || data==NULL || !PyList_Check(matrix)){
+		PyErr_SetString(ndfitError,"sweep needs data and a list of consts lists");
+		goto done;
+	}
+	Py_INCREF(matrix);
+	k = ndfit_sweep_matrix(&sw,matrix);
+	Py_DECREF(matrix);
+	if(k<0){goto done;}
+
+	// Row by row fits share one Dataset so the data is checked once
+	opt = PyDict_GetItemString(kw,"vectorized");
+	int vectorized = (opt!=NULL) ? PyObject_IsTrue(opt) : 0;
+	if(vectorized<0){goto done;}
+	if(!vectorized && PyList_Check(data)){
+		PyObject* ds = PyObject_CallFunctionObjArgs((PyObject*)ndfit_module()->dataset_type,data,NULL);
+		if(ds==NULL){goto done;}
+		k = PyDict_SetItemString(kw,"data",ds);
+		Py_DECREF(ds);
+		if(k<0){goto done;}
+	}
+
+	// Set up every fit here so bad options raise before any work
+	matrix = PyDict_GetItemString(kw,"consts");
+	Py_INCREF(matrix);
+	sw.states = PyMem_Calloc(sw.n,sizeof(ndfit_state));
+	sw.done = PyMem_Calloc(sw.n,1);
+	sw.results = PyList_New(sw.n);
+	empty = PyTuple_New(0);
+	if(sw.states==NULL || sw.done==NULL || sw.results==NULL || empty==NULL){
+		Py_DECREF(matrix);
+		if(!PyErr_Occurred()){PyErr_NoMemory();}
+		goto done;
+	}
+	for(k=0;k<sw.n;k+=1){
+		if(PyDict_SetItemString(kw,"consts",PyList_GetItem(matrix,k))<0 ||
+		   ndfit_setup(&sw.states[k],empty,kw)<0){
+			Py_DECREF(matrix);
+			goto done;
+		}
+		sw.states[k].trace = sw.trace;
+		sw.states[k].quiet = 1;
+	}
+	Py_DECREF(matrix);
+	if(sw.warm && ndfit_sweep_schedule(&sw)<0){goto done;}
+
+	if(threads<=0){threads = (int)sysconf(_SC_NPROCESSORS_ONLN);}
+	if(threads<1){threads = 1;}
+	if(threads>sw.n){threads = (int)sw.n;}
+
+	sw.lock = PyThread_allocate_lock();
+	if(sw.lock==NULL){PyErr_NoMemory(); goto done;}
+	PyThread_acquire_lock(sw.lock,WAIT_LOCK);
+
+	// The calling thread is always one of the workers
+	sw.running = threads;
+	sw.interp = PyInterpreterState_Get();
+	for(i=1;i<threads;i+=1){
+		if(PyThread_start_new_thread(ndfit_sweep_thread,(void*)&sw)==PYTHREAD_INVALID_THREAD_ID){
+			atomic_fetch_sub(&sw.running,threads-i);
+			break;
+		}
+	}
+	ndfit_sweep_worker(&sw);
+
+	// Wait for the other workers. Ctrl-C cancels the remaining fits,
+	// but we still wait: the workers use memory on this stack.
+	PyObject *it = NULL, *iv = NULL, *itb = NULL;
+	for(;;){
+		PyLockStatus r;
+		Py_BEGIN_ALLOW_THREADS
+		r = PyThread_acquire_lock_timed(sw.lock,50000,0);
+		Py_END_ALLOW_THREADS
+		if(r==PY_LOCK_ACQUIRED){break;}
+		if(it==NULL && PyErr_CheckSignals()<0){
+			PyErr_Fetch(&it,&iv,&itb);
+			ndfit_sweep_cancel(&sw);
+		}
+	}
+	if(it!=NULL){
+		PyErr_Restore(it,iv,itb);
+		goto done;
+	}
+	if(sw.trace!=NULL && ndfit_trace_write(sw.trace)<0){goto done;}
+	if(sw.exc_type!=NULL){
+		PyErr_Restore(sw.exc_type,sw.exc_value,sw.exc_tb);
+		sw.exc_type = sw.exc_value = sw.exc_tb = NULL;
+		goto done;
+	}
+	result = sw.results;
+	sw.results = NULL;
+
+done:
+	for(k=0;sw.states!=NULL && k<sw.n;k+=1){ndfit_release(&sw.states[k]);}
+	if(sw.lock){PyThread_free_lock(sw.lock);}
+	for(k=0;sw.finished!=NULL && k<sw.n;k+=1){
+		if(sw.finished[k]){PyThread_free_lock(sw.finished[k]);}
+	}
+	PyMem_Free(sw.finished);
+	PyMem_Free(sw.order);
+	PyMem_Free(sw.source);
+	ndfit_trace_free(sw.trace);
+	PyMem_Free(sw.states);
+	PyMem_Free(sw.done);
+	PyMem_Free(sw.consts);
+	PyMem_Free(sw.span);
+	Py_XDECREF(sw.results);
+	Py_XDECREF(sw.exc_type);
+	Py_XDECREF(sw.exc_value);
+	Py_XDECREF(sw.exc_tb);
+	Py_XDECREF(empty);
+	Py_DECREF(kw);
+	return result;
+}
@@ -0,0 +1,195 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <pythread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////
+// Event tracing (run(..., trace=path)). Every
+// thread appends begin/end events to buffers
+// of its own, found through a thread local,
+// so recording takes no lock. The buffers are
+// chained onto the trace with a compare and
+// swap. Once the fit and its workers are done
+// the events are written out as Chrome Trace
+// Event JSON (chrome://tracing, Perfetto).
+//
+
+#include "../inc/shared.h"
+
+// Events per chunk of a thread's buffer
+#define NDFIT_TRACE_CHUNK 4096
+
+typedef struct ndfit_event{
+	double ts;
+	const char* name;
+	const char* key;
+	double value;
+	char phase;
+} ndfit_event;
+
+typedef struct ndfit_chunk{
+	struct ndfit_chunk* next;
+	int n;
+	ndfit_event events[NDFIT_TRACE_CHUNK];
+} ndfit_chunk;
+
+// The events one thread recorded into one trace
+typedef struct ndfit_tbuf{
+	struct ndfit_tbuf* next;
+	unsigned long tid;
+	ndfit_chunk* head;
+	ndfit_chunk* tail;
+} ndfit_tbuf;
+
+struct ndfit_trace{
+	uint64_t id;
+	char* path;
+	double t0;
+	_Atomic(ndfit_tbuf*) buffers;
+	_Atomic long dropped;
+};
+
+// Traces are told apart by id rather than address: a thread may still
+// cache the buffer of a trace that has been freed since
+static _Atomic uint64_t ndfit_trace_ids = 1;
+static _Thread_local uint64_t ndfit_trace_tls_id = 0;
+static _Thread_local ndfit_tbuf* ndfit_trace_tls = NULL;
+
+// A trace written to path when the fit is done. Raises on failure.
+ndfit_trace* ndfit_trace_open(const char* path){
+
+	ndfit_trace* tr = PyMem_RawCalloc(1,sizeof(ndfit_trace));
+	char* copy = PyMem_RawMalloc(strlen(path)+1);
+	if(tr==NULL || copy==NULL){
+		PyMem_RawFree(tr);
+		PyMem_RawFree(copy);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	strcpy(copy,path);
+	tr->path = copy;
+	tr->id = atomic_fetch_add(&ndfit_trace_ids,1);
+	tr->t0 = ndfit_clock();
+	atomic_init(&tr->buffers,NULL);
+	atomic_init(&tr->dropped,0);
+	return tr;
+}
+
+// This thread's buffer for tr, chained onto the trace on first use
+static ndfit_tbuf* ndfit_trace_buffer(ndfit_trace* tr){
+
+	if(ndfit_trace_tls!=NULL && ndfit_trace_tls_id==tr->id){return ndfit_trace_tls;}
+	ndfit_tbuf* b = PyMem_RawCalloc(1,sizeof(ndfit_tbuf));
+	if(b==NULL){return NULL;}
+	b->tid = PyThread_get_thread_native_id();
+	ndfit_tbuf* head = atomic_load(&tr->buffers);
+	do{b->next = head;}while(!atomic_compare_exchange_weak(&tr->buffers,&head,b));
+	ndfit_trace_tls = b;
+	ndfit_trace_tls_id = tr->id;
+	return b;
+}
+
+// Record an event: 'B' opens a span, 'E' closes it and 'i' marks an
+// instant. name and key must be string literals. key (may be NULL)
+// attaches value to the event. Safe to call without the GIL. Events
+// that do not fit in memory are counted and dropped.
+void ndfit_trace_event(ndfit_trace* tr, const char* name, char phase, const char* key, double value){
+
+	ndfit_tbuf* b = ndfit_trace_buffer(tr);
+	if(b==NULL){atomic_fetch_add(&tr->dropped,1); return;}
+	ndfit_chunk* c = b->tail;
+	if(c==NULL || c->n==NDFIT_TRACE_CHUNK){
+		c = PyMem_RawMalloc(sizeof(ndfit_chunk));
+		if(c==NULL){atomic_fetch_add(&tr->dropped,1); return;}
+		c->next = NULL;
+		c->n = 0;
+		if(b->tail!=NULL){b->tail->next = c;}
+		else{b->head = c;}
+		b->tail = c;
+	}
+	ndfit_event* ev = &c->events[c->n];
+	ev->ts = (ndfit_clock()-tr->t0)*1e6;
+	ev->name = name;
+	ev->key = key;
+	ev->value = value;
+	ev->phase = phase;
+	c->n += 1;
+}
+
+// Write the events to the trace file. Only once nothing records into
+// the trace any more. Returns -1 with an exception set on failure.
+int ndfit_trace_write(ndfit_trace* tr){
+
+	int i;
+	int first = 1;
+	long pid = (long)getpid();
+	FILE* f = fopen(tr->path,"w");
+	if(f==NULL){
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError,tr->path);
+		return -1;
+	}
+	fprintf(f,"{\"traceEvents\":[\n");
+	fprintf(f,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"args\":{\"name\":\"ndfit\"}}",pid);
+	first = 0;
+
+	ndfit_tbuf* b;
+	for(b=atomic_load(&tr->buffers);b!=NULL;b=b->next){
+		ndfit_chunk* c;
+		for(c=b->head;c!=NULL;c=c->next){
+			for(i=0;i<c->n;i+=1){
+				ndfit_event* ev = &c->events[i];
+				fprintf(f,"%s{\"name\":\"%s\",\"cat\":\"ndfit\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%lu",
+					first ? "" : ",\n",ev->name,ev->phase,ev->ts,pid,b->tid);
+				if(ev->phase=='i'){fprintf(f,",\"s\":\"t\"");}
+				if(ev->key!=NULL){fprintf(f,",\"args\":{\"%s\":%.17g}",ev->key,ev->value);}
+				fprintf(f,"}");
+				first = 0;
+			}
+		}
+	}
+	fprintf(f,"\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%ld}}\n",atomic_load(&tr->dropped));
+
+	if(ferror(f) | (fclose(f)!=0)){
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError,tr->path);
+		return -1;
+	}
+	return 0;
+}
+
+void ndfit_trace_free(ndfit_trace* tr){
+
+	if(tr==NULL){return;}
+	ndfit_tbuf* b = atomic_load(&tr->buffers);
+	while(b!=NULL){
+		ndfit_tbuf* nb = b->next;
+		ndfit_chunk* c = b->head;
+		while(c!=NULL){
+			ndfit_chunk* nc = c->next;
+			PyMem_RawFree(c);
+			c = nc;
+		}
+		PyMem_RawFree(b);
+		b = nb;
+	}
+	PyMem_RawFree(tr->path);
+	PyMem_RawFree(tr);
+}
@@ -0,0 +1,650 @@
+//An N-dimensional curve fitting tool written in C Python
+//GNU license applies to v0.3 including v0.3.x and later versions
+//Copyright (C) 2014	Michael Winters : micwinte@chalmers.se
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA	02110-1301, USA.
+
+// Python includes
+#include <Python.h>
+#include <pythread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////
+// ndFit.uncertainty: standard errors and the
+// covariance of the fitted parameters. The
+// Hessian method fits a quadratic to the sum
+// of squares around the optimum, starting from
+// the points the last sweep of the search has
+// evaluated already. The bootstrap refits on
+// resampled data: the rows drawn are counted
+// into weights, the data itself is not copied.
+//
+
+#include "../inc/shared.h"
+
+// Smallest pivot, relative to the largest, before a system counts as
+// singular
+#define NDFIT_PIVOT_TOL 1e-10
+
+// The best params of the fit as a new list
+static PyObject* ndfit_unc_best(ndFit* self){
+
+	PyObject* plist = ndfit_fit_plist(self);
+	if(plist==NULL){return NULL;}
+	Py_ssize_t size = PyList_Size(plist);
+	PyObject* last = (size>0) ? PyList_GetItem(plist,size-1) : NULL;
+	PyObject* params = PyTuple_Check(last) ? PyTuple_GetItem(last,1) : NULL;
+	if(params==NULL){
+		PyErr_Clear();
+		PyErr_SetString(ndfitError,"Fit has no result");
+		return NULL;
+	}
+	return PySequence_List(params);
+}
+
+// A state for the problem the fit solved starting at params. The
+// options of the original run apply unless extra overrides them.
+static int ndfit_unc_setup(ndFit* self, ndfit_state* st, PyObject* params, PyObject* extra){
+
+	memset(st,0,sizeof(ndfit_state));
+	PyObject* kw = PyDict_Copy(self->options);
+	if(kw==NULL){return -1;}
+	PyObject* step = PyDict_GetItemString(kw,"step");
+	Py_XINCREF(step);
+	PyDict_DelItemString(kw,"step");
+	if(step==NULL || (extra!=NULL && PyDict_Update(kw,extra)<0)){
+		if(!PyErr_Occurred()){PyErr_SetString(ndfitError,"Fit options have no step");}
+		Py_XDECREF(step);
+		Py_DECREF(kw);
+		return -1;
+	}
+	PyObject* args = Py_BuildValue("(OOOOOO)",self->fitfunc,self->errfunc,self->data,
+		params,self->consts,step);
+	int status = (args!=NULL) ? ndfit_setup(st,args,kw) : -1;
+	Py_XDECREF(args);
+	st->quiet = 1;
+	Py_DECREF(step);
+	Py_DECREF(kw);
+	return status;
+}
+
+// Solve A X = B in place by Gaussian elimination with partial
+// pivoting. A is n x n, B is n x m and holds X on return. Returns -1
+// if A is singular.
+static int ndfit_unc_solve(double* A, double* B, Py_ssize_t n, Py_ssize_t m){
+
+	Py_ssize_t i, j, k;
+	double big = 0.0;
+	for(i=0;i<n;i+=1){
+		if(fabs(A[i*n+i])>big){big = fabs(A[i*n+i]);}
+	}
+	for(k=0;k<n;k+=1){
+		Py_ssize_t p = k;
+		for(i=k+1;i<n;i+=1){
+			if(fabs(A[i*n+k])>fabs(A[p*n+k])){p = i;}
+		}
+		if(fabs(A[p*n+k])<=NDFIT_PIVOT_TOL*big){return -1;}
+		if(p!=k){
+			for(j=0;j<n;j+=1){double t = A[k*n+j]; A[k*n+j] = A[p*n+j]; A[p*n+j] = t;}
+			for(j=0;j<m;j+=1){double t = B[k*m+j]; B[k*m+j] = B[p*m+j]; B[p*m+j] = t;}
+		}
+		for(i=0;i<n;i+=1){
+			if(i==k || A[i*n+k]==0.0){continue;}
+			double f = A[i*n+k]/A[k*n+k];
+			for(j=k;j<n;j+=1){A[i*n+j] -= f*A[k*n+j];}
+			for(j=0;j<m;j+=1){B[i*m+j] -= f*B[k*m+j];}
+		}
+	}
+	for(k=0;k<n;k+=1){
+		for(j=0;j<m;j+=1){B[k*m+j] /= A[k*n+k];}
+	}
+	return 0;
+}
+
+// True if the symmetric n x n matrix H is positive definite
+static int ndfit_unc_definite(const double* H, Py_ssize_t n){
+
+	Py_ssize_t i, j, k;
+	int ok = 1;
+	double* L = PyMem_Calloc(n*n,sizeof(double));
+	if(L==NULL){return 0;}
+	for(j=0;j<n && ok;j+=1){
+		double d = H[j*n+j];
+		for(k=0;k<j;k+=1){d -= L[j*n+k]*L[j*n+k];}
+		if(!(d>0.0)){ok = 0; break;}
+		L[j*n+j] = sqrt(d);
+		for(i=j+1;i<n;i+=1){
+			double s = H[i*n+j];
+			for(k=0;k<j;k+=1){s -= L[i*n+k]*L[j*n+k];}
+			L[i*n+j] = s/L[j*n+j];
+		}
+	}
+	PyMem_Free(L);
+	return ok;
+}
+
+// Standard errors and covariance as Python lists
+static PyObject* ndfit_unc_lists(const double* cov, Py_ssize_t d, PyObject** errors){
+
+	Py_ssize_t i, j;
+	PyObject* rows = PyList_New(d);
+	*errors = PyList_New(d);
+	if(rows==NULL || *errors==NULL){Py_XDECREF(rows); Py_CLEAR(*errors); return NULL;}
+	for(i=0;i<d;i+=1){
+		PyObject* row = PyList_New(d);
+		if(row==NULL){Py_DECREF(rows); Py_CLEAR(*errors); return NULL;}
+		for(j=0;j<d;j+=1){PyList_SET_ITEM(row,j,PyFloat_FromDouble(cov[i*d+j]));}
+		PyList_SET_ITEM(rows,i,row);
+		PyList_SET_ITEM(*errors,i,PyFloat_FromDouble(sqrt(cov[i*d+i])));
+	}
+	return rows;
+}
+
+////////////////////////
+// Hessian (Laplace)  //
+////////////////////////
+// The sum of squares is modelled as S(x+h*u) = a + g.u + u^T C u/2 in
+// units u of the lattice step h and fitted by least squares. The
+// normal equations collect every point added so far.
+typedef struct ndfit_quad{
+	ndfit_state* st;
+	PyObject* cache;
+	double* x;
+	double* h;
+	double* A;
+	double* b;
+	double* row;
+	Py_ssize_t d;
+	Py_ssize_t q;
+	long fresh;
+	long hits;
+	double center;
+} ndfit_quad;
+
+// Sum of squares from the entropy, the inverse of ndfit_measure
+static double ndfit_unc_sumsq(Py_ssize_t n, double e){
+	double r = e*(double)n/log((double)n);
+	return r*r;
+}
+
+static void ndfit_quad_add(ndfit_quad* qd, const double* u, double S){
+
+	Py_ssize_t i, j, k = 1;
+	qd->row[0] = 1.0;
+	for(i=0;i<qd->d;i+=1){qd->row[k++] = u[i];}
+	for(i=0;i<qd->d;i+=1){
+		for(j=i;j<qd->d;j+=1){qd->row[k++] = (i==j) ? 0.5*u[i]*u[i] : u[i]*u[j];}
+	}
+	for(i=0;i<qd->q;i+=1){
+		for(j=0;j<qd->q;j+=1){qd->A[i*qd->q+j] += qd->row[i]*qd->row[j];}
+		qd->b[i] += qd->row[i]*S;
+	}
+}
+
+// Add the point at u, from the cache if it has been evaluated
+static int ndfit_quad_point(ndfit_quad* qd, const double* u){
+
+	Py_ssize_t i;
+	double S;
+	PyObject* key = PyTuple_New(qd->d);
+	if(key==NULL){return -1;}
+	for(i=0;i<qd->d;i+=1){PyTuple_SET_ITEM(key,i,PyFloat_FromDouble(qd->x[i]+u[i]*qd->h[i]));}
+
+	PyObject* hit = PyDict_GetItemWithError(qd->cache,key);
+	if(hit!=NULL){
+		S = PyFloat_AsDouble(hit);
+		qd->hits+=1;
+	}
+	else{
+		PyObject* params = PyErr_Occurred() ? NULL : PySequence_List(key);
+		double e = (params!=NULL) ? ndfit_evaluate(qd->st,params) : -1.0;
+		Py_XDECREF(params);
+		if(e<0.0){Py_DECREF(key); return -1;}
+		S = ndfit_unc_sumsq(qd->st->datalen,e);
+		qd->fresh+=1;
+		PyObject* value = PyFloat_FromDouble(S);
+		int status = (value!=NULL) ? PyDict_SetItem(qd->cache,key,value) : -1;
+		Py_XDECREF(value);
+		if(status<0){Py_DECREF(key); return -1;}
+	}
+	Py_DECREF(key);
+	ndfit_quad_add(qd,u,S);
+	return 0;
+}
+
+// Cache an (entropy, params) pair. Points inside twice the step of the
+// optimum go into the fit straight away.
+static int ndfit_quad_cache(ndfit_quad* qd, PyObject* item, double* u){
+
+	Py_ssize_t i;
+	if(!PyTuple_Check(item) || PyTuple_Size(item)<2){return 0;}
+	double e = PyFloat_AsDouble(PyTuple_GetItem(item,0));
+	PyObject* key = PySequence_Tuple(PyTuple_GetItem(item,1));
+	if(key==NULL || PyErr_Occurred()){Py_XDECREF(key); return -1;}
+	if(PyTuple_Size(key)!=qd->d){Py_DECREF(key); return 0;}
+
+	int inside = 1;
+	for(i=0;i<qd->d;i+=1){
+		u[i] = (PyFloat_AsDouble(PyTuple_GetItem(key,i))-qd->x[i])/qd->h[i];
+		if(fabs(u[i])>2.0){inside = 0;}
+	}
+	int seen = PyDict_Contains(qd->cache,key);
+	PyObject* value = PyFloat_FromDouble(ndfit_unc_sumsq(qd->st->datalen,e));
+	int status = (seen<0 || value==NULL || PyErr_Occurred()) ? -1 :
+		(seen ? 0 : PyDict_SetItem(qd->cache,key,value));
+	Py_XDECREF(value);
+	Py_DECREF(key);
+	if(status<0){return -1;}
+	if(inside && !seen){
+		ndfit_quad_add(qd,u,ndfit_unc_sumsq(qd->st->datalen,e));
+		qd->hits+=1;
+	}
+	return 0;
+}
+
+// Solve the fit so far for the Hessian in parameter units. Returns 1
+// if the points so far do not determine it.
+static int ndfit_quad_hessian(ndfit_quad* qd, double* H){
+
+	Py_ssize_t i, j, k;
+	double* A = PyMem_Malloc(sizeof(double)*qd->q*(qd->q+1));
+	if(A==NULL){PyErr_NoMemory(); return -1;}
+	double* c = A+qd->q*qd->q;
+	memcpy(A,qd->A,sizeof(double)*qd->q*qd->q);
+	memcpy(c,qd->b,sizeof(double)*qd->q);
+	if(ndfit_unc_solve(A,c,qd->q,1)<0){PyMem_Free(A); return 1;}
+
+	k = 1+qd->d;
+	for(i=0;i<qd->d;i+=1){
+		for(j=i;j<qd->d;j+=1){
+			H[i*qd->d+j] = H[j*qd->d+i] = c[k++]/(qd->h[i]*qd->h[j]);
+		}
+	}
+	PyMem_Free(A);
+	return 0;
+}
+
+static PyObject* ndfit_hessian(ndFit* self, PyObject* best){
+
+	Py_ssize_t i, j, k;
+	PyObject* result = NULL;
+	ndfit_state st;
+	ndfit_quad qd;
+	memset(&qd,0,sizeof(ndfit_quad));
+
+	// The cache holds double precision sums only
+	PyObject* precision = PyDict_GetItemString(self->options,"precision");
+	int reuse = (precision!=NULL && PyUnicode_CompareWithASCIIString(precision,"double")==0);
+	PyObject* extra = Py_BuildValue("{s:s}","precision","double");
+	if(extra==NULL){return NULL;}
+	int status = ndfit_unc_setup(self,&st,best,extra);
+	Py_DECREF(extra);
+	if(status<0 || ndfit_prepare(&st)<0){goto done;}
+
+	qd.st = &st;
+	qd.d = st.dim;
+	qd.q = 1+qd.d+qd.d*(qd.d+1)/2;
+	if(st.datalen<=qd.d || st.datalen<2){
+		PyErr_SetString(ndfitError,"Uncertainties need more residuals than parameters");
+		goto done;
+	}
+	qd.cache = PyDict_New();
+	qd.x = PyMem_Calloc(4*qd.d,sizeof(double));
+	qd.A = PyMem_Calloc(qd.q*qd.q+2*qd.q,sizeof(double));
+	if(qd.cache==NULL || qd.x==NULL || qd.A==NULL){
+		if(!PyErr_Occurred()){PyErr_NoMemory();}
+		goto done;
+	}
+	qd.h = qd.x+qd.d;
+	double* u = qd.x+2*qd.d;
+	double* H = PyMem_Calloc(2*qd.d*qd.d,sizeof(double));
+	if(H==NULL){PyErr_NoMemory(); goto done;}
+	double* cov = H+qd.d*qd.d;
+	qd.b = qd.A+qd.q*qd.q;
+	qd.row = qd.b+qd.q;
+
+	// Steps: the corner of the final lattice, the user's step where
+	// there is no lattice, or a small fraction of the parameter
+	for(i=0;i<qd.d;i+=1){
+		qd.x[i] = PyFloat_AsDouble(PyList_GetItem(best,i));
+		PyObject* corner = PyList_Check(self->lattice) && PyList_Size(self->lattice)>0 ?
+			PyList_GetItem(self->lattice,0) : NULL;
+		qd.h[i] = (corner!=NULL && PyList_Check(corner) && PyList_Size(corner)==qd.d) ?
+			fabs(PyFloat_AsDouble(PyList_GetItem(corner,i))) :
+			fabs(PyFloat_AsDouble(PyList_GetItem(st.step,i)));
+		if(!(qd.h[i]>0.0)){qd.h[i] = 1e-6*(fabs(qd.x[i])>1.0 ? fabs(qd.x[i]) : 1.0);}
+	}
+	if(PyErr_Occurred()){goto cleanup;}
+
+	// The history and the last sweep of the search
+	if(reuse){
+		PyObject* plist = ndfit_fit_plist(self);
+		if(plist==NULL){goto cleanup;}
+		for(k=0;k<PyList_Size(plist);k+=1){
+			if(ndfit_quad_cache(&qd,PyList_GetItem(plist,k),u)<0){goto cleanup;}
+		}
+		if(self->evaluations!=NULL && PyList_Check(self->evaluations)){
+			for(k=0;k<PyList_Size(self->evaluations);k+=1){
+				if(ndfit_quad_cache(&qd,PyList_GetItem(self->evaluations,k),u)<0){goto cleanup;}
+			}
+		}
+	}
+
+	// The centre is needed for the residual variance whether or not
+	// the cache had it
+	PyObject* key = PySequence_Tuple(best);
+	if(key==NULL){goto cleanup;}
+	PyObject* value = PyDict_GetItemWithError(qd.cache,key);
+	if(value==NULL && !PyErr_Occurred()){
+		for(i=0;i<qd.d;i+=1){u[i] = 0.0;}
+		if(ndfit_quad_point(&qd,u)==0){value = PyDict_GetItemWithError(qd.cache,key);}
+	}
+	Py_DECREF(key);
+	if(value==NULL){goto cleanup;}
+	qd.center = PyFloat_AsDouble(value);
+
+	// Then the axis points for the diagonal and, if the cache does not
+	// pin the cross terms down, the pairs. Points bunched up close to
+	// the optimum (the last steps of L-BFGS) can leave a system that 
+	// solves but not to a minimum; the pairs settle that as well.
+	status = ndfit_quad_hessian(&qd,H);
+	if(status==0 && !ndfit_unc_definite(H,qd.d)){status = 1;}
+	for(i=0;i<qd.d && status==1;i+=1){
+		for(k=-1;k<=1;k+=2){
+			for(j=0;j<qd.d;j+=1){u[j] = (i==j) ? (double)k : 0.0;}
+			if(ndfit_quad_point(&qd,u)<0){goto cleanup;}
+		}
+	}
+	if(status==1){status = ndfit_quad_hessian(&qd,H);}
+	if(status==0 && !ndfit_unc_definite(H,qd.d)){status = 1;}
+	for(i=0;i<qd.d && status==1;i+=1){
+		for(j=i+1;j<qd.d;j+=1){
+			for(k=0;k<qd.d;k+=1){u[k] = (k==i || k==j) ? 1.0 : 0.0;}
+			if(ndfit_quad_point(&qd,u)<0){goto cleanup;}
+		}
+	}
+	if(status==1){status = ndfit_quad_hessian(&qd,H);}
+	if(status<0){goto cleanup;}
+	if(status==1){
+		PyErr_SetString(ndfitError,"Hessian could not be determined from the points around the optimum");
+		goto cleanup;
+	}
+	if(!ndfit_unc_definite(H,qd.d)){
+		PyErr_SetString(ndfitError,"Hessian is not positive definite: the fit may not be at a minimum");
+		goto cleanup;
+	}
+
+	// cov = 2 sigma^2 H^-1 with sigma^2 = S/(N-P), the Hessian of the
+	// sum of squares being twice J^T J
+	double sigma2 = qd.center/(double)(st.datalen-qd.d);
+	for(i=0;i<qd.d;i+=1){
+		for(j=0;j<qd.d;j+=1){cov[i*qd.d+j] = (i==j) ? 2.0*sigma2 : 0.0;}
+	}
+	if(ndfit_unc_solve(H,cov,qd.d,qd.d)<0){
+		PyErr_SetString(ndfitError,"Hessian is singular");
+		goto cleanup;
+	}
+
+	PyObject* errors;
+	PyObject* covariance = ndfit_unc_lists(cov,qd.d,&errors);
+	if(covariance==NULL){goto cleanup;}
+	result = Py_BuildValue("{s:s,s:O,s:N,s:N,s:l,s:l}","method","hessian","params",best,
+		"stderr",errors,"covariance",covariance,"evaluations",qd.fresh,"cached",qd.hits);
+
+cleanup:
+	PyMem_Free(H);
+done:
+	Py_XDECREF(qd.cache);
+	PyMem_Free(qd.x);
+	PyMem_Free(qd.A);
+	ndfit_release(&st);
+	return result;
+}
+
+///////////////
+// Bootstrap //
+///////////////
+// Refits are set up in the calling thread and taken off the queue by
+// worker threads as in ndfit.sweep. Every refit draws its rows when it
+// starts, so only the weights of the running ones are held.
+typedef struct ndfit_boot{
+	ndfit_state* states;
+	PyObject* samples;
+	Py_ssize_t n;
+	Py_ssize_t rows;
+	_Atomic Py_ssize_t next;
+	_Atomic int running;
+	volatile int failed;
+	PyObject* exc_type;
+	PyObject* exc_value;
+	PyObject* exc_tb;
+	PyThread_type_lock lock;
+	PyInterpreterState* interp;
+} ndfit_boot;
+
+static void ndfit_boot_cancel(ndfit_boot* bs){
+	Py_ssize_t k;
+	bs->failed = 1;
+	for(k=0;k<bs->n;k+=1){bs->states[k].cancelled = 1;}
+}
+
+// Draw rows with replacement: the weight of a row is the square root
+// of how often it was drawn
+static int ndfit_boot_draw(ndfit_state* st, Py_ssize_t rows){
+
+	Py_ssize_t i;
+	st->weights = PyMem_Calloc(rows,sizeof(double));
+	if(st->weights==NULL){PyErr_NoMemory(); return -1;}
+	for(i=0;i<rows;i+=1){
+		Py_ssize_t j = (Py_ssize_t)(ndfit_random(st)*(double)rows);
+		st->weights[j<rows ? j : rows-1] += 1.0;
+	}
+	for(i=0;i<rows;i+=1){st->weights[i] = sqrt(st->weights[i]);}
+	return 0;
+}
+
+// Refit until the samples run out or a refit fails. Signals are only
+// delivered to the calling thread, which checks them between refits
+// as well as in them; an interrupt there stops every worker.
+static void ndfit_boot_worker(ndfit_boot* bs){
+
+	while(!bs->failed){
+		Py_ssize_t k = atomic_fetch_add(&bs->next,1);
+		if(k>=bs->n){break;}
+
+		PyObject* params = NULL;
+		if(PyErr_CheckSignals()==0 && ndfit_boot_draw(&bs->states[k],bs->rows)==0){
+			ndFit* fit = (ndFit*)ndfit_fit(&bs->states[k]);
+			params = (fit!=NULL) ? ndfit_unc_best(fit) : NULL;
+			Py_XDECREF(fit);
+		}
+		NDFIT_BEGIN_CRITICAL(bs->samples)
+		if(params==NULL){
+			if(bs->exc_type==NULL){
+				PyErr_Fetch(&bs->exc_type,&bs->exc_value,&bs->exc_tb);
+				PyErr_NormalizeException(&bs->exc_type,&bs->exc_value,&bs->exc_tb);
+				if(bs->exc_tb!=NULL){PyException_SetTraceback(bs->exc_value,bs->exc_tb);}
+			}
+			PyErr_Clear();
+			ndfit_boot_cancel(bs);
+		}
+		else{
+			PyList_SetItem(bs->samples,k,params);
+		}
+		NDFIT_END_CRITICAL()
+		if(params==NULL){break;}
+		ndfit_release(&bs->states[k]);
+	}
+
+	if(atomic_fetch_sub(&bs->running,1)==1){PyThread_release_lock(bs->lock);}
+}
+
+// The other worker threads, as for ndfit.sweep
+static void ndfit_boot_thread(void* arg){
+	ndfit_boot* bs = (ndfit_boot*)arg;
+	PyThreadState* ts = ndfit_thread_enter(bs->interp);
+	ndfit_boot_worker(bs);
+	ndfit_thread_leave(ts);
+}
+
+static PyObject* ndfit_bootstrap(ndFit* self, PyObject* best, Py_ssize_t n, int threads, PyObject* seed){
+
+	Py_ssize_t i, j, k;
+	PyObject* result = NULL;
+	double* cov = NULL;
+	ndfit_boot bs;
+	memset(&bs,0,sizeof(ndfit_boot));
+
+	if(n<2){
+		PyErr_SetString(ndfitError,"The bootstrap needs at least two refits");
+		return NULL;
+	}
+	unsigned long long base;
+	if(seed!=NULL && seed!=Py_None){
+		base = PyLong_AsUnsignedLongLongMask(seed);
+		if(PyErr_Occurred()){return NULL;}
+	}
+	else{
+		base = (unsigned long long)(ndfit_clock()*1e9);
+	}
+
+	// Set up every refit here so bad options raise before any work.
+	// Refits warm start from the optimum and never start a pool.
+	bs.n = n;
+	bs.states = PyMem_Calloc(n,sizeof(ndfit_state));
+	bs.samples = PyList_New(n);
+	if(bs.states==NULL || bs.samples==NULL){
+		if(!PyErr_Occurred()){PyErr_NoMemory();}
+		goto done;
+	}
+	for(k=0;k<n;k+=1){
+		PyObject* extra = Py_BuildValue("{s:K}","seed",base+(unsigned long long)k);
+		int status = (extra!=NULL) ? ndfit_unc_setup(self,&bs.states[k],best,extra) : -1;
+		Py_XDECREF(extra);
+		if(status<0){goto done;}
+	}
+	if(ndfit_prepare(&bs.states[0])<0){goto done;}
+	bs.rows = bs.states[0].datalen;
+
+	if(threads<=0){threads = (int)sysconf(_SC_NPROCESSORS_ONLN);}
+	if(threads<1){threads = 1;}
+	if(threads>n){threads = (int)n;}
+
+	bs.lock = PyThread_allocate_lock();
+	if(bs.lock==NULL){PyErr_NoMemory(); goto done;}
+	PyThread_acquire_lock(bs.lock,WAIT_LOCK);
+
+	// The calling thread is always one of the workers
+	bs.running = threads;
+	bs.interp = PyInterpreterState_Get();
+	for(i=1;i<threads;i+=1){
+		if(PyThread_start_new_thread(ndfit_boot_thread,(void*)&bs)==PYTHREAD_INVALID_THREAD_ID){
+			atomic_fetch_sub(&bs.running,threads-i);
+			break;
+		}
+	}
+	ndfit_boot_worker(&bs);
+
+	PyObject *it = NULL, *iv = NULL, *itb = NULL;
+	for(;;){
+		PyLockStatus r;
+		Py_BEGIN_ALLOW_THREADS
+		r = PyThread_acquire_lock_timed(bs.lock,50000,0);
+		Py_END_ALLOW_THREADS
+		if(r==PY_LOCK_ACQUIRED){break;}
+		if(it==NULL && PyErr_CheckSignals()<0){
+			PyErr_Fetch(&it,&iv,&itb);
+			ndfit_boot_cancel(&bs);
+		}
+	}
+	if(it!=NULL){
+		PyErr_Restore(it,iv,itb);
+		goto done;
+	}
+	if(bs.exc_type!=NULL){
+		PyErr_Restore(bs.exc_type,bs.exc_value,bs.exc_tb);
+		bs.exc_type = bs.exc_value = bs.exc_tb = NULL;
+		goto done;
+	}
+
+	// Sample mean and covariance of the refitted params
+	Py_ssize_t d = PyList_Size(best);
+	cov = PyMem_Calloc(d*d+d,sizeof(double));
+	if(cov==NULL){PyErr_NoMemory(); goto done;}
+	double* mean = cov+d*d;
+	for(k=0;k<n;k+=1){
+		PyObject* p = PyList_GetItem(bs.samples,k);
+		for(i=0;i<d;i+=1){mean[i] += PyFloat_AsDouble(PyList_GetItem(p,i))/(double)n;}
+	}
+	for(k=0;k<n;k+=1){
+		PyObject* p = PyList_GetItem(bs.samples,k);
+		for(i=0;i<d;i+=1){
+			double di = PyFloat_AsDouble(PyList_GetItem(p,i))-mean[i];
+			for(j=0;j<d;j+=1){
+				cov[i*d+j] += di*(PyFloat_AsDouble(PyList_GetItem(p,j))-mean[j])/(double)(n-1);
+			}
+		}
+	}
+	if(PyErr_Occurred()){goto done;}
+
+	PyObject* means = PyList_New(d);
+	if(means==NULL){goto done;}
+	for(i=0;i<d;i+=1){PyList_SET_ITEM(means,i,PyFloat_FromDouble(mean[i]));}
+	PyObject* errors;
+	PyObject* covariance = ndfit_unc_lists(cov,d,&errors);
+	if(covariance==NULL){Py_DECREF(means); goto done;}
+	result = Py_BuildValue("{s:s,s:O,s:N,s:N,s:N,s:O}","method","bootstrap","params",best,
+		"mean",means,"stderr",errors,"covariance",covariance,"samples",bs.samples);
+
+done:
+	for(k=0;bs.states!=NULL && k<bs.n;k+=1){ndfit_release(&bs.states[k]);}
+	if(bs.lock){PyThread_free_lock(bs.lock);}
+	PyMem_Free(bs.states);
+	PyMem_Free(cov);
+	Py_XDECREF(bs.samples);
+	Py_XDECREF(bs.exc_type);
+	Py_XDECREF(bs.exc_value);
+	Py_XDECREF(bs.exc_tb);
+	return result;
+}
+
+// uncertainty(method="hessian", n=200, threads=0, seed=None). Returns
+// a dict with the params, their standard errors and covariance. The
+// bootstrap adds the mean and the refitted params (samples), the
+// Hessian how many points were evaluated and how many were cached.
+PyObject* ndfit_uncertainty(ndFit* self, PyObject* args, PyObject* kwds){
+
+	char* method = NULL;
+	Py_ssize_t n = 200;
+	int threads = 0;
+	PyObject* seed = NULL;
+	static char *kwlist[] = {"method","n","threads","seed",NULL};
+	if(!PyArg_ParseTupleAndKeywords(args,kwds,"|sniO",kwlist,&method,&n,&threads,&seed)){return NULL;}
+
+	if(self->options==NULL || !PyDict_Check(self->options)){
+		PyErr_SetString(ndfitError,"Uncertainties need a fit returned by ndfit.run");
+		return NULL;
+	}
+	PyObject* best = ndfit_unc_best(self);
+	if(best==NULL){return NULL;}
+
+	PyObject* result = NULL;
+	if(method==NULL || !strcmp(method,"hessian")){result = ndfit_hessian(self,best);}
+	else if(!strcmp(method,"bootstrap")){result = ndfit_bootstrap(self,best,n,threads,seed);}
+	else{PyErr_SetString(ndfitError,"method must be \"hessian\" or \"bootstrap\"");}
+	Py_DECREF(best);
+	return result;
+}
@@ -0,0 +1,74 @@
+#!/usr/bin/python
+
+# Model, data and helpers shared by the test_*.py scripts. Each test is
+# a plain function so the scripts run under pytest or on their own.
+import random
+
+import os
+import subprocess
+import sys
+
+# Import ndfit
+import ndfit as ndf
+
+## The fit function of fitting.py: a lorentzian on a flat background
+def fitfunc(dat,p,c):
+    return c[0]*p[2]+(c[1]*p[0]**2)/(p[0]**2 +(dat[0]-p[1])**2)
+
+def errfunc(dat,p,c):
+    return fitfunc(dat,p,c)-dat[1]
+
+params = [2.0,5.0,6.0]
+consts = [1.3,1.5]
+guess  = [2.10,5.80,5.00]
+step   = [0.01,0.01,0.01]
+
+# Same data as fitting.py, but reproducible
+def dataset(n=150, seed=1):
+    rng = random.Random(seed)
+    x = [10.0*i/(n-1) for i in range(n)]
+    return [(i,fitfunc([i],params,consts)+rng.randint(-5,5)/50.0) for i in x]
+
+# The settings fitting.py uses
+def defaults():
+    ndf.convergence(0.04)
+    ndf.maxdepth(1000)
+    ndf.throttle_factor(60.0)
+
+# Error function which counts its calls (one per row)
+class Counted(object):
+    def __init__(self, func=errfunc):
+        self.func = func
+        self.calls = 0
+    def __call__(self, dat, p, c):
+        self.calls += 1
+        return self.func(dat,p,c)
+
+# Call fn and return the message of the exception it must raise
+def raises(exc, fn, *args, **kwargs):
+    try:
+        fn(*args,**kwargs)
+    except exc as e:
+        return str(e)
+    raise AssertionError("%s was not raised"%exc.__name__)
+
+# Run a snippet after "from common import *" in a new interpreter
+def python(code, **kwargs):
+    env = dict(os.environ, PYTHONPATH=os.pathsep.join(sys.path))
+    return subprocess.run([sys.executable,"-c","from common import *\n"+code], cwd=os.path.dirname(os.path.abspath(__file__)),
+                          env=env, **kwargs)
+
+# Everything such a snippet writes to stdout, the printf of the C code
+# included
+def printed(code):
+    return python(code, stdout=subprocess.PIPE, check=True, universal_newlines=True).stdout
+
+# Run the tests of a script in the order they are defined
+def main(scope):
+    for name,test in list(scope.items()):
+        if name.startswith("test_") and callable(test):
+            defaults()
+            test()
+            print("%s: ok"%name)
+
+defaults()
@@ -0,0 +1,7 @@
+# pytest: every test starts from the default convergence settings
+import pytest
+from common import defaults
+
+@pytest.fixture(autouse=True)
+def settings():
+    defaults()
@@ -0,0 +1,39 @@
+#!/usr/bin/python
+
+# Adaptive per-dimension step sizes
+import ndfit as ndf
+from common import *
+
+def test_adaptive():
+    data  = dataset()
+    fixed = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True)
+    NDF   = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True, adaptive=True)
+    assert NDF.getresult()[0] <= fixed.getresult()[0]
+    assert all(abs(a-b) < 0.1 for a,b in zip(NDF.getresult()[1],params))
+
+def test_steptol():
+    data  = dataset()
+    tight = Counted()
+    loose = Counted()
+    a = ndf.run(fitfunc, tight, data, guess, consts, step, mode="full", throttle=True, adaptive=True, steptol=1e-4)
+    b = ndf.run(fitfunc, loose, data, guess, consts, step, mode="full", throttle=True, adaptive=True, steptol=1e-1)
+    assert loose.calls < tight.calls
+    assert a.getresult()[0] <= b.getresult()[0]
+
+def test_badly_scaled_step():
+    # Far too small a step for the centre: the step has to grow
+    ndf.convergence(1e-9)
+    ndf.maxdepth(400)
+    small = [0.01,1e-4,0.01]
+    fixed = ndf.run(fitfunc, errfunc, dataset(), guess, consts, small, mode="full")
+    NDF   = ndf.run(fitfunc, errfunc, dataset(), guess, consts, small, mode="full", adaptive=True)
+    assert abs(NDF.getresult()[1][1]-params[1]) < abs(fixed.getresult()[1][1]-params[1])
+
+def test_bad_arguments():
+    data = dataset()
+    assert "steptol" in raises(ndf.error, ndf.run, fitfunc, errfunc, data, guess, consts, step, adaptive=True, steptol=0.0)
+    assert "adaptive" in raises(ndf.error, ndf.run, fitfunc, errfunc, data, guess, consts, step, adaptive=True,
+                                mode="lbfgs", gradfunc=lambda d,p,c: [0.0]*3)
+
+if __name__ == "__main__":
+    main(globals())
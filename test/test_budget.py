@@ -0,0 +1,80 @@
+#!/usr/bin/python
+
+# Time and evaluation budgets, cancellation tokens and signals
+import signal
+import threading
+import time
+
+import ndfit as ndf
+from common import *
+
+def test_untruncated():
+    NDF = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True)
+    assert not NDF.truncated
+
+def test_evaluation_budget():
+    data = dataset()
+    err  = Counted()
+    NDF  = ndf.run(fitfunc, err, data, guess, consts, step, mode="full", max_evaluations=40)
+    assert NDF.truncated
+    assert err.calls//len(data) <= 40
+
+    # The best point so far is handed back
+    entropy, result = NDF.getresult()
+    assert len(result) == 3 and entropy > 0.0
+
+def test_time_budget():
+    def slow(dat,p,c):
+        time.sleep(1e-4)
+        return errfunc(dat,p,c)
+    ndf.convergence(1e-12)
+    start = time.time()
+    NDF = ndf.run(fitfunc, slow, dataset(), guess, consts, step, mode="full", time_budget=0.3)
+    assert NDF.truncated
+    assert time.time()-start < 2.0
+
+def test_cancel_event():
+    token = threading.Event()
+    threading.Timer(0.2,token.set).start()
+    ndf.convergence(1e-12)
+    ndf.maxdepth(10**6)
+    start = time.time()
+    NDF = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", cancel=token)
+    assert NDF.truncated
+    assert time.time()-start < 2.0
+
+def test_cancel_callable():
+    stop = time.time()+0.2
+    ndf.convergence(1e-12)
+    ndf.maxdepth(10**6)
+    NDF = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", cancel=lambda: time.time()>stop)
+    assert NDF.truncated
+
+def test_token_error():
+    def token():
+        raise ValueError("token failed")
+    assert raises(ValueError, ndf.run, fitfunc, errfunc, dataset(), guess, consts, step, cancel=token) == "token failed"
+
+def test_signal():
+    class Alarm(Exception):
+        pass
+    def alarm(signum, frame):
+        raise Alarm()
+    old = signal.signal(signal.SIGALRM, alarm)
+    try:
+        ndf.convergence(1e-12)
+        ndf.maxdepth(10**6)
+        signal.setitimer(signal.ITIMER_REAL, 0.2)
+        raises(Alarm, ndf.run, fitfunc, errfunc, dataset(), guess, consts, step, mode="full")
+    finally:
+        signal.setitimer(signal.ITIMER_REAL, 0)
+        signal.signal(signal.SIGALRM, old)
+
+def test_bad_arguments():
+    data = dataset()
+    assert "callable" in raises(ndf.error, ndf.run, fitfunc, errfunc, data, guess, consts, step, cancel=5)
+    assert "positive" in raises(ndf.error, ndf.run, fitfunc, errfunc, data, guess, consts, step, time_budget=-1.0)
+    assert "positive" in raises(ndf.error, ndf.run, fitfunc, errfunc, data, guess, consts, step, max_evaluations=-1)
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,111 @@
+#!/usr/bin/python
+
+# Checkpoints of the search state and ndfit.resume
+import os
+import signal
+import tempfile
+
+import ndfit as ndf
+from common import *
+
+folder = tempfile.mkdtemp()
+
+def test_resume():
+    data = dataset()
+    path = os.path.join(folder,"fit.ck")
+    for options in ({}, {"adaptive":True}, {"poll":"opportunistic"}):
+        whole = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True, **options)
+
+        # Stop early, then carry on from the file without a budget
+        part = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True,
+                       checkpoint=path, max_evaluations=100, **options)
+        assert part.truncated and os.path.getsize(path) > 0
+        rest = ndf.resume(path, fitfunc, errfunc, data, max_evaluations=0)
+        assert not rest.truncated
+
+        # The resumed search is the one that was never stopped
+        assert rest.getresult() == whole.getresult()
+        assert rest.pList == whole.pList
+    os.remove(path)
+
+def test_killed():
+    # A job killed without warning carries on from its last checkpoint,
+    # written every ten iterations by default
+    data  = dataset()
+    path  = os.path.join(folder,"killed.ck")
+    full  = Counted()
+    whole = ndf.run(fitfunc, full, data, guess, consts, step, mode="full")
+    job = python("""
+import os, signal
+calls = [0]
+def doomed(dat,p,c):
+    calls[0] += 1
+    if calls[0] > 50000:
+        os.kill(os.getpid(),signal.SIGKILL)
+    return errfunc(dat,p,c)
+ndf.run(fitfunc, doomed, dataset(), guess, consts, step, mode="full", checkpoint=%r)
+""" % path)
+    assert job.returncode == -signal.SIGKILL
+
+    counted = Counted()
+    rest = ndf.resume(path, fitfunc, counted, data)
+    assert rest.getresult() == whole.getresult()
+    assert rest.pList == whole.pList
+    assert 0 < counted.calls < full.calls
+
+    # A file cut short is refused
+    with open(path,"rb") as f:
+        head = f.read()
+    with open(path,"wb") as f:
+        f.write(head[:len(head)//2])
+    assert "corrupt" in raises(ndf.error, ndf.resume, path, fitfunc, errfunc, data)
+    os.remove(path)
+
+def test_budget_carries_over():
+    data = dataset()
+    path = os.path.join(folder,"budget.ck")
+    ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", checkpoint=path, max_evaluations=100)
+    assert ndf.resume(path, fitfunc, errfunc, data).truncated
+    os.remove(path)
+
+def test_periodic():
+    # Written every few steps while the fit runs, not only at the end
+    data  = dataset()
+    path  = os.path.join(folder,"every.ck")
+    sizes = []
+    def watch(dat,p,c):
+        if os.path.exists(path):
+            sizes.append(os.path.getsize(path))
+        return errfunc(dat,p,c)
+    writes = []
+    for every in (5,1,0):
+        del sizes[:]
+        ndf.run(fitfunc, watch, data, guess, consts, step, mode="full", throttle=True, checkpoint=path, checkpoint_every=every)
+        writes.append(len(set(sizes)))
+        os.remove(path)
+    assert 1 < writes[0] < writes[1]
+
+    # Ten iterations a write unless told otherwise
+    assert 1 < writes[2] < writes[0]
+
+def test_bad_files():
+    data = dataset()
+    raises(FileNotFoundError, ndf.resume, os.path.join(folder,"missing.ck"), fitfunc, errfunc, data)
+
+    path = os.path.join(folder,"garbage.ck")
+    with open(path,"wb") as f:
+        f.write(b"garbage"*16)
+    assert "checkpoint" in raises(ndf.error, ndf.resume, path, fitfunc, errfunc, data)
+
+    # A checkpoint only fits the data it was taken with
+    ndf.run(fitfunc, errfunc, data, guess, consts, step, checkpoint=path, max_evaluations=50)
+    assert "points" in raises(ndf.error, ndf.resume, path, fitfunc, errfunc, dataset(100))
+    os.remove(path)
+
+def test_bad_arguments():
+    run = lambda **kw: ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, checkpoint=os.path.join(folder,"x.ck"), **kw)
+    assert "multi-start" in raises(ndf.error, run, starts=2, bounds=[(1,3),(4,6),(5,7)])
+    assert "lbfgs" in raises(ndf.error, run, mode="lbfgs", gradfunc=lambda d,p,c: [0.0]*3)
+
+if __name__ == "__main__":
+    main(globals())
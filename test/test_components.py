@@ -0,0 +1,81 @@
+#!/usr/bin/python
+
+# Separable models fitted block by block (components=)
+import math
+import random
+
+import ndfit as ndf
+from common import *
+
+# Two narrow gaussians on 0..10, one params block each
+def peak(dat,p,c):
+    return p[0]*math.exp(-0.5*((dat[0]-p[1])/p[2])**2)
+
+truth = [1.0,3.0,0.3,0.8,7.0,0.4]
+rng   = random.Random(5)
+data  = [(x,peak([x],truth[:3],[])+peak([x],truth[3:],[])+rng.uniform(-0.01,0.01))
+         for x in [0.05*i for i in range(200)]]
+start = [0.9,3.1,0.35,0.9,6.9,0.35]
+steps = [0.01]*6
+
+def both(dat,p,c):
+    return peak(dat,p[:3],c)+peak(dat,p[3:],c)-dat[1]
+
+def entropy(p):
+    return math.sqrt(math.fsum(both(row,p,[])**2 for row in data))*math.log(len(data))/len(data)
+
+def fit(components, **kwargs):
+    return ndf.run(both, both, data, start, [], steps, throttle=True, components=components, **kwargs)
+
+def test_matches_full():
+    full = ndf.run(both, both, data, start, [], steps, throttle=True)
+    found = []
+    for windows in ([None,None], [(0,5),(5,10)]):
+        calls = [Counted(peak), Counted(peak)]
+        NDF = fit([(calls[0],3,windows[0]),(calls[1],3,windows[1])])
+        e, p = NDF.getresult()
+
+        # The peaks are all but zero away from their windows
+        assert abs(e-full.getresult()[0]) < 0.03*full.getresult()[0]
+        assert all(abs(a-b) < 0.02 for a,b in zip(p,truth))
+        found.append(p)
+
+        # The uncertainty is measured on the same component sum
+        u = NDF.uncertainty()["stderr"]
+        assert len(u) == 6 and all(0 < x < 0.05 for x in u)
+
+    assert all(abs(a-b) < 1e-9 for a,b in zip(*found))
+
+    # Unwindowed, the result is the model as a whole
+    NDF = fit([(peak,3),(peak,3)])
+    e, p = NDF.getresult()
+    assert abs(e-entropy(p)) < 1e-12*e
+
+def test_windows_save_calls():
+    wide, narrow = Counted(peak), Counted(peak)
+    fit([(wide,3),(wide,3)])
+    fit([(narrow,3,(0,5)),(narrow,3,(5,10))])
+    assert narrow.calls < 0.75*wide.calls
+
+def test_errors():
+    # A component that raises stops the fit
+    def broken(dat,p,c):
+        if p[1] != start[1]:
+            raise ZeroDivisionError("in component")
+        return peak(dat,p,c)
+    assert raises(ZeroDivisionError, fit, [(broken,3),(peak,3)]) == "in component"
+
+def test_bad_arguments():
+    assert "list" in raises(ndf.error, fit, (peak,3))
+    assert "tuples" in raises(ndf.error, fit, [(peak,),(peak,3)])
+    assert "tuples" in raises(ndf.error, fit, [(1.0,3),(peak,3)])
+    assert "pairs" in raises(ndf.error, fit, [(peak,3,(0,1,2)),(peak,3)])
+    assert "1 to" in raises(ndf.error, fit, [(peak,0),(peak,6)])
+    assert "add up" in raises(ndf.error, fit, [(peak,3),(peak,2)])
+    assert "no rows" in raises(ndf.error, fit, [(peak,3,(20,30)),(peak,3)])
+    assert "lbfgs" in raises(ndf.error, fit, [(peak,3),(peak,3)], mode="lbfgs", gradfunc=lambda d,p,c: [0.0]*6)
+    assert "workers" in raises(ndf.error, fit, [(peak,3),(peak,3)], workers=2)
+    assert "(x, ..., y)" in raises(ndf.error, ndf.run, both, both, [(1.0,)]*10, start, [], steps, components=[(peak,3),(peak,3)])
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,73 @@
+#!/usr/bin/python
+
+# ndfit.Dataset: data converted once and shared between fits
+import array
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+def test_conversions():
+    data  = dataset()
+    table = np.array(data)
+    for source in (data, table, table.astype(np.float32), np.asfortranarray(table), table[::-1][::-1]):
+        ds = ndf.Dataset(source)
+        assert ds.shape == (150,2) and len(ds) == 150
+        assert np.allclose(ds.column(0),table[:,0]) and np.allclose(ds.column(1),table[:,1])
+
+    # Plain numbers make a 1-D dataset
+    ds = ndf.Dataset(array.array("d",[1.0,2.0,4.0]))
+    assert ds.shape == (3,) and ds.rows == [1.0,2.0,4.0]
+    assert ds.min == (1.0,) and ds.max == (4.0,) and abs(ds.mean[0]-7.0/3.0) < 1e-15
+
+def test_buffer_export():
+    table = np.array(dataset())
+    ds    = ndf.Dataset(table)
+    view  = np.asarray(ds)
+    assert view.dtype == np.float64 and view.shape == (150,2)
+    assert np.array_equal(view,table)
+
+    # Stored by column and shared, not copied, and read-only
+    assert view.flags.f_contiguous and not view.flags.writeable
+    assert np.shares_memory(view,np.asarray(ds))
+    m = memoryview(ds)
+    assert m.readonly and m.format == "d" and m.shape == (150,2) and m.strides == (8,1200)
+    raises(ValueError, view.__setitem__, (0,0), 1.0)
+
+def test_rows_are_copies():
+    ds = ndf.Dataset(dataset())
+    rows = ds.rows
+    rows[0] = None
+    assert ds.rows[0] is not None
+
+def test_fits():
+    data = dataset()
+    ds   = ndf.Dataset(data)
+    a = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True)
+    b = ndf.run(fitfunc, errfunc, ds, guess, consts, step, mode="full", throttle=True)
+    assert a.getresult() == b.getresult()
+
+    # Vectorized error functions get the Dataset, an array for free
+    def columns(dat,p,c):
+        assert dat is ds
+        dat = np.asarray(dat)
+        x = dat[:,0]
+        return c[0]*p[2]+(c[1]*p[0]**2)/(p[0]**2+(x-p[1])**2)-dat[:,1]
+    v = ndf.run(fitfunc, columns, ds, guess, consts, step, mode="full", throttle=True, vectorized=True)
+    assert abs(v.getresult()[0]-a.getresult()[0]) < 1e-12
+    assert np.allclose(v.getresult()[1],a.getresult()[1])
+
+def test_bad_data():
+    assert "columns" in raises(ndf.error, ndf.Dataset, [(1.0,2.0),(1.0,2.0,3.0)])
+    assert "empty" in raises(ndf.error, ndf.Dataset, [])
+    assert "float" in raises(ndf.error, ndf.Dataset, np.zeros((2,2,2)))
+    assert "float" in raises(ndf.error, ndf.Dataset, np.zeros((4,2),dtype=np.int64))
+    raises(TypeError, ndf.Dataset, [("a",1.0)])
+
+    ds = ndf.Dataset([(1.0,2.0)])
+    assert "initialized" in raises(ndf.error, ds.__init__, [(1.0,2.0)])
+    raises(IndexError, ds.column, 2)
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,93 @@
+#!/usr/bin/python
+
+# Fits running in the background: ndfit.submit() and ndfit.Future
+import asyncio
+import threading
+import time
+
+import ndfit as ndf
+from common import *
+
+def test_result():
+    data = dataset()
+    fut = ndf.submit(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True)
+    NDF = fut.result(timeout=30)
+    assert fut.done() and not fut.cancelled()
+    assert fut.progress()["done"]
+
+    # Same search as run() in the calling thread
+    assert NDF.getresult() == ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True).getresult()
+
+def test_cancel():
+    gate = threading.Event()
+    def slow(dat,p,c):
+        gate.wait()
+        return errfunc(dat,p,c)
+    ndf.convergence(1e-12)
+    ndf.maxdepth(10**6)
+    fut = ndf.submit(fitfunc, slow, dataset(), guess, consts, step, mode="full")
+    assert "Fit is still running" == raises(TimeoutError, fut.result, timeout=0.05)
+    assert not fut.done()
+    assert fut.cancel()
+    gate.set()
+    NDF = fut.result(timeout=30)
+    assert fut.cancelled() and NDF.truncated
+    assert not fut.cancel()
+
+def test_await():
+    async def both():
+        a = ndf.submit(fitfunc, errfunc, dataset(seed=1), guess, consts, step, mode="full")
+        b = ndf.submit(fitfunc, errfunc, dataset(seed=2), guess, consts, step, mode="full")
+        return await asyncio.gather(a,b)
+    a, b = asyncio.run(both())
+    assert a.getresult() != b.getresult()
+
+    # Awaiting a finished fit resolves at once
+    fut = ndf.submit(fitfunc, errfunc, dataset(), guess, consts, step)
+    fut.result()
+    async def later():
+        return await fut
+    assert asyncio.run(later()) is fut.result()
+
+def test_await_threads():
+    # Loops on other threads await fits as they finish; each of them is
+    # woken, whether it joins before, while or after the fit completes
+    for k in range(20):
+        fut = ndf.submit(fitfunc, errfunc, dataset(20), guess, consts, step)
+        got = []
+        def wait():
+            async def one():
+                return await fut
+            got.append(asyncio.run(asyncio.wait_for(one(),30)))
+        threads = [threading.Thread(target=wait) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert len(got) == 4 and all(NDF is fut.result() for NDF in got)
+
+def test_errors():
+    # The first call is a probe whose failure becomes ndfit.error
+    def wrong(dat,p,c):
+        return dat[5]
+    fut = ndf.submit(fitfunc, wrong, dataset(), guess, consts, step)
+    assert "Unable to call" in raises(ndf.error, fut.result, timeout=30)
+
+    # Errors raised during the search come back as they are
+    calls = [0]
+    def broken(dat,p,c):
+        calls[0] += 1
+        if calls[0] > 1000:
+            raise ZeroDivisionError("in errfunc")
+        return errfunc(dat,p,c)
+    fut = ndf.submit(fitfunc, broken, dataset(), guess, consts, step)
+    assert raises(ZeroDivisionError, fut.result, timeout=30) == "in errfunc"
+    async def wait():
+        return await fut
+    assert raises(ZeroDivisionError, asyncio.run, wait()) == "in errfunc"
+
+    # Bad arguments are reported by submit itself
+    assert "Step" in raises(ndf.error, ndf.submit, fitfunc, errfunc, dataset(), guess, consts, (0.01,))
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,104 @@
+#!/usr/bin/python
+
+# ndfit.Grid: gridded data fitted by built-in or native models in C
+import ctypes
+import math
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+# params = [amplitude, centre and width per axis, offset]
+def gaussian(axes, p):
+    value = p[0]
+    for d,x in enumerate(np.ix_(*axes)):
+        value = value*np.exp(-0.5*((x-p[1+2*d])/p[2+2*d])**2)
+    return value+p[-1]
+
+truth = [2.0, 30.0,6.0, 45.0,9.0, 0.5]
+start = [1.7, 28.0,7.0, 47.0,8.0, 0.4]
+steps = [0.01]*6
+axes  = [np.arange(120.0)*0.5, np.arange(90.0)]
+rng   = np.random.default_rng(7)
+image = gaussian(axes,truth)+rng.normal(0,0.01,(120,90))
+
+def fit(grid, model="gaussian", p=start, **kwargs):
+    return ndf.run(fitfunc, model, grid, p, [], [0.01]*len(p), throttle=True, **kwargs)
+
+def test_model():
+    grid = ndf.Grid(image,axes)
+    assert grid.ndim == 2 and grid.shape == (120,90) and len(grid) == 120*90
+    assert grid.values is image and grid.axes[0][1] == 0.5
+    e, p = fit(grid,adaptive=True).getresult()
+    assert np.allclose(p,truth,atol=0.005)
+
+    # The same sum of squares as the model written out in numpy
+    r = (gaussian(axes,p)-image).ravel()
+    assert abs(e-math.sqrt(math.fsum(r*r))*math.log(r.size)/r.size) < 1e-12*e
+
+def test_strided_roi():
+    # Any view of the image is read where it lies, and visited in the 
+    # same order as a contiguous copy of it, so the fits are the same
+    roi  = image[10:110:2,5:80].T
+    sub  = [axes[1][5:80],axes[0][10:110:2]]
+    p    = [1.7, 47.0,8.0, 28.0,7.0, 0.4]
+    grid = ndf.Grid(roi,sub)
+    assert grid.values is roi and not roi.flags.c_contiguous
+    a = fit(grid,p=p).getresult()
+    b = fit(ndf.Grid(np.ascontiguousarray(roi),sub),p=p).getresult()
+    assert a == b
+    assert np.allclose(a[1],[truth[0],truth[3],truth[4],truth[1],truth[2],truth[5]],atol=0.2)
+
+    # float32 values and 1-D and 3-D grids
+    single = fit(ndf.Grid(roi.astype(np.float32),sub),p=p).getresult()
+    assert np.allclose(single[1],a[1],atol=1e-3)
+    line = image[60,::3]
+    e, q = fit(ndf.Grid(line,[axes[1][::3]]),p=[1.0,47.0,8.0,0.4]).getresult()
+    assert abs(q[1]-45.0) < 0.5
+    cube = np.stack([image[::4,::3]]*4,axis=2)
+    assert len(fit(ndf.Grid(cube),"lorentzian",p=[1.7,7.0,2.0,15.0,3.0,1.5,5.0,0.4]).getresult()[1]) == 8
+
+def test_native():
+    # Native error functions get tiles of (coordinates..., value)
+    c_double_p = ctypes.POINTER(ctypes.c_double)
+    prototype  = ctypes.CFUNCTYPE(ctypes.c_int, c_double_p, ctypes.c_int64, ctypes.c_int64, ctypes.c_int64,
+                                  c_double_p, ctypes.c_int64, c_double_p, ctypes.c_int64, c_double_p)
+    def residuals(data, nrows, ncols, ld, p, nparams, c, nconsts, out):
+        for i in range(nrows):
+            u = (data[i]-p[1])/p[2]
+            v = (data[ld+i]-p[3])/p[4]
+            out[i] = p[0]*math.exp(-0.5*(u*u+v*v))+p[5]-data[2*ld+i]
+        return 0
+    def failing(*args):
+        return 3
+    native = prototype(residuals)
+    small  = ndf.Grid(image[40:80:3,30:60:2],[axes[0][40:80:3],axes[1][30:60:2]])
+    a = fit(small,native).getresult()
+    b = fit(small).getresult()
+    assert abs(a[0]-b[0]) < 1e-9*b[0]
+    assert np.allclose(a[1],b[1],atol=1e-9)
+    assert "returned 3" in raises(ndf.error, fit, small, prototype(failing))
+
+def test_bad_grids():
+    assert "float32/float64" in raises(ndf.error, ndf.Grid, np.zeros((4,4),dtype=np.int64))
+    assert "float32/float64" in raises(ndf.error, ndf.Grid, np.zeros((2,2,2,2)))
+    assert "empty" in raises(ndf.error, ndf.Grid, np.zeros((0,3)))
+    assert "Axis 1" in raises(ndf.error, ndf.Grid, image, [axes[0],axes[0]])
+    assert "vector per axis" in raises(ndf.error, ndf.Grid, image, [axes[0]])
+    raises(TypeError, ndf.Grid, [1.0,2.0])
+    grid = ndf.Grid(image)
+    assert "initialized" in raises(ndf.error, grid.__init__, image)
+
+def test_bad_fits():
+    grid = ndf.Grid(image,axes)
+    assert "gaussian" in raises(ndf.error, fit, grid, "voigt")
+    assert "takes 6 params" in raises(ndf.error, fit, grid, p=start[:4])
+    assert "native" in raises(ndf.error, fit, grid, lambda d,p,c: 0.0)
+    assert "workers" in raises(ndf.error, fit, grid, workers=2)
+    assert "lbfgs" in raises(ndf.error, fit, grid, mode="lbfgs", gradfunc=lambda d,p,c: [0.0]*6)
+    assert "Checkpoints" in raises(ndf.error, fit, grid, checkpoint="x.ck")
+    assert "row by row" in raises(ndf.error, fit, grid, components=[(fitfunc,6)])
+
+if __name__ == "__main__":
+    main(globals())
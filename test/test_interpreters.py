@@ -0,0 +1,106 @@
+#!/usr/bin/python
+
+# Subinterpreters: ndfit in an interpreter with its own GIL, and the
+# worker pool backend built on them (Python 3.12 and later). Nothing
+# here needs numpy, which does not load in such interpreters.
+import os
+import sys
+import time
+
+import ndfit as ndf
+from common import *
+
+def fit(err=errfunc, data=None, **kwargs):
+    data = dataset() if data is None else data
+    return ndf.run(fitfunc, err, data, guess, consts, step, mode="full", throttle=True, **kwargs)
+
+# Run code in a new interpreter with a GIL of its own. Returns the
+# error it raised, None if there was none.
+def isolated(code):
+    try:
+        import _interpreters as interpreters
+        interp = interpreters.create()
+        error = interpreters.exec(interp, code)
+    except ImportError:
+        import _xxsubinterpreters as interpreters
+        interp = interpreters.create(isolated=True)
+        error = None
+        try:
+            interpreters.run_string(interp, code)
+        except interpreters.RunFailedError as e:
+            error = e
+    interpreters.destroy(interp)
+    return error
+
+# Sleep holding the GIL (ctypes.PyDLL keeps it), 0.5 ms a row. Only
+# an interpreter with a GIL of its own lets the others run meanwhile.
+# ctypes loads in subinterpreters from Python 3.13.
+_libc = None
+def held(dat,p,c):
+    global _libc
+    if _libc is None:
+        import ctypes
+        _libc = ctypes.PyDLL(None)
+    _libc.usleep(500)
+    return errfunc(dat,p,c)
+
+def busy(dat,p,c):
+    sum(i*i for i in range(2000))
+    return errfunc(dat,p,c)
+
+def test_isolated_import():
+    if sys.version_info < (3,12):
+        return
+    # Fits in the interpreter, on the threads of submit() and sweep()
+    # included, use its own module state
+    before = fit().getresult()
+    error = isolated("""
+import sys
+sys.path[:] = %r
+from common import *
+defaults()
+ndf.convergence(0.5)
+alone = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True)
+assert ndf.submit(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True).result(timeout=60).getresult() == alone.getresult()
+fits = ndf.sweep(fitfunc, errfunc, dataset(), guess, [consts,consts], step, mode="full", throttle=True, threads=2)
+assert [NDF.getresult() for NDF in fits] == [alone.getresult()]*2
+assert "empty" in raises(ndf.error, ndf.run, fitfunc, errfunc, [], guess, consts, step)
+""" % sys.path)
+    assert error is None, error
+
+    # Its convergence() left ours alone
+    assert fit().getresult() == before
+
+def test_backend():
+    if sys.version_info < (3,12):
+        assert "3.12" in raises(ndf.error, fit, workers=2, backend="subinterpreters")
+        return
+    alone = fit().getresult()
+    assert fit(workers=3, backend="subinterpreters").getresult() == alone
+    assert fit("common:errfunc", workers=2, backend="subinterpreters").getresult() == alone
+
+    # Error functions are imported by name, as for processes
+    assert "top level" in raises(ndf.error, fit, lambda d,p,c: errfunc(d,p,c), workers=2, backend="subinterpreters")
+
+def test_own_gil():
+    if sys.version_info < (3,13):
+        return
+    # Workers holding their GIL still overlap, even on one CPU
+    data = dataset(10)
+    elapsed = {}
+    for backend in ("threads","subinterpreters"):
+        start = time.perf_counter()
+        fit("test_interpreters:held", data, workers=4, backend=backend, max_evaluations=400)
+        elapsed[backend] = time.perf_counter()-start
+    assert elapsed["subinterpreters"] < 0.75*elapsed["threads"], elapsed
+
+    # and pure Python error functions run in parallel given the CPUs
+    if (os.cpu_count() or 1) > 1:
+        for backend in ("threads","subinterpreters"):
+            start = time.perf_counter()
+            fit("test_interpreters:busy", data, workers=2, backend=backend, max_evaluations=400)
+            elapsed[backend] = time.perf_counter()-start
+        assert elapsed["subinterpreters"] < 0.9*elapsed["threads"], elapsed
+
+if __name__ == "__main__":
+    main(globals())
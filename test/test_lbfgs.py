@@ -0,0 +1,76 @@
+#!/usr/bin/python
+
+# mode="lbfgs": gradient descent on half the sum of squares
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+# Derivatives of one residual of the lorentzian with respect to p
+def gradfunc(dat,p,c):
+    d = p[0]**2+(dat[0]-p[1])**2
+    return [2.0*c[1]*p[0]*(dat[0]-p[1])**2/d**2,
+            2.0*c[1]*p[0]**2*(dat[0]-p[1])/d**2,
+            c[0]]
+
+# The same model on whole columns of the data
+def columns(dat,p,c):
+    x = dat[:,0]
+    return c[0]*p[2]+(c[1]*p[0]**2)/(p[0]**2+(x-p[1])**2)-dat[:,1]
+
+def jacobian(dat,p,c):
+    x = dat[:,0]
+    d = p[0]**2+(x-p[1])**2
+    return np.column_stack([2.0*c[1]*p[0]*(x-p[1])**2/d**2,
+                            2.0*c[1]*p[0]**2*(x-p[1])/d**2,
+                            np.full(len(x),c[0])])
+
+def lbfgs(err=errfunc, grad=gradfunc, data=None, **kwargs):
+    data = dataset() if data is None else data
+    return ndf.run(fitfunc, err, data, guess, consts, step, mode="lbfgs", gradfunc=grad, **kwargs)
+
+def test_rows():
+    full = Counted()
+    desc = Counted()
+    a = ndf.run(fitfunc, full, dataset(), guess, consts, step, mode="full", throttle=True)
+    b = lbfgs(desc)
+
+    # At least as deep a minimum, near the params the data was made 
+    # with, from a fraction of the evaluations
+    assert b.getresult()[0] <= a.getresult()[0]
+    assert np.allclose(b.getresult()[1],params,atol=0.05)
+    assert 20*desc.calls < full.calls
+    assert b.lattice is None and not b.truncated
+
+def test_vectorized():
+    data = np.array(dataset())
+    rows = lbfgs()
+
+    # A column of a 2-D array is a strided residual vector
+    for err in (columns, lambda d,p,c: np.column_stack([columns(d,p,c)]*2)[:,0]):
+        NDF = lbfgs(err, jacobian, data, vectorized=True)
+        assert np.allclose(NDF.getresult()[1],rows.getresult()[1],atol=1e-6)
+    NDF = lbfgs(columns, lambda d,p,c: jacobian(d,p,c).tolist(), data, vectorized=True)
+    assert np.allclose(NDF.getresult()[1],rows.getresult()[1],atol=1e-6)
+
+def test_budget():
+    NDF = lbfgs(max_evaluations=3)
+    assert NDF.truncated
+
+def test_bad_arguments():
+    data = dataset()
+    assert "gradfunc" in raises(ndf.error, ndf.run, fitfunc, errfunc, data, guess, consts, step, mode="lbfgs")
+    assert "Gradient" in raises(ndf.error, lbfgs, grad=3)
+    assert "adaptive" in raises(ndf.error, lbfgs, adaptive=True)
+
+    # The Jacobian must have one row per residual and one column per param
+    assert "Gradient function must return" in raises(ndf.error, lbfgs, columns,
+        lambda d,p,c: jacobian(d,p,c)[:,:2], np.array(data), vectorized=True)
+
+def test_gradient_errors():
+    def broken(dat,p,c):
+        raise ZeroDivisionError("in gradfunc")
+    raises(ZeroDivisionError, lbfgs, grad=broken)
+
+if __name__ == "__main__":
+    main(globals())
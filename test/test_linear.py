@@ -0,0 +1,92 @@
+#!/usr/bin/python
+
+# Axis moves of linear params derived from cached residuals (linear=)
+import os
+import tempfile
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+# An amplitude, an offset and a slope on a lorentzian: p[0], p[3] and
+# p[4] enter the residuals linearly and never multiply each other
+def peak(dat,p,c):
+    x = dat[:,0]
+    return p[0]*p[2]**2/(p[2]**2+(x-p[1])**2)+p[3]+p[4]*x-dat[:,1]
+
+rng   = np.random.default_rng(11)
+x     = np.linspace(0,10,300)
+table = np.column_stack([x,3.0*1.44/(1.44+(x-5.0)**2)+0.5+0.1*x+rng.normal(0,0.02,x.size)])
+start = [2.5,5.3,1.0,0.3,0.0]
+
+def same(a, b):
+    assert len(a.pList) == len(b.pList)
+    assert abs(a.getresult()[0]-b.getresult()[0]) <= 1e-12*b.getresult()[0]
+    assert np.allclose(a.getresult()[1],b.getresult()[1],rtol=0,atol=1e-9)
+
+def test_rows():
+    # The offset of the test model, c[0]*p[2]
+    for options in ({}, {"adaptive":True}):
+        plain   = Counted()
+        derived = Counted()
+        a = ndf.run(fitfunc, plain, dataset(), guess, consts, step, mode="full", throttle=True, **options)
+        b = ndf.run(fitfunc, derived, dataset(), guess, consts, step, mode="full", throttle=True, linear=[2], **options)
+        same(b,a)
+        assert derived.calls < plain.calls
+
+def test_vectorized():
+    plain   = Counted(peak)
+    derived = Counted(peak)
+    run = lambda err, **kw: ndf.run(peak, err, table, start, [], [0.01]*5, mode="full", throttle=True, vectorized=True, **kw)
+    a = run(plain)
+    b = run(derived, linear=[0,3,4])
+    same(b,a)
+    assert derived.calls < plain.calls
+
+    # Any order of the indices
+    same(run(peak, linear=[4,0,3]),a)
+
+def test_errors():
+    calls = [0]
+    def broken(dat,p,c):
+        calls[0] += 1
+        if calls[0] > 300:
+            raise ZeroDivisionError("in errfunc")
+        return errfunc(dat,p,c)
+    assert raises(ZeroDivisionError, ndf.run, fitfunc, broken, dataset(), guess, consts, step, mode="full", linear=[2]) == "in errfunc"
+
+def test_checkpoint():
+    data = dataset()
+    path = os.path.join(tempfile.mkdtemp(),"linear.ck")
+    whole = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True, linear=[2])
+    calls = []
+    for linear in ([2], None):
+        ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True, linear=linear,
+                checkpoint=path, max_evaluations=100)
+        counted = Counted()
+        rest = ndf.resume(path, fitfunc, counted, data, max_evaluations=0)
+        calls.append(counted.calls)
+
+        # The resumed search still derives p[2]
+        if linear:
+            assert rest.getresult() == whole.getresult()
+            assert rest.pList == whole.pList
+    assert calls[0] < calls[1]
+    os.remove(path)
+
+def test_bad_arguments():
+    run = lambda **kw: ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, **kw)
+    assert "list" in raises(ndf.error, run, mode="full", linear=2)
+    assert "between 0 and 2" in raises(ndf.error, run, mode="full", linear=[3])
+    assert "between 0 and 2" in raises(ndf.error, run, mode="full", linear=[-1])
+    assert "twice" in raises(ndf.error, run, mode="full", linear=[2,2])
+    assert "mode=\"full\"" in raises(ndf.error, run, linear=[2])
+    assert "lbfgs" in raises(ndf.error, run, mode="lbfgs", gradfunc=lambda d,p,c: [0.0]*3, linear=[2])
+    assert "workers" in raises(ndf.error, run, mode="full", linear=[2], workers=2)
+    grid = ndf.Grid(np.ones((8,8)))
+    assert "Python error function" in raises(ndf.error, ndf.run, fitfunc, "gaussian", grid, [1.0,4.0,2.0,4.0,2.0,0.0], [],
+                                             [0.01]*6, mode="full", linear=[0,5])
+
+if __name__ == "__main__":
+    main(globals())
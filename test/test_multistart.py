@@ -0,0 +1,71 @@
+#!/usr/bin/python
+
+# Multi-start search with pruning of dominated starts
+import json
+import math
+import os
+import tempfile
+
+import ndfit as ndf
+from common import *
+
+# A cosine whose frequency has many local minima around the true one
+def cosfunc(dat,p,c):
+    return math.cos(p[0]*dat[0])
+
+def coserr(dat,p,c):
+    return cosfunc(dat,p,c)-dat[1]
+
+cosdata = [(0.1*i,math.cos(3.0*0.1*i)) for i in range(100)]
+
+def cosfit(**kwargs):
+    ndf.convergence(1e-6)
+    ndf.maxdepth(2000)
+    return ndf.run(cosfunc, coserr, cosdata, [0.5], [], [0.01], mode="full", **kwargs)
+
+def test_escapes_local_minimum():
+    single = cosfit()
+    assert abs(single.getresult()[1][0]-3.0) > 0.5
+    for sampling in ("lhs","random"):
+        multi = cosfit(starts=8, bounds=[(0.1,5.0)], seed=1, sampling=sampling)
+        assert abs(multi.getresult()[1][0]-3.0) < 0.01
+        assert multi.getresult()[0] < single.getresult()[0]
+
+def test_reproducible():
+    a = cosfit(starts=6, bounds=[(0.1,5.0)], seed=7)
+    b = cosfit(starts=6, bounds=[(0.1,5.0)], seed=7)
+    assert a.getresult() == b.getresult()
+    assert a.pList == b.pList
+
+def test_pruning():
+    path = os.path.join(tempfile.mkdtemp(),"trace.json")
+    cosfit(starts=8, bounds=[(0.1,5.0)], seed=1, prune=1, trace=path)
+    with open(path) as f:
+        events = json.load(f)["traceEvents"]
+    pruned = [e["args"]["start"] for e in events if e["name"]=="prune"]
+    assert 0 < len(pruned) < 8
+    os.remove(path)
+
+def test_lorentzian():
+    NDF = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True,
+                  starts=3, bounds=[(1,3),(4,6),(5,7)], seed=1)
+    assert NDF.getresult()[0] < 0.03
+
+def test_quiet():
+    # Only a fit run on its own reports how it stopped
+    fit = "ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode=\"full\"%s)"
+    assert "Recursion Depth" in printed(fit % "")
+    assert "Fit Entropy" not in printed(fit % ", starts=4, bounds=[(1.5,2.5),(4.5,5.5),(5.5,6.5)]")
+
+def test_bad_arguments():
+    data = dataset()
+    run = lambda **kw: ndf.run(fitfunc, errfunc, data, guess, consts, step, **kw)
+    assert "at least 1" in raises(ndf.error, run, starts=0)
+    assert "bounds" in raises(ndf.error, run, starts=2)
+    assert "bounds" in raises(ndf.error, run, starts=2, bounds=[(1,3)])
+    for bad in [(4,), (4,6,8), ("a","b"), 4]:
+        assert "(bound 1)" in raises(ndf.error, run, starts=2, bounds=[(1,3),bad,(5,7)])
+    assert "sampling" in raises(ndf.error, run, starts=2, bounds=[(1,3),(4,6),(5,7)], sampling="sobol")
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,73 @@
+#!/usr/bin/python
+
+# Native error functions: capsules, ctypes functions and addresses
+import ctypes
+
+import ndfit as ndf
+from common import *
+
+c_double_p = ctypes.POINTER(ctypes.c_double)
+prototype  = ctypes.CFUNCTYPE(ctypes.c_int, c_double_p, ctypes.c_int64, ctypes.c_int64, ctypes.c_int64,
+                              c_double_p, ctypes.c_int64, c_double_p, ctypes.c_int64, c_double_p)
+
+# The error function of common.py on a block of column storage. A
+# ctypes callback takes the GIL itself, so ndfit may call it without.
+def residuals(data, nrows, ncols, ld, p, nparams, c, nconsts, out):
+    for i in range(nrows):
+        out[i] = fitfunc([data[i]],p,c)-data[ld+i]
+    return 0
+
+native  = prototype(residuals)
+address = ctypes.cast(native,ctypes.c_void_p).value
+
+def capsule(name):
+    new = ctypes.pythonapi.PyCapsule_New
+    new.restype  = ctypes.py_object
+    new.argtypes = [ctypes.c_void_p,ctypes.c_char_p,ctypes.c_void_p]
+    return new(address,name,None)
+
+# Callable, but with an address: not native unless declared so
+class Addressed(object):
+    def __init__(self, address):
+        self.address = address
+    def __call__(self, dat, p, c):
+        return errfunc(dat,p,c)
+
+def fit(err, **kwargs):
+    return ndf.run(fitfunc, err, dataset(), guess, consts, step, mode="full", throttle=True, **kwargs)
+
+def test_native_functions():
+    python = fit(errfunc)
+    for err,kwargs in ((native,{}),
+                       (capsule(b"ndfit.native"),{}),
+                       (native,{"native":True}),
+                       (address,{"native":True}),
+                       (Addressed(address),{"native":True})):
+        NDF = fit(err, **kwargs)
+        assert abs(NDF.getresult()[0]-python.getresult()[0]) < 1e-12
+        assert NDF.getresult()[1] == python.getresult()[1]
+
+def test_undeclared_address():
+    # Only called as a Python function, the address is never used
+    NDF = fit(Addressed(1))
+    assert NDF.getresult() == fit(errfunc).getresult()
+
+def test_rejected():
+    assert "ndfit.native" in raises(TypeError, fit, capsule(b"other.name"))
+    assert "ndfit.native" in raises(TypeError, fit, capsule(None))
+
+    # ctypes functions are checked by type, not by their signature
+    other = ctypes.CFUNCTYPE(ctypes.c_int, c_double_p, ctypes.c_int64)(lambda d,n: 0)
+    assert "prototype" in raises(TypeError, fit, other)
+
+    assert "native=True" in raises(TypeError, fit, address)
+    for err in (errfunc, Addressed("1"), Addressed(0), 0):
+        assert "native=True" in raises(TypeError, fit, err, native=True)
+
+def test_errors():
+    failing = prototype(lambda *args: 1)
+    assert "returned 1" in raises(ndf.error, fit, failing)
+    assert "numbers" in raises(ndf.error, ndf.run, fitfunc, native, dataset(), guess, ["a",1.5], step)
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,36 @@
+#!/usr/bin/python
+
+# Opportunistic polling with success-direction ordering
+import ndfit as ndf
+from common import *
+
+def test_complete_is_default():
+    data = dataset()
+    a = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True)
+    b = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True, poll="complete")
+    assert a.getresult() == b.getresult()
+
+def test_opportunistic():
+    data = dataset()
+    for mode in ("short","full"):
+        complete = Counted()
+        early    = Counted()
+        a = ndf.run(fitfunc, complete, data, guess, consts, step, mode=mode, throttle=True)
+        b = ndf.run(fitfunc, early, data, guess, consts, step, mode=mode, throttle=True, poll="opportunistic")
+        assert early.calls < complete.calls
+        assert b.getresult()[0] < 1.5*a.getresult()[0]
+
+        # The order only depends on the search, not on timing
+        c = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode=mode, throttle=True, poll="opportunistic")
+        assert b.pList == c.pList
+
+def test_with_adaptive():
+    NDF = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True,
+                  poll="opportunistic", adaptive=True)
+    assert NDF.getresult()[0] < 0.03
+
+def test_bad_arguments():
+    assert "poll" in raises(ndf.error, ndf.run, fitfunc, errfunc, dataset(), guess, consts, step, poll="random")
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,70 @@
+#!/usr/bin/python
+
+# Worker pools: lattice points evaluated by processes or threads
+import os
+import threading
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+# Raise in a worker but not in the fit's own process or thread, which 
+# probes the error function first. Worker processes inherit the 
+# environment, and so learn which process is the parent.
+def broken(dat,p,c):
+    if os.getpid()!=int(os.environ["NDFIT_TEST_PARENT"]):
+        raise ZeroDivisionError("in worker")
+    return errfunc(dat,p,c)
+
+def threaded(dat,p,c):
+    if threading.current_thread() is not threading.main_thread():
+        raise ZeroDivisionError("in worker")
+    return errfunc(dat,p,c)
+
+def columns(dat,p,c):
+    dat = np.asarray(dat)
+    return c[0]*p[2]+(c[1]*p[0]**2)/(p[0]**2+(dat[:,0]-p[1])**2)-dat[:,1]
+
+def fit(err=errfunc, data=None, mode="full", **kwargs):
+    data = dataset() if data is None else data
+    return ndf.run(fitfunc, err, data, guess, consts, step, mode=mode, throttle=True, **kwargs)
+
+def test_backends():
+    alone = fit().getresult()
+    for backend in ("processes","threads"):
+        assert fit(workers=3, backend=backend).getresult() == alone
+    assert fit("common:errfunc", workers=2).getresult() == alone
+
+    # Workers see the data as the fit's own error function does
+    ds = ndf.Dataset(dataset())
+    vec = fit(columns, ds, vectorized=True).getresult()
+    assert fit("test_pool:columns", ds, vectorized=True, workers=2).getresult() == vec
+    assert fit(columns, ds, vectorized=True, workers=2, backend="threads").getresult() == vec
+
+def test_options():
+    # Budgets and opportunistic polling halt batches part way
+    NDF = fit(workers=2, max_evaluations=200)
+    assert NDF.truncated
+    alone = fit(poll="opportunistic").getresult()
+    assert fit(workers=2, backend="threads", poll="opportunistic").getresult()[0] <= alone[0]+0.01
+
+def test_worker_errors():
+    os.environ["NDFIT_TEST_PARENT"] = str(os.getpid())
+    assert "in worker" in raises(ndf.error, fit, "test_pool:broken", workers=2)
+    assert "in worker" in raises(ndf.error, fit, threaded, workers=2, backend="threads")
+
+def test_bad_arguments():
+    assert "workers" in raises(ndf.error, fit, workers=-1)
+    assert "backend" in raises(ndf.error, fit, workers=2, backend="fibers")
+
+    # Processes import the error function by name
+    assert "top level" in raises(ndf.error, fit, lambda d,p,c: errfunc(d,p,c), workers=2)
+    assert "module:qualname" in raises(ndf.error, fit, "common.errfunc", workers=2)
+    raises(AttributeError, fit, "common:missing", workers=2)
+
+    assert "lbfgs" in raises(ndf.error, fit, workers=2, mode="lbfgs", gradfunc=errfunc)
+    assert "double" in raises(ndf.error, fit, columns, workers=2, backend="threads", vectorized=True, precision="single")
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,57 @@
+#!/usr/bin/python
+
+# Single and mixed precision evaluation of vectorized error functions
+import math
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+# A lorentzian on a sloped background, evaluated on whole columns
+def peak(dat,p,c):
+    x = dat[:,0]
+    return p[0]*p[2]**2/(p[2]**2+(x-p[1])**2)+p[3]+p[4]*x-dat[:,1]
+
+rng  = np.random.default_rng(3)
+x    = np.linspace(0,10,4000)
+y    = 3.0*1.44/(1.44+(x-5.0)**2)+0.5+0.1*x+rng.normal(0,0.02,x.size)
+data = np.column_stack([x,y])
+start = [2.5,5.3,1.0,0.3,0.0]
+
+def entropy(p):
+    r = peak(data,p,[])
+    return math.sqrt(math.fsum(r*r))*math.log(len(r))/len(r)
+
+def fit(func=peak, **kwargs):
+    return ndf.run(func, func, data, start, [], [0.01]*5, mode="full", throttle=True, vectorized=True, **kwargs)
+
+def test_single():
+    seen = set()
+    def spy(dat,p,c):
+        seen.add(dat.dtype)
+        return peak(dat,p,c)
+    double = fit()
+    single = fit(spy, precision="single")
+    assert np.dtype(np.float32) in seen
+
+    # float32 residuals land close to the double optimum
+    assert abs(single.getresult()[0]-double.getresult()[0]) < 1e-4*double.getresult()[0]
+    assert np.allclose(single.getresult()[1],double.getresult()[1],atol=1e-3)
+
+def test_mixed():
+    mixed = fit(precision="mixed")
+    e, p = mixed.getresult()
+
+    # The result is measured in double precision
+    assert abs(e-entropy(p)) < 1e-12*e
+
+def test_double_default():
+    assert fit().getresult() == fit(precision="double").getresult()
+
+def test_bad_arguments():
+    assert "precision" in raises(ndf.error, fit, precision="half")
+    assert "vectorized" in raises(ndf.error, ndf.run, fitfunc, errfunc, dataset(), guess, consts, step, precision="single")
+
+if __name__ == "__main__":
+    main(globals())
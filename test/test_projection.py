@@ -0,0 +1,71 @@
+#!/usr/bin/python
+
+# Variable projection: linear params solved for at every lattice point
+import math
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+# An amplitude, an offset and a slope (p[0], p[3], p[4]) on a lorentzian
+def peak(dat,p,c):
+    x = dat[:,0]
+    return p[0]*p[2]**2/(p[2]**2+(x-p[1])**2)+p[3]+p[4]*x-dat[:,1]
+
+rng   = np.random.default_rng(11)
+x     = np.linspace(0,10,300)
+table = np.column_stack([x,3.0*1.44/(1.44+(x-5.0)**2)+0.5+0.1*x+rng.normal(0,0.02,x.size)])
+start = [2.5,5.3,1.0,0.3,0.0]
+
+def entropy(p):
+    r = peak(table,p,[])
+    return math.sqrt(math.fsum(r*r))*math.log(len(r))/len(r)
+
+# The least squares linear params for the others fixed
+def solved(p):
+    shape = p[2]**2/(p[2]**2+(x-p[1])**2)
+    return np.linalg.lstsq(np.column_stack([shape,np.ones_like(x),x]),table[:,1],rcond=None)[0]
+
+def fit(**kwargs):
+    return ndf.run(peak, peak, table, start, [], [0.01]*5, throttle=True, vectorized=True, **kwargs)
+
+def test_matches_optimum():
+    plain = fit(mode="full", adaptive=True)
+    for mode in ("short","full"):
+        e, p = fit(mode=mode, linear=[0,3,4], projection=True, adaptive=True).getresult()
+
+        # At least as good as the search over every param, with the 
+        # linear params where least squares puts them
+        assert e <= plain.getresult()[0]*(1+1e-9)
+        assert abs(e-entropy(p)) < 1e-12*e
+        assert np.allclose([p[0],p[3],p[4]],solved(p),rtol=0,atol=1e-6)
+        assert np.allclose(p,plain.getresult()[1],atol=1e-4)
+
+def test_rows():
+    plain = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True, adaptive=True)
+    NDF   = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True, linear=[2], projection=True, adaptive=True)
+    assert NDF.getresult()[0] <= plain.getresult()[0]*(1+1e-9)
+
+    # The history carries the solved params
+    assert all(len(p) == 3 for e,p in NDF.pList)
+
+def test_errors():
+    calls = [0]
+    def broken(dat,p,c):
+        calls[0] += 1
+        if calls[0] > 100:
+            raise ZeroDivisionError("in errfunc")
+        return peak(dat,p,c)
+    assert raises(ZeroDivisionError, ndf.run, peak, broken, table, start, [], [0.01]*5, vectorized=True,
+                  linear=[0,3,4], projection=True) == "in errfunc"
+
+def test_bad_arguments():
+    assert "linear=" in raises(ndf.error, fit, projection=True)
+    assert "not linear" in raises(ndf.error, fit, linear=[0,1,2,3,4], projection=True)
+    assert "lbfgs" in raises(ndf.error, fit, mode="lbfgs", gradfunc=lambda d,p,c: [0.0]*5, linear=[0], projection=True)
+    assert "Checkpoints" in raises(ndf.error, fit, linear=[0], projection=True, checkpoint="x.ck")
+    assert "twice" in raises(ndf.error, fit, linear=[0,0], projection=True)
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,67 @@
+#!/usr/bin/python
+
+# Sum of squares kernels: fast and accurate (pairwise) reductions
+import array
+import math
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+# Eight large residuals, one per lane of the kernel, then many whose
+# squares are lost next to them by a plain running sum
+rows  = 8+2**18
+resid = np.full(rows,1e-8)
+resid[:8] = 1.0
+table = np.column_stack([np.arange(rows,dtype=float),resid])
+
+def constant(dat,p,c):
+    return dat[:,1]
+
+def entropy(r):
+    return math.sqrt(math.fsum(float(x)*float(x) for x in r))*math.log(len(r))/len(r)
+
+def measured(errfunc, data, **kwargs):
+    ndf.maxdepth(2)
+    NDF = ndf.run(errfunc, errfunc, data, [1.0], [], [0.01], vectorized=True, **kwargs)
+    return NDF.getresult()[0]
+
+def test_accurate():
+    exact = entropy(resid)
+    assert abs(measured(constant,table,reduction="accurate")-exact) <= 1e-14*exact
+    assert abs(measured(constant,table)-exact) <= 1e-14*exact
+
+    # The lane sums of the fast kernel drop the small squares
+    fast = measured(constant,table,reduction="fast")
+    assert abs(fast-exact) > 1e-13*exact
+    assert abs(fast-exact) < 1e-10*exact
+
+def test_buffers():
+    exact = entropy(resid)
+
+    # A column of the data is strided, a copy is contiguous
+    for result in (lambda d,p,c: d[:,1],
+                   lambda d,p,c: np.ascontiguousarray(d[:,1]),
+                   lambda d,p,c: d[:,1].astype(np.float32),
+                   lambda d,p,c: array.array("d",d[:,1]),
+                   lambda d,p,c: d[:,1].tolist()):
+        e = measured(result,table,reduction="accurate")
+        assert abs(e-exact) <= 1e-6*exact, e
+
+def test_rows():
+    # Row by row error functions use the same kernel
+    data = dataset(2000)
+    a = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True, reduction="fast")
+    b = ndf.run(fitfunc, errfunc, data, guess, consts, step, mode="full", throttle=True, reduction="accurate")
+    assert abs(a.getresult()[0]-b.getresult()[0]) < 1e-12
+
+def test_bad_results():
+    assert "reduction" in raises(ndf.error, measured, constant, table, reduction="kahan")
+
+    # The probe at the guess fixes how many residuals there are
+    assert "expected" in raises(ndf.error, measured, lambda d,p,c: d[:,1] if p[0]==1.0 else d[:10,1], table)
+    raises(TypeError, measured, lambda d,p,c: 1.0, table)
+
+if __name__ == "__main__":
+    main(globals())
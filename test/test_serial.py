@@ -0,0 +1,72 @@
+#!/usr/bin/python
+
+# Compact results: ndFit.to_bytes, ndFit.from_bytes and pickling
+import pickle
+import struct
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+def fit(**kwargs):
+    return ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True, **kwargs)
+
+def test_round_trip():
+    NDF  = fit()
+    copy = ndf.ndFit.from_bytes(NDF.to_bytes(), dataset(), fitfunc, errfunc)
+    assert copy.pList == NDF.pList
+    assert copy.getresult() == NDF.getresult()
+    assert copy.consts == consts and not copy.truncated
+
+    # Only the last step, and whether the fit was cut short
+    part = fit(max_evaluations=50)
+    last = ndf.ndFit.from_bytes(part.to_bytes(history=False))
+    assert len(last.pList) == 1 and last.getresult() == part.getresult()
+    assert last.truncated
+    assert len(part.to_bytes(history=False)) < len(part.to_bytes())
+
+def test_history_view():
+    NDF  = fit()
+    blob = bytearray(NDF.to_bytes())
+    copy = ndf.ndFit.from_bytes(blob)
+    rows = np.asarray(copy.history)
+    assert rows.shape == (len(NDF.pList),4) and not rows.flags.writeable
+    assert [(r[0],list(r[1:])) for r in rows] == [(e,list(p)) for e,p in NDF.pList]
+
+    # A view of the buffer, not a copy of it
+    assert np.shares_memory(rows,np.frombuffer(blob,dtype=np.uint8))
+    assert np.array_equal(np.asarray(NDF.history),rows)
+
+    # A new pList replaces what the fit was loaded with
+    copy.pList = NDF.pList[:2]
+    assert np.asarray(copy.history).shape == (2,4)
+
+def test_pickle():
+    NDF  = fit(adaptive=True)
+    copy = pickle.loads(pickle.dumps(NDF))
+    assert copy.pList == NDF.pList and copy.consts == NDF.consts
+    assert copy.fitfunc is fitfunc and copy.errfunc is errfunc
+    assert len(copy.data) == len(NDF.data)
+
+    # Enough of the fit comes along to measure its uncertainty again
+    assert copy.uncertainty()["stderr"] == NDF.uncertainty()["stderr"]
+
+def test_bad_buffers():
+    blob = fit().to_bytes()
+    load = ndf.ndFit.from_bytes
+    assert "Not an ndfit" in raises(ndf.error, load, b"garbage"*8)
+    assert "Not an ndfit" in raises(ndf.error, load, b"")
+    assert "corrupt" in raises(ndf.error, load, blob[:-8])
+    assert "corrupt" in raises(ndf.error, load, blob+b"\0"*8)
+    assert "version" in raises(ndf.error, load, blob[:8]+struct.pack("=i",99)+blob[12:])
+    assert "contiguous" in raises(ndf.error, load, np.frombuffer(blob*2,dtype=np.uint8)[::2])
+    raises(TypeError, load, 1.0)
+
+    NDF = fit()
+    raises(TypeError, delattr, NDF, "pList")
+    NDF.pList = [(1.0,[1.0]),(1.0,[1.0,2.0])]
+    assert "pList entries" in raises(ndf.error, NDF.to_bytes)
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,61 @@
+#!/usr/bin/python
+
+# ndfit.sweep: one fit per consts vector on worker threads
+import ndfit as ndf
+from common import *
+
+grid = [[consts[0]+0.005*k,consts[1]] for k in range(16)]
+
+def sweep(errfunc=errfunc, **kwargs):
+    return ndf.sweep(fitfunc, errfunc, dataset(), guess, grid, step, mode="full", throttle=True, **kwargs)
+
+def test_matches_run():
+    data = dataset()
+    fits = sweep(threads=4)
+    assert len(fits) == len(grid)
+    for c,NDF in zip(grid[::5],fits[::5]):
+        alone = ndf.run(fitfunc, errfunc, data, guess, c, step, mode="full", throttle=True)
+        assert NDF.getresult() == alone.getresult()
+        assert NDF.consts == c
+
+def test_warm_start():
+    cold = Counted()
+    warm = Counted()
+    sweep(cold, threads=4)
+    first = [NDF.getresult() for NDF in sweep(warm, threads=4, warm_start=True)]
+    assert warm.calls < cold.calls
+
+    # Where each fit starts does not depend on the threads
+    for threads in (1,2,3,8):
+        assert [NDF.getresult() for NDF in sweep(threads=threads, warm_start=True)] == first
+
+def test_quiet():
+    # The items print nothing when they stop
+    assert printed("ndf.sweep(fitfunc, errfunc, dataset(), guess, [consts]*4, step, mode=\"full\", threads=2)") == ""
+
+def test_errors():
+    # The first error stops the sweep and is raised
+    calls = [0]
+    def broken(dat,p,c):
+        calls[0] += 1
+        if calls[0] > 5000:
+            raise ZeroDivisionError("in errfunc")
+        return errfunc(dat,p,c)
+    for warm in (False,True):
+        calls[0] = 0
+        assert raises(ZeroDivisionError, sweep, broken, threads=3, warm_start=warm) == "in errfunc"
+
+def test_bad_arguments():
+    data = dataset()
+    assert "consts" in raises(ndf.error, ndf.sweep, fitfunc, errfunc, data, guess, [], step)
+    assert "consts" in raises(ndf.error, ndf.sweep, fitfunc, errfunc, data, guess, consts, step)
+    assert "row 1" in raises(ndf.error, ndf.sweep, fitfunc, errfunc, data, guess, [[1.3,1.5],[1.3]], step)
+    assert "twice" in raises(ndf.error, ndf.sweep, fitfunc, errfunc, data, guess, grid, step, data=data)
+    assert "Checkpoints" in raises(ndf.error, ndf.sweep, fitfunc, errfunc, data, guess, grid, step, checkpoint="x.ck")
+    assert "workers" in raises(ndf.error, ndf.sweep, fitfunc, errfunc, data, guess, grid, step, workers=2)
+
+    # Options of run() are checked for every fit before any work
+    assert "poll" in raises(ndf.error, ndf.sweep, fitfunc, errfunc, data, guess, grid, step, poll="random")
+
+if __name__ == "__main__":
+    main(globals())
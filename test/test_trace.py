@@ -0,0 +1,82 @@
+#!/usr/bin/python
+
+# Chrome trace events of a fit (trace=path)
+import collections
+import json
+import os
+import tempfile
+
+import ndfit as ndf
+from common import *
+
+folder = tempfile.mkdtemp()
+
+def events(path):
+    with open(path) as f:
+        trace = json.load(f)
+    os.remove(path)
+    assert trace["otherData"]["dropped"] == 0
+    return [e for e in trace["traceEvents"] if e["ph"] != "M"]
+
+# Every span that opens on a thread closes on it, innermost first
+def balanced(evs):
+    open_ = collections.defaultdict(list)
+    for e in evs:
+        if e["ph"] == "B":
+            open_[e["tid"]].append(e["name"])
+        elif e["ph"] == "E":
+            assert open_[e["tid"]].pop() == e["name"]
+    return not any(open_.values())
+
+def test_run():
+    path = os.path.join(folder,"run.json")
+    NDF = ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True, trace=path)
+    evs = events(path)
+    assert balanced(evs)
+    names = collections.Counter(e["name"] for e in evs if e["ph"] == "B")
+    assert names["fit"] == 1 and names["lattice"] >= 1 and names["iteration"] > 1
+    assert names["errfunc"] > 100
+
+    # The fit closes with its count of evaluations
+    last = [e for e in evs if e["name"] == "fit"][-1]
+    assert last["ph"] == "E" and last["args"]["evaluations"] == names["errfunc"]
+    assert all(e["ts"] >= 0 for e in evs)
+    assert NDF.getresult() == ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True).getresult()
+
+def test_threads_and_sweep():
+    path = os.path.join(folder,"threads.json")
+    ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode="full", throttle=True, workers=2, backend="threads", trace=path)
+    evs = events(path)
+    assert balanced(evs)
+    assert len({e["tid"] for e in evs if e["name"] == "errfunc"}) > 1
+
+    # The fits of a sweep share one trace
+    grid = [[consts[0]+0.01*k,consts[1]] for k in range(3)]
+    ndf.sweep(fitfunc, errfunc, dataset(), guess, grid, step, mode="full", throttle=True, threads=2, trace=path)
+    evs = events(path)
+    assert balanced(evs)
+    assert sum(e["name"] == "fit" and e["ph"] == "B" for e in evs) == 3
+
+def test_errors():
+    # A trace that cannot be written fails the fit
+    missing = os.path.join(folder,"missing","run.json")
+    raises(FileNotFoundError, ndf.run, fitfunc, errfunc, dataset(), guess, consts, step, trace=missing)
+    raises(TypeError, ndf.run, fitfunc, errfunc, dataset(), guess, consts, step, trace=1.0)
+
+    # but the error function's error wins over the trace's
+    calls = [0]
+    def broken(dat,p,c):
+        calls[0] += 1
+        if calls[0] > 500:
+            raise ZeroDivisionError("in errfunc")
+        return errfunc(dat,p,c)
+    assert raises(ZeroDivisionError, ndf.run, fitfunc, broken, dataset(), guess, consts, step, trace=missing) == "in errfunc"
+
+    # Traces of fits that failed are still written
+    path = os.path.join(folder,"broken.json")
+    calls[0] = 0
+    raises(ZeroDivisionError, ndf.run, fitfunc, broken, dataset(), guess, consts, step, trace=path)
+    assert balanced(events(path))
+
+if __name__ == "__main__":
+    main(globals())
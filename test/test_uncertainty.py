@@ -0,0 +1,103 @@
+#!/usr/bin/python
+
+# ndFit.uncertainty: Hessian (Laplace) and bootstrap error estimates
+import math
+import signal
+import time
+
+import numpy as np
+
+import ndfit as ndf
+from common import *
+from test_lbfgs import gradfunc
+
+# Gauss-Newton standard errors, s^2 (J^T J)^-1 with s^2 = S/(N-P)
+def expected(data, p):
+    p = np.array(p)
+    resid = lambda p: np.array([errfunc(x,p,consts) for x in data])
+    J = np.column_stack([(resid(p+e)-resid(p-e))/2e-6 for e in np.eye(len(p))*1e-6])
+    s2 = (resid(p)**2).sum()/(len(data)-len(p))
+    return np.sqrt(np.diag(s2*np.linalg.inv(J.T@J)))
+
+def lattice(data=None, err=errfunc):
+    data = dataset() if data is None else data
+    return ndf.run(fitfunc, err, data, guess, consts, step, mode="full", throttle=True)
+
+def descent(data=None, err=errfunc):
+    data = dataset() if data is None else data
+    return ndf.run(fitfunc, err, data, guess, consts, step, mode="lbfgs", gradfunc=gradfunc)
+
+def test_hessian():
+    for NDF in (lattice(), descent()):
+        u = NDF.uncertainty()
+        assert u["method"] == "hessian" and u["params"] == NDF.getresult()[1]
+        assert np.allclose(u["stderr"],expected(dataset(),u["params"]),rtol=0.05)
+        cov = np.array(u["covariance"])
+        assert np.allclose(cov,cov.T) and np.allclose(np.sqrt(np.diag(cov)),u["stderr"])
+
+    # The lattice search leaves most of the points it needs behind
+    u = lattice().uncertainty()
+    assert u["cached"] > u["evaluations"]
+
+def test_bootstrap():
+    NDF = descent()
+    hessian = NDF.uncertainty()["stderr"]
+    u = NDF.uncertainty(method="bootstrap", n=100, seed=3)
+    assert u["method"] == "bootstrap" and len(u["samples"]) == 100
+    assert np.allclose(u["stderr"],hessian,rtol=0.25)
+    assert np.allclose(u["mean"],np.mean(u["samples"],axis=0))
+
+    # Refit k draws its rows from seed+k, whichever thread runs it
+    a = lattice().uncertainty(method="bootstrap", n=8, seed=5, threads=1)
+    b = lattice().uncertainty(method="bootstrap", n=8, seed=5, threads=3)
+    assert a["samples"] == b["samples"]
+
+def test_quiet():
+    # The refits keep quiet, the fit itself does not
+    out = printed("ndf.run(fitfunc, errfunc, dataset(), guess, consts, step, mode=\"full\").uncertainty(method=\"bootstrap\", n=4)")
+    assert out.count("Fit Entropy") == 1
+
+def test_interrupt():
+    # Signals reach the refits the calling thread runs
+    class Stop(KeyboardInterrupt):
+        pass
+    def alarm(signum, frame):
+        raise Stop()
+    def slow(dat,p,c):
+        time.sleep(1e-5)
+        return errfunc(dat,p,c)
+    NDF = lattice(err=slow)
+    old = signal.signal(signal.SIGALRM, alarm)
+    try:
+        start = time.time()
+        signal.setitimer(signal.ITIMER_REAL, 0.2)
+        raises(Stop, NDF.uncertainty, method="bootstrap", n=10**5, threads=1)
+        assert time.time()-start < 5.0
+    finally:
+        signal.setitimer(signal.ITIMER_REAL, 0)
+        signal.signal(signal.SIGALRM, old)
+
+def test_refit_errors():
+    calls = [0]
+    def broken(dat,p,c):
+        calls[0] += 1
+        if calls[0] > limit:
+            raise ZeroDivisionError("in refit")
+        return errfunc(dat,p,c)
+    limit = 10**9
+    NDF = lattice(err=broken)
+    limit = calls[0]+3000
+    assert raises(ZeroDivisionError, NDF.uncertainty, method="bootstrap", n=50, threads=2) == "in refit"
+
+def test_bad_arguments():
+    NDF = lattice()
+    assert "method" in raises(ndf.error, NDF.uncertainty, method="jackknife")
+    assert "two" in raises(ndf.error, NDF.uncertainty, method="bootstrap", n=1)
+    assert "more residuals" in raises(ndf.error, lattice(dataset(3)).uncertainty)
+
+    # Without the options of run() the problem can not be rebuilt
+    copy = ndf.ndFit.from_bytes(NDF.to_bytes(), dataset(), fitfunc, errfunc)
+    assert "ndfit.run" in raises(ndf.error, copy.uncertainty)
+
+if __name__ == "__main__":
+    main(globals())
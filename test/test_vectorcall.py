@@ -0,0 +1,76 @@
+#!/usr/bin/python
+
+# Error functions called with a params list that is reused between 
+# evaluations: whatever they keep must not change under them
+import numpy as np
+
+import ndfit as ndf
+from common import *
+
+def fit(err, **kwargs):
+    return ndf.run(fitfunc, err, dataset(), guess, consts, step, mode="full", throttle=True, **kwargs)
+
+def test_kept_params():
+    kept = []
+    def keep(dat,p,c):
+        kept.append((p,list(p)))
+        return errfunc(dat,p,c)
+    fit(keep)
+
+    # The lists kept still hold the values they were called with
+    assert len(kept) > 1000
+    assert all(p == seen for p,seen in kept)
+
+def test_kept_items():
+    kept = []
+    def keep(dat,p,c):
+        kept.append((p[0],p[2],p[0]+0.0,p[2]+0.0))
+        return errfunc(dat,p,c)
+    fit(keep)
+    assert all(a == x and b == y for a,b,x,y in kept)
+
+def columns(dat,p,c):
+    dat = np.asarray(dat)
+    return c[0]*p[2]+(c[1]*p[0]**2)/(p[0]**2+(dat[:,0]-p[1])**2)-dat[:,1]
+
+def vectorized(err, start=guess):
+    return ndf.run(fitfunc, err, np.array(dataset()), start, consts, step, mode="full", throttle=True, vectorized=True)
+
+def test_vectorized():
+    kept = []
+    def keep(dat,p,c):
+        kept.append((p,list(p)))
+        return columns(dat,p,c)
+    vectorized(keep)
+    assert all(p == seen for p,seen in kept)
+
+def test_changed_params():
+    # The error function may change its list; the search does not see it
+    alone = vectorized(columns).getresult()
+    def grow(dat,p,c):
+        r = columns(dat,p,c)
+        p.append(1.0)
+        return r
+    def swap(dat,p,c):
+        r = columns(dat,p,c)
+        p[0] = "x"
+        p[1] = type("Float",(float,),{})(p[1])
+        return r
+    start = list(guess)
+    for err in (grow,swap):
+        assert vectorized(err,start).getresult() == alone
+
+    # Not even the first call gets the caller's guess
+    assert start == guess
+
+def test_errors():
+    # The errfunc is still called as errfunc(dat, p, c)
+    assert "Unable to call" in raises(ndf.error, fit, lambda dat,p: 0.0)
+    def later(dat,p,c):
+        if p[0] != guess[0]:
+            raise ZeroDivisionError("in errfunc")
+        return errfunc(dat,p,c)
+    assert raises(ZeroDivisionError, fit, later) == "in errfunc"
+
+if __name__ == "__main__":
+    main(globals())